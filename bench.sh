@@ -0,0 +1,50 @@
+#!/bin/sh
+# benchmark for bs9: assemble the workloads written by gen9 and
+# compare the throughput with the baselines stored in bench.base
+#
+# bench.sh [-s] [directory]
+#   -s  save the measured throughput as new baselines
+#
+# The time of a workload is the best of RUNS runs of the sum of the
+# phase, binary and symbol times reported by "bs9 -t".
+
+BS9=${BS9:-./bs9}
+RUNS=${RUNS:-3}
+BASE=${BASE:-bench.base}
+SAVE=0
+
+if [ "$1" = "-s" ]; then SAVE=1; shift; fi
+DIR=${1:-bench}
+
+if [ $SAVE = 1 ]; then
+   echo "# workload  lines/s   (written by make bench-save)" > "$BASE.new"
+fi
+
+printf "%-8s %9s %9s %11s %11s %8s\n" Workload Lines Seconds Lines/s Baseline Change
+for w in sym mac inc fcb fwd cond
+do
+   best=""
+   r=0
+   while [ $r -lt $RUNS ]
+   do
+      out=$($BS9 -q -t "$DIR/$w") || { echo "$w: bs9 failed"; exit 1; }
+      t=$(echo "$out" | awk '/^(Phase [12]|Binaries|Symbols) *:/ {
+         for (i = 1; i < NF; ++i) if ($i == ":") s += $(i+1)} END {printf "%.6f", s}')
+      lines=$(echo "$out" | awk '/^Lines *:/ {print $3}')
+      if [ -z "$best" ]; then best=$t
+      else best=$(echo "$best $t" | awk '{print $2 < $1 ? $2 : $1}'); fi
+      r=$((r + 1))
+   done
+   base=""
+   [ -f "$BASE" ] && base=$(awk -v w=$w '$1 == w {print $2}' "$BASE")
+   echo "$w $lines $best ${base:-0}" | awk '{
+      rate = $3 > 0 ? $2 / $3 : 0
+      if ($4 > 0) printf "%-8s %9d %9.3f %11.0f %11.0f %+7.1f%%\n", $1, $2, $3, rate, $4, 100 * (rate - $4) / $4
+      else        printf "%-8s %9d %9.3f %11.0f %11s %8s\n", $1, $2, $3, rate, "-", "-"
+      }'
+   if [ $SAVE = 1 ]; then
+      echo "$w $lines $best" | awk '{printf "%-8s %11.0f\n", $1, ($3 > 0 ? $2 / $3 : 0)}' >> "$BASE.new"
+   fi
+done
+
+if [ $SAVE = 1 ]; then mv "$BASE.new" "$BASE"; echo "Saved $BASE"; fi
@@ -28,6 +28,19 @@ to install the binary to /usr/local/bin:
 make
 sudo make install
 
+"make bench" generates synthetic sources with "gen9" in the directory
+"bench" (many symbols, nested macros, an include tree, data tables,
+forward references, conditional blocks), assembles them with "-t"
+and compares the lines per second with "bench.base". "make bench-save"
+stores the current results as new baselines, BENCH_SCALE=n makes the
+sources larger.
+
+"make micro" builds "micro9", which includes bs9.c with BS9_NO_MAIN
+defined, and times SkipSpace, IsInstruction, ExtractOpText, EvalOperand,
+SetPostByte, LabelIndex and ParseASCII on the labels and operands of a
+source (MICRO_SRC=file, default bench/sym.as9) in ns and allocations
+per call.
+
 Running
 =======
 If you have a source code named "hello.as9", run the assembler with:
@@ -110,6 +123,359 @@ Strout.ret
 
 for these labels.
 
+Stack analysis
+==============
+
+The option "-s" writes the file "<source>.stk" with the stack depth
+of every module, every address called by JSR, BSR or LBSR and the
+handlers of the interrupt vectors at $FFF2 - $FFFE.
+The generated code is followed from the entry along all branches,
+adding the bytes pushed by PSHS, PSHSW and LEAS -n,S and the depth
+of called routines. Pushes onto U are reported separately.
+A JMP to an address outside the module is treated as tail call.
+Routines, that cannot be analysed exactly, get a note:
+
+new-stack   S is loaded (LDS), depth is counted from there
+dynamic     S is changed by TFR, EXG or variable LEAS
+indirect    call or jump through a pointer or register
+recursive   routine is part of a call cycle
+unbalanced  different stack depth at a return or join
+unbounded   stack grows inside a loop
+data        control flow runs into data
+external    called address outside the assembled code
+
+The worst case adds the frames and handlers of NMI, IRQ and FIRQ
+to the depth of the RESET routine. Without RESET vector the main
+line starts at the execution address of STORE or else at the first
+assembled instruction.
+
+Call graph
+==========
+
+The option "-g" writes the call graph of JSR, BSR, LBSR and JMP
+instructions with known targets to "<source>.dot" (for Graphviz)
+and as table to "<source>.cg". Every module is one node, code
+outside of modules belongs to the preceding global label.
+For each node the size in bytes, the sum of the cycles of its
+instructions and the totals including all reachable callees
+are listed.
+
+Inlining
+========
+
+The pseudo op INLINE inside a module marks it for inlining:
+
+MODULE GetPtr
+       INLINE 8                max. size in bytes (default 16)
+       LDX  Ptr
+       RTS
+ENDMOD
+
+If the module calls no other routine, ends with its only RTS
+and is not larger than the limit, every "JSR GetPtr", "BSR GetPtr"
+and "LBSR GetPtr" outside of macros is replaced by the module body
+without the RTS. Local labels of the body get a unique suffix,
+outside of modules they become global labels.
+If all references to the module were calls, that are inlined,
+the module itself is omitted.
+For this, phase 1 is run twice, so all addresses and branch sizes
+are computed for the code with inlined calls. Short branches, that
+are out of range after inlining, are assembled as long branches
+(BRA -> LBRA, Bcc -> LBcc, BSR -> LBSR) in a rerun and marked in
+the listing.
+The listing shows the result of the check after the INLINE line.
+
+Size optimization
+=================
+
+The option "-z" searches the assembled code for identical instruction
+sequences ending with RTS, RTI, PULS PC or JMP. The first instruction
+of one copy is replaced by "BRA _TAIL_n" or "JMP _TAIL_n" to the other
+copy and the remaining instructions are omitted. Sequences containing
+branches leaving the sequence or PC relative addressing are not merged
+and no address inside an omitted copy may be referenced by a label
+or an instruction outside of it. Besides the bytes, the operands
+must have the same source text, so "LDA #Len" is not merged with
+"LDA #$21", if Len changes after merging. After merging, the source
+is assembled again. The merged tails and repeated blocks, that could
+be replaced by a subroutine call, are listed in the hint file
+"<source>.opt".
+
+String pooling is switched on for all byte data lines (FCB, FCC,
+BYTE) with the option "-u" or for a range of lines with POOL ON/OFF.
+A labelled line of strings and numbers, whose bytes are equal to the
+bytes or to the end of the bytes of another such line, is omitted
+and its label is defined inside the other line:
+
+Hello   FCC "Hello World",0
+World   FCC "World",0          World = Hello+6, 6 bytes saved
+
+The line is kept, if other labels point into the string or if
+unlabelled data follows it. Lines with symbols or "*" in their
+operands are never pooled, their bytes may change with the moved
+addresses. The pooled strings are listed in
+"<source>.opt".
+
+Simulation
+==========
+
+The option "--run label" executes the assembled code in a built-in
+6809/6309 interpreter, starting at the label. The simulation stops
+at the RTS (or PULS PC) of the entry routine, after the cycle limit
+("--cycles n", default 100000000), at a breakpoint ("--break label",
+up to 16 times), at SYNC or CWAI, or at an illegal opcode.
+Cycles use the 6809 timing. The file "<source>.run" lists the cycles
+spent at every label, the calls and inclusive cycles of every called
+address and the cycles of every module. S starts at the lowest
+assembled address, so the stack grows below the code, unless REG S
+sets another value. The option "--io file" configures I/O and registers:
+
+IN   $FF00 $80               reads from $FF00 return $80
+IN   $FF01 input.bin         reads from $FF01 return bytes of file
+OUT  $FF02                   writes to $FF02 go to stdout
+OUT  $FF03-$FF04 out.bin     writes to $FF03 and $FF04 go to file
+STOP Exit                    a write to label Exit stops the simulation
+REG  S $7F00                 initial register value
+
+The directive "EXECUTE Routine,Size[,Value]" reserves Size bytes at the
+current address. After phase 2 the routine is run by the simulator
+with X = start of the reserved bytes, Y = Size and D = Value. The bytes
+written by the routine to the reserved range are stored in the image.
+S starts at the lowest assembled address like for --run, a range in
+the 256 bytes below, where the stack would wrap around, is an error.
+Tables computed by 6809 code stay consistent with the code using them:
+
+Squares EXECUTE MkSquare,32    ; 32 bytes: 0,1,4,9,...
+
+MkSquare CLRA
+MkSqLoop PSHS A
+         TFR  A,B
+         MUL
+         STB  ,X+
+         PULS A
+         INCA
+         LEAY -1,Y
+         BNE  MkSqLoop
+         RTS
+
+Profiling
+=========
+
+The option "--profile trace" reads a trace of an emulator (MAME,
+XRoar, ...). Each line starting with a hex address counts one
+execution of that address ("E000: LDX #$E006", "$e000", "e000 ...").
+Lines of the form "address count" with a decimal count add count
+executions. The file "<source>.prf" lists every source line with the
+number of executions and the estimated cycles (6809 timing), followed
+by the totals per module. The file "<source>.fold" contains the
+cycles per call stack in the folded format of flame graph tools:
+
+Main;Print;PrHex8 1234
+
+Placement
+=========
+
+The option "--place counts" moves modules by execution counts. The file
+contains lines "label count", "address count" or a PC trace like for
+"--profile". A name, that is a label, is never read as hex address
+(A1, Add), "$A1" is the address. The regions are declared in the
+source before the modules:
+
+PLACE HOT,$E000                hot modules from $E000 (main ROM)
+PLACE COLD,$8000               cold modules from $8000 (banked ROM)
+
+The most executed modules with 90% of all counts are assembled in the
+HOT region, the others in the COLD region, in source order. The code
+after ENDMOD continues at the address before the moved module.
+Modules are not moved, if code falls into or out of them or a short
+branch or 8 bit PC relative offset crosses their boundary.
+The hint file lists the placement and up to 16 variables with the most
+executed extended mode accesses as candidates for the direct page.
+Use "-o" together with "--place" for hints on branches, that became
+short enough for BRA or BSR.
+
+Library
+=======
+
+"make lib" builds libbs9.a and libbs9.so with the interface of bs9.h:
+
+struct BS9File  Inc = {"equ.as9","Chrout = $e803\n"};
+struct BS9Result Res;
+BS9_Assemble("snippet.as9",Text,&Inc,1,&Res);
+
+assembles the source in Text. INCLUDE finds the virtual files first,
+then files on disk. Res contains the 64K image, the range of stored
+bytes, the error count and the error messages. Nothing is written to
+disk, fatal errors return to the caller instead of ending the process.
+BS9_Symbol returns symbol values, BS9_Free releases the result.
+The assembler state is thread local, so threads may call BS9_Assemble
+in parallel, BS9_Symbol refers to the last call of the same thread.
+
+Statistics
+==========
+
+The option "-t" (or "--stats") prints after assembly the time spent in
+phase 1, phase 2, writing binaries and listing symbols, the lines per
+second, symbol lookups with the average number of compared entries,
+macro expansions, opened include files, calls of Put, the allocations
+with the sum of the requested bytes (not freed bytes), the peak memory (Linux) and the size of every written file.
+"--stats=json" prints the same numbers as JSON object on stdout and
+implies "-q". Times are wall clock seconds summed over all passes
+(processor seconds on Windows).
+
+Batch mode
+==========
+
+bs9 -q a.as9 b.as9 c.as9
+bs9 -q -j 8 --batch list.txt
+
+assembles several sources in one process. The file of "--batch" lists
+one source per line, lines starting with '#' or ';' are ignored.
+The jobs run on a pool of "-j" worker threads (default: one per CPU),
+a worker that finished its share takes jobs from the other workers.
+Every job has its own assembler state and writes its own listing,
+binaries and reports, messages go to <source>.err (removed if empty).
+Include files are read once and shared read-only by all jobs.
+Sources with errors are printed with a summary line, the exit code
+is the number of failed jobs. The options apply to all jobs, "-t"
+needs a single source. Batch mode is not available on Windows.
+
+bs9 -q --variants machines.txt os.as9
+
+assembles a source once for every line of the variant file. A line
+holds the name of the variant and its options, usually define sets:
+
+mo5    -DMO5=1 -DTO9=0
+to9    -DMO5=0 -DTO9=1
+dragon -DMO5=0 -DTO9=0 --cpu 6809
+
+"--cpu" selects the CPU at the start of each pass, the default is 6309.
+The variants run in parallel like batch jobs and read the source and
+its include files only once. Every output file gets the name of the
+variant before the extension: os-mo5.ls9, os-mo5.err and for
+STORE "os.bin" the binary os-mo5.bin.
+
+bs9 --parallel 4 big.as9
+
+runs phase 2 in up to 4 processes. Phase 1 records the state of the
+assembler every 1000 lines or more, where no include file, macro,
+conditional block or module is open. Every process assembles the
+lines from one checkpoint to the next, the listings, hints, messages,
+bytes and cross references are joined in the order of the source.
+Phase 2 runs in one piece if a symbol is assigned different values
+("="), with -d, -p, -u, -z, --profile or --place, in batch mode, for
+INLINE modules, with --obj and if a piece stops with a fatal error.
+
+Relocatable objects
+===================
+bs9 -q -j 8 --obj kernel.as9 disk.as9 video.as9
+bs9 --link os.bin --base $c000 kernel.o9 disk.o9 video.o9
+
+"--obj" writes the relocatable object <source>.o9 instead of the
+binaries of STORE. The code starts in the relocatable section "code",
+
+         SECT data               starts the relocatable section "data"
+         SECT vec,LOC=$fff0      starts the section "vec" at $fff0
+         ORG  $e000              starts a section at $e000
+         EXTERN Print,Msg        symbols defined in other objects
+         INTERN Start,Buf        symbols exported to other objects
+
+Without "--obj" EXTERN and INTERN are ignored. Relocatable values are
+symbols of relocatable sections or EXTERN symbols plus or minus a
+constant; the difference of two symbols of the same section is
+constant. Other operations on relocatable values, 8 bit operands
+and FCB are errors. Branches and PC relative operands to other sections
+are relocated too, "-o" does not optimize them. "-z" and "--place"
+cannot be combined with "--obj".
+
+"--link" places the sections of the objects: sections with a fixed
+address there, relocatable sections of the same name one after the
+other in the first free gap from "--base" on (default 0). EXTERN
+symbols are resolved with the INTERN symbols of all objects. The
+memory from the lowest to the highest section is written as binary,
+or as S-records for the extension .s19 or .srec, and the sections and
+symbols are listed in <file>.map. Only the changed sources must be
+assembled again before linking.
+
+Include cache
+=============
+bs9 --pch cache app.as9
+
+stores an include file, that defines only symbols ("=", EQU, SET,
+ENUM, BSS) and macros, after the assembly in the existing directory
+"cache". The name of the cache file is a hash of the contents of the
+include file and of the CPU, PC, BSS, DP, ENUM and CASE state at the
+INCLUDE statement. Later assemblies load the symbols and macros from
+the cache file instead of reading the include file in both phases,
+if the symbols of the source used by the include file have the same
+values as before. The listing shows "cached INCLUDE file" instead of
+its lines. Include files with code, data, other pseudo ops than BSS,
+CASE, CPU, LIST, MACLIST, SETDP and TTL, nested includes or labels
+defined by position are always read.
+
+Symbol export
+=============
+bs9 -q --sym rom.as9
+
+writes the defined symbols of rom.as9 with their final values to
+rom.sym, one "name = value" per line. Another source uses them with
+
+         IMPORTSYM "rom.sym"
+
+instead of including and assembling the whole ROM again. The symbols
+are locked like those of -D, so a source may define them again with
+the same or, with "=", a new value.
+
+Build cache
+===========
+bs9 -q --cache /var/cache/bs9 os.as9
+
+records after an assembly without errors the hashes of all files read
+(source, INCLUDE, LOAD, IMPORTSYM, --io, --place and --profile files)
+and stores all files written (STORE files, listing, hints, reports) in
+the existing directory. The next assembly of the same source with the
+same options and the same bs9 binary compares the hashes and, if no
+file has changed, copies the outputs from the cache instead of
+assembling. The cache may be shared by parallel builds.
+
+Make dependencies
+=================
+bs9 -q -M os.as9
+
+writes os.d for make with the rule "outputs: inputs". The targets are
+the STORE files, the listing and the other files written, the
+prerequisites are the source and all files read (INCLUDE, LOAD,
+IMPORTSYM ...). Every prerequisite but the source gets an empty rule,
+so make continues after an include file was removed. -MF file writes
+the rule to file instead. Use it in a Makefile with
+
+-include os.d
+
+Unchanged outputs
+=================
+STORE files, listing, symbol and dependency files are written to
+<name>.tmp first. An existing file with the same contents is left
+untouched, so make or an emulator watching it sees no change. Otherwise
+the new file replaces the old one with a rename, so that no other
+program ever reads a partially written file.
+
+Watch mode
+==========
+bs9 -q --watch os.as9
+
+assembles os.as9 and stays resident. Whenever the source or one of the
+files it read (INCLUDE, LOAD, IMPORTSYM ...) is saved, os.as9 is
+assembled again. The texts of the source and include files are kept in
+memory and only the changed files are read again. Each assembly prints
+its result and time. Stop it with Ctrl-C.
+
+Source lines
+============
+Source and include files are read into memory as a whole. Lines have
+no length limit, the line buffers grow with the longest line, so long
+FCB or FDB tables and macro calls need not be split. Symbol names are
+limited to 255 characters.
+
 Assign addresses to symbols
 ===========================
 LABEL   ENUM value             define label with value
@@ -143,7 +509,11 @@ LONG 1000000                   stores 32 bit long data
 REAL  3.1415926                stores a 32 bit real
 FILL  N ($EA)                  fill memory with N bytes containing $EA
 FILL  $A000 - * (0)            fill memory from pc(*) upto $9FFF
+EXECUTE MkSine,256,$40         fill 256 bytes by running MkSine (see below)
 INCLUDE "filename"             includes specified file
+INCLUDE ONCE "filename"        includes file, if not included before
+PRAGMA ONCE                    later INCLUDEs of this file are skipped
+IMPORTSYM "rom.sym"            defines the locked symbols of "bs9 --sym rom"
 END                            stops assembly
 CASE -                         symbols are not case sensitive
 SIZE                           print code size info
@@ -238,6 +608,8 @@ Macros accept up to 10 parameter and may have any length.
 
 MACLIST ON  : List expanded macro code lines
 MACLIST OFF : Do not list expanded macro code lines
+POOL ON     : Pool following labelled strings
+POOL OFF    : Stop pooling strings
 
 Conditional assembly
 ====================
@@ -323,8 +695,36 @@ For example:
 #include <ctype.h>
 #include <errno.h>
 #include <time.h>
-
-int CPU = 6309; // default: Hitachi 6309
+#include <setjmp.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+// batch mode (--batch) runs assemblies in threads, so every
+// global variable with assembler state exists once per thread
+
+#if !defined(_WIN32) && !defined(BS9_NO_MAIN) && !defined(BS9_LIBRARY)
+#define BS9_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL
+#endif
+
+THREAD_LOCAL int CPU = 6309; // default: Hitachi 6309
+THREAD_LOCAL int InitCPU = 6309; // CPU at the start of a pass (--cpu)
 
 #define MAX_STR 1024
 
@@ -333,11 +733,11 @@ int CPU = 6309; // default: Hitachi 6309
 // overflows are detected after using the new value.
 // So references to pc + n do no harm if pc is near the boundary
 
-unsigned char ROM[0x10100]; // binary
+THREAD_LOCAL unsigned char ROM[0x10100]; // binary
 
 // Used to detect overwrite attempts
 
-unsigned char LOCK[0x10100]; // binary
+THREAD_LOCAL unsigned char LOCK[0x10100]; // binary
 
 // A two pass assembler must set the instruction length in phase 1
 // These values are stored in ADL, in order to avoid phase errors
@@ -345,21 +745,82 @@ unsigned char LOCK[0x10100]; // binary
 // >0: instruction length locked
 // <0: data byte or not start byte of instruction
 
-int ErrNum;          // error count
-int ListGlobal = 1;  // global listing control
-int ListOn = 1;      // listing control
+THREAD_LOCAL int ErrNum;          // error count
+THREAD_LOCAL int ListGlobal = 1;  // global listing control
+THREAD_LOCAL int ListOn = 1;      // listing control
+
+THREAD_LOCAL FILE *sf; // source       file
+THREAD_LOCAL FILE *lf; // listing      file
+THREAD_LOCAL FILE *df; // debug        file
+THREAD_LOCAL FILE *pf; // preprocessed file
+THREAD_LOCAL FILE *of; // object       file
+THREAD_LOCAL FILE *prf; // profile      file
+
+THREAD_LOCAL int ProfAdr = -1; // address of instruction in current line (--profile)
+
+// *********
+// Terminate
+// *********
+
+// Fatal errors end the process, or return to BS9_Assemble
+// when the assembler is used as library.
+
+#if defined(__GNUC__)
+#define NORETURN __attribute__((noreturn))
+#elif defined(_MSC_VER)
+#define NORETURN __declspec(noreturn)
+#else
+#define NORETURN
+#endif
 
-FILE *sf; // source       file
-FILE *lf; // listing      file
-FILE *df; // debug        file
-FILE *pf; // preprocessed file
-FILE *of; // object       file
+THREAD_LOCAL jmp_buf *ExitJmp;
+
+int ListingClose(void);
+
+NORETURN void Terminate(int rc)
+{
+   if (ExitJmp) longjmp(*ExitJmp,1);
+   ListingClose(); // keep the listing up to the fatal error
+   exit(rc);
+}
+
+// statistics (-t, --stats)
+
+#define STAT_FILES 64
+
+THREAD_LOCAL int    Stats;           // 0: off  1: text report  2: JSON report
+THREAD_LOCAL double StatTime[4];     // seconds: phase 1, phase 2, binaries, symbol list
+THREAD_LOCAL int    StatRuns[2];     // number of phase 1 and phase 2 runs
+THREAD_LOCAL long   StatLines;       // source lines parsed in all passes
+THREAD_LOCAL long   StatLookups;     // symbol table searches
+THREAD_LOCAL long   StatProbes;      // symbol table entries compared
+THREAD_LOCAL long   StatMacros;      // macro and inline expansions
+THREAD_LOCAL long   StatIncludes;    // include and load files opened
+THREAD_LOCAL long   StatPuts;        // calls of Put
+THREAD_LOCAL long   StatAllocs;      // calls of MallocOrDie and ReallocOrDie
+THREAD_LOCAL size_t StatHeap;        // bytes requested by MallocOrDie and ReallocOrDie
+THREAD_LOCAL int    StatFiles;       // entries in StatFile
+THREAD_LOCAL int    StatChunks;      // processes of the last parallel phase 2
+THREAD_LOCAL struct StatFileStruct
+{
+   char *Name;
+   long  Bytes;
+} StatFile[STAT_FILES];
 
 // forward references
 
 void AddLabel(char *p);
 void ErrorLine(char *p);
 void ErrorMsg(const char *format, ...);
+char *ParseExecute(char *p);
+void RunExecutes(void);
+void PchDepend(int i);
+void PchPseudo(const char *Key);
+int SetCPU(int c);
+#ifdef BS9_THREADS
+int Phase2Parallel(void);
+#endif
+void ProfileLine(void);
 char *ExtractOpText(char *);
 char *EvalOperand(char *, int *, int);
 char *ExtractValue(char *, int *);
@@ -374,13 +835,14 @@ void Put(int i, int v, char *p)
 {
    if (df) fprintf(df,"LOCK[%4.4x]=%x  ROM[%4.4x]=%x  v=%4.4x\n",
                       i,LOCK[i],i,ROM[i],v);
+   ++StatPuts;
    v &= 0xff;
    if (LOCK[i] && ROM[i] != v)
    {
       ++ErrNum;
       if (p) ErrorLine(p);
       ErrorMsg("Tried to overwrite address %4.4x\n",i);
-      exit(1);
+      Terminate(1);
    }
    ROM[i]  = v;
    LOCK[i] = 1;
@@ -418,7 +880,7 @@ void *AssertAlloc(void *p)
 {
    if (p) return p;
    fprintf(stderr, "Allocation of memory failed.\n");
-   exit(1);
+   Terminate(1);
 }
 
 // ***********
@@ -427,6 +889,8 @@ void *AssertAlloc(void *p)
 
 void *MallocOrDie(size_t size)
 {
+   ++StatAllocs;
+   StatHeap += size;
    return AssertAlloc(calloc(size,1));
 }
 
@@ -436,6 +900,8 @@ void *MallocOrDie(size_t size)
 
 void *ReallocOrDie(void *p, size_t size)
 {
+   ++StatAllocs;
+   StatHeap += size;
    return AssertAlloc(realloc(p, size));
 }
 
@@ -447,7 +913,7 @@ FILE *AssertFileOp(FILE *p, const char *msg)
 {
    if (p) return p;
    perror(msg);
-   exit(1);
+   Terminate(1);
 }
 
 // *******
@@ -457,17 +923,99 @@ FILE *AssertFileOp(FILE *p, const char *msg)
 char *StrNDup(void *src, unsigned int n)
 {
    char *dst;
-   if (n > MAX_STR)
-   {
-      fprintf(stderr,"*** tried to allocate %d bytes for string\n",n);
-      fprintf(stderr,"*** current maximum length is %d\n",MAX_STR);
-      exit(1);
-   }
+
    dst = (char *)MallocOrDie(n+1);
    memmove(dst,src,n);
    return dst;
  }
 
+// *********
+// StatClock
+// *********
+
+// wall time in seconds, used for the phase timing of -t, so that
+// --parallel shows its gain and other batch threads don't count.
+// Windows uses the processor time.
+
+double StatClock(void)
+{
+#ifdef _WIN32
+   return (double)clock() / CLOCKS_PER_SEC;
+#else
+   struct timeval tv;
+
+   gettimeofday(&tv,NULL);
+   return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// ************
+// StatFileSize
+// ************
+
+// record the size of an output file before it is closed
+
+void StatFileSize(const char *Name, FILE *fp)
+{
+   if (!Stats || StatFiles == STAT_FILES) return;
+   StatFile[StatFiles].Name  = StrNDup((void *)Name,strlen(Name));
+   StatFile[StatFiles].Bytes = ftell(fp);
+   ++StatFiles;
+}
+
+// ***********
+// OutputClose
+// ***********
+
+// Binaries, listing and the other outputs are written to <name>.tmp first. An existing
+// file with the same contents is kept untouched, so its time stamp
+// doesn't trigger make rules, emulator reloads or checksum steps.
+// Otherwise the new file replaces it with rename, so that no reader
+// ever sees a partially written file.
+
+char *OutputTmp(const char *Name)
+{
+   char *Tmp = (char *)MallocOrDie(strlen(Name) + 5);
+
+   sprintf(Tmp,"%s.tmp",Name);
+   return Tmp;
+}
+
+int SameFile(const char *A, const char *B)
+{
+   int Same;
+   size_t n;
+   char BufA[4096],BufB[4096];
+   FILE *fa,*fb;
+
+   fa = fopen(A,"rb");
+   fb = fopen(B,"rb");
+   Same = fa && fb;
+   while (Same && (n = fread(BufA,1,sizeof(BufA),fa)) > 0)
+      Same = fread(BufB,1,n,fb) == n && !memcmp(BufA,BufB,n);
+   if (Same) Same = !ferror(fa) && fread(BufB,1,1,fb) == 0;
+   if (fa) fclose(fa);
+   if (fb) fclose(fb);
+   return Same;
+}
+
+// closes fp written to Tmp and frees Tmp, returns 0 on success
+
+int OutputClose(FILE *fp, const char *Name, char *Tmp)
+{
+   int rc;
+
+   rc = fclose(fp);
+   if (rc || SameFile(Tmp,Name)) remove(Tmp);
+   else if (rename(Tmp,Name)) // Windows doesn't replace existing files
+   {
+      remove(Name);
+      rc = rename(Tmp,Name);
+   }
+   free(Tmp);
+   return rc;
+}
+
 #define ADMODES 8
 
 enum Addressing_Mode
@@ -724,7 +1272,7 @@ struct MatStruct
 #define DIMOP_6809 139
 #define DIMOP_6309 (sizeof(Mat) / sizeof(struct MatStruct))
 
-int DimOp = DIMOP_6309;
+THREAD_LOCAL int DimOp = DIMOP_6309;
 
 // register Q is not included, it appears never as operand
 // and is only part of the mnemonic
@@ -741,7 +1289,7 @@ const char *Register_6809[] =
    "D","X","Y","U","S","PC","-","-","A","B","CC","DP","*","*","-","-"
 };
 
-const char **RegisterNames = Register_6309;
+THREAD_LOCAL const char **RegisterNames = Register_6309;
 
 struct PushStruct
 {
@@ -764,104 +1312,410 @@ struct PushStruct
 
 #define UNDEF (int) 0xff0000
 
-int SkipHex    =  0; // switch on with -x
-int Debug      =  0; // switch on with -d
-int LiNo       =  0; // line number of current file
-int WithLiNo   =  0; // print line numbers in listing if set
-int TotalLiNo  =  0; // total line number
-int Preprocess =  0; // print preprocessed source file <file.pp>
-int Quiet      =  0; // switch for quiet mode
-int ERRMAX     = 10; // stop assemby after ERRMAX errors
-int EnumValue  = -1; // last used ENUM value
-int MacLev;          // macro nesting level
-int MacList    =  1; // macro listing option
-int ModuleStart;     // address of a module
-int Optimize;        // branch and jump omtimization
-int FormLn;          // lines per page [inactive]
-int DP;              // current direct page
-int CodeStyle;       // 1: operand has no spaces (old form)
-int MneIndex;        // current mnemonic
-
-int oc;              // op code
-int pb;              // post byte
-int am;              // address mode
-int il;              // instruction length
-int ol;              // opcode length
-int pl;              // postbyte length
-int ql;              // operand length
-int pc = -1;         // program counter
-int bss;             // bss counter
-int nops;            // snychronisation nops
-
-int Phase;           // phase or pass of 2-pass assembler
-int IfLevel;         // if nesting level
-int Skipping;        // inside 'false' branch
-int SkipLine[10];    // skipping value for each nesting level
-int ForcedEnd;       // Triggered by END command
-int IgnoreCase;      // 1: Ignore case for symbols
-int ForcedMode;      // -1: direct page, +1: extended
-int optc;            // count optimization messages
-int Preset;          // value for initialisation
+THREAD_LOCAL int SkipHex    =  0; // switch on with -x
+THREAD_LOCAL int Debug      =  0; // switch on with -d
+THREAD_LOCAL int LiNo       =  0; // line number of current file
+THREAD_LOCAL int WithLiNo   =  0; // print line numbers in listing if set
+THREAD_LOCAL int TotalLiNo  =  0; // total line number
+THREAD_LOCAL int Preprocess =  0; // print preprocessed source file <file.pp>
+THREAD_LOCAL int Quiet      =  0; // switch for quiet mode
+THREAD_LOCAL int ERRMAX     = 10; // stop assemby after ERRMAX errors
+THREAD_LOCAL int EnumValue  = -1; // last used ENUM value
+THREAD_LOCAL int MacLev;          // macro nesting level
+THREAD_LOCAL int MacList    =  1; // macro listing option
+THREAD_LOCAL int ModuleStart;     // address of a module
+THREAD_LOCAL int Optimize;        // branch and jump omtimization
+THREAD_LOCAL int FormLn;          // lines per page [inactive]
+THREAD_LOCAL int DP;              // current direct page
+THREAD_LOCAL int CodeStyle;       // 1: operand has no spaces (old form)
+THREAD_LOCAL int MneIndex;        // current mnemonic
+
+THREAD_LOCAL int oc;              // op code
+THREAD_LOCAL int pb;              // post byte
+THREAD_LOCAL int am;              // address mode
+THREAD_LOCAL int il;              // instruction length
+THREAD_LOCAL int ol;              // opcode length
+THREAD_LOCAL int pl;              // postbyte length
+THREAD_LOCAL int ql;              // operand length
+THREAD_LOCAL int pc = -1;         // program counter
+THREAD_LOCAL int bss;             // bss counter
+THREAD_LOCAL int nops;            // snychronisation nops
+
+THREAD_LOCAL int Phase;           // phase or pass of 2-pass assembler
+THREAD_LOCAL int IfLevel;         // if nesting level
+THREAD_LOCAL int Skipping;        // inside 'false' branch
+THREAD_LOCAL int SkipLine[10];    // skipping value for each nesting level
+THREAD_LOCAL int ForcedEnd;       // Triggered by END command
+THREAD_LOCAL int IgnoreCase;      // 1: Ignore case for symbols
+THREAD_LOCAL int ForcedMode;      // -1: direct page, +1: extended
+THREAD_LOCAL int optc;            // count optimization messages
+THREAD_LOCAL int Preset;          // value for initialisation
 
 // local labels
 
 #define PLUMAX 200
 
-int minlab[11];
-int plucnt[11];
-int plulab[11][PLUMAX];
+THREAD_LOCAL int minlab[11];
+THREAD_LOCAL int plucnt[11];
+THREAD_LOCAL int plulab[11][PLUMAX];
 
 // Filenames
 
 #define FNSIZE 256
 
-char *Src;           // source file
-char  Lst[FNSIZE];   // list file
-char  Pre[FNSIZE];   // preprocessed file
-char  Opt[FNSIZE];   // optimzation hints
-
-int GenStart = 0x10000 ; //  Lowest assemble address
-int GenEnd   =       0 ; // Highest assemble address
+THREAD_LOCAL char *Src;           // source file
+THREAD_LOCAL char *Variant;       // --variants: name of the variant or NULL
+THREAD_LOCAL char  Lst[FNSIZE];   // list file
+THREAD_LOCAL char *LstTmp;        // list file while it is written
+THREAD_LOCAL char  Pre[FNSIZE];   // preprocessed file
+THREAD_LOCAL char  Opt[FNSIZE];   // optimzation hints
+THREAD_LOCAL char  Stk[FNSIZE];   // stack depth report
+THREAD_LOCAL char  Dot[FNSIZE];   // call graph (DOT)
+THREAD_LOCAL char  Cgr[FNSIZE];   // call graph (table)
+THREAD_LOCAL char  Run[FNSIZE];   // simulation report
+THREAD_LOCAL char  Prf[FNSIZE];   // profile listing
+THREAD_LOCAL char  Fld[FNSIZE];   // folded call stacks
+THREAD_LOCAL char  Obj[FNSIZE];   // relocatable object (--obj)
+THREAD_LOCAL char  Exp[FNSIZE];   // symbol export (--sym)
+THREAD_LOCAL char  Dep[FNSIZE];   // make dependencies (-M)
+
+THREAD_LOCAL int GenStart = 0x10000 ; //  Lowest assemble address
+THREAD_LOCAL int GenEnd   =       0 ; // Highest assemble address
 
 // These arrays hold the parameter for storage files
 
 #define SFMAX 20
-int SFA[SFMAX];      // start address of data block
-int SFL[SFMAX];      // length of data block
-char *SFF[SFMAX];    // filename
-int SFE[SFMAX];      // execution start address
-int SFR[SFMAX];      // number of records in a S19 file
-int SFT[SFMAX];      // file format
+THREAD_LOCAL int SFA[SFMAX];      // start address of data block
+THREAD_LOCAL int SFL[SFMAX];      // length of data block
+THREAD_LOCAL char *SFF[SFMAX];    // filename
+THREAD_LOCAL int SFE[SFMAX];      // execution start address
+THREAD_LOCAL int SFR[SFMAX];      // number of records in a S19 file
+THREAD_LOCAL int SFT[SFMAX];      // file format
 
-int StoreCount = 0;  // number of segments to store
+THREAD_LOCAL int StoreCount = 0;  // number of segments to store
 
 enum OutfileFormat { BINARY, SRECORD, SPARROW };
 
-signed char ADL[0x10000];
+THREAD_LOCAL signed char ADL[0x10000];
+
+#define ML 256 // max. symbol length, reserve of the line buffers
+
+// the source line and the buffers filled from it grow with the
+// longest line, see LineFit
+
+THREAD_LOCAL char  *Line;    // source line
+THREAD_LOCAL char  *Label;   // current label
+THREAD_LOCAL char  *MacArgs; // macro arguments
+THREAD_LOCAL char  *OpText;  // operand source
+THREAD_LOCAL size_t LineMax; // allocated size of the line buffers
+
+THREAD_LOCAL unsigned char *ByteBuffer; // bytes of a data line
+THREAD_LOCAL size_t ByteMax;            // allocated size of ByteBuffer
+
+// source text in memory (library interface, see BS9_Assemble)
+
+struct MemFileStruct
+{
+   const char *Name; // file name for INCLUDE
+   const char *Text; // contents
+   size_t      Len;  // length of Text
+   size_t      Pos;  // read position
+   int         Eof;  // end of file reached
+   int         Own;  // 1: Text read by SourceOpen, freed by SourceClose
+};
+
+THREAD_LOCAL struct MemFileStruct *mf;       // current memory file (NULL: read sf)
+THREAD_LOCAL struct MemFileStruct *MemFiles; // virtual files of the library call
+THREAD_LOCAL int MemFileCount;               // number of virtual files
 
 // organize nesting of include files
 
-struct IncludeStackStruct
+THREAD_LOCAL struct IncludeStackStruct
 {
    FILE *fp;
+   struct MemFileStruct *mf;
    int   LiNo;
    char *Src;
 } IncludeStack[100];
 
-int IncludeLevel;
+THREAD_LOCAL int IncludeLevel;
+
+// ********
+// ReadFile
+// ********
+
+// reads a whole file into memory, returns NULL if it can't be read
+
+char *ReadFile(const char *Name, size_t *Len)
+{
+   size_t n,l = 0,Max = 1 << 16;
+   char *Text;
+   FILE *fp;
+
+   fp = fopen(Name,"rb");
+   if (!fp) return NULL;
+   if (!fseek(fp,0,SEEK_END) && ftell(fp) > 0) Max = ftell(fp) + 1;
+   rewind(fp);
+   Text = (char *)MallocOrDie(Max);
+   while ((n = fread(Text+l,1,Max-l,fp)) > 0)
+   {
+      l += n;
+      if (l == Max) Text = (char *)ReallocOrDie(Text,Max *= 2);
+   }
+   if (ferror(fp))
+   {
+      free(Text);
+      Text = NULL;
+   }
+   fclose(fp);
+   *Len = l;
+   return Text;
+}
+
+// *******
+// LineFit
+// *******
+
+// Line and the buffers filled from it have room for a line of length
+// l plus ML bytes for terminators, scope prefixes and expansions.
+
+void LineFit(size_t l)
+{
+   if (l + ML <= LineMax) return;
+   LineMax = 2 * (l + ML);
+   Line    = (char *)ReallocOrDie(Line,LineMax);
+   Label   = (char *)ReallocOrDie(Label,LineMax);
+   MacArgs = (char *)ReallocOrDie(MacArgs,LineMax);
+   OpText  = (char *)ReallocOrDie(OpText,LineMax);
+}
+
+// *******
+// ByteFit
+// *******
+
+// ByteBuffer has room for l bytes
+
+void ByteFit(size_t l)
+{
+   if (l <= ByteMax) return;
+   ByteMax = 2 * l + ML;
+   ByteBuffer = (unsigned char *)ReallocOrDie(ByteBuffer,ByteMax);
+}
+
+// **********
+// SourceLine
+// **********
+
+// reads the next line of the current source file into Line, which
+// grows with the line, so that lines of any length are read whole.
+// EOF is set like feof, when a read hits the end of the text.
+
+char *SourceLine(void)
+{
+   size_t l;
+   const char *p,*e;
+
+   LineFit(0);
+   if (!mf) // file opened by the caller (micro9)
+   {
+      if (!fgets(Line,LineMax,sf)) return NULL;
+      for (l=strlen(Line) ; l && Line[l-1] != '\n' && !feof(sf) ; l += strlen(Line+l))
+      {
+         LineFit(l);
+         if (!fgets(Line+l,LineMax-l,sf)) break;
+      }
+      return Line;
+   }
+   if (mf->Pos >= mf->Len)
+   {
+      mf->Eof = 1;
+      return NULL;
+   }
+   p = mf->Text + mf->Pos;
+   e = (const char *)memchr(p,'\n',mf->Len - mf->Pos);
+   l = e ? (size_t)(e - p) + 1 : mf->Len - mf->Pos;
+   LineFit(l);
+   memcpy(Line,p,l);
+   Line[l] = 0;
+   mf->Pos += l;
+   if (!e) mf->Eof = 1;
+   return Line;
+}
+
+int SourceEof(void)
+{
+   return mf ? mf->Eof : feof(sf);
+}
+
+void SourceRewind(void)
+{
+   if (mf) mf->Pos = mf->Eof = 0;
+   else    rewind(sf);
+}
+
+#ifdef BS9_THREADS
+
+// include files of the batch mode, read once and shared by all jobs
+
+struct MemFileStruct *IncShared; // files read so far
+int IncShareds;                  // number of files
+int IncShareMax;                 // allocated size of IncShared
+int IncShare;                    // 1: share include files (--batch)
+pthread_mutex_t IncLock = PTHREAD_MUTEX_INITIALIZER;
+
+// **********
+// SharedOpen
+// **********
+
+// (re)reads the shared copy of a file, the caller holds IncLock.
+// A file, that can't be read any more, is dropped, returns the index
+// of the copy or -1.
+
+int SharedLoad(const char *Name)
+{
+   int i;
+   size_t l;
+   char *Text;
+
+   for (i=0 ; i < IncShareds ; ++i)
+      if (!strcmp(Name,IncShared[i].Name)) break;
+   Text = ReadFile(Name,&l);
+   if (!Text)
+   {
+      if (i < IncShareds)
+      {
+         free((char *)IncShared[i].Name);
+         free((char *)IncShared[i].Text);
+         IncShared[i] = IncShared[--IncShareds];
+      }
+      return -1;
+   }
+   if (i == IncShareds)
+   {
+      if (IncShareds == IncShareMax)
+      {
+         IncShareMax = IncShareMax ? 2 * IncShareMax : 16;
+         IncShared = (struct MemFileStruct *)ReallocOrDie(IncShared,
+                      IncShareMax * sizeof(struct MemFileStruct));
+      }
+      memset(IncShared+i,0,sizeof(struct MemFileStruct));
+      IncShared[i].Name = StrNDup((char *)Name,strlen(Name));
+      ++IncShareds;
+   }
+   else free((char *)IncShared[i].Text);
+   IncShared[i].Text = Text;
+   IncShared[i].Len  = l;
+   return i;
+}
+
+// opens the shared copy of an include file, reads it on first use
+
+int SharedOpen(const char *Name)
+{
+   int i;
+
+   pthread_mutex_lock(&IncLock);
+   for (i=0 ; i < IncShareds ; ++i)
+      if (!strcmp(Name,IncShared[i].Name)) break;
+   if (i == IncShareds) i = SharedLoad(Name);
+   mf = NULL;
+   if (i >= 0)
+   {
+      mf  = (struct MemFileStruct *)MallocOrDie(sizeof(struct MemFileStruct));
+      *mf = IncShared[i];
+      sf  = NULL;
+   }
+   pthread_mutex_unlock(&IncLock);
+   return mf != NULL;
+}
+
+#endif
+
+// **********
+// SourceOpen
+// **********
+
+// opens a virtual file of the library call or a file
+
+int SourceOpen(const char *Name)
+{
+   int i;
+
+   for (i=0 ; i < MemFileCount ; ++i)
+   {
+      if (!strcmp(Name,MemFiles[i].Name))
+      {
+         mf  = (struct MemFileStruct *)MallocOrDie(sizeof(struct MemFileStruct));
+         *mf = MemFiles[i];
+         sf  = NULL;
+         return 1;
+      }
+   }
+#ifdef BS9_THREADS
+   if (IncShare) return SharedOpen(Name);
+#endif
+
+   // files are read whole, lines are taken from memory
+
+   sf = NULL;
+   mf = (struct MemFileStruct *)MallocOrDie(sizeof(struct MemFileStruct));
+   memset(mf,0,sizeof(struct MemFileStruct));
+   mf->Name = Name;
+   mf->Text = ReadFile(Name,&mf->Len);
+   mf->Own  = 1;
+   if (mf->Text) return 1;
+   free(mf);
+   mf = NULL;
+   return 0;
+}
+
+int SourceClose(void)
+{
+   if (!mf) return fclose(sf);
+   if (mf->Own) free((char *)mf->Text);
+   free(mf);
+   mf = NULL;
+   return 0;
+}
+
+// **********
+// DiagPrintf
+// **********
+
+// Messages for the user go to stdout or, for the library,
+// are collected in Diag.
+
+THREAD_LOCAL char  *Diag;     // collected messages
+THREAD_LOCAL size_t DiagLen;  // length of messages
+THREAD_LOCAL int    DiagOn;   // 1: collect messages
+
+void DiagPrintf(const char *format, ...)
+{
+   va_list args;
+   char buf[MAX_STR];
+   size_t l;
 
-#define ML 256
+   va_start(args,format);
+   if (!DiagOn)
+   {
+      vprintf(format,args);
+      va_end(args);
+      return;
+   }
+   vsnprintf(buf,sizeof(buf),format,args);
+   va_end(args);
+   l = strlen(buf);
+   Diag = (char *)ReallocOrDie(Diag,DiagLen+l+1);
+   memcpy(Diag+DiagLen,buf,l+1);
+   DiagLen += l;
+}
 
-int ArgPtr[10];              // macro argument pointer
-char Line[ML];               // source line
-char Label[ML];              // current label
-char MacArgs[ML];            // macro arguments
-unsigned char Operand[ML];   // binary operand
-char OpText[ML];             // operand source
-char Comment[ML];            // comment source
-char Hint[ML];               // optimization hints
-char Scope[ML];              // for local symbols
-char datebuffer [80];
+THREAD_LOCAL int ArgPtr[10];              // macro argument pointer
+THREAD_LOCAL unsigned char Operand[ML];   // binary operand
+THREAD_LOCAL char Comment[ML];            // comment source
+THREAD_LOCAL char Hint[ML];               // optimization hints
+THREAD_LOCAL char Scope[ML];              // for local symbols
+THREAD_LOCAL char datebuffer [80];
 
 // state of label definition
 // defined or BSS or defined by position
@@ -872,18 +1726,102 @@ char datebuffer [80];
 
 #define MAXLAB 8000
 
-struct LabelStruct
+THREAD_LOCAL struct LabelStruct
 {
    char *Name;     // Label name - case sensitive
    int   Address;  // Range 0 - 65536
    int   Bytes;    // Length of object (string for example)
    int   Locked;   // Cannot change value
    int   NumRef;   // # of references
+   int   Uses;     // # of references in phase 1
+   int   Calls;    // # of JSR, BSR, LBSR with this label in phase 1
    int  *Ref;      // list of references
    int  *Att;      // list of attributes
+   int   Rel;      // relocation: 0 absolute, > 0 section, < 0 external
+   int   Intern;   // exported to the object file by INTERN
 } lab[MAXLAB];
 
-int Labels;        // number of labels
+THREAD_LOCAL int Labels;        // number of labels
+THREAD_LOCAL int Reassigned;    // a label changed its value in phase 1
+
+// relocatable object (--obj)
+
+#define MAXSECT 64
+
+THREAD_LOCAL int ObjMode;       // 1: write <source>.o9 instead of binaries
+THREAD_LOCAL int Rel;           // relocation of the last value of EvalOperand
+THREAD_LOCAL int CurRel;        // relocation of pc
+THREAD_LOCAL int CurSect = -1;  // current section
+THREAD_LOCAL int Sects;         // number of sections
+THREAD_LOCAL int RelNext;       // start of the next relocatable section
+THREAD_LOCAL int Externs;       // number of EXTERN symbols
+
+THREAD_LOCAL struct SectStruct
+{
+   char *Name;     // SECT name, "ORG" for absolute sections
+   int   Loc;      // fixed address or -1: relocatable
+   int   Base;     // start address in the assembly
+   int   End;      // end address in the assembly
+} Sect[MAXSECT];
+
+THREAD_LOCAL struct FixStruct
+{
+   int   Sect;     // section of the operand
+   int   Addr;     // address of the operand
+   int   Kind;     // 'W' address, 'R' 16 bit or 'B' 8 bit distance from pc
+   int   Target;   // relocation of the value
+   int   Value;    // value in the assembly
+} *Fix;
+
+THREAD_LOCAL int Fixes;         // number of fixups
+THREAD_LOCAL int FixMax;        // allocated size of Fix
+
+// include cache (--pch)
+
+struct PchStateStruct
+{
+   int   pc;
+   int   bss;
+   int   DP;
+   int   CPU;
+   int   EnumValue;
+   int   ListGlobal;
+   int   MacList;
+   int   IgnoreCase;
+   int   CodeStyle;
+};
+
+struct PchSymStruct
+{
+   int   Index;    // index in lab[]
+   int   Address;  // value at the end of the include file
+   int   Bytes;
+};
+
+THREAD_LOCAL struct PchStruct
+{
+   char *Path;     // cache file
+   int   Call;     // number of the INCLUDE statement in the phase
+   int   Hit;      // 1: loaded from the cache, 0: recorded
+   int   Bad;      // 1: the file does more than define symbols
+   int   pc;       // pc at the INCLUDE statement
+   int   Labels;   // labels before the file
+   int   Macros;   // macros before the file
+   int   LabEnd;   // labels after the file
+   int   MacEnd;   // macros after the file
+   int   IfLevel;  // conditional level at the INCLUDE statement
+   int   minlab[11];
+   struct PchStateStruct End; // state after the file
+   struct PchSymStruct *Dep;  // used symbols defined before the file
+   int   Deps;
+   struct PchSymStruct *Sym;  // symbols of the file at its end
+} *Pch;
+
+THREAD_LOCAL char *PchDir;      // --pch: directory of the cache files
+THREAD_LOCAL int   Pchs;        // recorded or loaded include files
+THREAD_LOCAL int   PchMax;      // allocated size of Pch
+THREAD_LOCAL int   PchLevel;    // include level of the recorded file
+THREAD_LOCAL int   PchCalls;    // INCLUDE statements of the phase
 
 // maximum number of macros
 
@@ -893,7 +1831,7 @@ int Labels;        // number of labels
 
 #define CHAMAC '`'
 
-struct MacroStruct
+THREAD_LOCAL struct MacroStruct
 {
    char *Name;  // MACRO Name(arg,arg,...) (up to 10 arguments)
    char *Body;  // "Line1\nLine2\n ... LastLine\n"
@@ -902,10 +1840,166 @@ struct MacroStruct
    int  Type;   // 0: name(arg1,arg2))  1: name arg1,arg2
 } Mac[MAXMAC];
 
-char *MacPtr[MAXMAC]; // pointer inside macro body
-int Macros;           // total number of macros
+THREAD_LOCAL char *MacPtr[MAXMAC]; // pointer inside macro body
+THREAD_LOCAL int Macros;           // total number of macros
+
+// modules (MODULE ... ENDMOD) are recorded in phase 2
+// and used by the code analysis after assembly
+
+THREAD_LOCAL struct ModuleStruct
+{
+   char *Name;  // module name (scope)
+   int   Start; // address of first byte
+   int   End;   // address after last byte (-1: not closed)
+} *Mod;
+
+THREAD_LOCAL int Modules;          // total number of modules
+THREAD_LOCAL int ModMax;           // allocated size of Mod
+
+// *********
+// AddModule
+// *********
+
+void AddModule(char *Name, int Start, int End)
+{
+   if (Modules >= ModMax)
+   {
+      ModMax += 256;
+      Mod = (struct ModuleStruct *)
+            ReallocOrDie(Mod,ModMax*sizeof(struct ModuleStruct));
+   }
+   Mod[Modules].Name  = Name;
+   Mod[Modules].Start = Start;
+   Mod[Modules].End   = End;
+   ++Modules;
+}
+
+// INLINE modules are recorded in a first run of phase 1.
+// Phase 1 is then repeated with JSR, BSR and LBSR calls to
+// these modules replaced by the module body without RTS.
+
+#define MAXINL 200
+#define INLMAX  16 // default size limit for INLINE
+
+enum InlineCheck { INL_OK, INL_SIZE, INL_CALL, INL_RTS, INL_MACRO,
+                   INL_LABEL, INL_CODE };
+
+const char *InlineWhy[] =
+{
+   "OK", "too large", "calls or jumps", "no single RTS at end",
+   "uses macro or include", "defines global label", "INLINE after code"
+};
 
-char Cstat[26];
+THREAD_LOCAL struct InlineStruct
+{
+   char *Name;   // module name
+   char *Body;   // source lines without the final RTS
+   int   Len;    // length of body
+   int   Last;   // start of last recorded line in body
+   int   Cut;    // start of RTS line in body
+   int   RtsEnd; // address after RTS
+   int   Rts;    // # of RTS
+   int   Max;    // size limit in bytes
+   int   Size;   // size of module in bytes
+   int   Bad;    // INL_OK or reason why module is not inlined
+   int   Drop;   // all references are inlined: omit module
+   int   Count;  // # of expansions in current phase
+} Inl[MAXINL];
+
+THREAD_LOCAL int Inlines;          // total number of INLINE modules
+THREAD_LOCAL int InlPass;          // 0: record INLINE modules 1: expand calls
+THREAD_LOCAL int InlCur = -1;      // INLINE module being recorded
+THREAD_LOCAL int InlSkip;          // skipping a dropped INLINE module
+THREAD_LOCAL int Inlined;          // # of inlined calls
+THREAD_LOCAL int *InlLong;         // total line numbers of promoted short branches
+THREAD_LOCAL int  InlLongs;        // # of promoted short branches
+THREAD_LOCAL int  InlLongNew;      // branches promoted in current phase 2
+
+// Tail merging (-z) finds identical instruction sequences ending
+// with RTS, RTI, PULS PC or JMP in the image of phase 2.
+// Phase 1 and 2 are repeated with the first instruction of one copy
+// replaced by a jump to the other copy and its rest omitted.
+// The lines are identified by their total line number.
+
+#define MRG_LABEL 1 // define label _TAIL_n for shared tail
+#define MRG_JUMP  2 // replace instruction by jump to shared tail
+#define MRG_SKIP  3 // omit instruction of merged tail
+
+THREAD_LOCAL struct MergeStruct
+{
+   int Start;  // first address of omitted copy
+   int End;    // address after omitted copy
+   int Shared; // first address of shared copy
+   int Label;  // number of label _TAIL_n at shared copy
+   int Bra;    // 1: BRA  0: JMP
+} *Mrg;
+
+THREAD_LOCAL int Merges;           // number of merged tails
+THREAD_LOCAL int Merge;            // -z: merge identical tails
+THREAD_LOCAL int Merged;           // bytes saved by merging
+THREAD_LOCAL int *MrgLine;         // address -> total line number of instruction
+THREAD_LOCAL int *MrgLiNo;         // address -> line number of instruction
+THREAD_LOCAL char **MrgOpd;        // address -> operand text of instruction
+THREAD_LOCAL int *MrgAct;          // total line number -> label * 4 + MRG_...
+THREAD_LOCAL int  MrgLines;        // size of MrgAct
+THREAD_LOCAL int  MrgJump;         // merge + 1 for the current line
+
+// String pooling (POOL ON or -u) records labelled byte data lines
+// in phase 2. A line, whose bytes are equal to or a suffix of the
+// bytes of another line, is omitted in a rerun and its label is
+// defined inside the other line.
+
+THREAD_LOCAL struct PoolStruct
+{
+   char *Name;   // label of line
+   int   Line;   // total line number
+   int   LiNo;   // line number
+   int   Start;  // address
+   int   Len;    // # of bytes
+   int   Target; // pool entry containing this string (-1: none)
+   int   Offset; // offset inside target
+   int   Alias;  // first pool entry using this one as target
+   int   Next;   // next pool entry with the same target
+} *Pol;
+
+THREAD_LOCAL int Pools;            // number of pool entries
+THREAD_LOCAL int PoolOn;           // POOL ON/OFF
+THREAD_LOCAL int PoolAll;          // -u: pool all byte data lines
+THREAD_LOCAL int Pooled;           // bytes saved by pooling
+THREAD_LOCAL int *PoolAct;         // total line number -> pool entry + 1
+THREAD_LOCAL int  PoolLines;       // size of PoolAct
+
+// Placement (--place) moves modules into the HOT or COLD region
+// declared by PLACE HOT,address and PLACE COLD,address.
+// Moved modules are assembled at the next free address of their
+// region, the code following ENDMOD continues at the old address.
+
+#define PLC_HOT  1
+#define PLC_COLD 2
+
+THREAD_LOCAL char *PlaceFile;      // --place: counts file
+THREAD_LOCAL char *PlcAct;         // module # -> PLC_HOT, PLC_COLD or 0
+THREAD_LOCAL int   PlcMods;        // size of PlcAct
+THREAD_LOCAL int   PlcNum;         // # of MODULE lines in current pass
+THREAD_LOCAL int   PlcCur;         // region of current module (0: not moved)
+THREAD_LOCAL int   PlcSave;        // pc for the code after the moved module
+THREAD_LOCAL int   PlcNext[3];     // next free address of HOT and COLD region
+THREAD_LOCAL int   PlcUsed[3];     // region was declared by PLACE
+THREAD_LOCAL int   Placed;         // number of moved modules
+THREAD_LOCAL int   PlcDP[16];      // candidates for direct page
+THREAD_LOCAL long long PlcAcc[16]; // accesses of candidates
+THREAD_LOCAL int   PlcDPs;         // number of candidates
+THREAD_LOCAL char **PlcRep;        // lines for the hint file
+THREAD_LOCAL int   PlcReps;        // number of lines
+THREAD_LOCAL long long *PlcHits;   // counts per address
+
+// state after option parsing, restored by ResetPass
+
+THREAD_LOCAL int InitLabels;       // labels defined with -D
+THREAD_LOCAL int InitIgnoreCase;
+THREAD_LOCAL int InitCodeStyle;
+
+THREAD_LOCAL char Cstat[26];
 
 // *******
 // MneStat
@@ -991,17 +2085,24 @@ int isym(char c)
 
 char *GetSymbol(char *p, char *s)
 {
+   char *e = s + ML - 1; // symbol buffers have ML bytes
+
    if (*p == '.') // expand local symbol
    {
       if (Scope[0])
       {
          strcpy(s,Scope);
          s += strlen(s);
-         *s++ = *p++;
+         if (s < e) *s++ = *p++;
       }
    }
-   if (*p == '_' || isalpha(*p)) while (isym(*p)) *s++ = *p++;
+   if (*p == '_' || isalpha(*p)) while (isym(*p) && s < e) *s++ = *p++;
    *s = 0;
+   if (s == e && isym(*p))
+   {
+      ErrorMsg("Symbol name too long (> %d characters)\n",ML-1);
+      Terminate(1);
+   }
    return p;
 }
 
@@ -1105,20 +2206,20 @@ char *SkipHexCode(char *p)
 void ErrorLine(char *p)
 {
    int i,ep;
-   printf("%s\n",Line);
+   DiagPrintf("%s\n",Line);
    ep = p - Line;
    if (ep >= 0 && ep < 80)
    {
-      for (i=0 ; i < ep ; ++i) printf(" ");
-      printf("^\n");
+      for (i=0 ; i < ep ; ++i) DiagPrintf(" ");
+      DiagPrintf("^\n");
       return;
    }
    ep = p - OpText;
    if (ep >= 0 && ep < 80 && *OpText)
    {
-      printf("Operand: %s\n",OpText);
-      for (i=0 ; i < ep+9 ; ++i) printf(" ");
-      printf("^\n");
+      DiagPrintf("Operand: %s\n",OpText);
+      for (i=0 ; i < ep+9 ; ++i) DiagPrintf(" ");
+      DiagPrintf("^\n");
       return;
    }
 
@@ -1141,9 +2242,9 @@ void ErrorMsg(const char *format, ...) {
    va_start(args,format);
    vsnprintf(buf+strlen(buf), SIZE_ERRMSG-strlen(buf), format, args);
    va_end(args);
-   fputs(Line, stdout);
+   DiagPrintf("%s",Line);
    fputs(Line, lf);
-   fputs(buf, stdout);
+   DiagPrintf("%s",buf);
    fputs(buf, lf);
    if (df)
    {
@@ -1302,7 +2403,7 @@ char *ParseCaseData(char *p)
    {
       ++ErrNum;
       ErrorMsg("Missing '+' or '-' after CASE\n");
-      exit(1);
+      Terminate(1);
    }
    PrintLine();
    return p+1;
@@ -1317,7 +2418,7 @@ char *ParseListOption(char *p)
    {
       ++ErrNum;
       ErrorMsg("Missing '+' or '-' after LIST\n");
-      exit(1);
+      Terminate(1);
    }
    ListOn = ListGlobal;
    PrintLine();
@@ -1331,7 +2432,7 @@ char *SetBSS(char *p)
    {
       ++ErrNum;
       ErrorMsg("Missing '=' in set BSS & instruction\n");
-      exit(1);
+      Terminate(1);
    }
    p = ExtractValue(p+1,&bss);
    if (ListOn && Phase == 2)
@@ -1358,8 +2459,10 @@ int LabelIndex(char *p)
 {
    int i;
 
+   ++StatLookups;
    for (i = 0 ; i < Labels ; ++i)
    {
+      ++StatProbes;
       if (!StrCmp(p,lab[i].Name)) return i;
    }
    return -1;
@@ -1370,8 +2473,10 @@ int AddressIndex(int a)
 {
    int i;
 
+   ++StatLookups;
    for (i = 0 ; i < Labels ; ++i)
    {
+      ++StatProbes;
       if (lab[i].Address == a) return i;
    }
    return -1;
@@ -1418,11 +2523,11 @@ char *ExtractOpText(char *p)
 
    if (CodeStyle == 1) // Thomson style
    {
-      while (*p && *p != ' ' && l < ML) OpText[l++] = *p++;
+      while (*p && *p != ' ' && l < (int)LineMax-1) OpText[l++] = *p++;
    }
    else
    {
-      while (*p && l < ML)
+      while (*p && l < (int)LineMax-1)
       {
          if (*p == '"'  && inapo == 0) inquo = !inquo;
          if (*p == '\'' && inquo == 0) inapo = !inapo;
@@ -1466,7 +2571,7 @@ char *DefineLabel(char *p, int *val, int Locked)
    {
       ++ErrNum;
       ErrorMsg("Too many labels (> %d)\n",MAXLAB);
-      exit(1);
+      Terminate(1);
    }
    p = GetSymbol(p,Label);
    if (*p == ':') ++p; // Ignore colon after label
@@ -1508,10 +2613,15 @@ char *DefineLabel(char *p, int *val, int Locked)
          {
             ErrorLine(rop);
             ErrorMsg("Extra text after label assignment\n");
-            exit(1);
+            Terminate(1);
          }
+         if (Phase == 1 && lab[j].Address != UNDEF && lab[j].Address != v)
+            Reassigned = 1; // value depends on the line
          if (lab[j].Address == UNDEF || LabDef[i].Type == 0)
+         {
              lab[j].Address = v;
+             lab[j].Rel = Rel;
+         }
          else if (lab[j].Address != v && !lab[j].Locked)
          {
             ++ErrNum;
@@ -1519,7 +2629,7 @@ char *DefineLabel(char *p, int *val, int Locked)
             ErrorMsg("*Multiple assignments for label [%s]\n"
                      "1st. value = $%4.4x   2nd. value = $%4.4x\n",
                      Label, lab[j].Address, v);
-            exit(1);
+            Terminate(1);
          }
          *val = v;
          if (LabDef[i].Type > 0) EnumValue = v;
@@ -1534,7 +2644,7 @@ char *DefineLabel(char *p, int *val, int Locked)
             ++ErrNum;
             ErrorLine(p);
             ErrorMsg("ENUM phase error\n");
-            exit(1);
+            Terminate(1);
          }
       }
       else
@@ -1542,7 +2652,7 @@ char *DefineLabel(char *p, int *val, int Locked)
          ++ErrNum;
          ErrorLine(p);
          ErrorMsg("Missing operand\n");
-         exit(1);
+         Terminate(1);
       }
    }
    else if (!strcmpword(p,"BSS"))
@@ -1568,7 +2678,7 @@ char *DefineLabel(char *p, int *val, int Locked)
          ErrorMsg("Multiple assignments for BSS label [%s]\n"
                   "1st. value = $%4.4x   2nd. value = $%4.4x\n",
                   Label,lab[j].Address,bss);
-         exit(1);
+         Terminate(1);
       }
       *val = bss;
       bss += v;
@@ -1601,12 +2711,17 @@ char *DefineLabel(char *p, int *val, int Locked)
                      " phase 1: %4.4x   phase 2: %4.4x\n",
                      Label,lab[j].Address,pc);
          }
-         exit(1);
+         Terminate(1);
+      }
+      if (!lab[j].Locked)
+      {
+         *val = pc;
+         lab[j].Rel = CurRel;
       }
-      if (!lab[j].Locked) *val = pc;
       lab[j].Ref[0] = LiNo;
       lab[j].Att[0] = LPOS;
    }
+   if (PchLevel && j < Pch[Pchs-1].Labels) Pch[Pchs-1].Bad = 1;
    return p;
 }
 
@@ -1615,7 +2730,12 @@ void SymRefs(int i)
 {
    int n;
 
-   if (Phase != 2) return;
+   if (PchLevel) PchDepend(i);
+   if (Phase != 2)
+   {
+      ++lab[i].Uses;
+      return;
+   }
    n = ++lab[i].NumRef;
    lab[i].Ref = (int *)ReallocOrDie(lab[i].Ref,(n+1)*sizeof(int));
    lab[i].Ref[n] = LiNo;
@@ -1630,16 +2750,20 @@ char *EvalSymValue(char *p, int *v)
    char Sym[ML];
 
    p = GetSymbol(p,Sym);
+   ++StatLookups;
    for (i=0 ; i < Labels ; ++i)
    {
+      ++StatProbes;
       if (!StrCmp(Sym,lab[i].Name))
       {
          *v = lab[i].Address;
+         Rel = lab[i].Rel;
          SymRefs(i);
          return p;
       }
    }
    AddLabel(Sym);
+   if (Phase == 1) ++lab[Labels-1].Uses;
    *v = UNDEF;
    return p;
 }
@@ -1651,8 +2775,10 @@ char *EvalSymBytes(char *p, int *v)
    char Sym[ML];
 
    p = GetSymbol(p,Sym);
+   ++StatLookups;
    for (i=0 ; i < Labels ; ++i)
    {
+      ++StatProbes;
       if (!StrCmp(Sym,lab[i].Name))
       {
          *v = lab[i].Bytes;
@@ -1661,6 +2787,7 @@ char *EvalSymBytes(char *p, int *v)
       }
    }
    AddLabel(Sym);
+   if (Phase == 1) ++lab[Labels-1].Uses;
    *v = UNDEF;
    return p;
 }
@@ -1812,7 +2939,7 @@ char *EvalDecValue(char *p, int *v)
       ErrorMsg("Illegal character in decimal constant\n");
    ++ErrNum;
    ErrorLine(p);
-   exit(1);
+   Terminate(1);
 }
 
 
@@ -1846,7 +2973,7 @@ char *EvalCharValue(char *p, int *v)
    {
       ++ErrNum;
       ErrorMsg("Missing ' delimiter after character operand\n");
-      exit(1);
+      Terminate(1);
    }
    if (*p) ++p;
    return p;
@@ -1891,6 +3018,24 @@ char *SkipToComma(char *p)
 }
 
 
+// ******
+// RelAbs
+// ******
+
+// Unary operators and byte selections cannot be relocated
+// by the linker, the result is absolute.
+
+void RelAbs(char *p)
+{
+   if (Rel && Phase == 2)
+   {
+      ErrorLine(p);
+      ErrorMsg("Illegal operation on relocatable value\n");
+      Terminate(1);
+   }
+   Rel = 0;
+}
+
 char *op_par(char *p, int *v)
 {
    char c = (*p == '[') ? ']' : ')'; // closing char
@@ -1900,7 +3045,7 @@ char *op_par(char *p, int *v)
    {
       ErrorLine(p);
       ErrorMsg("Missing closing %c\n",c);
-      exit(1);
+      Terminate(1);
    }
    return p+1;
 }
@@ -1908,14 +3053,14 @@ char *op_par(char *p, int *v)
 // functions parsing unary operators or constants
 
 char *op_plu(char *p, int *v) { p = EvalOperand(p+1,v,12)               ; return p; }
-char *op_min(char *p, int *v) { p = EvalOperand(p+1,v,12);*v = -(*v)    ; return p; }
-char *op_lno(char *p, int *v) { p = EvalOperand(p+1,v,12);*v = !(*v)    ; return p; }
-char *op_bno(char *p, int *v) { p = EvalOperand(p+1,v,12);*v = ~(*v)    ; return p; }
+char *op_min(char *p, int *v) { p = EvalOperand(p+1,v,12);*v = -(*v)    ; RelAbs(p); return p; }
+char *op_lno(char *p, int *v) { p = EvalOperand(p+1,v,12);*v = !(*v)    ; RelAbs(p); return p; }
+char *op_bno(char *p, int *v) { p = EvalOperand(p+1,v,12);*v = ~(*v)    ; RelAbs(p); return p; }
 
 char *op_low(char *p, int *v) { p = EvalOperand(p+1,v,12);ForcedMode=-1 ; return p; }
 char *op_hig(char *p, int *v) { p = EvalOperand(p+1,v,12);ForcedMode= 1 ; return p; }
 
-char *op_prc(char *p, int *v) { *v = pc ; return p+1;}
+char *op_prc(char *p, int *v) { *v = pc ; Rel = CurRel; return p+1;}
 char *op_dac(char *p, int *v) { *v = bss; return p+1;}
 char *op_hex(char *p, int *v) { return EvalHexValue(p+1,v) ;}
 char *op_cha(char *p, int *v) { return EvalCharValue(p+1,v);}
@@ -2004,9 +3149,33 @@ struct binop_struct binop[BINOPS] =
    {"|" , 4,&op_bor}  //  bitwise OR
 };
 
-// ***********
-// EvalOperand
-// ***********
+// **********
+// RelOperand
+// **********
+
+// Relocation of the result of binop[i] for operands with the
+// relocations t and u. The linker can relocate the sum of a relocatable
+// and an absolute value and the difference of a relocatable and an
+// absolute value. The difference of two values of the same section
+// is absolute.
+
+int RelOperand(int i, int t, int u, char *p)
+{
+   if (!t && !u) return 0;
+   if (binop[i].foo == &op_add && (!t || !u)) return t | u;
+   if (binop[i].foo == &op_sub && (t == u || !u)) return t == u ? 0 : t;
+   if (Phase == 2)
+   {
+      ErrorLine(p);
+      ErrorMsg("Illegal operation on relocatable value\n");
+      Terminate(1);
+   }
+   return 0;
+}
+
+// ***********
+// EvalOperand
+// ***********
 
 char *EvalOperand(char *p, int *v, int prio)
 {
@@ -2015,9 +3184,11 @@ char *EvalOperand(char *p, int *v, int prio)
    int  o;    // priority of operator
    int  r;    // return value
    int  w;    // value of right operand
+   int  t;    // relocation of left operand
    char c;    // current character
 
    r = UNDEF; // preset result to UNDEF
+   Rel = 0;   // absolute
 
    p = SkipSpace(p);
    c = *p;
@@ -2043,8 +3214,9 @@ char *EvalOperand(char *p, int *v, int prio)
    {
       ErrorLine(p);
       ErrorMsg("Illegal operand\n");
-      exit(1);
+      Terminate(1);
    }
+   t = Rel;
 
    // Left operand has been parsed successfully
    // now look for binary operators
@@ -2075,11 +3247,13 @@ char *EvalOperand(char *p, int *v, int prio)
             if ((o = binop[i].prio) <= prio)
             {
                *v = r;
+               Rel = t;
                if (CodeStyle == 1 && *p == ' ') p += strlen(p);
                if (df) fprintf(df,"Result: %4x %d\n",r,r);
                return p;
             }
             p = EvalOperand(p+l,&w,o);
+            t = RelOperand(i,t,Rel,p);
             if (w == UNDEF) r = UNDEF;
             else r = binop[i].foo(r,w);
             break;
@@ -2089,10 +3263,11 @@ char *EvalOperand(char *p, int *v, int prio)
       {
          ErrorMsg("Syntax error: binary operator expected\n");
          ErrorLine(p);
-         exit(1);
+         Terminate(1);
       }
    }
    *v = r;
+   Rel = t;
    if (CodeStyle == 1 && *p == ' ') p += strlen(p);
    if (df) fprintf(df,"Result: %4x %d\n",r,r);
    if (df) fprintf(df,"Rest  : %s\n",p);
@@ -2112,14 +3287,14 @@ char *ExtractValue(char *p, int *v)
    {
       ErrorLine(p);
       ErrorMsg("Empty operand\n");
-      exit(1);
+      Terminate(1);
    }
    r = EvalOperand(OpText,v,0); // evaluate integer value
    if (*r)                      // check for trailing text
    {
       ErrorLine(r);
       ErrorMsg("Extra text after operand\n");
-      exit(1);
+      Terminate(1);
    }
    return p;                    // points to comment or EOL
 }
@@ -2137,7 +3312,7 @@ char *AlignFill(char *p, int *v, int *f)
    {
       ErrorLine(p);
       ErrorMsg("Empty operand\n");
-      exit(1);
+      Terminate(1);
    }
    r = EvalOperand(OpText,v,0); // evaluate integer value
    if (*r == 0) return p;       // no fill value specified
@@ -2145,12 +3320,150 @@ char *AlignFill(char *p, int *v, int *f)
    {
       ErrorLine(r);
       ErrorMsg("Illegal syntax for fill value\n");
-      exit(1);
+      Terminate(1);
    }
    r = EvalOperand(r+1,f,0);    // evaluate fill value
    return p;                    // points to comment or EOL
 }
 
+// ******
+// AddFix
+// ******
+
+// Records in phase 2 of --obj, that the linker has to relocate the
+// operand of Size bytes at address a, which has the value v in the
+// assembly. Kind 'W' adds the relocation of Target to the value,
+// 'R' the distance between the relocations of Target and pc.
+// Returns v truncated to the operand size.
+
+int AddFix(int a, int Kind, int Target, int v, int Size, char *p)
+{
+   if (Phase < 2 || !ObjMode) return v;
+   if (Kind == 'R' && Size == 1) Kind = 'B';
+   if (Size != 2 && Kind != 'B')
+   {
+      ErrorLine(p);
+      ErrorMsg("Relocatable value needs a 16 bit operand\n");
+      Terminate(1);
+   }
+   if (Fixes == FixMax)
+   {
+      FixMax = FixMax ? 2 * FixMax : 256;
+      Fix = (struct FixStruct *)ReallocOrDie(Fix,FixMax * sizeof(struct FixStruct));
+   }
+   Fix[Fixes].Sect   = CurSect;
+   Fix[Fixes].Addr   = a;
+   Fix[Fixes].Kind   = Kind;
+   Fix[Fixes].Target = Target;
+   Fix[Fixes].Value  = v;
+   ++Fixes;
+   return Size == 1 ? v & 0xff : v & 0xffff;
+}
+
+// ************
+// CloseSection
+// ************
+
+void CloseSection(void)
+{
+   struct SectStruct *s;
+
+   if (CurSect < 0) return;
+   s = Sect + CurSect;
+   s->End = pc;
+   if (s->Loc < 0 && pc > RelNext) RelNext = pc;
+}
+
+// ***********
+// OpenSection
+// ***********
+
+// Starts a section at the fixed address Loc or, for Loc < 0, a
+// relocatable section behind the previous relocatable sections.
+// The linker places the relocatable sections of the same name
+// one after the other.
+
+void OpenSection(const char *Name, int Loc)
+{
+   struct SectStruct *s;
+
+   CloseSection();
+   if (Sects == MAXSECT)
+   {
+      ++ErrNum;
+      ErrorMsg("Too many sections (> %d)\n",MAXSECT);
+      Terminate(1);
+   }
+   s = Sect + Sects;
+   s->Name = StrNDup((void *)Name,strlen(Name));
+   s->Loc  = Loc;
+   s->Base = s->End = Loc < 0 ? RelNext : Loc;
+   CurSect = Sects++;
+   CurRel  = Loc < 0 ? Sects : 0;
+   pc = s->Base;
+}
+
+// *************
+// ResetSections
+// *************
+
+// Each phase of --obj starts with the relocatable section "code".
+
+void ResetSections(void)
+{
+   int i;
+
+   for (i=0 ; i < Sects ; ++i) free(Sect[i].Name);
+   Sects   =  0;
+   CurSect = -1;
+   CurRel  =  0;
+   RelNext =  0;
+   if (ObjMode) OpenSection("code",-1);
+}
+
+// *************
+// ParseExternal
+// *************
+
+// EXTERN name[,name...] declares symbols of other objects,
+// INTERN name[,name...] exports symbols to the object file.
+// Both are ignored without --obj.
+
+char *ParseExternal(char *p, int Intern)
+{
+   int j;
+   char Sym[ML];
+
+   if (!ObjMode) return p;
+   p = SkipSpace(p);
+   while (isym(*p))
+   {
+      p = GetSymbol(p,Sym);
+      j = LabelIndex(Sym);
+      if (j < 0)
+      {
+         AddLabel(Sym);
+         j = Labels - 1;
+      }
+      if (Intern) lab[j].Intern = 1;
+      else if (lab[j].Rel >= 0)
+      {
+         if (lab[j].Address != UNDEF)
+         {
+            ++ErrNum;
+            ErrorLine(p);
+            ErrorMsg("EXTERN symbol [%s] is defined in this source\n",Sym);
+            Terminate(1);
+         }
+         lab[j].Address = 0;
+         lab[j].Rel = -(++Externs);
+      }
+      p = SkipSpace(p);
+      if (*p == ',') p = SkipSpace(p+1);
+   }
+   return p;
+}
+
 // *************
 // ParseWordData
 // *************
@@ -2158,13 +3471,14 @@ char *AlignFill(char *p, int *v, int *f)
 char *ParseWordData(char *p)
 {
    int i,j,l,v;
-   unsigned char ByteBuffer[ML];
 
    l = 0;
    p = SkipSpace(p);
    while (*p && *p != ';') // Parse data line
    {
+      ByteFit(l+2);
       p = EvalOperand(p,&v,0);
+      if (Rel) v = AddFix(pc+l,'W',Rel,v,2,p);
       ByteBuffer[l++] = v >> 8;
       ByteBuffer[l++] = v;
       p = SkipToComma(p);
@@ -2174,7 +3488,7 @@ char *ParseWordData(char *p)
    {
       ErrorMsg("Missing WORD data\n");
       ErrorLine(p);
-      exit(1);
+      Terminate(1);
    }
    j = AddressIndex(pc);
    if (j >= 0 && df) fprintf(df,"Byte label [%s] $%4.4x $%4.4x %d bytes\n",
@@ -2208,13 +3522,14 @@ char *ParseWordData(char *p)
 char *ParseLongData(char *p)
 {
    int i,j,l,v;
-   unsigned char ByteBuffer[ML];
 
    l = 0;
    p = SkipSpace(p);
    while (*p && *p != ';') // Parse data line
    {
+      ByteFit(l+4);
       p = EvalOperand(p,&v,0);
+      if (Rel) AddFix(pc+l,'W',Rel,v,4,p);
       ByteBuffer[l++] = v >> 24;
       ByteBuffer[l++] = v >> 16;
       ByteBuffer[l++] = v >>  8;
@@ -2226,7 +3541,7 @@ char *ParseLongData(char *p)
    {
       ErrorMsg("Missing LONG data\n");
       ErrorLine(p);
-      exit(1);
+      Terminate(1);
    }
    j = AddressIndex(pc);
    if (j >= 0 && df) fprintf(df,"LONG label [%s] $%4.4x $%4.4x %d bytes\n",
@@ -2264,13 +3579,13 @@ char *ParseFillData(char *p)
    if (m < 0 || m > 0xffff)
    {
       ErrorMsg("Illegal FILL multiplier %d\n",m);
-      exit(1);
+      Terminate(1);
    }
    p = NeedChar(p,'(');
    if (!p)
    {
       ErrorMsg("Missing '(' before FILL value\n");
-      exit(1);
+      Terminate(1);
    }
    p = EvalOperand(p+1,&v,0);
    v &= 0xff;
@@ -2302,7 +3617,8 @@ char *ListSizeInfo(char *p)
    if (!ModuleStart) return p;
    if (ListOn && Phase == 2)
    {
-      i = AddressIndex(ModuleStart);
+      i = Scope[0] ? LabelIndex(Scope) : -1;
+      if (i < 0) i = AddressIndex(ModuleStart);
       if (i >= 0)
       {
          fprintf(lf,"              %s",Line);
@@ -2315,2878 +3631,9957 @@ char *ListSizeInfo(char *p)
 }
 
 
-char *IncludeFile(char *p)
+// ********
+// HashFile
+// ********
+
+// continues the FNV-1a hash h with the contents of file Name,
+// returns 0 if the file can't be read
+
+#define FNV_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+unsigned long long HashFile(const char *Name, unsigned long long h)
 {
-   char FileName[256];
-   char *fp;
-   p = NeedChar(p,'"');
-   if (!p)
-   {
-      ErrorMsg("Missing quoted filename after INCLUDE\n");
-      exit(1);
-   }
-   fp = FileName;
-   ++p;
-   while (*p != 0 && *p != '"') *fp++ = *p++;
-   *fp = 0;
-   if (df) fprintf(df,"fopen %s\n",FileName);
-   if (IncludeLevel >= 99)
-   {
-      ErrorMsg("Too many includes nested ( >= 99)\n");
-      exit(1);
-   }
-   sf = fopen(FileName,"r");
-   if (!sf)
-   {
-      printf("Could not open include file <%s>\n",FileName);
-      exit(1);
-   }
-   IncludeStack[IncludeLevel].LiNo = LiNo;
-   IncludeStack[++IncludeLevel].fp = sf;
-   IncludeStack[IncludeLevel].Src = (char *)StrNDup(FileName,strlen(FileName));
-   PrintLine();
-   LiNo = 0;
-   return p+1; // skip quote after filename
+   size_t i,n;
+   unsigned char Buf[4096];
+   FILE *fp;
+
+   fp = fopen(Name,"rb");
+   if (!fp) return 0;
+   while ((n = fread(Buf,1,sizeof(Buf),fp)) > 0)
+      for (i=0 ; i < n ; ++i) h = (h ^ Buf[i]) * FNV_PRIME;
+   fclose(fp);
+   return h ? h : 1;
 }
 
-char *ParseStoreData(char *p)
+unsigned long long HashBytes(const void *p, size_t n, unsigned long long h)
 {
-   int Start,Length,FileFormat,Entry;
-   char *Filename,*EndPtr;
+   size_t i;
+   const unsigned char *b = (const unsigned char *)p;
 
-   if (Phase < 2) return p + strlen(p);
-   p = EvalOperand(p,&Start,0);
-   if (Start < 0 || Start > 0xfffff)
-   {
-      ErrorMsg("Illegal start address for STORE %d\n",Start);
-      exit(1);
-   }
-   p = NeedChar(p,',');
-   if (!p)
-   {
-      ErrorMsg("Missing ',' after start address\n");
-      exit(1);
-   }
-   p = EvalOperand(p+1,&Length,0);
-   if (Length < 0 || Length > 0x10000)
-   {
-      ErrorMsg("Illegal length for STORE %d\n",Length);
-      exit(1);
-   }
-   p = NeedChar(p,',');
-   if (!p)
-   {
-      ErrorMsg("Missing ',' after length\n");
-      exit(1);
-   }
-   p = NeedChar(p+1,'"');
-   if (!p)
-   {
-      ErrorMsg("Missing quote for filename\n");
-      exit(1);
-   }
-   EndPtr = ++p;
-   while (*EndPtr != '\0' && *EndPtr != '"') ++EndPtr;
-   Filename = (char *)StrNDup(p, EndPtr - p);
-   FileFormat = BINARY;
-   Entry = -1;
-   p = NeedChar(EndPtr+1,',');
-   if (p)
-   {
-      ++p;
-           if (StrMatch(p, "BIN"))  FileFormat = BINARY;
-      else if (StrMatch(p, "SREC")) FileFormat = SRECORD;
-      else if (StrMatch(p, "S19"))  FileFormat = SRECORD;
-      else if (StrMatch(p, "SPARROW"))  FileFormat = SPARROW;
-      else
-      {
-         ErrorMsg("Unknown output file format\n");
-         exit(1);
-      }
-      if (df) fprintf(df,"Filefornat = %d\n",FileFormat);
-      p = NeedChar(p,',');
-      if (p)
-      {
-         p = EvalOperand(p+1,&Entry,0);
-         if (Entry < 0 || Entry > 0xffff)
-         {
-            ErrorMsg("Illegal execution start address for STORE %d\n",Entry);
-            exit(1);
-         }
-      } else p = EndPtr;
-   } else p = EndPtr;
+   for (i=0 ; i < n ; ++i) h = (h ^ b[i]) * FNV_PRIME;
+   return h;
+}
 
-   SFA[StoreCount] = Start;
-   SFL[StoreCount] = Length;
-   SFE[StoreCount] = Entry;
-   SFF[StoreCount] = Filename;
-   SFT[StoreCount] = FileFormat;
-   if (df)
-   {
-      fprintf(df,"Storing %4.4x - %4.4x <%s>,",
-           Start,Start+Length-1,Filename);
-           if (FileFormat == SPARROW) fprintf(df,"SPARROW\n");
-      else if (FileFormat == SRECORD) fprintf(df,"SRECORD\n");
-      else                            fprintf(df,"BINARY\n");
-   }
-   if (StoreCount < SFMAX) ++StoreCount;
-   else
-   {
-      ErrorMsg("number of storage files exceeds %d\n",SFMAX);
-      exit(1);
-   }
-   PrintLine();
-   p += strlen(p);
-   return p;
+// *************
+// Include cache
+// *************
+
+// With --pch an include file, that only defines symbols and macros,
+// is written after the assembly to <dir>/<key>.pch. The key is a hash
+// of the file contents and of the state at the INCLUDE statement.
+// Later assemblies load the symbols and macros from the cache file and
+// skip the include file in both phases, if the symbols defined before
+// and used by the file have still the same values.
+
+#define PCH_MAGIC "BS9 pch 1"
+
+// pseudo ops allowed in a cached file
+
+const char *PchSafe[] = {"BSS","CASE","CPU","LIST","MACLIST","SETDP","TTL",NULL};
+
+void PutString(FILE *fp, const char *s)
+{
+   int l = strlen(s);
+
+   fwrite(&l,sizeof(int),1,fp);
+   fwrite(s,1,l,fp);
 }
 
+char *GetString(FILE *fp)
+{
+   int l = 0;
+   char *s;
 
+   if (fread(&l,sizeof(int),1,fp) != 1 || l < 0 || l > 0x100000) l = 0;
+   s = (char *)MallocOrDie(l+1);
+   if (fread(s,1,l,fp) != (size_t)l) l = 0;
+   s[l] = 0;
+   return s;
+}
 
-char *ParseLoadData(char *p)
+int GetInt(FILE *fp)
 {
-   int i,Start,Size,Advance;
-   char *Filename,*EndPtr;
-   FILE *lp;
+   int v = 0;
 
-   p = SkipSpace(p);
+   if (fread(&v,sizeof(int),1,fp) != 1) v = -1;
+   return v;
+}
 
-   Advance = 1;
-   if (*p == '\"') Start = pc;
-   else
+void PchGetState(struct PchStateStruct *s)
+{
+   memset(s,0,sizeof(struct PchStateStruct)); // defined bytes for the key
+   s->pc         = pc;
+   s->bss        = bss;
+   s->DP         = DP;
+   s->CPU        = CPU;
+   s->EnumValue  = EnumValue;
+   s->ListGlobal = ListGlobal;
+   s->MacList    = MacList;
+   s->IgnoreCase = IgnoreCase;
+   s->CodeStyle  = CodeStyle;
+}
+
+void PchSetState(struct PchStateStruct *s)
+{
+   bss        = s->bss;
+   DP         = s->DP;
+   SetCPU(s->CPU);
+   EnumValue  = s->EnumValue;
+   ListGlobal = s->ListGlobal;
+   MacList    = s->MacList;
+   IgnoreCase = s->IgnoreCase;
+   CodeStyle  = s->CodeStyle;
+}
+
+// FNV-1a hash of the file and the state, 0 if the file can't be read
+
+unsigned long long PchKey(const char *Name, struct PchStateStruct *s)
+{
+   unsigned long long h = HashFile(Name,FNV_BASIS);
+
+   if (!h) return 0;
+   return HashBytes(s,sizeof(struct PchStateStruct),h);
+}
+
+// Checks (Apply = 0) or loads (Apply = 1) a cache file.
+// Returns 0 if it is damaged or doesn't fit to the source.
+
+int PchRead(FILE *fp, int Apply, struct PchStateStruct *End)
+{
+   int i,j,n,a,b,t,Ok;
+   char *s;
+
+   rewind(fp);
+   s = GetString(fp);
+   Ok = !strcmp(s,PCH_MAGIC);
+   free(s);
+
+   // symbols defined before the file
+
+   n = Ok ? GetInt(fp) : 0;
+   for (i=0 ; i < n && Ok ; ++i)
    {
-      Advance = 0;
-      p = EvalOperand(p,&Start,0);
+      s = GetString(fp);
+      a = GetInt(fp);
+      b = GetInt(fp);
+      j = LabelIndex(s);
+      if (j >= 0) Ok = lab[j].Address == a && (a == UNDEF || lab[j].Bytes == b);
+      else if (a != UNDEF) Ok = 0;
+      else if (Apply) AddLabel(s);
+      free(s);
+   }
 
-      if (Start < 0 || Start > 0xffff)
+   // symbols of the file
+
+   n = Ok ? GetInt(fp) : 0;
+   if (n < 0 || Labels + n > MAXLAB - 2) Ok = 0;
+   for (i=0 ; i < n && Ok ; ++i)
+   {
+      s = GetString(fp);
+      t = GetInt(fp);
+      a = GetInt(fp);
+      b = GetInt(fp);
+      if (!Apply)
       {
-         ErrorMsg("Illegal start address for LOAD %d\n",Start);
-         exit(1);
+         Ok = *s && LabelIndex(s) < 0;
+         free(s);
+         continue;
       }
-      p = NeedChar(p,',');
-      if (!p)
+      j = Labels++;
+      lab[j].Name    = s;
+      lab[j].Address = a;
+      lab[j].Bytes   = b;
+      lab[j].Ref     = (int *)MallocOrDie(sizeof(int));
+      lab[j].Att     = (int *)MallocOrDie(sizeof(int));
+      lab[j].Ref[0]  = LiNo;
+      lab[j].Att[0]  = t;
+   }
+
+   // macros of the file
+
+   n = Ok ? GetInt(fp) : 0;
+   if (n < 0 || Macros + n > MAXMAC - 2) Ok = 0;
+   for (i=0 ; i < n && Ok ; ++i)
+   {
+      s = GetString(fp);
+      if (!Apply)
       {
-         ErrorMsg("Missing ',' after start address\n");
-         exit(1);
+         Ok = *s && MacroIndex(s) < 0;
+         free(s);
+         free(GetString(fp));
+         GetInt(fp);
+         GetInt(fp);
+         continue;
       }
-      p = NeedChar(p+1,'"');
-      if (!p)
+      j = Macros++;
+      Mac[j].Name = s;
+      Mac[j].Body = GetString(fp);
+      if (!*Mac[j].Body)
       {
-         ErrorMsg("Missing quote for filename\n");
-         exit(1);
+         free(Mac[j].Body);
+         Mac[j].Body = NULL;
       }
+      Mac[j].Narg = GetInt(fp);
+      Mac[j].Type = GetInt(fp);
+      Mac[j].Cola = 0;
    }
-   EndPtr = ++p;
-   while (*EndPtr != '\0' && *EndPtr != '"') ++EndPtr;
-   Filename = (char *)StrNDup(p, EndPtr - p);
-   if (df) fprintf(df,"Loading %4.4x <%s>\n",Start,Filename);
-   PrintLine();
-   lp = fopen(Filename,"rb");
-   AssertFileOp(lp,"Could not LOAD <%s>\n");
-   fseek(lp,0,SEEK_END);
-   Size = ftell(lp);
-   rewind(lp);
-   if (Start + Size > 0x10000)
-   {
-      ErrorMsg("LOADING %4.4x to %4.4x violates 64K size\n",
-         Start,Start+Size);
-      exit(1);
-   }
+   if (Ok && fread(End,sizeof(struct PchStateStruct),1,fp) != 1) Ok = 0;
+   return Ok && !ferror(fp) && fgetc(fp) == EOF;
+}
+
+// INCLUDE of file Name, returns 1 if the file is skipped
+
+int PchInclude(const char *Name)
+{
+   int Call;
+   unsigned long long Key;
+   char Path[FNSIZE];
+   struct PchStateStruct s;
+   struct PchStruct *r;
+   FILE *fp;
 
+   Call = PchCalls++;
    if (Phase == 2)
-   for (i=Start; i < Start+Size ; ++i)
    {
-      if (LOCK[i])
+      for (r=Pch ; r < Pch + Pchs ; ++r)
+      if (r->Hit && r->Call == Call)
       {
-         ErrorMsg("LOAD would overwrite defined values\n");
-         ErrorLine(p);
-         exit(1);
+         PchSetState(&r->End);
+         return 1;
       }
-      LOCK[i] = 1;
+      return 0;
    }
-   fread(ROM+Start,Size,1,lp);
-   fclose(lp);
-   if (Advance) pc += Size;
-   p += strlen(p);
-   return p;
+   if (PchLevel) Pch[Pchs-1].Bad = 1; // nested include
+   if (PchLevel || MacLev || Scope[0] || InlCur >= 0) return 0;
+   PchGetState(&s);
+   Key = PchKey(Name,&s);
+   if (!Key) return 0;
+   if (Pchs == PchMax)
+   {
+      PchMax = PchMax ? 2 * PchMax : 16;
+      Pch = (struct PchStruct *)ReallocOrDie(Pch,PchMax * sizeof(struct PchStruct));
+   }
+   r = Pch + Pchs++;
+   memset(r,0,sizeof(struct PchStruct));
+   snprintf(Path,sizeof(Path),"%s/%016llx.pch",PchDir,Key);
+   r->Path = StrNDup(Path,strlen(Path));
+   r->Call = Call;
+   if ((fp = fopen(Path,"rb")))
+   {
+      r->Hit = PchRead(fp,0,&r->End) && PchRead(fp,1,&r->End);
+      fclose(fp);
+   }
+   if (r->Hit)
+   {
+      PchSetState(&r->End);
+      return 1;
+   }
+   r->pc      = pc;
+   r->Labels  = Labels;
+   r->Macros  = Macros;
+   r->IfLevel = IfLevel;
+   memcpy(r->minlab,minlab,sizeof(minlab));
+   PchLevel = IncludeLevel + 1;
+   return 0;
 }
 
+// symbol i is used by the recorded file
 
-char *ParseBSSData(char *p)
+void PchDepend(int i)
 {
-   int m;
+   int k;
+   struct PchStruct *r = Pch + Pchs - 1;
 
-   p = ExtractValue(p,&m);
-   if (m < 1 || m > 32767)
+   if (i >= r->Labels) return;
+   for (k=0 ; k < r->Deps ; ++k) if (r->Dep[k].Index == i) return;
+   r->Dep = (struct PchSymStruct *)ReallocOrDie(r->Dep,
+             (r->Deps+1) * sizeof(struct PchSymStruct));
+   r->Dep[r->Deps++].Index = i;
+}
+
+// pseudo op Key in the recorded file
+
+void PchPseudo(const char *Key)
+{
+   int i;
+
+   for (i=0 ; PchSafe[i] ; ++i) if (!strcmp(Key,PchSafe[i])) return;
+   Pch[Pchs-1].Bad = 1;
+}
+
+void PchValue(struct PchSymStruct *s)
+{
+   s->Address = lab[s->Index].Address;
+   s->Bytes   = lab[s->Index].Bytes;
+}
+
+// end of the recorded file in phase 1
+
+void PchClose(void)
+{
+   int i;
+   struct PchStruct *r = Pch + Pchs - 1;
+
+   PchLevel = 0;
+   if (pc != r->pc || IfLevel != r->IfLevel || Scope[0] ||
+       memcmp(minlab,r->minlab,sizeof(minlab))) r->Bad = 1;
+   if (r->Bad) return;
+   PchGetState(&r->End);
+   r->LabEnd = Labels;
+   r->MacEnd = Macros;
+   for (i=0 ; i < r->Deps ; ++i) PchValue(r->Dep+i);
+   r->Sym = (struct PchSymStruct *)MallocOrDie((Labels - r->Labels + 1) *
+             sizeof(struct PchSymStruct));
+   for (i=r->Labels ; i < Labels ; ++i)
+   {
+      if (lab[i].Att[0] == LPOS || lab[i].Rel) r->Bad = 1;
+      r->Sym[i - r->Labels].Index = i;
+      PchValue(r->Sym + i - r->Labels);
+   }
+}
+
+// a symbol has still the value of the end of the recorded file
+
+int PchSame(struct PchSymStruct *s)
+{
+   return lab[s->Index].Address == s->Address && lab[s->Index].Bytes == s->Bytes;
+}
+
+// writes the recorded files after the assembly
+
+void PchSave(void)
+{
+   int i,k,Ok;
+   char Tmp[FNSIZE+20];
+   struct PchStruct *r;
+   struct PchSymStruct *s;
+   FILE *fp;
+
+   for (r=Pch ; r < Pch + Pchs ; ++r)
    {
-      ErrorMsg("Illegal BSS size %d\n",m);
-      exit(1);
+      if (r->Hit || r->Bad) continue;
+      Ok = 1;
+      for (i=0 ; i < r->Deps ; ++i) Ok &= PchSame(r->Dep+i);
+      for (i=0 ; i < r->LabEnd - r->Labels ; ++i) Ok &= PchSame(r->Sym+i);
+      if (!Ok) continue; // the source changed symbols of the file later
+
+      // write to a temporary file and rename it, so that concurrent
+      // assemblies never read a partial cache file
+
+      snprintf(Tmp,sizeof(Tmp),"%s.%lx",r->Path,(unsigned long)(size_t)&PchCalls);
+      fp = fopen(Tmp,"wb");
+      if (!fp)
+      {
+         DiagPrintf("Could not write include cache <%s>\n",r->Path);
+         return;
+      }
+      PutString(fp,PCH_MAGIC);
+      fwrite(&r->Deps,sizeof(int),1,fp);
+      for (s=r->Dep ; s < r->Dep + r->Deps ; ++s)
+      {
+         PutString(fp,lab[s->Index].Name);
+         fwrite(&s->Address,sizeof(int),1,fp);
+         fwrite(&s->Bytes,sizeof(int),1,fp);
+      }
+      k = r->LabEnd - r->Labels;
+      fwrite(&k,sizeof(int),1,fp);
+      for (s=r->Sym ; s < r->Sym + k ; ++s)
+      {
+         PutString(fp,lab[s->Index].Name);
+         fwrite(lab[s->Index].Att,sizeof(int),1,fp);
+         fwrite(&s->Address,sizeof(int),1,fp);
+         fwrite(&s->Bytes,sizeof(int),1,fp);
+      }
+      k = r->MacEnd - r->Macros;
+      fwrite(&k,sizeof(int),1,fp);
+      for (i=r->Macros ; i < r->MacEnd ; ++i)
+      {
+         PutString(fp,Mac[i].Name);
+         PutString(fp,Mac[i].Body ? Mac[i].Body : "");
+         fwrite(&Mac[i].Narg,sizeof(int),1,fp);
+         fwrite(&Mac[i].Type,sizeof(int),1,fp);
+      }
+      fwrite(&r->End,sizeof(struct PchStateStruct),1,fp);
+      Ok = !ferror(fp);
+      if (fclose(fp)) Ok = 0;
+      if (!Ok || rename(Tmp,r->Path))
+      {
+         remove(Tmp);
+         if (!Ok) DiagPrintf("Could not write include cache <%s>\n",r->Path);
+      }
    }
-   if (ListOn && Phase == 2)
-      fprintf(lf,"%4.4x             %s\n",bss,Line);
-   bss += m;
-   return p;
 }
 
+// forgets the recorded and loaded files before phase 1
 
-char *ParseCPUData(char *p)
+void PchReset(void)
 {
-   p = SkipSpace(p);
-   if (*p == '=') ++p;
-   p = EvalOperand(p,&CPU,0);
-   if (CPU == 6809)
+   int i;
+
+   for (i=0 ; i < Pchs ; ++i)
    {
-      DimOp = DIMOP_6809;
-      RegisterNames = Register_6809;
+      free(Pch[i].Path);
+      free(Pch[i].Dep);
+      free(Pch[i].Sym);
    }
-   else if (CPU == 6309)
+   Pchs     = 0;
+   PchLevel = 0;
+   PchCalls = 0;
+}
+
+// ***********
+// Build cache
+// ***********
+
+// With --cache an assembly without errors writes the manifest
+// <dir>/<key>.man, the key is a hash of the options and the source name.
+// The manifest lists the hashes of the files read (source, INCLUDE,
+// LOAD, IMPORTSYM, --io, --place, --profile) and of the files written,
+// whose contents are kept as <dir>/<hash>.out. If the files read have
+// still the same hashes, the next run copies the outputs from there
+// instead of assembling.
+
+#define CACHE_MAGIC "BS9 cache 1"
+#define CACHE_BUILD __DATE__ " " __TIME__ // new bs9, new keys
+
+THREAD_LOCAL char *CacheDir;    // --cache: directory of the build cache
+THREAD_LOCAL int Watch;         // --watch: assemble again after changes
+THREAD_LOCAL int DepOut;        // -M: write a make dependency file
+THREAD_LOCAL char *DepFile;     // -MF: its name, default <source>.d
+THREAD_LOCAL unsigned long long OptKey = FNV_BASIS; // hash of the options
+
+THREAD_LOCAL struct CacheFileStruct
+{
+   char *Name;     // file name
+   int   Out;      // 1: written, 0: read
+   unsigned long long Dev,Ino; // identity of an existing file (Ino 0: none)
+} *CacheFiles;
+
+THREAD_LOCAL int CacheNum;      // files read or written
+THREAD_LOCAL int CacheMax;      // allocated size of CacheFiles
+
+// options, that don't change the outputs, are not part of the key
+
+const char *CacheNeutral[] = {"-q","-t","--stats","--stats=json","-j",
+   "--parallel","--cache","--pch","--watch",NULL};
+
+int CacheKeyOption(const char *o)
+{
+   int i;
+
+   for (i=0 ; CacheNeutral[i] ; ++i) if (!strcmp(o,CacheNeutral[i])) return 0;
+   return 1;
+}
+
+// ******
+// FileId
+// ******
+
+// returns the inode of an existing file and its device in Dev,
+// or 0, if the file doesn't exist or has no inode number
+
+unsigned long long FileId(const char *Name, unsigned long long *Dev)
+{
+   struct stat St;
+
+   *Dev = 0;
+   if (stat(Name,&St) || !St.st_ino) return 0;
+   *Dev = St.st_dev;
+   return St.st_ino;
+}
+
+// records a file read (Out = 0) or written (Out = 1), once for
+// every file, also if it is named differently ("a.as9", "./a.as9")
+
+void CacheFile(const char *Name, int Out)
+{
+   int i;
+   unsigned long long Dev,Ino;
+
+   if (!CacheDir && !Watch && !DepOut) return;
+   Ino = FileId(Name,&Dev);
+   for (i=0 ; i < CacheNum ; ++i)
    {
-      DimOp = DIMOP_6309;
-      RegisterNames = Register_6309;
+      if (CacheFiles[i].Out != Out) continue;
+      if (!strcmp(Name,CacheFiles[i].Name)) return;
+      if (Ino && CacheFiles[i].Ino == Ino && CacheFiles[i].Dev == Dev) return;
    }
-   else
+   if (CacheNum == CacheMax)
    {
-      ErrorMsg("Unknown CPU %d - use 6809 or 6309\n",CPU);
-      exit(1);
+      CacheMax = CacheMax ? 2 * CacheMax : 32;
+      CacheFiles = (struct CacheFileStruct *)ReallocOrDie(CacheFiles,
+                    CacheMax * sizeof(struct CacheFileStruct));
    }
-   if (ListOn && Phase == 2)
+   CacheFiles[CacheNum].Name = StrNDup((char *)Name,strlen(Name));
+   CacheFiles[CacheNum].Dev  = Dev;
+   CacheFiles[CacheNum].Ino  = Ino;
+   CacheFiles[CacheNum++].Out = Out;
+}
+
+// copies file From to To, returns 0 on failure
+
+int CacheCopy(const char *From, const char *To)
+{
+   int Ok = 1;
+   size_t n;
+   char Buf[4096];
+   FILE *in,*out;
+
+   in = fopen(From,"rb");
+   if (!in) return 0;
+   out = fopen(To,"wb");
+   if (!out)
    {
-      PrintLiNo();
-      fprintf(lf,"%4d              %s\n",CPU,Line);
+      fclose(in);
+      return 0;
    }
-   return p;
+   while ((n = fread(Buf,1,sizeof(Buf),in)) > 0)
+      if (fwrite(Buf,1,n,out) != n) Ok = 0;
+   if (ferror(in)) Ok = 0;
+   fclose(in);
+   if (fclose(out)) Ok = 0;
+   return Ok;
 }
 
+void CacheManifest(char *Path, size_t Size)
+{
+   unsigned long long h;
 
-char *ParseOnOff(char *p, int *v)
+   h = HashBytes(CACHE_BUILD,sizeof(CACHE_BUILD),OptKey);
+   h = HashBytes(Src,strlen(Src)+1,h);
+   if (Variant) h = HashBytes(Variant,strlen(Variant)+1,h);
+   snprintf(Path,Size,"%s/%016llx.man",CacheDir,h);
+}
+
+// reads line Buf of a manifest: kind, hash and file name
+
+char *CacheLine(char *Buf, unsigned long long *h)
 {
-   p = SkipSpace(p);
-        if (*p == '1') *v = 1;
-   else if (*p == '0') *v = 0;
-   else if (!StrNCaseCmp(p,"ON" ,2)) *v = 1;
-   else if (!StrNCaseCmp(p,"OFF",3)) *v = 0;
+   Buf[strcspn(Buf,"\r\n")] = 0;
+   if ((Buf[0] != 'I' && Buf[0] != 'O') || strlen(Buf) < 20 || Buf[18] != ' ' ||
+       sscanf(Buf+2,"%llx",h) != 1) return NULL;
+   return Buf + 19;
+}
 
-   else
+// copies the outputs from the cache, returns 1 if they were cached
+
+int CacheRestore(void)
+{
+   int Ok;
+   unsigned long long h;
+   char Path[FNSIZE+32],Blob[FNSIZE+32],Buf[MAX_STR];
+   char *Name;
+   FILE *fp;
+
+   CacheManifest(Path,sizeof(Path));
+   fp = fopen(Path,"r");
+   if (!fp) return 0;
+   Ok = fgets(Buf,sizeof(Buf),fp) && !strncmp(Buf,CACHE_MAGIC,strlen(CACHE_MAGIC));
+
+   // all files read and all stored outputs must have the recorded hash
+
+   while (Ok && fgets(Buf,sizeof(Buf),fp))
    {
-      ErrorMsg("Unknown option\n");
-      exit(1);
+      Name = CacheLine(Buf,&h);
+      if (!Name) Ok = 0;
+      else if (Buf[0] == 'I') Ok = HashFile(Name,FNV_BASIS) == h;
+      else
+      {
+         snprintf(Blob,sizeof(Blob),"%s/%016llx.out",CacheDir,h);
+         Ok = HashFile(Blob,FNV_BASIS) == h;
+      }
    }
-   if (ListOn && Phase == 2)
+   if (Ok)
    {
-      PrintLiNo();
-      fprintf(lf,"                  %s\n",Line);
+      rewind(fp);
+      if (!fgets(Buf,sizeof(Buf),fp)) Ok = 0;
+      while (Ok && fgets(Buf,sizeof(Buf),fp))
+      {
+         Name = CacheLine(Buf,&h);
+         if (Buf[0] != 'O') continue;
+         if (HashFile(Name,FNV_BASIS) == h) continue; // leave it untouched
+         snprintf(Blob,sizeof(Blob),"%s/%016llx.out",CacheDir,h);
+         if (!CacheCopy(Blob,Name))
+         {
+            DiagPrintf("Could not restore <%s> from the build cache\n",Name);
+            Ok = 0;
+         }
+      }
    }
-   return p + strlen(p);
+   fclose(fp);
+   return Ok;
 }
 
+// writes the manifest and stores the outputs after the assembly
 
-char *ParseBitData(char *p)
+void CacheStore(void)
 {
-   int i,v;
+   int i,Ok;
+   unsigned long long h;
+   char Path[FNSIZE+32],Tmp[FNSIZE+64],Blob[FNSIZE+32],Part[FNSIZE+64];
+   struct CacheFileStruct *c;
+   FILE *fp;
 
-   v = 0;
-   for (i=0 ; i < 8 ; ++i)
+   // write to temporary files and rename them, so that concurrent
+   // assemblies never read a partial manifest or output
+
+   CacheManifest(Path,sizeof(Path));
+   snprintf(Tmp,sizeof(Tmp),"%s.%lx",Path,(unsigned long)(size_t)&CacheNum);
+   fp = fopen(Tmp,"w");
+   if (!fp)
    {
-      v <<= 1;
-      p = SkipSpace(p+1);
-      if (*p == '*') v |= 1;
-      else if (*p != '.')
+      DiagPrintf("Could not write build cache <%s>\n",Path);
+      return;
+   }
+   fprintf(fp,"%s\n",CACHE_MAGIC);
+   Ok = 1;
+   for (c=CacheFiles ; c < CacheFiles + CacheNum && Ok ; ++c)
+   {
+      h = HashFile(c->Name,FNV_BASIS);
+      if (!h) // removed output (empty hint file) or vanished input
       {
-         ErrorMsg("use only '*' for 1 and '.' for 0 in BITS statement\n");
-         exit(1);
+         Ok = c->Out;
+         continue;
+      }
+      if (c->Out)
+      {
+         snprintf(Blob,sizeof(Blob),"%s/%016llx.out",CacheDir,h);
+         if (HashFile(Blob,FNV_BASIS) != h)
+         {
+            snprintf(Part,sizeof(Part),"%s.%lx",Blob,(unsigned long)(size_t)&CacheNum);
+            Ok = CacheCopy(c->Name,Part) && !rename(Part,Blob);
+            if (!Ok) remove(Part);
+         }
       }
+      fprintf(fp,"%c %016llx %s\n",c->Out ? 'O' : 'I',h,c->Name);
    }
-   if (ListOn && Phase == 2)
+   if (ferror(fp)) Ok = 0;
+   if (fclose(fp)) Ok = 0;
+   if (!Ok || rename(Tmp,Path))
    {
-      PrintPC();
-      Put(pc,v,p);
-      fprintf(lf," %2.2x           ",v);
-      fprintf(lf,"%s\n",Line);
+      remove(Tmp);
+      DiagPrintf("Could not write build cache <%s>\n",Path);
    }
-   ++pc;
-   return p + strlen(p);
+   if (Watch) return; // the files to watch
+   for (i=0 ; i < CacheNum ; ++i) free(CacheFiles[i].Name);
+   CacheNum = 0;
 }
 
-char *ParseCmapData(char *p)
+// *****************
+// WriteDependencies
+// *****************
+
+// -M writes a make rule with the outputs (STORE files, listing,
+// reports) as targets and the files read as prerequisites, followed
+// by an empty rule for each file but the source, so that make doesn't
+// stop when an include file is removed.
+
+void DepName(FILE *fp, const char *Name)
 {
-   int i,v,scanline;
+   for ( ; *Name ; ++Name)
+   {
+      if (*Name == ' ' || *Name == '#') fputc('\\',fp);
+      if (*Name == '$') fputc('$',fp);
+      fputc(*Name,fp);
+   }
+}
 
-   v = 0;
-   if (*p >= '0' && *p < '8') scanline = *p - '0';
-   else                       scanline = -1;
+void WriteDependencies(const char *Name)
+{
+   int n = 0;
+   char *Tmp;
+   struct CacheFileStruct *c;
+   FILE *fp,*tp;
 
-   for (i=0 ; i < 8 ; ++i)
+   CacheFile(Name,1); // stored in the build cache like the other outputs
+   Tmp = OutputTmp(Name);
+   fp = AssertFileOp(fopen(Tmp,"w"),"Open dependency file");
+   for (c=CacheFiles ; c < CacheFiles + CacheNum ; ++c)
    {
-      v <<= 1;
-      p = SkipSpace(p+1);
-      if (*p == '*') v |= 1;
-      else if (*p != '.')
-      {
-         ErrorMsg("use only '*' for 1 and '.' for 0 in CMAP statement\n");
-         exit(1);
-      }
+      if (!c->Out || !strcmp(c->Name,Name)) continue;
+      tp = fopen(c->Name,"rb"); // hint file is removed without hints
+      if (!tp) continue;
+      fclose(tp);
+      if (n++) fputc(' ',fp);
+      DepName(fp,c->Name);
    }
-   if (Phase == 2)
+   fputc(':',fp);
+   for (c=CacheFiles ; c < CacheFiles + CacheNum ; ++c)
    {
-      if (ListOn) PrintPC();
-      if (scanline < 0) Put(pc,v,p);
-      else Put(pc+2*scanline-7,v,p);
-      if (ListOn)
-      {
-         fprintf(lf," %2.2x       ",v);
-         fprintf(lf,"%s\n",Line);
-      }
+      if (c->Out) continue;
+      fputs(" \\\n ",fp);
+      DepName(fp,c->Name);
    }
-   ++pc;
-   return p + strlen(p);
+   fputc('\n',fp);
+   for (c=CacheFiles ; c < CacheFiles + CacheNum ; ++c)
+   {
+      if (c->Out || !strcmp(c->Name,Src)) continue;
+      fputc('\n',fp);
+      DepName(fp,c->Name);
+      fputs(":\n",fp);
+   }
+   if (OutputClose(fp,Name,Tmp)) AssertFileOp(NULL,"Close dependency file");
 }
 
-char *ParseASCII(char *p, unsigned char b[], int *l)
+// ************
+// Include once
+// ************
+
+// INCLUDE ONCE "file" skips a file, that was included before, and
+// PRAGMA ONCE in an include file skips every later INCLUDE of it,
+// without opening the file. Files are identified by device and inode
+// if possible, otherwise by their normalized name. The list starts
+// empty in each phase, so both phases skip the same includes.
+
+THREAD_LOCAL struct IncOnceStruct
 {
-   char Delimiter;
+   char *Name;              // normalized file name
+   unsigned long long Dev;  // device and inode, 0 if unknown
+   unsigned long long Ino;
+   int   Once;              // 1: PRAGMA ONCE
+} *IncOnce;
 
-   Delimiter = *p++;
-   while (*p && *p != Delimiter && *l < ML-1)
+THREAD_LOCAL int IncOnces;     // files included in this phase
+THREAD_LOCAL int IncOnceMax;   // allocated size of IncOnce
+
+// removes empty and "." parts and "dir/.." from a file name
+
+char *OnceName(const char *Name)
+{
+   int l;
+   char *n,*d,*b,*q;
+
+   n = d = (char *)MallocOrDie(strlen(Name) + 1);
+   if (*Name == '/') *d++ = *Name++;
+   b = d; // first part
+   while (*Name)
    {
-      if (*p == '\\') // special character CR, LF, NULL
+      l = strcspn(Name,"/");
+      if (l == 2 && Name[0] == '.' && Name[1] == '.' && d > b)
       {
-         ++p;
-              if (*p == 'r') b[*l] = 13; // return
-         else if (*p == 'f') b[*l] = 12; // form feed
-         else if (*p == 'n') b[*l] = 10; // new line
-         else if (*p == 't') b[*l] =  9; // tab
-         else if (*p == 'a') b[*l] =  7; // alert
-         else if (*p == 'e') b[*l] = 27; // escape
-         else if (*p == '0') b[*l] =  0; // zero
-         else if (*p == 'b') b[*l] = 29; // bold colour
-         else if (*p == 's') b[*l] = 28; // standard colour
-         else b[*l] = *p;
-         ++(*l);
-         ++p;
+         for (q=d-1 ; q > b && q[-1] != '/' ; --q) ;
+         if (strncmp(q,"../",3)) d = q; // drop "dir/"
+         else
+         {
+            memcpy(d,"../",3);
+            d += 3;
+         }
       }
-      else
+      else if (l > 1 || (l == 1 && *Name != '.'))
       {
-         b[(*l)++] = *p++;
+         memcpy(d,Name,l);
+         d += l;
+         *d++ = '/';
       }
+      Name += l;
+      if (*Name) ++Name;
    }
-   if (*p == Delimiter) ++p;
-   if (*p == '^')
+   if (d > b) --d; // trailing slash
+   *d = 0;
+   return n;
+}
+
+// returns the index of the file in IncOnce, adds new files
+
+int OnceFind(const char *FileName)
+{
+   int i;
+   unsigned long long Dev,Ino;
+   char *Name;
+
+   Ino  = FileId(FileName,&Dev);
+   Name = OnceName(FileName);
+   for (i=0 ; i < IncOnces ; ++i)
    {
-      b[(*l)-1] |= 0x80; // Set bit 7 of last char
-      ++p;
+      if (Ino ? IncOnce[i].Ino == Ino && IncOnce[i].Dev == Dev
+              : !strcmp(Name,IncOnce[i].Name)) break;
    }
-   return p;
+   if (i < IncOnces)
+   {
+      free(Name);
+      return i;
+   }
+   if (IncOnces == IncOnceMax)
+   {
+      IncOnceMax = IncOnceMax ? 2 * IncOnceMax : 16;
+      IncOnce = (struct IncOnceStruct *)ReallocOrDie(IncOnce,
+                 IncOnceMax * sizeof(struct IncOnceStruct));
+   }
+   IncOnce[i].Name = Name;
+   IncOnce[i].Dev  = Dev;
+   IncOnce[i].Ino  = Ino;
+   IncOnce[i].Once = 0;
+   return IncOnces++;
 }
 
-// *************
-// ParseByteData
-// *************
+// forgets the files after the first n (new phase or checkpoint)
 
-char *ParseByteData(char *p)
+void OnceReset(int n)
 {
-   int i,j,l,v;
-   unsigned char ByteBuffer[ML];
-   char Delimiter;
+   while (IncOnces > n) free(IncOnce[--IncOnces].Name);
+}
 
+char *ParsePragma(char *p)
+{
    p = SkipSpace(p);
-   l = 0;
-   while (*p && *p != ';') // Parse data line
+   if (StrNCaseCmp(p,"ONCE",4) || isym(p[4]))
    {
-      if (CodeStyle == 1 && *p == ' ') break;
-      else p = SkipSpace(p);
-      Delimiter = *p;
-      if (!strncmp(p,"$DATE",5))
-      {
-         strcpy((char *)ByteBuffer+l,datebuffer);
-         l += strlen(datebuffer);
-         p += 5;
-      }
-      else if (Delimiter == '"' || Delimiter == '\'')
-      {
-         i = l; // remember start of string
-         p = ParseASCII(p,ByteBuffer,&l);
-         if (df)
-         {
-            fprintf(df,"String $%4.4x:<",pc);
-            for (j=i ; j < l ; ++j) fprintf(df,"%c",ByteBuffer[j]&0x7f);
-            fprintf(df,"> [%d]\n",l-i);
-         }
-      }
-      else
-      {
-         v = UNDEF;
-         p = EvalOperand(p,&v,0);
-         if (v == UNDEF && Phase == 2)
-         {
-            ErrorMsg("Undefined symbol in BYTE data\n");
-            ErrorLine(p);
-            exit(1);
-         }
-         if (v > 255 || v < -127) ByteBuffer[l++] = v >> 8;
-         ByteBuffer[l++] = v & 0xff;
-         if (df)
-         {
-            fprintf(df,"BYTE   $%4.4x: %2.2x\n",pc,v);
-         }
-      }
-      if (CodeStyle == 1 && *p == ' ') break;
-      p = SkipToComma(p);
-      if (*p == ',') ++p;
+      ErrorMsg("Unknown PRAGMA - use PRAGMA ONCE\n");
+      Terminate(1);
    }
-   if (l < 1)
+   if (IncludeLevel) IncOnce[OnceFind(IncludeStack[IncludeLevel].Src)].Once = 1;
+   return p + 4;
+}
+
+char *IncludeFile(char *p)
+{
+   char FileName[256];
+   char *fp;
+   int i,n,Once = 0;
+
+   p = SkipSpace(p);
+   if (!StrNCaseCmp(p,"ONCE",4) && !isym(p[4]))
    {
-      ErrorMsg("Missing byte data\n");
-      ErrorLine(p);
-      exit(1);
+      Once = 1;
+      p += 4;
    }
-   j = AddressIndex(pc);
-   if (j >= 0)
-   for ( ; j < Labels ; ++j) // There may be multiple lables on this address
+   p = NeedChar(p,'"');
+   if (!p)
    {
-       if (lab[j].Address == pc) lab[j].Bytes = l;
+      ErrorMsg("Missing quoted filename after INCLUDE\n");
+      Terminate(1);
    }
-   if (j >= 0 && df) fprintf(df,"Byte label [%s] $%4.4x $%4.4x %d bytes\n",
-                   lab[j].Name,lab[j].Address,pc,l);
-   if (Phase == 2)
+   fp = FileName;
+   ++p;
+   while (*p != 0 && *p != '"' && fp < FileName + sizeof(FileName) - 1) *fp++ = *p++;
+   *fp = 0;
+   if (df) fprintf(df,"fopen %s\n",FileName);
+   CacheFile(FileName,0);
+   if (IncludeLevel >= 99)
    {
-      for (i=0 ; i < l ; ++i)
-      {
-         Put(pc+i,ByteBuffer[i],p);
-         if (ListOn && i < 4) fprintf(lf," %2.2x",ByteBuffer[i]);
-      }
-      if (ListOn)
-      {
-         for (i=l ; i < 4 ; ++i) fprintf(lf,"   ");
-         fprintf(lf,"  %s\n",Line);
-      }
+      ErrorMsg("Too many includes nested ( >= 99)\n");
+      Terminate(1);
    }
-   pc += l;
-   return p;
+   n = IncOnces;
+   i = OnceFind(FileName);
+   if (i < n && (Once || IncOnce[i].Once))
+   {
+      PrintLine();
+      PrintLiNo();
+      if (ListOn && Phase == 2)
+         fprintf(lf,";                       skipped INCLUDE ONCE file %s\n",FileName);
+      return p+1;
+   }
+   if (PchDir && PchInclude(FileName))
+   {
+      PrintLine();
+      PrintLiNo();
+      if (ListOn && Phase == 2)
+         fprintf(lf,";                       cached INCLUDE file %s\n",FileName);
+      return p+1;
+   }
+   if (!SourceOpen(FileName))
+   {
+      DiagPrintf("Could not open include file <%s>\n",FileName);
+      Terminate(1);
+   }
+   ++StatIncludes;
+   IncludeStack[IncludeLevel].LiNo = LiNo;
+   IncludeStack[++IncludeLevel].fp = sf;
+   IncludeStack[IncludeLevel].mf = mf;
+   IncludeStack[IncludeLevel].Src = (char *)StrNDup(FileName,strlen(FileName));
+   PrintLine();
+   LiNo = 0;
+   return p+1; // skip quote after filename
 }
 
+// ***********
+// VariantName
+// ***********
 
-// *************
-// Parsebit5Data
-// *************
+// Inserts "-<variant>" before the extension of a file name,
+// so that the variants of a source write different files.
+// Returns the new name and frees the old one.
 
-char *Parsebit5Data(char *p)
+char *VariantName(char *Name)
 {
-   char c;
-   int i,v;
-
-   p = SkipSpace(p);
-   if (strlen(p) < 7 || p[0] != '"' || p[6] != '"')
-   {
-      ErrorMsg("Need 5 character string\n");
-      ErrorLine(p);
-      exit(1);
-   }
+   int l,e;
+   char *v;
 
-   // pack 5 characters into 20 bit
+   if (!Variant) return Name;
+   l = strlen(Name);
+   for (e=l ; e > 0 && Name[e-1] != '.' && Name[e-1] != '/' ; --e) ;
+   if (e == 0 || Name[e-1] != '.') e = l + 1; // no extension
+   v = (char *)MallocOrDie(l + strlen(Variant) + 2);
+   sprintf(v,"%.*s-%s%s",e-1,Name,Variant,Name+e-1);
+   free(Name);
+   return v;
+}
 
-   // '?' ->  0
-   // ' ' ->  1
-   // 'A' ->  2
-   // 'Z' -> 27
-   // '2' -> 28
-   // '3' -> 29
+char *ParseStoreData(char *p)
+{
+   int Start,Length,FileFormat,Entry;
+   char *Filename,*EndPtr;
 
-   v = 0;
-   for (i=4 ; i > 0 ; --i)
+   if (Phase < 2) return p + strlen(p);
+   p = EvalOperand(p,&Start,0);
+   if (Start < 0 || Start > 0xfffff)
    {
-      c = p[i];
-      if (c == ' ') c = 0x40;
-      if (c == '2') c = 'Z'+1;
-      if (c == '3') c = 'Z'+2;
-      if (c < '?' || c > 'Z'+2)
-      {
-         ErrorMsg("illegal character\n");
-         ErrorLine(p);
-         exit(1);
-      }
-      v = (v << 5) | (c - '?');
+      ErrorMsg("Illegal start address for STORE %d\n",Start);
+      Terminate(1);
    }
-        if (p[5] == 'C') v |= (1 << 20);
-   else if (p[5] == 'D') v |= (2 << 20);
-   else if (p[5] == 'R') v |= (3 << 20);
-   else if (p[5] == 'W') v |= (4 << 20);
-
-   if (Phase == 2)
+   p = NeedChar(p,',');
+   if (!p)
    {
-      if (ListOn) fprintf(lf," %6.6x       %s\n",v,Line);
-      for (i=2 ; i >= 0 ; --i)
+      ErrorMsg("Missing ',' after start address\n");
+      Terminate(1);
+   }
+   p = EvalOperand(p+1,&Length,0);
+   if (Length < 0 || Length > 0x10000)
+   {
+      ErrorMsg("Illegal length for STORE %d\n",Length);
+      Terminate(1);
+   }
+   p = NeedChar(p,',');
+   if (!p)
+   {
+      ErrorMsg("Missing ',' after length\n");
+      Terminate(1);
+   }
+   p = NeedChar(p+1,'"');
+   if (!p)
+   {
+      ErrorMsg("Missing quote for filename\n");
+      Terminate(1);
+   }
+   EndPtr = ++p;
+   while (*EndPtr != '\0' && *EndPtr != '"') ++EndPtr;
+   Filename = (char *)StrNDup(p, EndPtr - p);
+   FileFormat = BINARY;
+   Entry = -1;
+   p = NeedChar(EndPtr+1,',');
+   if (p)
+   {
+      ++p;
+           if (StrMatch(p, "BIN"))  FileFormat = BINARY;
+      else if (StrMatch(p, "SREC")) FileFormat = SRECORD;
+      else if (StrMatch(p, "S19"))  FileFormat = SRECORD;
+      else if (StrMatch(p, "SPARROW"))  FileFormat = SPARROW;
+      else
       {
-         Put(pc+i,v & 0xff,p);
-         v >>= 8;
+         ErrorMsg("Unknown output file format\n");
+         Terminate(1);
       }
-   }
-   pc += 3;
-   return p+7;
-}
-
-// ***************
-// ParseSubroutine
-// ***************
+      if (df) fprintf(df,"Filefornat = %d\n",FileFormat);
+      p = NeedChar(p,',');
+      if (p)
+      {
+         p = EvalOperand(p+1,&Entry,0);
+         if (Entry < 0 || Entry > 0xffff)
+         {
+            ErrorMsg("Illegal execution start address for STORE %d\n",Entry);
+            Terminate(1);
+         }
+      } else p = EndPtr;
+   } else p = EndPtr;
 
-char *ParseSubroutine(char *p)
-{
-   p = SkipSpace(p);
-   DefineLabel(p,&ModuleStart,0);
-   strcpy(Scope,Label);
-   if (df) fprintf(df,"SCOPE: [%s]\n",Scope);
-   if (Phase == 2 && ListOn)
+   SFA[StoreCount] = Start;
+   SFL[StoreCount] = Length;
+   SFE[StoreCount] = Entry;
+   SFF[StoreCount] = VariantName(Filename);
+   SFT[StoreCount] = FileFormat;
+   if (df)
    {
-      fprintf(lf,"              %s\n",Line);
+      fprintf(df,"Storing %4.4x - %4.4x <%s>,",
+           Start,Start+Length-1,Filename);
+           if (FileFormat == SPARROW) fprintf(df,"SPARROW\n");
+      else if (FileFormat == SRECORD) fprintf(df,"SRECORD\n");
+      else                            fprintf(df,"BINARY\n");
+   }
+   if (StoreCount < SFMAX) ++StoreCount;
+   else
+   {
+      ErrorMsg("number of storage files exceeds %d\n",SFMAX);
+      Terminate(1);
    }
+   PrintLine();
+   p += strlen(p);
    return p;
 }
 
-// ******
-// EndSub
-// ******
 
-char *EndSub(char *p)
+
+char *ParseLoadData(char *p)
 {
-   if (Phase == 2 && ListOn)
-   {
-      PrintPC();
-      p = ListSizeInfo(p);
-   }
-   Scope[0] = 0;
-   ModuleStart = 0;
-   return p;
-}
+   int i,Start,Size,Advance;
+   char *Filename,*EndPtr;
+   FILE *lp;
 
-// Functions for pseudo ops
+   p = SkipSpace(p);
 
-// ###
+   Advance = 1;
+   if (*p == '\"') Start = pc;
+   else
+   {
+      Advance = 0;
+      p = EvalOperand(p,&Start,0);
 
-char *ps_bit5(char *p)   { PrintPC(); return Parsebit5Data(p);}
-char *ps_bits(char *p)   {            return ParseBitData(p); }
-char *ps_bss(char *p)    { PrintPC(); return ParseBSSData(p); }
-char *ps_byte(char *p)   { PrintPC(); return ParseByteData(p); }
-char *ps_case(char *p)   { PrintPC(); return ParseCaseData(p); }
-char *ps_cmap(char *p)   { PrintPC(); return ParseCmapData(p); }
-char *ps_cpu(char *p)    {            return ParseCPUData(p); }
-char *ps_end(char *p)    { PrintLine(); ForcedEnd = 1; return p; }
-char *ps_endsub(char *p) {            return EndSub(p); }
-char *ps_fill(char *p)   { PrintPC(); return ParseFillData(p); }
-char *ps_formln(char *p) { FormLn = atoi(p); PrintByteLine(FormLn); return p; }
-char *ps_ignore(char *p) { PrintLine(); return p; }
-char *ps_include(char *p){ PrintPC(); return IncludeFile(p); }
-char *ps_list(char *p)   { PrintPC(); return ParseListOption(p); }
-char *ps_load(char *p)   { PrintPC(); return ParseLoadData(p); }
-char *ps_long(char *p)   { PrintPC(); return ParseLongData(p); }
-char *ps_maclist(char *p){            return ParseOnOff(p,&MacList); }
-char *ps_real(char *p)   {            return ParseRealData(p); }
-char *ps_size(char *p)   { PrintPC(); return ListSizeInfo(p); }
-char *ps_store(char *p)  {            return ParseStoreData(p); }
-char *ps_string(char *p) { PrintPC(); return ParseByteData(p); }
-char *ps_subr(char *p)   { PrintPC(); return ParseSubroutine(p); }
-char *ps_word(char *p)   { PrintPC(); return ParseWordData(p); }
-
-char *ps_align(char *p)
-{
-   int a,dal,fill;
-
-   dal  = 0;                  // data align = false
-   p = SkipSpace(p);
-   if (*p == '*') ++p;        // PC align
-   if (*p == '&')
-   {
-      dal = 1;                // data align
-      ++p;
+      if (Start < 0 || Start > 0xffff)
+      {
+         ErrorMsg("Illegal start address for LOAD %d\n",Start);
+         Terminate(1);
+      }
+      p = NeedChar(p,',');
+      if (!p)
+      {
+         ErrorMsg("Missing ',' after start address\n");
+         Terminate(1);
+      }
+      p = NeedChar(p+1,'"');
+      if (!p)
+      {
+         ErrorMsg("Missing quote for filename\n");
+         Terminate(1);
+      }
    }
-   if (dal) fill = Preset;
-   else     fill = 0x12  ;    // NOP
-
-   p = AlignFill(p,&a,&fill);
-
-   if (dal)
+   EndPtr = ++p;
+   while (*EndPtr != '\0' && *EndPtr != '"') ++EndPtr;
+   Filename = (char *)StrNDup(p, EndPtr - p);
+   if (df) fprintf(df,"Loading %4.4x <%s>\n",Start,Filename);
+   PrintLine();
+   lp = fopen(Filename,"rb");
+   AssertFileOp(lp,"Could not LOAD <%s>\n");
+   ++StatIncludes;
+   CacheFile(Filename,0);
+   fseek(lp,0,SEEK_END);
+   Size = ftell(lp);
+   rewind(lp);
+   if (Start + Size > 0x10000)
    {
-      a = (a - bss % a) % a;
-      if (df) fprintf(df,"Data align %4.4x - %4.4x fill %2.2x\n",bss,bss+a,fill);
-      while (a--) ROM[bss++] = fill;
+      ErrorMsg("LOADING %4.4x to %4.4x violates 64K size\n",
+         Start,Start+Size);
+      Terminate(1);
    }
-   else
+
+   if (Phase == 2)
+   for (i=Start; i < Start+Size ; ++i)
    {
-      a = (a - pc  % a) % a;
-      if (df) fprintf(df,"Code align %4.4x - %4.4x fill %2.2x\n",pc,pc+a,fill);
-      while (a--) ROM[pc++]  = fill;
+      if (LOCK[i])
+      {
+         ErrorMsg("LOAD would overwrite defined values\n");
+         ErrorLine(p);
+         Terminate(1);
+      }
+      LOCK[i] = 1;
    }
-   PrintPCLine();
+   fread(ROM+Start,Size,1,lp);
+   fclose(lp);
+   if (Advance) pc += Size;
+   p += strlen(p);
    return p;
 }
 
-// ******
-// ps_org
-// ******
 
-char *ps_org(char *p)
-{
-   p = ExtractValue(p,&pc);
-   PrintPCLine();
-   return p;
-}
+// *************
+// ImportSymbols
+// *************
 
-// *****
-// SetPC
-// *****
+// IMPORTSYM "file" defines the symbols of a file written by --sym
+// ("name = value" lines) as locked symbols like -D. The file is read
+// in phase 1 only, phase 2 finds the symbols already defined.
 
-char *SetPC(char *p)
+char *ImportSymbols(char *p)
 {
-   p = NeedChar(p,'=');
-   if (p) return ps_org(p+1);
-
-   ++ErrNum;
-   ErrorMsg("Setting PC with \"* = address\" syntax error\n");
-   exit(1);
-}
+   int l,n,v;
+   char FileName[256];
+   char Buf[ML];
+   char *q;
+   FILE *fp;
 
-char *ps_rmb(char *p)
-{
-   int size;
-   p = ExtractValue(p,&size);
-   if (size < 0)
+   p = NeedChar(p,'"');
+   if (!p)
    {
-      ErrorMsg("Only theoretical physicists are allowed to reserve "
-               "a negative amount of space: %d bytes\n", size);
-      exit(1);
+      ErrorMsg("Missing quoted filename after IMPORTSYM\n");
+      Terminate(1);
    }
-   PrintPCLine();
-   pc+=size;
-   p += strlen(p);
+   for (++p,l=0 ; *p && *p != '"' && l < (int)sizeof(FileName)-1 ; ) FileName[l++] = *p++;
+   FileName[l] = 0;
+   if (*p) ++p;
+   if (Phase == 2) return p;
+   fp = fopen(FileName,"r");
+   if (!fp)
+   {
+      DiagPrintf("Could not open symbol file <%s>\n",FileName);
+      Terminate(1);
+   }
+   ++StatIncludes;
+   CacheFile(FileName,0);
+   n = 0;
+   while (fgets(Buf,sizeof(Buf),fp))
+   {
+      ++n;
+      Buf[strcspn(Buf,"\r\n")] = 0;
+      q = SkipSpace(Buf);
+      if (!*q || *q == ';' || *q == '*') continue;
+      if (!strchr(q,'='))
+      {
+         ++ErrNum;
+         ErrorMsg("Missing '=' in symbol file <%s> line %d\n",FileName,n);
+         Terminate(1);
+      }
+      DefineLabel(q,&v,1);
+   }
+   fclose(fp);
    return p;
 }
 
-char *ps_sect(char *p)
+
+char *ParseBSSData(char *p)
 {
-   char *q;
+   int m;
 
-   q = StrMatch(p,"LOC=");
-   if (q) q = EvalOperand(q+4,&pc,0);
-   PrintPCLine();
+   p = ExtractValue(p,&m);
+   if (m < 1 || m > 32767)
+   {
+      ErrorMsg("Illegal BSS size %d\n",m);
+      Terminate(1);
+   }
+   if (ListOn && Phase == 2)
+      fprintf(lf,"%4.4x             %s\n",bss,Line);
+   bss += m;
    return p;
 }
 
-char *ps_setdp(char *p)
-{
-   p = ExtractValue(p,&DP);
-   if (DP > 255) DP >>= 8;      // alternate DP assignment
-   PrintByteLine(DP);
-   return p;
-}
 
-struct PseudoStruct
-{
-   const char *keyword;
-   char *(*foo)(char *);
-};
+// selects the instruction set and register names, returns 0 for unknown CPUs
 
-struct PseudoStruct PseudoTab[] =
+int SetCPU(int c)
 {
-   {"ALIGN"     , &ps_align  },
-   {"BITS"      , &ps_bits   },
-   {"BSS"       , &ps_bss    },
-   {"BYTE"      , &ps_byte   },
-   {"C5TO3"     , &ps_bit5   },
-   {"CASE"      , &ps_case   },
-   {"CMAP"      , &ps_cmap   },
-   {"CPU"       , &ps_cpu    },
-   {"END"       , &ps_end    },
-   {"ENDMOD"    , &ps_endsub }, // alias to ENDSUB
-   {"ENDSUB"    , &ps_endsub },
-   {"EXTERN"    , &ps_ignore },
-   {"FCB"       , &ps_byte   },
-   {"FCC"       , &ps_string },
-   {"FDB"       , &ps_word   },
-   {"FILL"      , &ps_fill   },
-   {"FORMLN"    , &ps_formln },
-   {"INCLUDE"   , &ps_include},
-   {"INTERN"    , &ps_ignore },
-   {"LIST"      , &ps_list   },
-   {"LOAD"      , &ps_load   },
-   {"LONG"      , &ps_long   },
-   {"MACLIST"   , &ps_maclist},
-   {"MODULE"    , &ps_subr   }, // alias to SUBROUTINE
-   {"ORG"       , &ps_org    },
-   {"RMB"       , &ps_rmb    },
-   {"REAL"      , &ps_real   },
-   {"SECT"      , &ps_sect   },
-   {"SETDP"     , &ps_setdp  },
-   {"SIZE"      , &ps_size   },
-   {"STORE"     , &ps_store  },
-   {"SUBROUTINE", &ps_subr   },
-   {"TTL"       , &ps_ignore },
-   {"WORD"      , &ps_word   }
-};
+   if (c == 6809)
+   {
+      DimOp = DIMOP_6809;
+      RegisterNames = Register_6809;
+   }
+   else if (c == 6309)
+   {
+      DimOp = DIMOP_6309;
+      RegisterNames = Register_6309;
+   }
+   else return 0;
+   CPU = c;
+   return 1;
+}
 
-#define PSEUDOS (int)(sizeof(PseudoTab) / sizeof(struct PseudoStruct))
 
-char *CheckPseudo(char *p)
+char *ParseCPUData(char *p)
 {
-   int i;
+   int c;
 
    p = SkipSpace(p);
-
-   for (i=0 ; i < PSEUDOS ; ++i)
-   if (!strcmpword(p,PseudoTab[i].keyword))
+   if (*p == '=') ++p;
+   p = EvalOperand(p,&c,0);
+   if (!SetCPU(c))
    {
-      p = PseudoTab[i].foo(p+strlen(PseudoTab[i].keyword));
-      if (pc > 0x10000)
-      {
-         ErrorMsg("Program counter overflow\n");
-         ErrorLine(p);
-         exit(1);
-      }
-      return NULL; // flag for pseudo op processed
+      ErrorMsg("Unknown CPU %d - use 6809 or 6309\n",c);
+      Terminate(1);
+   }
+   if (ListOn && Phase == 2)
+   {
+      PrintLiNo();
+      fprintf(lf,"%4d              %s\n",CPU,Line);
    }
    return p;
 }
 
 
-void AddLabel(char *p)
+char *ParseOnOff(char *p, int *v)
 {
-   int i,l;
+   p = SkipSpace(p);
+        if (*p == '1') *v = 1;
+   else if (*p == '0') *v = 0;
+   else if (!StrNCaseCmp(p,"ON" ,2)) *v = 1;
+   else if (!StrNCaseCmp(p,"OFF",3)) *v = 0;
 
-   if (Labels > MAXLAB -2)
+   else
    {
-      ++ErrNum;
-      ErrorMsg("Too many labels (> %d)\n",MAXLAB);
-      exit(1);
+      ErrorMsg("Unknown option\n");
+      Terminate(1);
    }
-   l = strlen(p);
+   if (ListOn && Phase == 2)
+   {
+      PrintLiNo();
+      fprintf(lf,"                  %s\n",Line);
+   }
+   return p + strlen(p);
+}
 
-   // test for mnemonic
+// ***********
+// PlaceModule
+// ***********
 
-   for (i=0 ; i < DimOp ; ++i)
+// Sets pc to the region of a module moved by --place
+
+void PlaceModule(void)
+{
+   if (PlcAct && PlcNum < PlcMods && PlcAct[PlcNum] && PlcUsed[(int)PlcAct[PlcNum]])
    {
-      if (!StrCaseCmp(p,Mat[i].Mne))
-      {
-         ErrorMsg("Use of reserved mnemonic <%s> as label or operand\n",p);
-         exit(1);
-      }
+      PlcCur  = PlcAct[PlcNum];
+      PlcSave = pc;
+      pc = PlcNext[PlcCur];
    }
+   ++PlcNum;
+}
 
-   // test for pseudos
+// **********
+// ParsePlace
+// **********
 
-   for (i=0 ; i < PSEUDOS ; ++i)
-   {
-      if (!StrCaseCmp(p,PseudoTab[i].keyword))
-      {
-         ErrorMsg("Use of reserved keyword <%s> as label or operand\n",p);
-         exit(1);
-      }
-   }
-
-   lab[Labels].Address = UNDEF;
-   lab[Labels].Name = (char *)StrNDup(p,l);
-   lab[Labels].Ref = (int *)MallocOrDie(sizeof(int));
-   lab[Labels].Att = (int *)MallocOrDie(sizeof(int));
-   lab[Labels].Ref[0] = LiNo;
-   lab[Labels].Att[0] = 0;
-   Labels++;
-}
+// PLACE HOT,address or PLACE COLD,address declares a region for --place
 
-
-void SetInstructionLength(char *p)
+char *ParsePlace(char *p)
 {
-   int i;
-
-   // Store opcode
+   int r,v;
 
-   if (oc >= 0)
+   p = SkipSpace(p);
+   if      (!StrNCaseCmp(p,"HOT" ,3)) r = PLC_HOT;
+   else if (!StrNCaseCmp(p,"COLD",4)) r = PLC_COLD;
+   else
    {
-      if (oc < 256)  Put(pc,oc,p);
-      else
-      {
-         if (df) fprintf(df,"Put ROM[%4.4x] = %4.4x\n",pc,oc);
-         Put(pc  ,oc >> 8  ,p);
-         Put(pc+1,oc & 0xff,p);
-      }
+      ErrorMsg("PLACE needs HOT or COLD\n");
+      Terminate(1);
    }
-
-   // Lock instruction length
-
-   if (pc >= 0 && pc < 0x10000)
+   p = NeedChar(p + (r == PLC_HOT ? 3 : 4),',');
+   if (!p)
    {
-      if (ADL[pc] != 0 && ADL[pc] != il)
-      {
-         ErrorMsg("Phase error\n");
-         ErrorLine(p);
-         exit(1);
-      }
-      ADL[pc] = il;
-      for (i=1 ; i < il ; ++i) ADL[pc+i] = -1;
+      ErrorMsg("Missing ',' after PLACE region\n");
+      Terminate(1);
    }
-   if (df) fprintf(df,"lock oc = %4.2x il = %d ol = %d\n",oc,il,ol);
-}
-
-
-void Synchronize(void)
-{
-   nops = ADL[pc] - il;
-   if (df) fprintf(df,"oc = %4.2x ol=%d ql=%d il=%d\n",oc,ol,ql,il);
-   if (df && nops) fprintf(df,"Add %d NOP's\n",nops);
-   il = ADL[pc];
-   if (df) fprintf(df,"SYnc lock[%4.4x] = %d\n",pc,LOCK[pc]);
-   if (nops) LOCK[pc] = 0;
+   p = EvalOperand(p+1,&v,0);
+   if (!PlcCur) PlcNext[r] = v;
+   PlcUsed[r] = 1;
+   return p;
 }
 
 
-void CheckSkip(void)
+char *ParseBitData(char *p)
 {
-   int i;
-
-   Skipping = 0;
-   for (i=1 ; i <= IfLevel ; ++i) Skipping |= SkipLine[i];
-}
+   int i,v;
 
-int CheckCondition(char *p)
-{
-   int r,v,Ifdef,Ifndef,Ifval;
-   r = 0;
-   if (df) fprintf(df,"Check <%s>\n",p);
-   if (*p == '#') ++p; // old syntax #if, #endif, etc.
-   if (!strcmpword(p,"error") && (Phase == 1))
-   {
-      CheckSkip();
-      if (Skipping) return 0;     // Include line in listing
-      ErrorMsg("%s\n",p+6);
-      exit(1);
-   }
-   Ifdef  = !strcmpword(p,"ifdef");
-   Ifndef = !strcmpword(p,"ifndef");
-   Ifval  = !strcmpword(p,"if");
-   if (Ifdef || Ifndef || Ifval)
+   v = 0;
+   for (i=0 ; i < 8 ; ++i)
    {
-      r = 1;
-      IfLevel++;
-      if (IfLevel > 9)
-      {
-         ++ErrNum;
-         ErrorMsg("More than 10  IF or IFDEF conditions nested\n");
-         exit(1);
-      }
-      if (Ifdef)
-      {
-         p = EvalOperand(p+6,&v,0);
-         SkipLine[IfLevel] = v == UNDEF;
-      }
-      else if (Ifndef)
-      {
-         p = EvalOperand(p+7,&v,0);
-         SkipLine[IfLevel] = v != UNDEF;
-      }
-      else // if (Ifval)
-      {
-         p = EvalOperand(p+3,&v,0);
-         SkipLine[IfLevel] = v == UNDEF || v == 0;
-      }
-      CheckSkip();
-      if (ListOn && Phase == 2)
+      v <<= 1;
+      p = SkipSpace(p+1);
+      if (*p == '*') v |= 1;
+      else if (*p != '.')
       {
-         PrintLiNo();
-         if (SkipLine[IfLevel])
-            fprintf(lf,"%4.4x FALSE    %s\n",SkipLine[IfLevel],Line);
-         else
-            fprintf(lf,"0000 TRUE     %s\n",Line);
+         ErrorMsg("use only '*' for 1 and '.' for 0 in BITS statement\n");
+         Terminate(1);
       }
-      if (df) fprintf(df,"%5d %4.4x          %s\n",LiNo,SkipLine[IfLevel],Line);
-   }
-   else if (!strcmpword(p,"else"))
-   {
-      r = 1;
-      SkipLine[IfLevel] = !SkipLine[IfLevel];
-      CheckSkip();
-      PrintLiNo();
-      if (ListOn && Phase == 2) fprintf(lf,"              %s\n",Line);
    }
-   if (!strcmpword(p,"endif"))
+   if (ListOn && Phase == 2)
    {
-   if (df) fprintf(df,"inside Check endif\n");
-      r = 1;
-      IfLevel--;
-      PrintLiNo();
-      if (ListOn && Phase == 2) fprintf(lf,"              %s\n",Line);
-      if (IfLevel < 0)
-      {
-         ++ErrNum;
-         ErrorMsg("endif without if\n");
-         exit(1);
-      }
-      CheckSkip();
-      if (df) fprintf(df,"ENDIF SkipLevel[%d]=%d\n",IfLevel,SkipLine[IfLevel]);
+      PrintPC();
+      Put(pc,v,p);
+      fprintf(lf," %2.2x           ",v);
+      fprintf(lf,"%s\n",Line);
    }
-   return r;
+   ++pc;
+   return p + strlen(p);
 }
 
-
-int RegisterSize(int n)
+char *ParseCmapData(char *p)
 {
-   char r;
-
-   if (!StrNCaseCmp(Mat[n].Mne,"LDMD",4)) return 1;
-   if (!StrNCaseCmp(Mat[n].Mne,"CWAI",4)) return 1;
-
-   r = Mat[n].Mne[strlen(Mat[n].Mne)-1];
-
-   if (r == 'A' || r == 'B' || r == 'C' || r == 'E' || r == 'F') return 1;
-   if (r == 'D' || r == 'X' || r == 'Y' || r == 'W') return 2;
-   if (r == 'S' || r == 'U') return 2;
-   if (r == 'Q') return 4;
-
-   ErrorMsg("Illegal register name [%c]\n",r);
-   exit(1);
-}
-
+   int i,v,scanline;
 
-char *ScanRegister(char *p, int *v)
-{
-   int i;
-   char *q;
+   v = 0;
+   if (*p >= '0' && *p < '8') scanline = *p - '0';
+   else                       scanline = -1;
 
-   for (i=15 ; i >= 0 ; --i)
+   for (i=0 ; i < 8 ; ++i)
    {
-      if (!StrNCaseCmp(RegisterNames[i],p,strlen(RegisterNames[i]))) break;
+      v <<= 1;
+      p = SkipSpace(p+1);
+      if (*p == '*') v |= 1;
+      else if (*p != '.')
+      {
+         ErrorMsg("use only '*' for 1 and '.' for 0 in CMAP statement\n");
+         Terminate(1);
+      }
    }
-   if (i < 0)
+   if (Phase == 2)
    {
-      ErrorLine(p);
-      ErrorMsg("Unknown register name or wrong CPU set\n");
-      exit(1);
+      if (ListOn) PrintPC();
+      if (scanline < 0) Put(pc,v,p);
+      else Put(pc+2*scanline-7,v,p);
+      if (ListOn)
+      {
+         fprintf(lf," %2.2x       ",v);
+         fprintf(lf,"%s\n",Line);
+      }
    }
-   *v = i;
-   q = p + strlen(RegisterNames[i]);
-   q = SkipSpace(q);
-   if (*q == ',') ++q;
-   return q;
+   ++pc;
+   return p + strlen(p);
 }
 
-
-char *TFMRegister(char *p, int *v)
+char *ParseASCII(char *p, unsigned char b[], int *l)
 {
-   int i;
+   char Delimiter;
 
-   for (i=4 ; i >= 0 ; --i)
+   Delimiter = *p++;
+   while (*p && *p != Delimiter)
    {
-      if (RegisterNames[i][0] == toupper(*p)) break;
+      if (*p == '\\') // special character CR, LF, NULL
+      {
+         ++p;
+              if (*p == 'r') b[*l] = 13; // return
+         else if (*p == 'f') b[*l] = 12; // form feed
+         else if (*p == 'n') b[*l] = 10; // new line
+         else if (*p == 't') b[*l] =  9; // tab
+         else if (*p == 'a') b[*l] =  7; // alert
+         else if (*p == 'e') b[*l] = 27; // escape
+         else if (*p == '0') b[*l] =  0; // zero
+         else if (*p == 'b') b[*l] = 29; // bold colour
+         else if (*p == 's') b[*l] = 28; // standard colour
+         else b[*l] = *p;
+         ++(*l);
+         ++p;
+      }
+      else
+      {
+         b[(*l)++] = *p++;
+      }
    }
-   if (i < 0)
+   if (*p == Delimiter) ++p;
+   if (*p == '^')
    {
-      ErrorLine(p);
-      ErrorMsg("Illegal register name for TFM or wrong CPU set\n");
-      exit(1);
+      b[(*l)-1] |= 0x80; // Set bit 7 of last char
+      ++p;
    }
-   *v = i;
-   return p+1;
+   return p;
 }
 
+// *************
+// ParseByteData
+// *************
 
-void OperandError(char *p)
+char *ParseByteData(char *p)
 {
-   ++ErrNum;
-   ErrorLine(p);
-   ErrorMsg("Syntax error in operand\n");
-   exit(1);
-}
-
+   int i,j,l,v;
+   char Delimiter;
 
-int PostIndex(int reg,char *p)
-{
-   switch(*p)
+   p = SkipSpace(p);
+   l = 0;
+   while (*p && *p != ';') // Parse data line
    {
-      case 'x':
-      case 'X': if (reg < 0) reg = 0x00; else OperandError(p); break;
-      case 'y':
-      case 'Y': if (reg < 0) reg = 0x20; else OperandError(p); break;
-      case 'u':
-      case 'U': if (reg < 0) reg = 0x40; else OperandError(p); break;
-      case 's':
-      case 'S': if (reg < 0) reg = 0x60; else OperandError(p); break;
-      default : OperandError(p);
+      if (CodeStyle == 1 && *p == ' ') break;
+      else p = SkipSpace(p);
+      Delimiter = *p;
+      ByteFit(l + strlen(p) + sizeof(datebuffer));
+      if (!strncmp(p,"$DATE",5))
+      {
+         strcpy((char *)ByteBuffer+l,datebuffer);
+         l += strlen(datebuffer);
+         p += 5;
+      }
+      else if (Delimiter == '"' || Delimiter == '\'')
+      {
+         i = l; // remember start of string
+         p = ParseASCII(p,ByteBuffer,&l);
+         if (df)
+         {
+            fprintf(df,"String $%4.4x:<",pc);
+            for (j=i ; j < l ; ++j) fprintf(df,"%c",ByteBuffer[j]&0x7f);
+            fprintf(df,"> [%d]\n",l-i);
+         }
+      }
+      else
+      {
+         v = UNDEF;
+         p = EvalOperand(p,&v,0);
+         if (Rel) AddFix(pc+l,'W',Rel,v,1,p);
+         if (v == UNDEF && Phase == 2)
+         {
+            ErrorMsg("Undefined symbol in BYTE data\n");
+            ErrorLine(p);
+            Terminate(1);
+         }
+         if (v > 255 || v < -127) ByteBuffer[l++] = v >> 8;
+         ByteBuffer[l++] = v & 0xff;
+         if (df)
+         {
+            fprintf(df,"BYTE   $%4.4x: %2.2x\n",pc,v);
+         }
+      }
+      if (CodeStyle == 1 && *p == ' ') break;
+      p = SkipToComma(p);
+      if (*p == ',') ++p;
    }
-   return reg;
+   if (l < 1)
+   {
+      ErrorMsg("Missing byte data\n");
+      ErrorLine(p);
+      Terminate(1);
+   }
+   j = AddressIndex(pc);
+   if (j >= 0)
+   for ( ; j < Labels ; ++j) // There may be multiple lables on this address
+   {
+       if (lab[j].Address == pc) lab[j].Bytes = l;
+   }
+   if (j >= 0 && df) fprintf(df,"Byte label [%s] $%4.4x $%4.4x %d bytes\n",
+                   lab[j].Name,lab[j].Address,pc,l);
+   if (Phase == 2)
+   {
+      for (i=0 ; i < l ; ++i)
+      {
+         Put(pc+i,ByteBuffer[i],p);
+         if (ListOn && i < 4) fprintf(lf," %2.2x",ByteBuffer[i]);
+      }
+      if (ListOn)
+      {
+         for (i=l ; i < 4 ; ++i) fprintf(lf,"   ");
+         fprintf(lf,"  %s\n",Line);
+      }
+   }
+   pc += l;
+   return p;
 }
 
 
-// ************
-// PostIndexReg
-// ************
+// *************
+// Parsebit5Data
+// *************
 
-int PostIndexReg(int reg,char *p)
+char *Parsebit5Data(char *p)
 {
-   reg = PostIndex(reg,p);
-   if (*(++p)) OperandError(p);
-   return reg;
-}
+   char c;
+   int i,v;
 
-/* special postbyte codes for W register operand
+   p = SkipSpace(p);
+   if (strlen(p) < 7 || p[0] != '"' || p[6] != '"')
+   {
+      ErrorMsg("Need 5 character string\n");
+      ErrorLine(p);
+      Terminate(1);
+   }
 
-   8F     ,W
-   90    [,W]
-   AF   ea,W
-   B0  [ea,W]
-   CF     ,W++
-   D0    [,W++]
-   EF   ,--W
-   F0  [,--W]
-*/
+   // pack 5 characters into 20 bit
 
-// **********
-// PostIndexW
-// **********
+   // '?' ->  0
+   // ' ' ->  1
+   // 'A' ->  2
+   // 'Z' -> 27
+   // '2' -> 28
+   // '3' -> 29
 
-int PostIndexW(int reg,char *p)
-{
-   if (df) fprintf(df,"PostIndexW [%c]\n",*p);
-   if (*p == 'w' || *p == 'W') return 0xf;
-   return PostIndex(reg,p);
+   v = 0;
+   for (i=4 ; i > 0 ; --i)
+   {
+      c = p[i];
+      if (c == ' ') c = 0x40;
+      if (c == '2') c = 'Z'+1;
+      if (c == '3') c = 'Z'+2;
+      if (c < '?' || c > 'Z'+2)
+      {
+         ErrorMsg("illegal character\n");
+         ErrorLine(p);
+         Terminate(1);
+      }
+      v = (v << 5) | (c - '?');
+   }
+        if (p[5] == 'C') v |= (1 << 20);
+   else if (p[5] == 'D') v |= (2 << 20);
+   else if (p[5] == 'R') v |= (3 << 20);
+   else if (p[5] == 'W') v |= (4 << 20);
+
+   if (Phase == 2)
+   {
+      if (ListOn) fprintf(lf," %6.6x       %s\n",v,Line);
+      for (i=2 ; i >= 0 ; --i)
+      {
+         Put(pc+i,v & 0xff,p);
+         v >>= 8;
+      }
+   }
+   pc += 3;
+   return p+7;
 }
 
-// ***********
-// SetPostByte
-// ***********
+// ***************
+// ParseSubroutine
+// ***************
 
-int SetPostByte(char *p, int *v)
+char *ParseSubroutine(char *p)
 {
-   int inc,dec,reg,amo,off,ind,opl;
-
-   ind =  0;  // indirect bit
-   inc =  0;  // auto increment counter
-   dec =  0;  // auto decrement counter
-   reg = -1;  // index  register
-   amo = -1;  // address mode bits
-   off =  0;  // constant offset
-   opl = strlen(p);
-
-   // indirect
+   int i;
 
-   if (df) fprintf(df,"indirect check %c %c\n",p[0],p[opl-1]);
-   if (p[0] == '[' && p[opl-1] == ']')
+   p = SkipSpace(p);
+   DefineLabel(p,&ModuleStart,0);
+   strcpy(Scope,Label);
+   if (df) fprintf(df,"SCOPE: [%s]\n",Scope);
+   if (InlPass) // omit INLINE module without remaining references
    {
-      ind = 0x10;
-      p[opl-1] = 0;
-      opl-=2;
-      ++p;
-      if (df) fprintf(df,"is indirect <%s>\n",p);
+      for (i=0 ; i < Inlines ; ++i)
+         if (Inl[i].Drop && !StrCmp(Scope,Inl[i].Name)) InlSkip = 1;
+   }
+   if (Phase == 2) AddModule(StrNDup(Scope,strlen(Scope)),pc,-1);
+   if (Phase == 2 && ListOn)
+   {
+      fprintf(lf,"              %s\n",Line);
    }
+   return p;
+}
 
-   if (df && strlen(p) > 2)
-      fprintf(df,"Check R,R: %c%c%c\n",toupper(p[0]),p[1],toupper(p[2]));
+// ************
+// RecordInline
+// ************
 
-   // A,R
+// Appends the current source line to the body of the INLINE module.
+// Local labels get markers for their dot and a unique suffix, that
+// are replaced for every expansion (see InlineCall).
 
-   if (toupper(p[0]) == 'A' && p[1] == ',')
+void RecordInline(char *cp)
+{
+   struct InlineStruct *n = Inl + InlCur;
+   char *p,*b;
+   int q;
+
+   if (MacLev || !strcmpword(cp,"INCLUDE")) n->Bad = INL_MACRO;
+   n->Body = (char *)ReallocOrDie(n->Body,n->Len+3*strlen(Line)+2);
+   p = Line;
+   b = n->Body + n->Len;
+   q = 0;
+   while (*p)
    {
-      reg = PostIndexReg(reg,p+2);
-      ql = 0;
-      return (0x80 | reg | ind | 0x06);
+      if (*p == '"') q = !q;
+      if (!q && *p == '.' && (p == Line || !isym(p[-1])) &&
+         (p[1] == '_' || isalpha(p[1])))
+      {
+         *b++ = CHAMAC;
+         *b++ = '0';
+         ++p;
+         while (isym(*p)) *b++ = *p++;
+         *b++ = CHAMAC;
+         *b++ = '1';
+      }
+      else *b++ = *p++;
    }
+   *b++ = '\n';
+   *b   = 0;
+   n->Last = n->Len;
+   n->Len = b - n->Body;
+}
 
-   // B,R
+// **********
+// InlineCode
+// **********
 
-   if (toupper(p[0]) == 'B' && p[1] == ',')
-   {
-      reg = PostIndexReg(reg,p+2);
-      ql = 0;
-      return (0x80 | reg | ind | 0x05);
-   }
+// Checks the instruction just generated inside an INLINE module
 
-   // D,R
+void InlineCode(void)
+{
+   struct InlineStruct *n = Inl + InlCur;
 
-   if (toupper(p[0]) == 'D' && p[1] == ',')
+   if (oc == 0x39) // RTS
    {
-      reg = PostIndexReg(reg,p+2);
-      ql = 0;
-      return (0x80 | reg | ind | 0x0b);
+      ++n->Rts;
+      n->Cut = n->Last;
+      n->RtsEnd = pc;
    }
+   else if (oc == 0x17 || oc == 0x8d ||                       // LBSR BSR
+            oc == 0x9d || oc == 0xad || oc == 0xbd ||         // JSR
+            oc == 0x0e || oc == 0x6e || oc == 0x7e ||         // JMP
+            oc == 0x3b || oc == 0x3c || oc == 0x3f ||         // RTI CWAI SWI
+            oc == 0x103f || oc == 0x113f ||                   // SWI2 SWI3
+           (oc == 0x35 && (pb & 0x80)) ||                     // PULS PC
+           ((oc == 0x1e || oc == 0x1f) && (pb & 0x0f) == 5))  // EXG TFR PC
+      n->Bad = INL_CALL;
+}
 
-   // E,R
+// *********
+// EndInline
+// *********
 
-   if (toupper(p[0]) == 'E' && p[1] == ',')
-   {
-      reg = PostIndexReg(reg,p+2);
-      ql = 0;
-      return (0x80 | reg | ind | 0x07);
-   }
+// Called at ENDMOD of an INLINE module. The RTS line is removed
+// from the body, but a label in front of it is kept.
 
-   // F,R
+void EndInline(void)
+{
+   struct InlineStruct *n = Inl + InlCur;
+   char *p,*r;
 
-   if (toupper(p[0]) == 'F' && p[1] == ',')
+   InlCur  = -1;
+   n->Size = pc - ModuleStart;
+   if (n->Bad) return;
+   if (n->Rts != 1 || n->RtsEnd != pc)
    {
-      reg = PostIndexReg(reg,p+2);
-      ql = 0;
-      return (0x80 | reg | ind | 0x0a);
+      n->Bad = INL_RTS;
+      return;
    }
-
-   // W,R
-
-   if (toupper(p[0]) == 'W' && p[1] == ',')
+   if (n->Size - 1 > n->Max)
    {
-      reg = PostIndexReg(reg,p+2);
-      ql = 0;
-      return (0x80 | reg | ind | 0x0e);
+      n->Bad = INL_SIZE;
+      return;
    }
+   p = n->Body + n->Cut;
+   r = StrMatch(p,"RTS");
+   if (!r) r = StrMatch(p,"rts");
+   if (!r) r = p;
+   while (r > p && isspace(r[-1])) --r;
+   n->Len = n->Cut + (r - p);
+   if (r > p) n->Body[n->Len++] = '\n';
+   n->Body[n->Len] = 0;
+}
 
-   // PC relative
+// *********
+// ps_inline
+// *********
 
-   if (df) fprintf(df,"check PC relative %d [%s],<%s>\n",opl,p,p+opl-3);
-   if ((opl > 4 && StrNCaseCmp(p+opl-4,",PCR",4) == 0) ||
-       (opl > 3 && StrNCaseCmp(p+opl-3,",PC" ,3) == 0))
+char *ps_inline(char *p)
+{
+   int i,v;
+   struct InlineStruct *n;
+
+   if (Phase == 2)
    {
-      if (df) fprintf(df,"check PC relative %s\n",p);
-      p = EvalOperand(p,&off,0);
-      off -= pc+3;
-      if (ForcedMode < 0 || (off >= -128 && off < 128 && ROM[pc] != 0x8d))
-      {
-         ql = 1;
-         *v = off;
-         return (0x8c | ind);
-      }
-      else
+      for (i=0 ; i < Inlines ; ++i) if (!StrCmp(Scope,Inl[i].Name)) break;
+      if (ListOn && i < Inlines)
       {
-         ql = 2;
-         *v = off-1;
-         return (0x8d | ind);
+         PrintLiNo();
+         fprintf(lf,"                  %s ; %s\n",Line,InlineWhy[Inl[i].Bad]);
       }
+      return p + strlen(p);
    }
-
-   // offset
-
-   if (*p != ',')
+   if (InlPass) return p + strlen(p);
+   if (!Scope[0])
    {
-      p = EvalOperand(p,&off,0);
+      ErrorMsg("INLINE outside of MODULE\n");
+      Terminate(1);
+   }
+   if (Inlines >= MAXINL)
+   {
+      ErrorMsg("Too many INLINE modules (> %d)\n",MAXINL);
+      Terminate(1);
    }
+   v = INLMAX;
+   p = SkipSpace(p);
+   if (*p && *p != ';') p = EvalOperand(p,&v,0);
+   if (v < 1 || v > 255)
+   {
+      ErrorMsg("Illegal size limit for INLINE %d\n",v);
+      Terminate(1);
+   }
+   n = Inl + Inlines;
+   memset(n,0,sizeof(struct InlineStruct));
+   n->Name = StrNDup(Scope,strlen(Scope));
+   n->Max  = v;
+   if (pc != ModuleStart) n->Bad = INL_CODE;
+   InlCur = Inlines++;
+   return p;
+}
 
-   // zero offset
+// *********
+// MergeLine
+// *********
+
+// Called in a rerun after tail merging for lines of merged tails.
+// Returns 1, if the line is omitted.
+
+int MergeLine(void)
+{
+   int a,v;
+   char Buf[24];
 
-   if (*p == ',' && off == 0)
+   a = MrgAct[TotalLiNo];
+   if ((a & 3) == MRG_LABEL)
    {
-      while (*(++p) == '-') ++dec;
-      reg = PostIndexW(reg,p);
-      if (df) fprintf(df,"zero offset reg=%2.2x\n",reg);
-      while (*(++p) == '+') ++inc;
-      if (df) fprintf(df, "Pre - (%d) and Post + (%d)\n",dec,inc);
-      if (reg <  0) OperandError(p);
-           if (inc == 1 && dec == 0) amo = 0x00;
-      else if (inc == 2 && dec == 0) amo = 0x01;
-      else if (inc == 0 && dec == 1) amo = 0x02;
-      else if (inc == 0 && dec == 2) amo = 0x03;
-      else if (inc == 0 && dec == 0) amo = 0x04;
-      else OperandError(p);
-      ql = 0; // no address
-      if (reg == 0xf) // W register
-      {
-              if (amo == 4) reg = 0x8f; // ,W
-         else if (amo == 1) reg = 0xcf; // ,W++
-         else if (amo == 3) reg = 0xef; // ,--W
-         else OperandError(p);
-         if (ind) reg +=1;
-         if (df) fprintf(df,"W pb = %2.2x ind = %2.2x\n",reg,ind);
-         return reg;
-      }
-      if (*p) OperandError(p);
-      return (0x80 | reg | ind | amo);
+      snprintf(Buf,sizeof(Buf),"_TAIL_%d",a >> 2);
+      DefineLabel(Buf,&v,0);
+      Label[0] = 0;
+   }
+   else if ((a & 3) == MRG_JUMP) MrgJump = (a >> 2) + 1;
+   else if ((a & 3) == MRG_SKIP)
+   {
+      PrintLiNo();
+      if (ListOn && Phase == 2) fprintf(lf,"MERGE         %s\n",Line);
+      return 1;
    }
+   return 0;
+}
 
-   // constant offset
+// *********
+// MergeJump
+// *********
 
-   if (*p == ',')
-   {
-      if (df) fprintf(df,"constant off = %x\n",off);
-      *v = off;
-      reg = PostIndexW(reg,++p);
+// Replaces the first instruction of a merged tail by a jump
+// to the shared copy of the tail.
 
-      if (reg == 0xf) // W register
-      {
-         ql = 2;
-         if (ind) return 0xb0;
-         else     return 0xaf;
-      }
-                                             // 5 bit offset
-      if (ForcedMode <= 0 && off >= -16 && off < 16 && ind == 0)
-      {
-         ql = 0; // no following bytes
-         return (reg | (off & 0x1f));
-      }                                      // 8 bit offset
+void MergeJump(void)
+{
+   char Mne[4];
+   struct MergeStruct *m = Mrg + MrgJump - 1;
 
-      if (ForcedMode <  0 || (off >= -128 && off < 128))
-      {
-         ql = 1; // one following byte
-         return (0x80 | reg | ind | 0x08);
-      }
+   strcpy(Mne,m->Bra ? "BRA" : "JMP");
+   MneIndex = IsInstruction(Mne);
+   snprintf(OpText,LineMax,"_TAIL_%d",m->Label);
+   if (Phase == 2) snprintf(Hint,sizeof(Hint)," ; %s _TAIL_%d",Mne,m->Label);
+   MrgJump = 0;
+}
 
-      // 16 bit offset
+// ************
+// MergeOperand
+// ************
 
-      ql = 2; // two following bytes
-      return (0x80 | reg | ind | 0x09);
-   }
+// Records the operand text of the instruction at pc in phase 2.
+// Equal bytes of two tails are not enough: symbols like Len = End-Start
+// may change in the rerun. Local symbols get their scope, operands
+// with the location counter '*' are not recorded.
 
-   OperandError(p);
-   return -1;
+void MergeOperand(void)
+{
+   char *s;
+   size_t l = strlen(Scope) + strlen(OpText) + 2;
+
+   free(MrgOpd[pc]);
+   MrgOpd[pc] = NULL;
+   if (strchr(OpText,'*')) return;
+   s = (char *)MallocOrDie(l);
+   snprintf(s,l,"%s %s",strchr(OpText,'.') ? Scope : "",OpText);
+   MrgOpd[pc] = s;
 }
 
+// **********
+// InlineLong
+// **********
+
+// Inlined calls may push short branches out of range. These are
+// assembled as long branches in a rerun. Returns 1, if the branch
+// of the current line is promoted, with Add set it is added.
 
-int ScanPushList(char *p)
+int InlineLong(int Add)
 {
-   int i,l,v;
-   char *Reg;
+   int i;
 
-   if (!strcmpword(p,"ALL")) return 0xff;
-   v = 0;
-   while (*p)
+   for (i=0 ; i < InlLongs ; ++i) if (InlLong[i] == TotalLiNo) return 1;
+   if (!Add) return 0;
+   InlLong = (int *)ReallocOrDie(InlLong,(InlLongs+1)*sizeof(int));
+   InlLong[InlLongs++] = TotalLiNo;
+   InlLongNew = 1;
+   return 1;
+}
+
+// **********
+// InlineCall
+// **********
+
+// Returns 1, if the current JSR, BSR or LBSR was replaced by
+// the body of an INLINE module. In the first run of phase 1
+// the calls of all modules are counted.
+
+int InlineCall(void)
+{
+   int i,k;
+   char Sym[ML];
+   char *p;
+   const char *m = Mat[MneIndex].Mne;
+
+   if (MacLev) return 0;
+   if (StrCaseCmp(m,"JSR") && StrCaseCmp(m,"BSR") && StrCaseCmp(m,"LBSR"))
+      return 0;
+   p = SkipSpace(OpText);
+   if (*p != '_' && !isalpha(*p)) return 0;
+   p = GetSymbol(p,Sym);
+   if (*SkipSpace(p)) return 0;
+   if (!InlPass)
    {
-      for (i=9 ; i >= 0 ; --i) // Scan DP before D
+      if (Phase == 1)
       {
-         Reg = PushList[i].Reg;
-         l = strlen(Reg);
-         if (df) fprintf(df,"push list [%s] <%s>\n",p,Reg);
-         if (!strcmpword(p,Reg)) break;
+         if ((i = LabelIndex(Sym)) < 0)
+         {
+            AddLabel(Sym);
+            i = Labels - 1;
+         }
+         ++lab[i].Calls;
       }
-      if (i < 0) OperandError(p);
-      v |= PushList[i].Val;
-      p = SkipSpace(p+l);
-      if (*p != ',' && *p != 0) OperandError(p);
-      if (*p == ',') ++p;
-      p = SkipSpace(p);
+      return 0;
    }
-   return v;
+   for (k=0 ; k < Inlines ; ++k)
+      if (!Inl[k].Bad && !StrCmp(Sym,Inl[k].Name)) break;
+   if (k == Inlines) return 0;
+   if (Phase == 2) ++Inlined;
+   // local labels stay local inside a module and become unique
+   // global labels outside, e.g. .pos -> .pos_GetA1 or pos_GetA1
+
+   strcpy(MacArgs,Scope[0] ? "." : "");
+   ArgPtr[0] = 0;
+   ArgPtr[1] = strlen(MacArgs) + 1;
+   snprintf(MacArgs+ArgPtr[1],LineMax-ArgPtr[1],"_%s%d",Inl[k].Name,++Inl[k].Count);
+   ++MacLev;
+   ++StatMacros;
+   MacPtr[MacLev] = Inl[k].Body;
+   PrintLine();
+   return 1;
 }
 
+// ******
+// EndSub
+// ******
 
-char *GenerateCode(char *p)
+char *EndSub(char *p)
 {
-   int ibi = 0; // instruction byte index
-   int i,l,v,rd;
-   int r1,r2,qc,XIM;
-   char *q;
-   char *rop;   // rest of operand
-   char p1,p2;  // post increment
-
-   // initialize
-
-   v   = UNDEF;
-   pb  = -1;
-   ql  =  0;
-
-   p = SkipSpace(p);
-
-   if (pc < 0)
+   if (InlCur >= 0) EndInline();
+   if (Phase == 2 && Modules && Mod[Modules-1].End < 0)
+      Mod[Modules-1].End = pc;
+   if (Phase == 2 && ListOn)
    {
-      ErrorLine(p);
-      ErrorMsg("Undefined program counter (PC)\n");
-      exit(1);
+      PrintPC();
+      p = ListSizeInfo(p);
    }
+   if (PlcCur)
+   {
+      PlcNext[PlcCur] = pc;
+      pc = PlcSave;
+      PlcCur = 0;
+   }
+   Scope[0] = 0;
+   ModuleStart = 0;
+   return p;
+}
 
-   // immediate data to memory
+// ***********
+// PoolLiteral
+// ***********
 
-   XIM = (Mat[MneIndex].Mne[1] == 'I' && Mat[MneIndex].Mne[2] == 'M');
-   if (XIM)
+// Returns 1 for byte data made of strings and numbers only. The bytes
+// of other lines may change, when pooling moves the labels they use,
+// so they are neither pooled nor used as pool.
+
+int PoolLiteral(const char *p)
+{
+   char q;
+
+   while (isspace((unsigned char)*p)) ++p;
+   while (*p && *p != ';')
    {
-      if (*p == '#') ++p;
-      else
+      if (*p == '"' || *p == '\'') // string
       {
-         ErrorLine(p);
-         ErrorMsg("Immediate operand must start with '#'\n");
-         exit(1);
+         for (q=*p++ ; *p && *p != q ; ++p) if (*p == '\\' && p[1]) ++p;
+         if (*p) ++p;
       }
-      p   = EvalOperand(p,&v,0);
-
-      // make pseudo 16 bit opcode with embedded immediate value
-
-      XIM = ((Mat[MneIndex].Opc[AM_Extended] << 8) | (v & 0xff));
-      ol  = 2;
-      if (*p == ',') ++p;
-      else
+      else if (*p == '$') // hex number
       {
-         ErrorLine(p);
-         ErrorMsg("Immediate value must be followed by comma\n");
-         exit(1);
+         for (++p ; isxdigit((unsigned char)*p) ; ++p) ;
       }
-      v = UNDEF;
-      oc = XIM;
+      else if (isdigit((unsigned char)*p)) // decimal, %binary, C syntax
+      {
+         while (isalnum((unsigned char)*p)) ++p;
+      }
+      else if (CodeStyle == 1 && *p == ' ') break; // comment follows
+      else if (isalpha((unsigned char)*p) || strchr("_.*&@",*p)) return 0;
+      else ++p;
    }
+   return 1;
+}
 
-   // inherent instruction (no operand)
+// ************
+// PoolByteData
+// ************
 
-   if ((oc = Mat[MneIndex].Opc[AM_Inherent]) >= 0)
-   {
-      ol = il = 1 + (oc > 255); // instruction length
-      p += strlen(p) ;          // ignore rest
-   }
+// Byte data lines with a label are recorded in phase 2,
+// if pooling is switched on (POOL ON or -u)
+
+char *PoolByteData(char *p)
+{
+   int a,j;
+   char *q = p;
+   struct PoolStruct *s;
+
+   a = pc;
+   p = ParseByteData(p);
+   if (Phase < 2 || PoolAct || !(PoolOn || PoolAll) || !Label[0]) return p;
+   if (!PoolLiteral(q)) return p; // bytes may depend on addresses
+   j = LabelIndex(Label);
+   if (j < 0 || lab[j].Address != a || Label[0] == '.') return p;
+   Pol = (struct PoolStruct *)ReallocOrDie(Pol,(Pools+1)*sizeof(struct PoolStruct));
+   s = Pol + Pools++;
+   s->Name   = StrNDup(Label,strlen(Label));
+   s->Line   = TotalLiNo;
+   s->LiNo   = LiNo;
+   s->Start  = a;
+   s->Len    = pc - a;
+   s->Target = -1;
+   s->Alias  = -1;
+   return p;
+}
 
-   // check for missing operand
+// ********
+// PoolLine
+// ********
 
-   else if (OpText[0] == 0)
-   {
-      ++ErrNum;
-      ErrorLine(p);
-      ErrorMsg("Missing operand\n");
-      exit(1);
-   }
+// Called in the rerun after pooling. The line of a pooled string
+// is omitted, its label is defined at the line of the shared string.
 
-   // illegal operand conditions
+int PoolLine(void)
+{
+   int i,j,v;
+   char Buf[ML+16];
+   struct PoolStruct *s = Pol + PoolAct[TotalLiNo] - 1;
 
-   else if (OpText[0] == 0x27) // apostrophe
+   if (s->Target >= 0)
    {
-      ErrorLine(p);
-      ErrorMsg("Operand cannot start with apostrophe\n");
-      exit(1);
+      PrintLiNo();
+      if (ListOn && Phase == 2) fprintf(lf,"POOL          %s\n",Line);
+      return 1;
    }
-
-   // register address mode
-
-   else if ((oc = Mat[MneIndex].Opc[AM_Register]) >= 0)
+   for (i=s->Alias ; i >= 0 ; i=Pol[i].Next)
    {
+      snprintf(Buf,sizeof(Buf),"%s = $%x",Pol[i].Name,pc+Pol[i].Offset);
+      DefineLabel(Buf,&v,0);
+      if ((j = LabelIndex(Pol[i].Name)) >= 0) lab[j].Bytes = Pol[i].Len;
+   }
+   Label[0] = 0;
+   return 0;
+}
 
-      // push pull
-
-      if (Mat[MneIndex].Mne[0] == 'P')
-      {
-         ol = 1 + (oc > 255); // instruction length
-         il = ol + 1;
-         pb  = ScanPushList(p);
-         p += strlen(p) ;          // ignore rest
-      }
+// Functions for pseudo ops
 
-      // TFM
+// ###
 
-      else if (!StrnCmp(Mat[MneIndex].Mne,"TFM",3))
-      {
-         p1 = p2 = 0;
-         ol = 1 + (oc > 255); // instruction length
-         il = ol + 1;
-         q = TFMRegister(OpText,&r1);
-         if (*q == '+' || *q == '-') p1 = *q++;
-         if (*q == ',') q++;
-         else
-         {
-            ErrorLine(p);
-            ErrorMsg("Missing comma\n");
-            exit(1);
-         }
-         q = TFMRegister(q     ,&r2);
-         if (*q == '+' || *q == '-') p2 = *q++;
-         pb = (r1 << 4) | r2;
-         p += strlen(p) ;          // ignore rest
-
-               if (p1 == '+' && p2 == '+') oc = 0x1138;
-         else  if (p1 == '-' && p2 == '-') oc = 0x1139;
-         else  if (p1 == '+' && p2 ==  0 ) oc = 0x113a;
-         else  if (p1 ==  0  && p2 == '+') oc = 0x113b;
-         else
-         {
-            ErrorLine(p);
-            ErrorMsg("Illegal increment/decrement combination\n");
-            exit(1);
-         }
-      }
+char *ps_bit5(char *p)   { PrintPC(); return Parsebit5Data(p);}
+char *ps_bits(char *p)   {            return ParseBitData(p); }
+char *ps_bss(char *p)    { PrintPC(); return ParseBSSData(p); }
+char *ps_byte(char *p)   { PrintPC(); return PoolByteData(p); }
+char *ps_case(char *p)   { PrintPC(); return ParseCaseData(p); }
+char *ps_cmap(char *p)   { PrintPC(); return ParseCmapData(p); }
+char *ps_cpu(char *p)    {            return ParseCPUData(p); }
+char *ps_end(char *p)    { PrintLine(); ForcedEnd = 1; return p; }
+char *ps_endsub(char *p) {            return EndSub(p); }
+char *ps_execute(char *p){            return ParseExecute(p); }
+char *ps_fill(char *p)   { PrintPC(); return ParseFillData(p); }
+char *ps_formln(char *p) { FormLn = atoi(p); PrintByteLine(FormLn); return p; }
+char *ps_extern(char *p) { PrintLine(); return ParseExternal(p,0); }
+char *ps_ignore(char *p) { PrintLine(); return p; }
+char *ps_include(char *p){ PrintPC(); return IncludeFile(p); }
+char *ps_import(char *p) { PrintLine(); return ImportSymbols(p); }
+char *ps_intern(char *p) { PrintLine(); return ParseExternal(p,1); }
+char *ps_list(char *p)   { PrintPC(); return ParseListOption(p); }
+char *ps_load(char *p)   { PrintPC(); return ParseLoadData(p); }
+char *ps_long(char *p)   { PrintPC(); return ParseLongData(p); }
+char *ps_maclist(char *p){            return ParseOnOff(p,&MacList); }
+char *ps_real(char *p)   {            return ParseRealData(p); }
+char *ps_size(char *p)   { PrintPC(); return ListSizeInfo(p); }
+char *ps_store(char *p)  {            return ParseStoreData(p); }
+char *ps_pool(char *p)   {            return ParseOnOff(p,&PoolOn); }
+char *ps_place(char *p)  { PrintLine(); return ParsePlace(p); }
+char *ps_pragma(char *p) { PrintLine(); return ParsePragma(p); }
+char *ps_string(char *p) { PrintPC(); return PoolByteData(p); }
+char *ps_subr(char *p)   { PlaceModule(); PrintPC(); return ParseSubroutine(p); }
+char *ps_word(char *p)   { PrintPC(); return ParseWordData(p); }
 
-      // register register
+char *ps_align(char *p)
+{
+   int a,dal,fill;
 
-      else
-      {
-         ol = 1 + (oc > 255); // instruction length
-         il = ol + 1;
-         q = ScanRegister(OpText,&r1);
-         q = ScanRegister(q     ,&r2);
-         if (r1 != 13 && r2 != 13 && ((r1 < 8 && r2 > 7) || (r1 > 7 && r2 < 8)))
-         {
-            ErrorLine(p);
-            ErrorMsg("mixing register of different sizes\n"
-                     "register %-2.2s is %2d bit\n"
-                     "register %-2.2s is %2d bit\n",
-                     RegisterNames[r1],8 + 8 * (r1 < 8),
-                     RegisterNames[r2],8 + 8 * (r2 < 8));
-            exit(1);
-         }
-         pb = (r1 << 4) | r2;
-         p += strlen(p) ;          // ignore rest
-      }
+   dal  = 0;                  // data align = false
+   p = SkipSpace(p);
+   if (*p == '*') ++p;        // PC align
+   if (*p == '&')
+   {
+      dal = 1;                // data align
+      ++p;
    }
+   if (dal) fill = Preset;
+   else     fill = 0x12  ;    // NOP
 
-   // relative address mode
+   p = AlignFill(p,&a,&fill);
 
-   else if ((oc = Mat[MneIndex].Opc[AM_Relative]) >= 0)
+   if (dal)
    {
-      ol = 1 + (oc > 255); // operand length = opcode length
-      ql = 1 + (Mat[MneIndex].Mne[0] == 'L');
-      il = ol + ql;
-      if (OpText[0] == '-') // local backward label
-      {
-         l = strlen(OpText);
-         for (i=0 ; i < l ; ++i)
-         if (OpText[i] != '-') break;
-         if (i == l) v = minlab[l];
-         else
-         {
-            rop = EvalOperand(OpText,&v,0);
-            if (*rop)
-            {
-               ErrorLine(rop);
-               ErrorMsg("Extra text after branch operand\n");
-               exit(1);
-            }
-         }
-      }
-      else if (OpText[0] == '+') // local forward label
-      {
-         l = strlen(OpText);
-         for (i=0 ; i < l ; ++i)
-         if (OpText[i] != '+') break;
-         if (i == l)
-         {
-            v = UNDEF;
-            i = plucnt[l];
-            while (--i >= 0 && plulab[l][i] > pc) v = plulab[l][i];
-         }
-         else EvalOperand(OpText,&v,0);
-      }
-      else EvalOperand(OpText,&v,0);
-      if (v != UNDEF) v  -= (pc + il);
-      if (Phase == 2 && v == UNDEF)
-      {
-         ErrorLine(p);
-         ErrorMsg("Branch to undefined label\n");
-         exit(1);
-      }
+      a = (a - bss % a) % a;
+      if (df) fprintf(df,"Data align %4.4x - %4.4x fill %2.2x\n",bss,bss+a,fill);
+      while (a--) ROM[bss++] = fill;
+   }
+   else
+   {
+      a = (a - pc  % a) % a;
+      if (df) fprintf(df,"Code align %4.4x - %4.4x fill %2.2x\n",pc,pc+a,fill);
+      while (a--) ROM[pc++]  = fill;
+   }
+   PrintPCLine();
+   return p;
+}
 
-      if (Optimize)
-      {
-         // fix short branch to long branch
+// ******
+// ps_org
+// ******
 
-         if (v < -128 && oc >= 0x20 && oc < 0x30)
-         {
-            if (Phase == 1 || (Phase == 2 && ADL[pc] >= 3))
-            {
-               if (oc == 0x20) // BRA
-               {
-                  oc = 0x16;   // LBRA
-                  ol = 1;
-               }
-               else
-               {
-                  oc |= 0x1000; // short branch -> long branch
-                  ol  = 2;
-               }
-               ql = 2;
-               il = ol + ql;
-            }
-         }
+char *ps_org(char *p)
+{
+   int v;
 
-         // optimize long branch to short branch
+   p = ExtractValue(p,&v);
+   if (ObjMode && Rel && Rel != CurRel)
+   {
+      ErrorLine(p);
+      ErrorMsg("ORG to another section\n");
+      Terminate(1);
+   }
+   if (ObjMode && !Rel && v >= 0 && v <= 0xffff) OpenSection("ORG",v);
+   else pc = v;
+   PrintPCLine();
+   return p;
+}
 
-         if (v >= -128 && v < 0 && oc > 0x1020 && oc < 0x1030)
-         {
-            if (Phase == 1 || (Phase == 2 && ADL[pc] == 2))
-            {
-               oc &= 0xff; // long branch -> short branch
-               ol  = 1;
-               ql  = 1;
-               il  = 2;
-               if (Phase == 2)
-               {
-                  optc++;
-                  fprintf(of,"%4s %4.4x   -->   %3s %2.2x:%5d %s\n",
-                  Mat[MneIndex].Mne,v,Mat[MneIndex].Mne+1,v,LiNo,Line);
-                  strcpy(Hint," ; ");
-                  strcat(Hint,Mat[MneIndex].Mne+1);
-               }
-            }
-         }
+// *****
+// SetPC
+// *****
 
-         // optimize LBRA to BRA
+char *SetPC(char *p)
+{
+   p = NeedChar(p,'=');
+   if (p) return ps_org(p+1);
 
-         if (v >= -128 && v < 0 && oc == 0x16)
-         {
-            if (Phase == 1 || (Phase == 2 && ADL[pc] == 2))
-            {
-               oc  = 0x20; // BRA
-               ol  = 1;
-               ql  = 1;
-               il  = 2;
-            }
-         }
-      }
+   ++ErrNum;
+   ErrorMsg("Setting PC with \"* = address\" syntax error\n");
+   Terminate(1);
+}
 
-      if (Phase == 2 && ql == 1 && (v < -128 || v > 127))
-      {
-         ErrorLine(p);
-         ErrorMsg("Short Branch out of range (%d)\n",v);
-         exit(1);
-      }
-      if (df) fprintf(df,"branch %4.4x -> %4.4x : %4.4x\n",pc,v,v-pc-il);
+char *ps_rmb(char *p)
+{
+   int size;
+   p = ExtractValue(p,&size);
+   if (size < 0)
+   {
+      ErrorMsg("Only theoretical physicists are allowed to reserve "
+               "a negative amount of space: %d bytes\n", size);
+      Terminate(1);
+   }
+   PrintPCLine();
+   pc+=size;
+   p += strlen(p);
+   return p;
+}
+
+char *ps_sect(char *p)
+{
+   int v;
+   char *q;
+   char Name[ML];
 
-      if (Optimize)
+   q = StrMatch(p,"LOC=");
+   if (ObjMode) // SECT [name][,LOC=address]
+   {
+      v = -1;
+      if (q)
       {
-         if (Phase == 2 && ql == 2 && v >= -128 && v < 128)
+         EvalOperand(q+4,&v,0);
+         if (v < 0 || v > 0xffff)
          {
-            optc++;
-            fprintf(of,"%4s %4.4x   ***   %3s %2.2x:%5d %s\n",
-               Mat[MneIndex].Mne,v,Mat[MneIndex].Mne+1,v,LiNo,Line);
+            ErrorLine(q);
+            ErrorMsg("Illegal LOC address for SECT\n");
+            Terminate(1);
          }
       }
-      v &= 0xffff;
-      p += strlen(p) ;          // ignore rest
+      q = SkipSpace(p);
+      if (isym(*q) && StrNCaseCmp(q,"LOC=",4)) GetSymbol(q,Name);
+      else strcpy(Name,"code");
+      OpenSection(Name,v);
    }
+   else if (q) q = EvalOperand(q+4,&pc,0);
+   PrintPCLine();
+   return p;
+}
 
-   // immediate address mode
+char *ps_setdp(char *p)
+{
+   p = ExtractValue(p,&DP);
+   if (DP > 255) DP >>= 8;      // alternate DP assignment
+   PrintByteLine(DP);
+   return p;
+}
 
-   else if (*p == '#')
-   {
-      oc = Mat[MneIndex].Opc[AM_Immediate];
-      if (oc < 0)
-      {
-         ++ErrNum;
-         ErrorLine(p);
-         ErrorMsg("Illegal immediate instruction %s %s\n",Mat[MneIndex].Mne,OpText);
-         exit(1);
-      }
-      rop = EvalOperand(OpText+1,&v,0);
-      if (*rop)
-      {
-         ErrorLine(rop);
-         ErrorMsg("Extra text after operand\n");
-         exit(1);
-      }
-      ol = 1 + (oc > 255);
-      ql = RegisterSize(MneIndex);
-      if (oc == 0x118d) ql = 1; // DIVD uses byte operand
-      if (ql == 4 && oc != 0xcd) ql = 2; // only LDQ immediate has 32 bit value
-      il = ol + ql;
-      if (Phase == 2 && v == UNDEF)
+struct PseudoStruct
+{
+   const char *keyword;
+   char *(*foo)(char *);
+};
+
+struct PseudoStruct PseudoTab[] =
+{
+   {"ALIGN"     , &ps_align  },
+   {"BITS"      , &ps_bits   },
+   {"BSS"       , &ps_bss    },
+   {"BYTE"      , &ps_byte   },
+   {"C5TO3"     , &ps_bit5   },
+   {"CASE"      , &ps_case   },
+   {"CMAP"      , &ps_cmap   },
+   {"CPU"       , &ps_cpu    },
+   {"END"       , &ps_end    },
+   {"ENDMOD"    , &ps_endsub }, // alias to ENDSUB
+   {"ENDSUB"    , &ps_endsub },
+   {"EXECUTE"   , &ps_execute},
+   {"EXTERN"    , &ps_extern },
+   {"FCB"       , &ps_byte   },
+   {"FCC"       , &ps_string },
+   {"FDB"       , &ps_word   },
+   {"FILL"      , &ps_fill   },
+   {"FORMLN"    , &ps_formln },
+   {"IMPORTSYM" , &ps_import },
+   {"INCLUDE"   , &ps_include},
+   {"INLINE"    , &ps_inline },
+   {"INTERN"    , &ps_intern },
+   {"LIST"      , &ps_list   },
+   {"LOAD"      , &ps_load   },
+   {"LONG"      , &ps_long   },
+   {"MACLIST"   , &ps_maclist},
+   {"MODULE"    , &ps_subr   }, // alias to SUBROUTINE
+   {"ORG"       , &ps_org    },
+   {"PLACE"     , &ps_place  },
+   {"POOL"      , &ps_pool   },
+   {"PRAGMA"    , &ps_pragma },
+   {"RMB"       , &ps_rmb    },
+   {"REAL"      , &ps_real   },
+   {"SECT"      , &ps_sect   },
+   {"SETDP"     , &ps_setdp  },
+   {"SIZE"      , &ps_size   },
+   {"STORE"     , &ps_store  },
+   {"SUBROUTINE", &ps_subr   },
+   {"TTL"       , &ps_ignore },
+   {"WORD"      , &ps_word   }
+};
+
+#define PSEUDOS (int)(sizeof(PseudoTab) / sizeof(struct PseudoStruct))
+
+char *CheckPseudo(char *p)
+{
+   int i;
+
+   p = SkipSpace(p);
+
+   for (i=0 ; i < PSEUDOS ; ++i)
+   if (!strcmpword(p,PseudoTab[i].keyword))
+   {
+      if (PchLevel) PchPseudo(PseudoTab[i].keyword);
+      p = PseudoTab[i].foo(p+strlen(PseudoTab[i].keyword));
+      if (pc > 0x10000)
       {
+         ErrorMsg("Program counter overflow\n");
          ErrorLine(p);
-         ErrorMsg("Undefined immediate value\n");
-         exit(1);
+         Terminate(1);
       }
-      if (ql == 1 && Phase == 2 && (v < -128 || v > 255))
+      return NULL; // flag for pseudo op processed
+   }
+   return p;
+}
+
+
+void AddLabel(char *p)
+{
+   int i,l;
+
+   if (Labels > MAXLAB -2)
+   {
+      ++ErrNum;
+      ErrorMsg("Too many labels (> %d)\n",MAXLAB);
+      Terminate(1);
+   }
+   l = strlen(p);
+
+   // test for mnemonic
+
+   for (i=0 ; i < DimOp ; ++i)
+   {
+      if (!StrCaseCmp(p,Mat[i].Mne))
       {
-         ErrorLine(p);
-         ErrorMsg("Immediate value out of range (%d)\n",v);
-         exit(1);
+         ErrorMsg("Use of reserved mnemonic <%s> as label or operand\n",p);
+         Terminate(1);
       }
-      if (ql == 2 && Phase == 2 && (v < -32768 || v > 0xffff))
+   }
+
+   // test for pseudos
+
+   for (i=0 ; i < PSEUDOS ; ++i)
+   {
+      if (!StrCaseCmp(p,PseudoTab[i].keyword))
       {
-         ErrorLine(p);
-         ErrorMsg("Immediate value out of range (%d)\n",v);
-         exit(1);
+         ErrorMsg("Use of reserved keyword <%s> as label or operand\n",p);
+         Terminate(1);
       }
-      p += strlen(p) ;          // ignore rest
    }
 
-   // indirect indexed
+   lab[Labels].Address = UNDEF;
+   lab[Labels].Name = (char *)StrNDup(p,l);
+   lab[Labels].Ref = (int *)MallocOrDie(sizeof(int));
+   lab[Labels].Att = (int *)MallocOrDie(sizeof(int));
+   lab[Labels].Ref[0] = LiNo;
+   lab[Labels].Att[0] = 0;
+   Labels++;
+}
 
-   else if (OpText[0] == '[')
+
+void SetInstructionLength(char *p)
+{
+   int i;
+
+   // Store opcode
+
+   if (oc >= 0)
    {
-      l = strlen(OpText);
-      if (OpText[l-1] != ']')
+      if (oc < 256)  Put(pc,oc,p);
+      else
       {
-         ErrorLine(p);
-         ErrorMsg("Missing closing bracket ]\n");
-         exit(1);
+         if (df) fprintf(df,"Put ROM[%4.4x] = %4.4x\n",pc,oc);
+         Put(pc  ,oc >> 8  ,p);
+         Put(pc+1,oc & 0xff,p);
       }
-      oc = Mat[MneIndex].Opc[AM_Indexed];
-      if (oc < 0)
+   }
+
+   // Lock instruction length
+
+   if (pc >= 0 && pc < 0x10000)
+   {
+      if (ADL[pc] != 0 && ADL[pc] != il)
       {
-         ++ErrNum;
+         ErrorMsg("Phase error\n");
          ErrorLine(p);
-         ErrorMsg("Illegal instruction %s %s\n",Mat[MneIndex].Mne,OpText);
-         exit(1);
-      }
-      if (!strchr(OpText+1,',')) // indirect address
-      {
-         p = EvalOperand(OpText+1,&v,0);
-         pb = 0x9f;
-         ql = 2;
-         il = ol + 3;
-      }
-      else
-      {
-         pb = SetPostByte(OpText,&v) | 0x10;
-         ol = 1 + (oc > 255); // opcode length
-         il = ol + 1 + ql;    // opcode + postbyte + address
+         Terminate(1);
       }
+      ADL[pc] = il;
+      for (i=1 ; i < il ; ++i) ADL[pc+i] = -1;
    }
+   if (df) fprintf(df,"lock oc = %4.2x il = %d ol = %d\n",oc,il,ol);
+}
 
-   // register - direct page bit operation
 
-   else if (strchr(p,',') && strchr(p,'.'))
+void Synchronize(void)
+{
+   nops = ADL[pc] - il;
+   if (df) fprintf(df,"oc = %4.2x ol=%d ql=%d il=%d\n",oc,ol,ql,il);
+   if (df && nops) fprintf(df,"Add %d NOP's\n",nops);
+   il = ADL[pc];
+   if (df) fprintf(df,"SYnc lock[%4.4x] = %d\n",pc,LOCK[pc]);
+   if (nops) LOCK[pc] = 0;
+}
+
+
+void CheckSkip(void)
+{
+   int i;
+
+   Skipping = 0;
+   for (i=1 ; i <= IfLevel ; ++i) Skipping |= SkipLine[i];
+}
+
+int CheckCondition(char *p)
+{
+   int r,v,Ifdef,Ifndef,Ifval;
+   r = 0;
+   if (df) fprintf(df,"Check <%s>\n",p);
+   if (*p == '#') ++p; // old syntax #if, #endif, etc.
+   if (!strcmpword(p,"error") && (Phase == 1))
    {
-      if (df) fprintf(df,"Check bit op <%s>\n",p);
-      oc = Mat[MneIndex].Opc[AM_Direct];
-      if (oc < 0)
+      CheckSkip();
+      if (Skipping) return 0;     // Include line in listing
+      ErrorMsg("%s\n",p+6);
+      Terminate(1);
+   }
+   Ifdef  = !strcmpword(p,"ifdef");
+   Ifndef = !strcmpword(p,"ifndef");
+   Ifval  = !strcmpword(p,"if");
+   if (Ifdef || Ifndef || Ifval)
+   {
+      r = 1;
+      IfLevel++;
+      if (IfLevel > 9)
       {
          ++ErrNum;
-         ErrorLine(p);
-         ErrorMsg("Illegal bit operation %s %s\n",Mat[MneIndex].Mne,OpText);
-         exit(1);
+         ErrorMsg("More than 10  IF or IFDEF conditions nested\n");
+         Terminate(1);
       }
-      pb = 0xc0; // invalid
-      if (!StrNCaseCmp(p,"CC.",3))
+      if (Ifdef)
       {
-         pb = 0x00;
-         p += 3;
+         p = EvalOperand(p+6,&v,0);
+         SkipLine[IfLevel] = v == UNDEF;
       }
-      else if (!StrNCaseCmp(p,"A.",2))
+      else if (Ifndef)
       {
-         pb = 0x40;
-         p += 2;
+         p = EvalOperand(p+7,&v,0);
+         SkipLine[IfLevel] = v != UNDEF;
       }
-      else if (!StrNCaseCmp(p,"B.",2))
+      else // if (Ifval)
       {
-         pb = 0x80;
-         p += 2;
+         p = EvalOperand(p+3,&v,0);
+         SkipLine[IfLevel] = v == UNDEF || v == 0;
       }
-      else
+      CheckSkip();
+      if (ListOn && Phase == 2)
       {
-         ++ErrNum;
-         ErrorLine(p);
-         ErrorMsg("Illegal register in bit operation %s %s\n",Mat[MneIndex].Mne,OpText);
-         exit(1);
+         PrintLiNo();
+         if (SkipLine[IfLevel])
+            fprintf(lf,"%4.4x FALSE    %s\n",SkipLine[IfLevel],Line);
+         else
+            fprintf(lf,"0000 TRUE     %s\n",Line);
       }
-      i = *p++ - '0';
-      if (i < 0 || i > 7)
+      if (df) fprintf(df,"%5d %4.4x          %s\n",LiNo,SkipLine[IfLevel],Line);
+   }
+   else if (!strcmpword(p,"else"))
+   {
+      r = 1;
+      SkipLine[IfLevel] = !SkipLine[IfLevel];
+      CheckSkip();
+      PrintLiNo();
+      if (ListOn && Phase == 2) fprintf(lf,"              %s\n",Line);
+   }
+   if (!strcmpword(p,"endif"))
+   {
+   if (df) fprintf(df,"inside Check endif\n");
+      r = 1;
+      IfLevel--;
+      PrintLiNo();
+      if (ListOn && Phase == 2) fprintf(lf,"              %s\n",Line);
+      if (IfLevel < 0)
       {
          ++ErrNum;
-         ErrorLine(p);
-         ErrorMsg("Illegal bit# %d\n",i);
-         exit(1);
+         ErrorMsg("endif without if\n");
+         Terminate(1);
       }
-      pb |= i; // add target bit
-      p = strchr(p,','); // skip after comma
-      q = strrchr(p,'.'); // search bit field
-      if (!p || !q)
-      {
+      CheckSkip();
+      if (df) fprintf(df,"ENDIF SkipLevel[%d]=%d\n",IfLevel,SkipLine[IfLevel]);
+   }
+   return r;
+}
+
+
+int RegisterSize(int n)
+{
+   char r;
+
+   if (!StrNCaseCmp(Mat[n].Mne,"LDMD",4)) return 1;
+   if (!StrNCaseCmp(Mat[n].Mne,"CWAI",4)) return 1;
+
+   r = Mat[n].Mne[strlen(Mat[n].Mne)-1];
+
+   if (r == 'A' || r == 'B' || r == 'C' || r == 'E' || r == 'F') return 1;
+   if (r == 'D' || r == 'X' || r == 'Y' || r == 'W') return 2;
+   if (r == 'S' || r == 'U') return 2;
+   if (r == 'Q') return 4;
+
+   ErrorMsg("Illegal register name [%c]\n",r);
+   Terminate(1);
+}
+
+
+char *ScanRegister(char *p, int *v)
+{
+   int i;
+   char *q;
+
+   for (i=15 ; i >= 0 ; --i)
+   {
+      if (!StrNCaseCmp(RegisterNames[i],p,strlen(RegisterNames[i]))) break;
+   }
+   if (i < 0)
+   {
+      ErrorLine(p);
+      ErrorMsg("Unknown register name or wrong CPU set\n");
+      Terminate(1);
+   }
+   *v = i;
+   q = p + strlen(RegisterNames[i]);
+   q = SkipSpace(q);
+   if (*q == ',') ++q;
+   return q;
+}
+
+
+char *TFMRegister(char *p, int *v)
+{
+   int i;
+
+   for (i=4 ; i >= 0 ; --i)
+   {
+      if (RegisterNames[i][0] == toupper(*p)) break;
+   }
+   if (i < 0)
+   {
+      ErrorLine(p);
+      ErrorMsg("Illegal register name for TFM or wrong CPU set\n");
+      Terminate(1);
+   }
+   *v = i;
+   return p+1;
+}
+
+
+void OperandError(char *p)
+{
+   ++ErrNum;
+   ErrorLine(p);
+   ErrorMsg("Syntax error in operand\n");
+   Terminate(1);
+}
+
+
+int PostIndex(int reg,char *p)
+{
+   switch(*p)
+   {
+      case 'x':
+      case 'X': if (reg < 0) reg = 0x00; else OperandError(p); break;
+      case 'y':
+      case 'Y': if (reg < 0) reg = 0x20; else OperandError(p); break;
+      case 'u':
+      case 'U': if (reg < 0) reg = 0x40; else OperandError(p); break;
+      case 's':
+      case 'S': if (reg < 0) reg = 0x60; else OperandError(p); break;
+      default : OperandError(p);
+   }
+   return reg;
+}
+
+
+// ************
+// PostIndexReg
+// ************
+
+int PostIndexReg(int reg,char *p)
+{
+   reg = PostIndex(reg,p);
+   if (*(++p)) OperandError(p);
+   return reg;
+}
+
+/* special postbyte codes for W register operand
+
+   8F     ,W
+   90    [,W]
+   AF   ea,W
+   B0  [ea,W]
+   CF     ,W++
+   D0    [,W++]
+   EF   ,--W
+   F0  [,--W]
+*/
+
+// **********
+// PostIndexW
+// **********
+
+int PostIndexW(int reg,char *p)
+{
+   if (df) fprintf(df,"PostIndexW [%c]\n",*p);
+   if (*p == 'w' || *p == 'W') return 0xf;
+   return PostIndex(reg,p);
+}
+
+// ***********
+// SetPostByte
+// ***********
+
+int SetPostByte(char *p, int *v)
+{
+   int inc,dec,reg,amo,off,ind,opl;
+
+   ind =  0;  // indirect bit
+   inc =  0;  // auto increment counter
+   dec =  0;  // auto decrement counter
+   reg = -1;  // index  register
+   amo = -1;  // address mode bits
+   off =  0;  // constant offset
+   opl = strlen(p);
+   Rel =  0;  // relocation of offset
+
+   // indirect
+
+   if (df) fprintf(df,"indirect check %c %c\n",p[0],p[opl-1]);
+   if (p[0] == '[' && p[opl-1] == ']')
+   {
+      ind = 0x10;
+      p[opl-1] = 0;
+      opl-=2;
+      ++p;
+      if (df) fprintf(df,"is indirect <%s>\n",p);
+   }
+
+   if (df && strlen(p) > 2)
+      fprintf(df,"Check R,R: %c%c%c\n",toupper(p[0]),p[1],toupper(p[2]));
+
+   // A,R
+
+   if (toupper(p[0]) == 'A' && p[1] == ',')
+   {
+      reg = PostIndexReg(reg,p+2);
+      ql = 0;
+      return (0x80 | reg | ind | 0x06);
+   }
+
+   // B,R
+
+   if (toupper(p[0]) == 'B' && p[1] == ',')
+   {
+      reg = PostIndexReg(reg,p+2);
+      ql = 0;
+      return (0x80 | reg | ind | 0x05);
+   }
+
+   // D,R
+
+   if (toupper(p[0]) == 'D' && p[1] == ',')
+   {
+      reg = PostIndexReg(reg,p+2);
+      ql = 0;
+      return (0x80 | reg | ind | 0x0b);
+   }
+
+   // E,R
+
+   if (toupper(p[0]) == 'E' && p[1] == ',')
+   {
+      reg = PostIndexReg(reg,p+2);
+      ql = 0;
+      return (0x80 | reg | ind | 0x07);
+   }
+
+   // F,R
+
+   if (toupper(p[0]) == 'F' && p[1] == ',')
+   {
+      reg = PostIndexReg(reg,p+2);
+      ql = 0;
+      return (0x80 | reg | ind | 0x0a);
+   }
+
+   // W,R
+
+   if (toupper(p[0]) == 'W' && p[1] == ',')
+   {
+      reg = PostIndexReg(reg,p+2);
+      ql = 0;
+      return (0x80 | reg | ind | 0x0e);
+   }
+
+   // PC relative
+
+   if (df) fprintf(df,"check PC relative %d [%s],<%s>\n",opl,p,p+opl-3);
+   if ((opl > 4 && StrNCaseCmp(p+opl-4,",PCR",4) == 0) ||
+       (opl > 3 && StrNCaseCmp(p+opl-3,",PC" ,3) == 0))
+   {
+      if (df) fprintf(df,"check PC relative %s\n",p);
+      p = EvalOperand(p,&off,0);
+      off -= pc+3;
+      if (ForcedMode < 0 || (Rel == CurRel && off >= -128 && off < 128 && ROM[pc] != 0x8d))
+      {
+         ql = 1;
+         *v = off;
+         return (0x8c | ind);
+      }
+      else
+      {
+         ql = 2;
+         *v = off-1;
+         return (0x8d | ind);
+      }
+   }
+
+   // offset
+
+   if (*p != ',')
+   {
+      p = EvalOperand(p,&off,0);
+   }
+
+   // zero offset
+
+   if (*p == ',' && off == 0 && !Rel)
+   {
+      while (*(++p) == '-') ++dec;
+      reg = PostIndexW(reg,p);
+      if (df) fprintf(df,"zero offset reg=%2.2x\n",reg);
+      while (*(++p) == '+') ++inc;
+      if (df) fprintf(df, "Pre - (%d) and Post + (%d)\n",dec,inc);
+      if (reg <  0) OperandError(p);
+           if (inc == 1 && dec == 0) amo = 0x00;
+      else if (inc == 2 && dec == 0) amo = 0x01;
+      else if (inc == 0 && dec == 1) amo = 0x02;
+      else if (inc == 0 && dec == 2) amo = 0x03;
+      else if (inc == 0 && dec == 0) amo = 0x04;
+      else OperandError(p);
+      ql = 0; // no address
+      if (reg == 0xf) // W register
+      {
+              if (amo == 4) reg = 0x8f; // ,W
+         else if (amo == 1) reg = 0xcf; // ,W++
+         else if (amo == 3) reg = 0xef; // ,--W
+         else OperandError(p);
+         if (ind) reg +=1;
+         if (df) fprintf(df,"W pb = %2.2x ind = %2.2x\n",reg,ind);
+         return reg;
+      }
+      if (*p) OperandError(p);
+      return (0x80 | reg | ind | amo);
+   }
+
+   // constant offset
+
+   if (*p == ',')
+   {
+      if (df) fprintf(df,"constant off = %x\n",off);
+      *v = off;
+      reg = PostIndexW(reg,++p);
+
+      if (reg == 0xf) // W register
+      {
+         ql = 2;
+         if (ind) return 0xb0;
+         else     return 0xaf;
+      }
+                                             // 5 bit offset
+      if (ForcedMode <= 0 && !Rel && off >= -16 && off < 16 && ind == 0)
+      {
+         ql = 0; // no following bytes
+         return (reg | (off & 0x1f));
+      }                                      // 8 bit offset
+
+      if (ForcedMode <  0 || (!Rel && off >= -128 && off < 128))
+      {
+         ql = 1; // one following byte
+         return (0x80 | reg | ind | 0x08);
+      }
+
+      // 16 bit offset
+
+      ql = 2; // two following bytes
+      return (0x80 | reg | ind | 0x09);
+   }
+
+   OperandError(p);
+   return -1;
+}
+
+
+// **********
+// RelIndexed
+// **********
+
+// relocation kind of the offset of an indexed operand with post byte
+// pb after SetPostByte, the relocation is stored in *rt
+
+int RelIndexed(int pb, int *rt)
+{
+   *rt = Rel;
+   if ((pb & 0xee) == 0x8c) return Rel != CurRel ? 'R' : 0; // PC relative
+   return Rel ? 'W' : 0;
+}
+
+
+int ScanPushList(char *p)
+{
+   int i,l,v;
+   char *Reg;
+
+   if (!strcmpword(p,"ALL")) return 0xff;
+   v = 0;
+   while (*p)
+   {
+      for (i=9 ; i >= 0 ; --i) // Scan DP before D
+      {
+         Reg = PushList[i].Reg;
+         l = strlen(Reg);
+         if (df) fprintf(df,"push list [%s] <%s>\n",p,Reg);
+         if (!strcmpword(p,Reg)) break;
+      }
+      if (i < 0) OperandError(p);
+      v |= PushList[i].Val;
+      p = SkipSpace(p+l);
+      if (*p != ',' && *p != 0) OperandError(p);
+      if (*p == ',') ++p;
+      p = SkipSpace(p);
+   }
+   return v;
+}
+
+
+char *GenerateCode(char *p)
+{
+   int ibi = 0; // instruction byte index
+   int i,l,v,rd;
+   int r1,r2,qc,XIM;
+   int rk = 0;  // relocation kind of the operand (--obj)
+   int rt = 0;  // relocation of the operand
+   int lb = 0;  // short branch promoted after inlining
+   char *q;
+   char *rop;   // rest of operand
+   char p1,p2;  // post increment
+
+   // initialize
+
+   v   = UNDEF;
+   pb  = -1;
+   ql  =  0;
+
+   p = SkipSpace(p);
+
+   if (pc < 0)
+   {
+      ErrorLine(p);
+      ErrorMsg("Undefined program counter (PC)\n");
+      Terminate(1);
+   }
+
+   // immediate data to memory
+
+   XIM = (Mat[MneIndex].Mne[1] == 'I' && Mat[MneIndex].Mne[2] == 'M');
+   if (XIM)
+   {
+      if (*p == '#') ++p;
+      else
+      {
+         ErrorLine(p);
+         ErrorMsg("Immediate operand must start with '#'\n");
+         Terminate(1);
+      }
+      p   = EvalOperand(p,&v,0);
+      if (Rel) AddFix(pc+2,'W',Rel,v,1,p);
+
+      // make pseudo 16 bit opcode with embedded immediate value
+
+      XIM = ((Mat[MneIndex].Opc[AM_Extended] << 8) | (v & 0xff));
+      ol  = 2;
+      if (*p == ',') ++p;
+      else
+      {
+         ErrorLine(p);
+         ErrorMsg("Immediate value must be followed by comma\n");
+         Terminate(1);
+      }
+      v = UNDEF;
+      oc = XIM;
+   }
+
+   // inherent instruction (no operand)
+
+   if ((oc = Mat[MneIndex].Opc[AM_Inherent]) >= 0)
+   {
+      ol = il = 1 + (oc > 255); // instruction length
+      p += strlen(p) ;          // ignore rest
+   }
+
+   // check for missing operand
+
+   else if (OpText[0] == 0)
+   {
+      ++ErrNum;
+      ErrorLine(p);
+      ErrorMsg("Missing operand\n");
+      Terminate(1);
+   }
+
+   // illegal operand conditions
+
+   else if (OpText[0] == 0x27) // apostrophe
+   {
+      ErrorLine(p);
+      ErrorMsg("Operand cannot start with apostrophe\n");
+      Terminate(1);
+   }
+
+   // register address mode
+
+   else if ((oc = Mat[MneIndex].Opc[AM_Register]) >= 0)
+   {
+
+      // push pull
+
+      if (Mat[MneIndex].Mne[0] == 'P')
+      {
+         ol = 1 + (oc > 255); // instruction length
+         il = ol + 1;
+         pb  = ScanPushList(p);
+         p += strlen(p) ;          // ignore rest
+      }
+
+      // TFM
+
+      else if (!StrnCmp(Mat[MneIndex].Mne,"TFM",3))
+      {
+         p1 = p2 = 0;
+         ol = 1 + (oc > 255); // instruction length
+         il = ol + 1;
+         q = TFMRegister(OpText,&r1);
+         if (*q == '+' || *q == '-') p1 = *q++;
+         if (*q == ',') q++;
+         else
+         {
+            ErrorLine(p);
+            ErrorMsg("Missing comma\n");
+            Terminate(1);
+         }
+         q = TFMRegister(q     ,&r2);
+         if (*q == '+' || *q == '-') p2 = *q++;
+         pb = (r1 << 4) | r2;
+         p += strlen(p) ;          // ignore rest
+
+               if (p1 == '+' && p2 == '+') oc = 0x1138;
+         else  if (p1 == '-' && p2 == '-') oc = 0x1139;
+         else  if (p1 == '+' && p2 ==  0 ) oc = 0x113a;
+         else  if (p1 ==  0  && p2 == '+') oc = 0x113b;
+         else
+         {
+            ErrorLine(p);
+            ErrorMsg("Illegal increment/decrement combination\n");
+            Terminate(1);
+         }
+      }
+
+      // register register
+
+      else
+      {
+         ol = 1 + (oc > 255); // instruction length
+         il = ol + 1;
+         q = ScanRegister(OpText,&r1);
+         q = ScanRegister(q     ,&r2);
+         if (r1 != 13 && r2 != 13 && ((r1 < 8 && r2 > 7) || (r1 > 7 && r2 < 8)))
+         {
+            ErrorLine(p);
+            ErrorMsg("mixing register of different sizes\n"
+                     "register %-2.2s is %2d bit\n"
+                     "register %-2.2s is %2d bit\n",
+                     RegisterNames[r1],8 + 8 * (r1 < 8),
+                     RegisterNames[r2],8 + 8 * (r2 < 8));
+            Terminate(1);
+         }
+         pb = (r1 << 4) | r2;
+         p += strlen(p) ;          // ignore rest
+      }
+   }
+
+   // relative address mode
+
+   else if ((oc = Mat[MneIndex].Opc[AM_Relative]) >= 0)
+   {
+      ol = 1 + (oc > 255); // operand length = opcode length
+      ql = 1 + (Mat[MneIndex].Mne[0] == 'L');
+      il = ol + ql;
+      lb = ql == 1 && InlPass && InlineLong(0);
+      if (lb) // short branch out of range after inlining
+      {
+         if (oc == 0x20)      oc  = 0x16;   // BRA -> LBRA
+         else if (oc == 0x8d) oc  = 0x17;   // BSR -> LBSR
+         else                 oc |= 0x1000; // short branch -> long branch
+         ol = 1 + (oc > 255);
+         ql = 2;
+         il = ol + ql;
+         if (Phase == 2)
+            snprintf(Hint,sizeof(Hint)," ; L%s",Mat[MneIndex].Mne);
+      }
+      Rel = CurRel; // local labels are in the same section
+      if (OpText[0] == '-') // local backward label
+      {
+         l = strlen(OpText);
+         for (i=0 ; i < l ; ++i)
+         if (OpText[i] != '-') break;
+         if (i == l) v = minlab[l];
+         else
+         {
+            rop = EvalOperand(OpText,&v,0);
+            if (*rop)
+            {
+               ErrorLine(rop);
+               ErrorMsg("Extra text after branch operand\n");
+               Terminate(1);
+            }
+         }
+      }
+      else if (OpText[0] == '+') // local forward label
+      {
+         l = strlen(OpText);
+         for (i=0 ; i < l ; ++i)
+         if (OpText[i] != '+') break;
+         if (i == l)
+         {
+            v = UNDEF;
+            i = plucnt[l];
+            while (--i >= 0 && plulab[l][i] > pc) v = plulab[l][i];
+         }
+         else EvalOperand(OpText,&v,0);
+      }
+      else EvalOperand(OpText,&v,0);
+      if (v != UNDEF) v  -= (pc + il);
+      if (Rel != CurRel) // distance to another section
+      {
+         rk = 'R';
+         rt = Rel;
+      }
+      if (Phase == 2 && v == UNDEF)
+      {
+         ErrorLine(p);
+         ErrorMsg("Branch to undefined label\n");
+         Terminate(1);
+      }
+
+      if (Optimize && !rk && !lb)
+      {
+         // fix short branch to long branch
+
+         if (v < -128 && oc >= 0x20 && oc < 0x30)
+         {
+            if (Phase == 1 || (Phase == 2 && ADL[pc] >= 3))
+            {
+               if (oc == 0x20) // BRA
+               {
+                  oc = 0x16;   // LBRA
+                  ol = 1;
+               }
+               else
+               {
+                  oc |= 0x1000; // short branch -> long branch
+                  ol  = 2;
+               }
+               ql = 2;
+               il = ol + ql;
+            }
+         }
+
+         // optimize long branch to short branch
+
+         if (v >= -128 && v < 0 && oc > 0x1020 && oc < 0x1030)
+         {
+            if (Phase == 1 || (Phase == 2 && ADL[pc] == 2))
+            {
+               oc &= 0xff; // long branch -> short branch
+               ol  = 1;
+               ql  = 1;
+               il  = 2;
+               if (Phase == 2)
+               {
+                  optc++;
+                  fprintf(of,"%4s %4.4x   -->   %3s %2.2x:%5d %s\n",
+                  Mat[MneIndex].Mne,v,Mat[MneIndex].Mne+1,v,LiNo,Line);
+                  strcpy(Hint," ; ");
+                  strcat(Hint,Mat[MneIndex].Mne+1);
+               }
+            }
+         }
+
+         // optimize LBRA to BRA
+
+         if (v >= -128 && v < 0 && oc == 0x16)
+         {
+            if (Phase == 1 || (Phase == 2 && ADL[pc] == 2))
+            {
+               oc  = 0x20; // BRA
+               ol  = 1;
+               ql  = 1;
+               il  = 2;
+            }
+         }
+      }
+
+      if (Phase == 2 && ql == 1 && !rk && (v < -128 || v > 127))
+      {
+         if (InlPass && InlineLong(1)) v = 0; // long branch in the rerun
+         else
+         {
+            ErrorLine(p);
+            ErrorMsg("Short Branch out of range (%d)\n",v);
+            Terminate(1);
+         }
+      }
+      if (df) fprintf(df,"branch %4.4x -> %4.4x : %4.4x\n",pc,v,v-pc-il);
+
+      if (Optimize && !rk)
+      {
+         if (Phase == 2 && ql == 2 && v >= -128 && v < 128)
+         {
+            optc++;
+            fprintf(of,"%4s %4.4x   ***   %3s %2.2x:%5d %s\n",
+               Mat[MneIndex].Mne,v,Mat[MneIndex].Mne+1,v,LiNo,Line);
+         }
+      }
+      v &= 0xffff;
+      p += strlen(p) ;          // ignore rest
+   }
+
+   // immediate address mode
+
+   else if (*p == '#')
+   {
+      oc = Mat[MneIndex].Opc[AM_Immediate];
+      if (oc < 0)
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal immediate instruction %s %s\n",Mat[MneIndex].Mne,OpText);
+         Terminate(1);
+      }
+      rop = EvalOperand(OpText+1,&v,0);
+      if (*rop)
+      {
+         ErrorLine(rop);
+         ErrorMsg("Extra text after operand\n");
+         Terminate(1);
+      }
+      if (Rel)
+      {
+         rk = 'W';
+         rt = Rel;
+      }
+      ol = 1 + (oc > 255);
+      ql = RegisterSize(MneIndex);
+      if (oc == 0x118d) ql = 1; // DIVD uses byte operand
+      if (ql == 4 && oc != 0xcd) ql = 2; // only LDQ immediate has 32 bit value
+      il = ol + ql;
+      if (Phase == 2 && v == UNDEF)
+      {
+         ErrorLine(p);
+         ErrorMsg("Undefined immediate value\n");
+         Terminate(1);
+      }
+      if (ql == 1 && Phase == 2 && (v < -128 || v > 255))
+      {
+         ErrorLine(p);
+         ErrorMsg("Immediate value out of range (%d)\n",v);
+         Terminate(1);
+      }
+      if (ql == 2 && Phase == 2 && (v < -32768 || v > 0xffff))
+      {
+         ErrorLine(p);
+         ErrorMsg("Immediate value out of range (%d)\n",v);
+         Terminate(1);
+      }
+      p += strlen(p) ;          // ignore rest
+   }
+
+   // indirect indexed
+
+   else if (OpText[0] == '[')
+   {
+      l = strlen(OpText);
+      if (OpText[l-1] != ']')
+      {
+         ErrorLine(p);
+         ErrorMsg("Missing closing bracket ]\n");
+         Terminate(1);
+      }
+      oc = Mat[MneIndex].Opc[AM_Indexed];
+      if (oc < 0)
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal instruction %s %s\n",Mat[MneIndex].Mne,OpText);
+         Terminate(1);
+      }
+      if (!strchr(OpText+1,',')) // indirect address
+      {
+         p = EvalOperand(OpText+1,&v,0);
+         if (Rel)
+         {
+            rk = 'W';
+            rt = Rel;
+         }
+         pb = 0x9f;
+         ql = 2;
+         il = ol + 3;
+      }
+      else
+      {
+         pb = SetPostByte(OpText,&v) | 0x10;
+         rk = RelIndexed(pb,&rt);
+         ol = 1 + (oc > 255); // opcode length
+         il = ol + 1 + ql;    // opcode + postbyte + address
+      }
+   }
+
+   // register - direct page bit operation
+
+   else if (strchr(p,',') && strchr(p,'.'))
+   {
+      if (df) fprintf(df,"Check bit op <%s>\n",p);
+      oc = Mat[MneIndex].Opc[AM_Direct];
+      if (oc < 0)
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal bit operation %s %s\n",Mat[MneIndex].Mne,OpText);
+         Terminate(1);
+      }
+      pb = 0xc0; // invalid
+      if (!StrNCaseCmp(p,"CC.",3))
+      {
+         pb = 0x00;
+         p += 3;
+      }
+      else if (!StrNCaseCmp(p,"A.",2))
+      {
+         pb = 0x40;
+         p += 2;
+      }
+      else if (!StrNCaseCmp(p,"B.",2))
+      {
+         pb = 0x80;
+         p += 2;
+      }
+      else
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal register in bit operation %s %s\n",Mat[MneIndex].Mne,OpText);
+         Terminate(1);
+      }
+      i = *p++ - '0';
+      if (i < 0 || i > 7)
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal bit# %d\n",i);
+         Terminate(1);
+      }
+      pb |= i; // add target bit
+      p = strchr(p,','); // skip after comma
+      q = strrchr(p,'.'); // search bit field
+      if (!p || !q)
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal syntax in bit operand\n");
+         Terminate(1);
+      }
+      *q = 0; // separate bit number from address
+      p = EvalOperand(p+1,&v,0);
+      if (Rel)
+      {
+         rk = 'W';
+         rt = Rel;
+      }
+      if (v != UNDEF && (v < 0 || v > 255))
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal address %d\n",v);
+         Terminate(1);
+      }
+      i = q[1] - '0';
+      if (i < 0 || i > 7)
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal bit# %d\n",i);
+         Terminate(1);
+      }
+      pb |= (i<<3); // add source bit
+      ol = 2;
+      ql = 1;
+      il = 4;
+   }
+
+   // indexed address mode
+
+   else if (strchr(p,','))
+   {
+      if (XIM) oc = XIM & 0xefff; // extended -> indexed
+      else oc = Mat[MneIndex].Opc[AM_Indexed];
+      if (df) fprintf(df,"indexed am oc = %4.4x\n",oc);
+      if (oc < 0)
+      {
+         ++ErrNum;
+         ErrorLine(p);
+         ErrorMsg("Illegal indexed instruction %s %s\n",Mat[MneIndex].Mne,OpText);
+         Terminate(1);
+      }
+      pb = SetPostByte(p,&v);
+      rk = RelIndexed(pb,&rt);
+
+      if (XIM) ol = 2;
+      else     ol = 1 + (oc > 255); // opcode length
+      il = ol + 1 + ql;    // opcode + postbyte + address
+   }
+
+   // all other
+
+   else
+   {
+      p = EvalOperand(p,&v,0);
+      if (Rel)
+      {
+         rk = 'W';
+         rt = Rel;
+      }
+
+      if (XIM)
+      {
+         ol = 2;
+         if (v > 255 || rk)
+         {
+            oc = XIM;
+            ql = 2;
+         }
+         else
+         {
+            oc = XIM & 0xfff; // extended -> direct
+            ql = 1;
+         }
+         il = ol + ql;
+         if (df) fprintf(df,"XIM oc = %4.4x  v = %4.4x il = %d\n",oc,v,il);
+      }
+
+      if (Phase == 2) // opcode and instruction length is set in phase 1
+      {
+         if (XIM)
+         {
+            oc = (ROM[pc] << 8) + ROM[pc+1];
+            il = ADL[pc];
+            ql = il - ol;
+            if (df) fprintf(df,"ROM oc = %4.4x  v = %4.4x\n",oc,v);
+         }
+         else
+         {
+            oc = ROM[pc];
+            if (df) fprintf(df,"ROM oc = %4.4x  v = %4.4x\n",oc,v);
+            ol = 1 + (oc == 0x10 || oc == 0x11);
+            if (ol == 2) oc = (oc << 8) | ROM[pc+1];
+            il = ADL[pc];
+            ql = il - ol;
+            if (ForcedMode < 0 || ql == 1) v &= 0xff;
+         }
+      }
+      else
+      {
+         // extended address mode
+
+         if (!XIM) oc = Mat[MneIndex].Opc[AM_Extended];
+         if (oc >= 0)
+         {
+            // assume extended mode
+
+            ol = 1 + (oc > 255); // opcode  length
+            ql = 2;              // operand length
+            il = ol + 2;         // instruction length
+
+            // direct address mode
+
+            if (ForcedMode <= 0) // not forced extended
+            {
+               if (XIM) qc = oc & 0xfff;
+               else     qc = Mat[MneIndex].Opc[AM_Direct];
+
+               if (qc >= 0 && (ForcedMode < 0 ||
+                  (!rk && v != UNDEF && (v >> 8) == DP)))
+               {
+                  oc = qc;
+                  v &= 0xff;
+                  ql = 1;
+                  il = ol + 1;
+      if (XIM && df) fprintf(df,"XIM3 oc = %4.4x  v = %4.4x il = %d\n",oc,v,il);
+               }
+            }
+         }
+         else
+         {
+            ++ErrNum;
+            ErrorLine(p);
+            ErrorMsg("Illegal instruction %s %s\n",Mat[MneIndex].Mne,OpText);
+            Terminate(1);
+         }
+      }
+
+      if (XIM && df) fprintf(df,"XIM2 oc = %4.4x  v = %4.4x il = %d\n",oc,v,il);
+      if (Optimize && rt == CurRel)
+      {
+          // optimise JSR to BSR
+
+          rd = v - pc - 3;
+          if (Phase == 2 && oc == 0xbd && rd >= -128 && rd < 128)
+          {
+             optc++;
+             fprintf(of," JSR %4.4x   ***   BSR %2.2x:%5d %s\n",
+                     v,rd&0xff,LiNo,Line);
+          }
+
+         // optimize JMP to BRA
+
+         rd = v - pc - 3;
+         if (rd >= -128 && rd < 0)
+         {
+            if (Phase == 1 && oc == 0x7e)
+            {
+               oc = 0x20; // BRA
+               ol =  1;
+               ql =  1;
+               il =  2;
+               v  = rd;
+               rk =  0;
+            }
+            if (Phase == 2 && oc == 0x20)
+            {
+               optc++;
+               fprintf(of," JMP %4.4x   -->   BRA %2.2x:%5d %s\n",
+                       v,rd&0xff,LiNo,Line);
+               strcpy(Hint," ; BRA");
+               ol =  1;
+               ql =  1;
+               il =  2;
+               v  = rd;
+               rk =  0;
+            }
+         }
+      }
+   }
+
+   if (Phase == 1) SetInstructionLength(p);
+
+   if (Phase == 2)
+   {
+      Synchronize();
+      if (v == UNDEF && ql > 0)
+      {
+         ErrorLine(p);
+         ErrorMsg("Use of an undefined label\n");
+         Terminate(1);
+      }
+
+      // insert binary code
+
+      if (df) fprintf(df,"PUT OC = %4.4x\n",oc);
+      if (oc > 255) // two byte opcode
+      {
+         Put(pc,oc >> 8,p);
+         Put(pc+1,oc,p);
+         ibi = 2;
+      }
+      else
+      {
+         Put(pc,oc,p);
+         ibi = 1;
+      }
+
+      if (pb >= 0) // post byte
+      {
+         Put(pc+ibi++,pb,p);
+      }
+
+      if (rk) v = AddFix(pc+ibi,rk,rt,v,ql,p); // relocated by the linker
+
+      if (ql == 4) // 32 bit value
+      {
+         Put(pc+ibi++,v >> 24,p);
+         Put(pc+ibi++,v >> 16,p);
+         Put(pc+ibi++,v >>  8,p);
+         Put(pc+ibi++,v      ,p);;
+      }
+
+      if (ql == 2) // 16 bit value
+      {
+         if (v > 0xffff || v < -32768)
+         {
+            ErrorLine(p);
+            ErrorMsg("16 bit address/value out of range\n");
+            Terminate(1);
+         }
+         Put(pc+ibi++,v >> 8,p);
+         Put(pc+ibi++,v     ,p);
+      }
+
+      if (ql == 1) //  8 bit value
+      {
+         if (v >= 0xff00 && v <= 0xffff) v &= 0xff;
+         if ((v-(DP<<8)) < 256 && (v-(DP<<8)) >= -128) v -= DP<<8;
+         if (v > 255 || v < -128)
+         {
+            printf("v = %x  DP = %x\n",v,DP);
+            ErrorLine(p);
+            ErrorMsg("8 bit address/value out of range\n");
+            Terminate(1);
+         }
+         Put(pc+ibi++,v,p);
+      }
+
+      for (i=0 ; i < nops ; ++i) Put(pc+ibi++,0x12,p); // NOP
+
+      if (ListOn)
+      {
+         PrintPC();
+         PrintOC(v);
+         fprintf(lf," %s",Line);
+         if (Hint[0])
+         {
+            fprintf(lf,"%s",Hint);
+            Hint[0] = 0;
+         }
+
+         if (nops && df) fprintf(df,"Added %d NOP's\n",nops);
+         if (nops >  1 && lf) fprintf(lf," ; added %d NOP's",nops);
+         if (nops == 1 && lf) fprintf(lf," ; added a NOP");
+      }
+   }
+
+   if (il < 1 || il > 5)
+   {
+      ++ErrNum;
+      ErrorMsg("Wrong instruction length = %d\n",il);
+      il = 1;
+   }
+
+   if (pc+il > 0xffff)
+   {
+      if (Phase > 1)
+      {
+         ++ErrNum;
+         ErrorMsg("Program counter exceeds 64 KB\n");
+      }
+   }
+   else pc += il;
+   return p;
+}
+
+#define MAXARGS 10
+
+// *************
+// ScanArguments
+// *************
+
+// for nargs == MAXARGS this is a recording call
+// otherwise it's an expansion call
+
+int ScanArguments(char *p, char *args, int ptr[], int nargs)
+{
+   int l,n;
+
+   if (df) fprintf(df,"Scan Args %d <%s>\n",nargs,p);
+   n = 0;
+   ptr[0] = 0;
+   while (*p && n < nargs)
+   {
+      if (df) fprintf(df,"Arg #%d <%s>\n",n,p);
+      p = SkipSpace(p);
+      if (*p == ')') break; // end of list
+      if (nargs == MAXARGS) p = GetSymbol(p,args+ptr[n]);
+      else                  p = GetMacroArg(p,args+ptr[n]);
+      l = strlen(args+ptr[n]);
+      ++n;
+      ptr[n] = ptr[n-1] + l + 1;
+      p = SkipSpace(p);
+      if (*p == ')') break; // end of list
+      if (*p != ',' && n < nargs-1 && nargs < MAXARGS)
+      {
+         ++ErrNum;
+         ErrorMsg("Syntax error in macro definition '%c'\n",*p);
+         Terminate(1);
+      }
+      if (*p == ',') ++p;
+   }
+   return n;
+}
+
+
+// Called after name MCRO returns # of args
+
+int ScanArgs(char *p, char *args, int ptr[])
+{
+   int l,n;
+   char sym[ML];
+
+   n = 0;
+   ptr[0] = 0;
+   // if (df) fprintf(df,"Inside ScanArgs: <%s>\n",p);
+   while (*p && n < 10)
+   {
+      p = SkipSpace(p);
+      if (*p == ';') break; // comment
+      p = NextSymbol(p,sym);
+      l = strlen(sym);
+      // if (df) fprintf(df,"ScanSym:<%s>[%d]\n",sym,l);
+      if (l) memmove(args+ptr[n],sym,l+1);
+      else   args[ptr[n]] = 0;
+      ++n;
+      ptr[n] = ptr[n-1] + l + 1;
+      p = SkipSpace(p);
+      if (*p != ',') break; // end of list
+      ++p; // skip comma
+   }
+   return n;
+}
+
+void MacroInfo(int n)
+{
+   fprintf(df,"-----------------\n");
+   fprintf(df,"Name: %s\n",Mac[n].Name);
+   fprintf(df,"Args: %d\n",Mac[n].Narg);
+   fprintf(df,"Cola: %d\n",Mac[n].Cola);
+   fprintf(df,"Type: %d\n",Mac[n].Type);
+   fprintf(df,"Body: <<<%s>>>\n",Mac[n].Body);
+   fprintf(df,"-----------------\n");
+}
+
+// ***********
+// RecordMacro
+// ***********
+
+void RecordMacro(char *p)
+{
+   char Macro[ML];
+   int i,j,l,al,an,bl,mf;
+   int ap[10];
+   char args[MAXARGS*ML];
+   char *b,*q;
+   char *at;
+
+   if (Macros > MAXMAC -2)
+   {
+      ++ErrNum;
+      ErrorMsg("Too many macros (> %d)\n",MAXMAC);
+      Terminate(1);
+   }
+
+   bl = 1;
+   mf = strcmpword(p,"MACRO") != 0; // 1 : name MACRO
+   if (!mf) p += 5;                 // 0 : MACRO name
+   if (df) fprintf(df,"macro type = %d\n",mf);
+
+   p = NextSymbol(p,Macro);
+   l = strlen(Macro);
+   if (mf) p = StrMatch(p,"MACRO") + 5;
+   p = SkipSpace(p);
+
+   if (df)
+   {
+      fprintf(df,"Macro name: <%s>\n",Macro);
+      fprintf(df,"Arglist: <%s>\n",p);
+   }
+
+   if (*p == '(') ++p;
+   if (mf) an = ScanArgs(p,args,ap);
+   else    an = ScanArguments(p,args,ap,MAXARGS);
+   if (df)
+   {
+      fprintf(df,"RecordMacro: %s(",Macro);
+      for (i=0 ; i < an ; ++i)
+      {
+         at = args + ap[i];
+         al = strlen(at);
+         fprintf(df,"%s[%d]",at,al);
+         if (i < an-1) fprintf(df,",");
+      }
+      fprintf(df,")\n");
+   }
+   j = MacroIndex(Macro);
+   if (j < 0)  // create new entry in macro table
+   {
+      j = Macros;
+      Mac[j].Name = (char *)StrNDup(Macro,l);
+      Mac[j].Narg = an;
+      Mac[j].Type = mf;
+      Mac[j].Body = StrNDup("",0);
+      SourceLine();
+      while (!SourceEof() && !StrCaseStr(Line,"ENDM"))
+      {
+         ++LiNo;
+         l = strlen(Line);
+         if (l && Line[l-1] == 10) Line[--l] = 0; // Remove linefeed
+         if (l && Line[l-1] == 13) Line[--l] = 0; // Remove return
+
+         // parse line and substitute arguments, an argument
+         // of one character grows to two, CHAMAC and its number
+
+         Mac[j].Body = (char *)ReallocOrDie(Mac[j].Body,bl+2*l+1);
+         p = Line;
+         q = b = Mac[j].Body + bl - 1;
+         while (*p)
+         {
+            for (i=0 ; i < an ; ++i)
+            {
+               at = args + ap[i];
+               al = strlen(at);
+               if (al && !StrnCmp(p,at,al))
+               {
+                  *b++ = CHAMAC;
+                  *b++ = '0' + i;
+                  p += al;
+                  break;
+               }
+            }
+            if (i == an) *b++ = *p++;
+         }
+         *b++ = '\n';
+         *b = 0;
+
+         if (df)
+         {
+            fprintf(df,"MAC line  :%s\n",Line);
+            fprintf(df,"MAC parsed:%s\n",q);
+         }
+         bl += b - q;
+         SourceLine();
+      }
+      Macros++;
+      if (df) fprintf(df,"finished macro %d\n",Macros);
+   }
+   else if (Phase == 2) // List macro
+   {
+      PrintLiNo();
+      ++LiNo;
+      if (ListOn) fprintf(lf,"            %s\n",Line);
+      do
+      {
+         SourceLine();
+         PrintLiNo();
+         ++LiNo;
+         if (ListOn) fprintf(lf,"            %s",Line);
+         if (pf) fprintf(pf,"%s",Line);
+      } while (!SourceEof() && !StrCaseStr(Line,"ENDM"));
+      LiNo-=2;
+   }
+   else if (Phase == 1)
+   {
+      ++ErrNum;
+      ErrorMsg("Duplicate macro [%s]\n",Macro);
+      Terminate(1);
+   }
+   if (df) MacroInfo(j);
+   ++LiNo;
+}
+
+
+int ExpandMacro(char *m)
+{
+   int j,an;
+   char *p;
+   char Macro[ML];
+
+   j = MacroIndex(m);
+   if (j < 0) return j;
+   if (df) fprintf(df,"\nExpanding [%s] phase %d\n",Mac[j].Name,Phase);
+
+   p = NextSymbol(m,Macro);
+   p = SkipSpace(p);
+   if (*p == '(') ++p;  // parenthesis are optional
+
+   ExtractOpText(p);    // separate arguments from comment
+   p  = OpText;
+   an = ScanArguments(p,MacArgs,ArgPtr,Mac[j].Narg);
+
+   if (an != Mac[j].Narg)
+   {
+      ++ErrNum;
+      ErrorMsg("Wrong # of arguments in [%s] called (%d) defined (%d)\n",
+            Macro,an,Mac[j].Narg);
+      Terminate(1);
+   }
+   ++MacLev;
+   ++StatMacros;
+   MacPtr[MacLev] = Mac[j].Body;
+   if (df) fprintf(df,"Macro Level:%d\n",MacLev);
+   if (df) fprintf(df,"Macro Body :<<<%s>>>\n",Mac[j].Body);
+
+   if (Phase == 2)
+   {
+      Mac[j].Cola = m - Line;
+      PrintLine();
+   }
+   return j;
+}
+
+
+// copies the next line of the macro body with its arguments to Line
+
+void NextMacLine(void)
+{
+   int i;
+   size_t l;
+   char *r,*w;
+
+   if (df) fprintf(df,"Next Macro Line:%s\n",Line);
+
+   // do not count macro expansion lines
+
+   --LiNo;
+
+   // check for end of macro body
+
+   while (MacLev > 0 && *MacPtr[MacLev] == 0) --MacLev;
+
+   if (df) fprintf(df,"MacPtr[%d] = {{%s}}\n",MacLev,MacPtr[MacLev]);
+
+   w = Line;
+   if (MacPtr[MacLev] && *MacPtr[MacLev])
+   {
+      for (l=0, r=MacPtr[MacLev] ; *r && *r != '\n' ; ++r)
+      {
+         if (*r == CHAMAC) l += strlen(MacArgs + ArgPtr[*++r - '0']);
+         else ++l;
+      }
+      LineFit(l);
+      w = Line;
+      while (*MacPtr[MacLev] &&
+             *MacPtr[MacLev] != '\n')
+      {
+         if (*MacPtr[MacLev] == CHAMAC)
+         {
+            i = *(++MacPtr[MacLev]) - '0';
+            r = MacArgs + ArgPtr[i];
+            while (*r) *w++ = *r++;
+            ++MacPtr[MacLev];
+         }
+         else *w++ = *MacPtr[MacLev]++;
+      }
+      if (*MacPtr[MacLev] == '\n') ++MacPtr[MacLev];
+   }
+   *w = 0;
+}
+
+
+void ParseLine(char *cp)
+{
+   int i,l,v,m;
+   char *start;
+
+   am = -1;
+   oc = -1;
+   Label[0] = 0;
+   OpText[0] = 0;
+   Comment[0] = 0;
+   cp = SkipHexCode(cp);        // Skip disassembly
+   cp = SkipSpace(cp);          // Skip leading blanks
+   start = cp;                  // Remember start of line
+   if (df) fprintf(df,"%5d %4.4x Parse[%d]:%s\n",LiNo,pc&0xffff,Phase,cp);
+   if (CheckCondition(cp)) return;
+   if (Skipping)
+   {
+      PrintLiNo();
+      if (ListOn && Phase == 2) fprintf(lf,"SKIP          %s\n",Line);
+      if (df)         fprintf(df,"%5d SKIP          %s\n",LiNo,Line);
+      return;
+   }
+   if (pf && Phase == 2 && !MacLev)
+   {
+       fprintf(pf,"%s\n",Line); // write to preprocessed file
+   }
+   if (InlSkip)
+   {
+      if (strcmpword(cp,"ENDMOD") && strcmpword(cp,"ENDSUB"))
+      {
+         PrintLiNo();
+         if (ListOn && Phase == 2) fprintf(lf,"INLINE        %s\n",Line);
+         return;
+      }
+      InlSkip = 0;
+   }
+   if (MrgAct && TotalLiNo < MrgLines && MrgAct[TotalLiNo] && MergeLine())
+      return;
+   if (PoolAct && TotalLiNo < PoolLines && PoolAct[TotalLiNo] && PoolLine())
+      return;
+   if (InlCur >= 0) RecordInline(cp);
+   if (strncmp(cp,"/*",2) == 0 || strncmp(cp,"\\*",2) == 0) // SDDRIVE comment style
+   {
+      CodeStyle = 1;
+      if (Phase == 2) PrintLine();
+      return;
+   }
+   if (*cp == 0)  // Empty
+   {
+      if (Phase == 2)
+      {
+          PrintLiNo();
+          fputc('\n',lf);
+      }
+      return;
+   }
+   if (*cp == ';')  // comment only
+   {
+      PrintLine();
+      return;
+   }
+
+   if (*cp == '*')  // comment or setting of PC ?
+   {
+      if (!NeedChar(cp+1,'='))
+      {
+         PrintLine();  // no "* =" syntax
+         return;
+      }
+   }
+
+   // set local backward label
+
+   if (*cp == '-')
+   {
+      l = strlen(cp);
+      i = 0;
+      while (*cp++ == '-' && i < 10 && i < l) ++i;
+      minlab[i] = pc;
+   }
+
+   // set local forward label
+
+   if (*cp == '+')
+   {
+      l = strlen(cp);
+      i = 0;
+      while (*cp++ == '+' && i < 10 && i < l) ++i;
+      if (Phase == 1)
+      {
+         plulab[i][plucnt[i]] = pc;
+         if (++plucnt[i] > PLUMAX-2)
+         {
+            ++ErrNum;
+            ErrorMsg("too many local labels\n");
+            Terminate(1);
+         }
+      }
+   }
+
+   cp = CheckPseudo(cp);
+   if (!cp) return;      // Pseudo Op successfull processed
+   if (*cp == '.' || *cp == '_' || isalpha(*cp)) // Macro, Label or mnemonic
+   {
+      if (StrMatch(cp,"MACRO"))
+      {
+         RecordMacro(cp);
+         return;
+      }
+      if ((MneIndex = IsInstruction(cp)) < 0)
+      {
+         m = ExpandMacro(cp);
+         if (m < 0) // not a macro
+         {
+            if (df) fprintf(df,"LABEL:%s:\n",cp);
+            if (df) fprintf(df,"start:%s:\n",start);
+            if (cp == start) cp = DefineLabel(cp,&v,0);
+            else
+            {
+               if (StrKey(cp,"SET") || StrKey(cp,"ENUM") ||
+                   StrKey(cp,"EQU") || strchr(cp,'='))
+                  cp = DefineLabel(cp,&v,0);
+            }
+            cp = SkipSpace(cp);         // Skip leading blanks
+            if (*cp) m = ExpandMacro(cp);   // Macro after label
+            if (m >= 0) cp += strlen(cp);         // advance to EOL
+         }
+         else cp += strlen(cp);         // advance to EOL
+         if (m < 0 && (*cp == 0 || *cp == ';')) // no code or data
+         {
+            PrintLiNo();
+            if (ListOn && Phase == 2)
+               fprintf(lf,"%4.4x              %s\n",v&0xffff,Line);
+            return;
+         }
+      }
+   }
+   if (ForcedEnd)  return;
+   if (*cp ==  0 ) return;             // No code
+   if (*cp == ';') return;             // No code
+   if (*cp == '&') { cp = SetBSS(cp+1); return; }    // Set BSS counter
+   if (*cp == '*') { cp = SetPC(cp+1) ; return; }    // Set PC
+   cp = CheckPseudo(cp);
+   if (!cp) return;      // Pseudo Op successfull processed
+   if (MneIndex < 0) MneIndex = IsInstruction(cp); // Check for mnemonic after label
+   if (MneIndex >= 0)
+   {
+      ExtractOpText(cp+strlen(Mat[MneIndex].Mne));
+      cp += strlen(cp);
+      if (InlineCall()) return;
+      if (MrgJump) MergeJump();
+      if (MrgLine && Phase == 2 && pc >= 0 && pc < 0x10000)
+      {
+         MrgLine[pc] = TotalLiNo;
+         MrgLiNo[pc] = LiNo;
+         MergeOperand();
+      }
+      if (prf && Phase == 2) ProfAdr = pc;
+      GenerateCode(OpText);
+      if (InlCur >= 0) InlineCode();
+   }
+   if (ListOn && Phase == 2) fprintf(lf,"\n");
+   if (*cp == 0 || *cp == ';' || *cp == '*') return; // end of code
+
+   DiagPrintf("<%s>\n",cp);
+   ++ErrNum;
+   ErrorLine(cp);
+   ErrorMsg("Syntax error\n");
+   Terminate(1);
+}
+
+void Phase1Listing(void)
+{
+   fprintf(df,"%5d %4.4x",LiNo,pc);
+   if (Label[0]) fprintf(df,"  Label:[%s]{%4.4x}",Label,lab[LabelIndex(Label)].Address);
+   if (OpText[0]) fprintf(df,"  %s",OpText);
+   if (Comment[0]) fprintf(df,"  %s",Comment);
+   fprintf(df,"\n");
+}
+
+
+int CloseInclude(void)
+{
+   const char *msg = "Close INCLUDE file";
+
+   if (PchLevel == IncludeLevel) PchClose();
+   PrintLiNo();
+   if (Phase == 2)
+   {
+      if (ListOn) fprintf(lf,";                       closed INCLUDE file %s\n",
+            IncludeStack[IncludeLevel].Src);
+      if (ferror(lf)) AssertFileOp(NULL, msg);
+   }
+   if (SourceClose()) AssertFileOp(NULL, msg);
+   free(IncludeStack[IncludeLevel].Src);
+   sf = IncludeStack[--IncludeLevel].fp;
+   mf = IncludeStack[IncludeLevel].mf;
+   LiNo = IncludeStack[IncludeLevel].LiNo;
+   SourceLine();
+   ForcedEnd = 0;
+   return SourceEof();
+}
+
+// ***********
+// Checkpoint
+// ***********
+
+// Phase 1 records the state at line boundaries outside of include
+// files, macros, conditional blocks and modules. Phase 2 restarts
+// from these checkpoints in parallel processes (--parallel).
+
+#define CHK_LINES 1000 // min. lines between checkpoints
+
+THREAD_LOCAL struct CheckStruct
+{
+   long Pos;        // position of the next line in the source file
+   int  TotalLiNo;  // lines before the checkpoint
+   int  LiNo;
+   int  pc;
+   int  bss;
+   int  DP;
+   int  CPU;
+   int  EnumValue;
+   int  ListGlobal;
+   int  MacList;
+   int  IgnoreCase;
+   int  CodeStyle;
+   int  FormLn;
+   int  PchCalls;
+   int  IncOnces;
+   int  minlab[11];
+} *Chk;
+
+THREAD_LOCAL int Checks;     // number of checkpoints
+THREAD_LOCAL int ChkMax;     // allocated size of Chk
+THREAD_LOCAL int Parallel;   // --parallel: processes for phase 2
+THREAD_LOCAL int ChkLines;   // source lines of phase 1
+
+void Checkpoint(void)
+{
+   struct CheckStruct *c;
+
+   if (IncludeLevel || IfLevel || Scope[0] || ForcedEnd || (!mf && !sf)) return;
+   if (TotalLiNo < (Checks ? Chk[Checks-1].TotalLiNo + CHK_LINES : CHK_LINES)) return;
+   if (Checks == ChkMax)
+   {
+      ChkMax = ChkMax ? 2 * ChkMax : 64;
+      Chk = (struct CheckStruct *)ReallocOrDie(Chk,ChkMax * sizeof(struct CheckStruct));
+   }
+   c = Chk + Checks++;
+   c->Pos        = mf ? (long)mf->Pos : ftell(sf);
+   c->TotalLiNo  = TotalLiNo;
+   c->LiNo       = LiNo;
+   c->pc         = pc;
+   c->bss        = bss;
+   c->DP         = DP;
+   c->CPU        = CPU;
+   c->EnumValue  = EnumValue;
+   c->ListGlobal = ListGlobal;
+   c->MacList    = MacList;
+   c->IgnoreCase = IgnoreCase;
+   c->CodeStyle  = CodeStyle;
+   c->FormLn     = FormLn;
+   c->PchCalls   = PchCalls;
+   c->IncOnces   = IncOnces;
+   memcpy(c->minlab,minlab,sizeof(minlab));
+}
+
+// restores the state of checkpoint c for phase 2
+
+void Restart(struct CheckStruct *c)
+{
+   TotalLiNo  = c->TotalLiNo;
+   LiNo       = c->LiNo;
+   pc         = c->pc;
+   bss        = c->bss;
+   DP         = c->DP;
+   SetCPU(c->CPU);
+   EnumValue  = c->EnumValue;
+   ListGlobal = c->ListGlobal;
+   ListOn     = c->ListGlobal;
+   MacList    = c->MacList;
+   IgnoreCase = c->IgnoreCase;
+   CodeStyle  = c->CodeStyle;
+   FormLn     = c->FormLn;
+   PchCalls   = c->PchCalls;
+   OnceReset(c->IncOnces);
+   memcpy(minlab,c->minlab,sizeof(minlab));
+}
+
+
+void Phase1(void)
+{
+    int i,l,Eof;
+    double t = StatClock();
+
+   Phase = 1;
+   Checks = 0;
+   Reassigned = 0;
+   ForcedEnd = 0;
+   InlSkip = 0;
+   SetCPU(InitCPU);
+   PoolOn  = 0;
+   PlcNum  = 0;
+   PlcCur  = 0;
+   ResetSections();
+   PchReset();
+   OnceReset(0);
+   for (i=0 ; i < 11 ; ++i) minlab[i] = UNDEF;
+   for (i=0 ; i < Inlines ; ++i) Inl[i].Count = 0;
+
+   SourceLine();
+   Eof = SourceEof();
+   while (!Eof || IncludeLevel > 0)
+   {
+      ++LiNo; ++TotalLiNo; ++StatLines;
+      l = strlen(Line);
+      if (l && Line[l-1] == 10) Line[--l] = 0; // Remove linefeed
+      if (l && Line[l-1] == 13) Line[--l] = 0; // Remove return
+      ParseLine(Line);
+      if (MacLev)
+      {
+         NextMacLine();
+         if (df) fprintf(df,"Macro: %s\n",Line);
+      }
+      else
+      {
+         if (Parallel > 1) Checkpoint();
+         SourceLine();
+      }
+      Eof = SourceEof() || ForcedEnd;;
+      if (Eof && IncludeLevel > 0) Eof = CloseInclude();
+   }
+   ChkLines = TotalLiNo;
+   StatTime[0] += StatClock() - t;
+   ++StatRuns[0];
+}
+
+
+// ***********
+// Phase2Lines
+// ***********
+
+// Assembles the source lines from the current position to the end
+// or, if End > 0, up to the checkpoint at total line number End.
+
+void Phase2Lines(int End)
+{
+   int l,Eof;
+
+   SourceLine();
+   Eof = SourceEof();
+   while (!Eof || IncludeLevel > 0)
+   {
+      ++LiNo; ++TotalLiNo; ++StatLines;
+      l = strlen(Line);
+      if (l && Line[l-1] == 10) Line[--l] = 0; // Remove linefeed
+      if (l && Line[l-1] == 13) Line[--l] = 0; // Remove return
+      ParseLine(Line);
+      if (prf) ProfileLine();
+      if (MacLev)
+      {
+         NextMacLine();
+         ListOn = MacList;
+      }
+      else
+      {
+         if (TotalLiNo == End && !IncludeLevel) break;
+         SourceLine();
+         ListOn = ListGlobal;
+      }
+      Eof = SourceEof() || ForcedEnd;
+      if (Eof && IncludeLevel > 0) Eof = CloseInclude();
+      if (GenEnd < pc) GenEnd = pc; // Remember highest assenble address
+      if (ErrNum >= ERRMAX)
+      {
+         DiagPrintf("\n*** Error count reached maximum of %d ***\n",ErrNum);
+         DiagPrintf("Assembly stopped\n");
+         break;
+      }
+   }
+}
+
+
+void Phase2(void)
+{
+   int i;
+   double t = StatClock();
+
+   Phase     =    2;
+   pc        =   -1;
+   EnumValue =   -1;
+   ForcedEnd =    0;
+   ListOn    =    1;
+   SetCPU(InitCPU);
+   Scope[0]  =    0;
+   ModuleStart =  0;
+   InlSkip   =    0;
+   PoolOn    =    0;
+   PlcNum    =    0;
+   PlcCur    =    0;
+   Fixes     =    0;
+   PchCalls  =    0;
+   ResetSections();
+
+   for (i=0 ; i < 11 ; ++i) minlab[i] = UNDEF;
+   for (i=0 ; i < Inlines ; ++i) Inl[i].Count = 0;
+
+   if (IfLevel)
+   {
+      DiagPrintf("\n*** Error in conditional assembly ***\n");
+      if (IfLevel == 1)
+         DiagPrintf("*** an #endif statement is missing\n");
+      else
+         DiagPrintf("*** %d #endif statements are missing\n",IfLevel);
+      Terminate(1);
+   }
+   SourceRewind();
+   LiNo = 0; TotalLiNo = 0;
+
+   // the chunks of --parallel restart with the include files of phase 1
+
+#ifdef BS9_THREADS
+   if (!Phase2Parallel())
+#endif
+   {
+      OnceReset(0);
+      Phase2Lines(0);
+   }
+   if (ErrNum < ERRMAX) RunExecutes();
+   StatTime[1] += StatClock() - t;
+   ++StatRuns[1];
+}
+
+
+// *************
+// SelectInlines
+// *************
+
+// After the first run of phase 1: modules, that are referenced
+// only by calls, which will all be inlined, are omitted.
+
+void SelectInlines(void)
+{
+   int i,j;
+
+   for (i=0 ; i < Inlines ; ++i)
+   {
+      j = LabelIndex(Inl[i].Name);
+      Inl[i].Drop = !Inl[i].Bad && j >= 0 && lab[j].Calls > 0 &&
+                    lab[j].Uses == lab[j].Calls;
+      if (df) fprintf(df,"INLINE %s size %d calls %d uses %d: %s%s\n",
+         Inl[i].Name,Inl[i].Size,j < 0 ? 0 : lab[j].Calls,
+         j < 0 ? 0 : lab[j].Uses,InlineWhy[Inl[i].Bad],
+         Inl[i].Drop ? " (dropped)" : "");
+   }
+}
+
+// *********
+// ResetPass
+// *********
+
+// Restores the state after option parsing for another run of phase 1.
+
+void ResetPass(void)
+{
+   int i;
+
+   for (i=InitLabels ; i < Labels ; ++i)
+   {
+      free(lab[i].Name);
+      free(lab[i].Ref);
+      free(lab[i].Att);
+      memset(lab+i,0,sizeof(struct LabelStruct));
+   }
+   Labels = InitLabels;
+   Externs = 0;
+   for (i=0 ; i < Labels ; ++i)
+   {
+      lab[i].NumRef = 0;
+      lab[i].Uses   = 0;
+      lab[i].Calls  = 0;
+   }
+   for (i=0 ; i < Macros ; ++i)
+   {
+      free(Mac[i].Name);
+      free(Mac[i].Body);
+   }
+   Macros = 0;
+   MacLev = 0;
+   memset(ROM,Preset,sizeof(ROM));
+   memset(LOCK,0,sizeof(LOCK));
+   memset(ADL,0,sizeof(ADL));
+   memset(plucnt,0,sizeof(plucnt));
+   pc            =   -1;
+   bss           =    0;
+   EnumValue     =   -1;
+   DP            =    0;
+   SetCPU(InitCPU);
+   IgnoreCase    = InitIgnoreCase;
+   CodeStyle     = InitCodeStyle;
+   ListGlobal    =    1;
+   MacList       =    1;
+   Scope[0]      =    0;
+   ModuleStart   =    0;
+   IfLevel       =    0;
+   Skipping      =    0;
+   PoolOn        =    0;
+   ForcedEnd     =    0;
+   GenStart      = 0x10000;
+   GenEnd        =    0;
+   LiNo          =    0;
+   TotalLiNo     =    0;
+   SourceRewind();
+}
+
+// ***********
+// ResetOutput
+// ***********
+
+// Discards the results of phase 2 before phase 1 and 2 are repeated.
+
+void ResetOutput(void)
+{
+   int i;
+
+   lf = AssertFileOp(freopen(LstTmp ? LstTmp : Lst,"w",lf), "Open list file");
+   if (pf) pf = AssertFileOp(freopen(Pre,"w",pf), "Open preprocessor file");
+   if (of) of = AssertFileOp(freopen(Opt,"w",of), "Open hint file");
+   if (prf) prf = AssertFileOp(freopen(Prf,"w",prf), "Open profile file");
+   optc = 0;
+   for (i=0 ; i < Modules ; ++i) free(Mod[i].Name);
+   Modules = 0;
+   for (i=0 ; i < StoreCount ; ++i) free(SFF[i]);
+   StoreCount = 0;
+   Inlined = 0;
+}
+
+// ************
+// ListingClose
+// ************
+
+// replaces the listing, if it has changed, returns 0 on success
+
+int ListingClose(void)
+{
+   int rc = 0;
+   FILE *fp = lf;
+
+   lf = NULL;
+   if (fp && LstTmp) rc = OutputClose(fp,Lst,LstTmp);
+   else if (fp) rc = fclose(fp);
+   LstTmp = NULL;
+   return rc;
+}
+
+void ListSymbols(FILE *lf, int n, int lb, int ub)
+{
+   int i,j,l;
+   char A;
+
+   if (!ListOn) return;
+   for (i=0 ; i < n && i < Labels; ++i)
+   if (lab[i].Address >= lb && lab[i].Address <= ub)
+   {
+      fprintf(lf,"%-30.30s $%4.4x",lab[i].Name,lab[i].Address);
+      for (j=0 ; j <= lab[i].NumRef ; ++j)
+      {
+         if (j > 0 && (j % 5) == 0)
+         fprintf(lf,"\n                                    ");
+         fprintf(lf,"%6d",lab[i].Ref[j]);
+         l = lab[i].Att[j];
+         if (l == LDEF || l == LBSS || l == LPOS) A = 'D';
+         else  A = ' ';
+         if ((A != ' ' || (j % 5) != 4) && j != lab[i].NumRef)
+            fprintf(lf,"%c",A);
+      }
+      fprintf(lf,"\n");
+   }
+}
+
+
+// *************
+// ExportSymbols
+// *************
+
+// --sym writes the defined absolute symbols as "name = value" lines,
+// that other sources read with IMPORTSYM.
+
+THREAD_LOCAL int SymExport;      // --sym: write <source>.sym
+
+void ExportSymbols(char *Name)
+{
+   int i,v;
+   char *Tmp;
+   FILE *fp;
+
+   Tmp = OutputTmp(Name); // importing sources see no change if equal
+   fp = AssertFileOp(fopen(Tmp,"w"),"Open symbol file");
+   CacheFile(Name,1);
+   fprintf(fp,"; symbols of %s\n",Src);
+   for (i=0 ; i < Labels ; ++i)
+   {
+      v = lab[i].Address;
+      if (v == UNDEF || lab[i].Rel) continue;
+      if (v < 0) fprintf(fp,"%-30s = -$%x\n",lab[i].Name,-v);
+      else       fprintf(fp,"%-30s = $%4.4x\n",lab[i].Name,v);
+   }
+   if (ferror(fp) || OutputClose(fp,Name,Tmp)) AssertFileOp(NULL,"Write symbol file");
+}
+
+
+void ListUndefinedSymbols(void)
+{
+   int i;
+
+   for (i=0 ; i < Labels ; ++i)
+   {
+      if (lab[i].Address == UNDEF)
+      {
+         DiagPrintf("* Undefined   : %-25.25s *\n",lab[i].Name);
          ++ErrNum;
-         ErrorLine(p);
-         ErrorMsg("Illegal syntax in bit operand\n");
-         exit(1);
       }
-      *q = 0; // separate bit number from address
-      p = EvalOperand(p+1,&v,0);
-      if (v != UNDEF && (v < 0 || v > 255))
+   }
+}
+
+int CmpAddress( const void *arg1, const void *arg2 )
+{
+   struct LabelStruct *Label1;
+   struct LabelStruct *Label2;
+
+   Label1 = (struct LabelStruct *) arg1;
+   Label2 = (struct LabelStruct *) arg2;
+
+   if (Label1->Address == Label2->Address) return 0;
+   if (Label1->Address  > Label2->Address) return 1;
+   return -1;
+}
+
+
+int CmpRefs( const void *arg1, const void *arg2 )
+{
+   struct LabelStruct *Label1;
+   struct LabelStruct *Label2;
+
+   Label1 = (struct LabelStruct *) arg1;
+   Label2 = (struct LabelStruct *) arg2;
+
+   if (Label1->NumRef == Label2->NumRef)
+   {
+      if (Label1->Address < Label2->Address) return  1;
+      if (Label1->Address > Label2->Address) return -1;
+      return 0;
+   }
+   if (Label1->NumRef  < Label2->NumRef) return 1;
+   return -1;
+}
+
+// *******************
+// Instruction Decoder
+// *******************
+
+// The code analysis after phase 2 works on the final image in ROM[].
+// ADL[] is non zero for all bytes generated by instructions, so code
+// and data can be distinguished. Opcodes are mapped back to Mat[].
+
+struct InsStruct
+{
+   int Adr;   // address of instruction
+   int Len;   // instruction length in bytes
+   int Opc;   // opcode (8 or 16 bit)
+   int Mne;   // index into Mat[] (-1: illegal opcode)
+   int Amo;   // addressing mode
+   int Pb;    // postbyte (-1: none)
+   int Reg;   // index register 0-3 (X,Y,U,S), 4: PC, -1: none
+   int Off;   // constant index offset (UNDEF: none or variable)
+   int Val;   // operand value or target address (UNDEF: unknown)
+   int Cyc;   // cycles (6809 timing, not taken branches)
+};
+
+#define INDIRECT(pb) (((pb) & 0x90) == 0x90)
+
+THREAD_LOCAL short OpcMne[3][256]; // opcode -> index into Mat[] for page 0,$10,$11
+THREAD_LOCAL char  OpcAmo[3][256]; // opcode -> addressing mode
+
+// Cycles for page 0, page 1 ($10) and page 2 ($11) opcodes.
+// Indexed modes get the postbyte cycles added in DecodeInstruction,
+// push and pull instructions one cycle for each byte.
+
+const unsigned char Cycles[3][256] =
+{
+   {
+//    0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+      6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 3, 6, // 00
+      0, 0, 2, 2, 4, 0, 5, 9, 0, 2, 3, 0, 3, 2, 8, 6, // 10
+      3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // 20
+      4, 4, 4, 4, 5, 5, 5, 5, 0, 5, 3, 6,20,11,19,19, // 30
+      2, 0, 0, 2, 2, 0, 2, 2, 2, 2, 2, 0, 2, 2, 0, 2, // 40
+      2, 0, 0, 2, 2, 0, 2, 2, 2, 2, 2, 0, 2, 2, 0, 2, // 50
+      6, 6, 7, 6, 6, 7, 6, 6, 6, 6, 6, 7, 6, 6, 3, 6, // 60
+      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 4, 7, // 70
+      2, 2, 2, 4, 2, 2, 2, 0, 2, 2, 2, 2, 4, 7, 3, 0, // 80
+      4, 4, 4, 6, 4, 4, 4, 4, 4, 4, 4, 4, 6, 7, 5, 5, // 90
+      4, 4, 4, 6, 4, 4, 4, 4, 4, 4, 4, 4, 6, 7, 5, 5, // A0
+      5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 5, 7, 8, 6, 6, // B0
+      2, 2, 2, 4, 2, 2, 2, 0, 2, 2, 2, 2, 3, 5, 3, 0, // C0
+      4, 4, 4, 6, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, // D0
+      4, 4, 4, 6, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, // E0
+      5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6  // F0
+   },
+   {
+//    0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 00
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 10
+      0, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, // 20
+      4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 0, 0, 0,20, // 30
+      3, 0, 0, 3, 3, 0, 3, 3, 3, 3, 3, 0, 3, 3, 0, 3, // 40
+      0, 0, 0, 3, 3, 0, 3, 0, 0, 3, 3, 0, 3, 3, 0, 3, // 50
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 60
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 70
+      5, 5, 5, 5, 5, 5, 5, 0, 5, 5, 5, 5, 5, 0, 4, 0, // 80
+      7, 7, 7, 7, 7, 7, 6, 6, 7, 7, 7, 7, 7, 0, 6, 6, // 90
+      7, 7, 7, 7, 7, 7, 6, 6, 7, 7, 7, 7, 7, 0, 6, 6, // A0
+      8, 8, 8, 8, 8, 8, 7, 7, 8, 8, 8, 8, 8, 0, 7, 7, // B0
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0, // C0
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 8, 6, 6, // D0
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 8, 6, 6, // E0
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 9, 9, 7, 7  // F0
+   },
+   {
+//    0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 00
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 10
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 20
+      7, 7, 7, 7, 7, 7, 7, 8, 6, 6, 6, 6, 4, 5, 0,20, // 30
+      0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 3, 0, 3, 3, 0, 3, // 40
+      0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 3, 0, 3, 3, 0, 3, // 50
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 60
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 70
+      3, 3, 0, 5, 0, 0, 3, 0, 0, 0, 0, 3, 5,25,36,28, // 80
+      5, 5, 0, 7, 0, 0, 5, 5, 0, 0, 0, 5, 7,27,36,30, // 90
+      5, 5, 0, 7, 0, 0, 5, 5, 0, 0, 0, 5, 7,27,36,30, // A0
+      6, 6, 0, 8, 0, 0, 6, 6, 0, 0, 0, 6, 8,28,37,31, // B0
+      3, 3, 0, 0, 0, 0, 3, 0, 0, 0, 0, 3, 0, 0, 0, 0, // C0
+      5, 5, 0, 0, 0, 0, 5, 5, 0, 0, 0, 5, 0, 0, 0, 0, // D0
+      5, 5, 0, 0, 0, 0, 5, 5, 0, 0, 0, 5, 0, 0, 0, 0, // E0
+      6, 6, 0, 0, 0, 0, 6, 6, 0, 0, 0, 6, 0, 0, 0, 0  // F0
+   }
+};
+
+// ***************
+// InitOpcodeTable
+// ***************
+
+void InitOpcodeTable(void)
+{
+   int i,m,oc,page;
+
+   memset(OpcMne,0xff,sizeof(OpcMne));
+   for (i=DIMOP_6309-1 ; i >= 0 ; --i) // first entry wins (BCC before BHS)
+   for (m=AM_Inherent ; m <= AM_Extended ; ++m)
+   {
+      if ((oc = Mat[i].Opc[m]) < 0) continue;
+      page = oc >> 8;
+      if (page) page -= 0x0f;
+      OpcMne[page][oc & 0xff] = i;
+      OpcAmo[page][oc & 0xff] = m;
+   }
+}
+
+// *********
+// PushBytes
+// *********
+
+int PushBytes(int pb)
+{
+   int i,n;
+
+   n = 0;
+   for (i=0 ; i < 8 ; ++i)
+   if (pb & (1 << i)) n += 1 + (i > 3); // CC,A,B,DP: 1 X,Y,U/S,PC: 2
+   return n;
+}
+
+// ***********
+// IndexedInfo
+// ***********
+
+// returns the number of bytes following the postbyte
+// and adds the extra cycles of the indexed mode to d->Cyc
+
+int IndexedInfo(int pb, struct InsStruct *d)
+{
+   static const char IdxCyc[2][16] =
+   {
+      {2,3,2,3,0,1,1,1,1,4,1,4,1,5,4,0}, // direct
+      {0,6,0,6,3,4,4,4,4,7,4,7,4,8,7,5}  // indirect
+   };
+   static const char IdxLen[16] = {0,0,0,0,0,0,0,0,1,2,0,0,1,2,0,2};
+
+   d->Reg = (pb >> 5) & 3;
+   if (!(pb & 0x80)) // 5 bit offset
+   {
+      d->Off  = (pb & 0x10) ? (pb & 0x1f) - 32 : (pb & 0x1f);
+      d->Cyc += 1;
+      return 0;
+   }
+   switch (pb) // 6309 W register modes
+   {
+      case 0x8f: case 0x90: d->Reg = -1; d->Cyc += (pb & 0x10) ? 3 : 0; return 0;
+      case 0xaf: case 0xb0: d->Reg = -1; d->Cyc += 5; return 2;
+      case 0xcf: case 0xd0:
+      case 0xef: case 0xf0: d->Reg = -1; d->Cyc += (pb & 0x10) ? 6 : 3; return 0;
+   }
+   if ((pb & 0x1f) == 0x1f) d->Reg = -1;                     // [n16]
+   if ((pb & 0x0e) == 0x0c) d->Reg =  4;                     // n,PCR
+   if ((pb & 0x0f) == 0x04) d->Off =  0;                     // ,R
+   d->Cyc += IdxCyc[(pb >> 4) & 1][pb & 15];
+   return IdxLen[pb & 15];
+}
+
+// *****************
+// DecodeInstruction
+// *****************
+
+int DecodeInstruction(int a, struct InsStruct *d)
+{
+   int i,n,m,oc,page,ql,XIM;
+
+   d->Adr = a;
+   d->Pb  = -1;
+   d->Reg = -1;
+   d->Off = UNDEF;
+   d->Val = UNDEF;
+   d->Amo = AM_None;
+   oc = ROM[a];
+   n  = 1;
+   page = 0;
+   if (oc == 0x10 || oc == 0x11)
+   {
+      page = oc - 0x0f;
+      oc = (oc << 8) | ROM[a+1];
+      n  = 2;
+   }
+   d->Opc = oc;
+   d->Mne = i = OpcMne[page][oc & 0xff];
+   d->Cyc = Cycles[page][oc & 0xff];
+   if (i < 0)
+   {
+      d->Len = n;
+      return n;
+   }
+   d->Amo = m = OpcAmo[page][oc & 0xff];
+   XIM = (Mat[i].Mne[1] == 'I' && Mat[i].Mne[2] == 'M');
+   if (XIM) ++n; // immediate byte of OIM, AIM, EIM, TIM
+
+   switch (m)
+   {
+      case AM_Register:
+         d->Pb = ROM[a+n++];
+         if (oc >= 0x34 && oc <= 0x37) d->Cyc += PushBytes(d->Pb);
+         break;
+      case AM_Relative:
+         if (Mat[i].Mne[0] == 'L')
+         {
+            d->Val = (ROM[a+n] << 8) | ROM[a+n+1];
+            if (d->Val & 0x8000) d->Val -= 0x10000;
+            n += 2;
+         }
+         else
+         {
+            d->Val = ROM[a+n];
+            if (d->Val & 0x80) d->Val -= 0x100;
+            n += 1;
+         }
+         d->Val = (a + n + d->Val) & 0xffff;
+         break;
+      case AM_Immediate:
+         ql = RegisterSize(i);
+         if (oc == 0x118d) ql = 1; // DIVD uses byte operand
+         if (ql == 4 && oc != 0xcd) ql = 2;
+         d->Val = 0;
+         while (ql--) d->Val = (d->Val << 8) | ROM[a+n++];
+         break;
+      case AM_Direct:
+         if (oc >= 0x1130 && oc <= 0x1137) d->Pb = ROM[a+n++]; // bit ops
+         ++n; // target depends on DP
+         break;
+      case AM_Indexed:
+         d->Pb = ROM[a+n++];
+         ql = IndexedInfo(d->Pb,d);
+         if (ql == 1)
+         {
+            d->Off = ROM[a+n];
+            if (d->Off & 0x80) d->Off -= 0x100;
+         }
+         if (ql == 2)
+         {
+            d->Off = (ROM[a+n] << 8) | ROM[a+n+1];
+            if (d->Off & 0x8000) d->Off -= 0x10000;
+         }
+         n += ql;
+         if (d->Reg == 4 && d->Off != UNDEF && !INDIRECT(d->Pb))
+            d->Val = (a + n + d->Off) & 0xffff; // PC relative address
+         break;
+      case AM_Extended:
+         d->Val = (ROM[a+n] << 8) | ROM[a+n+1];
+         n += 2;
+         break;
+   }
+   d->Len = n;
+   return n;
+}
+
+// **************
+// Stack Analysis
+// **************
+
+// Every entry point (module, call target, interrupt vector) is a
+// routine. The code of a routine is walked from its entry along all
+// branches, tracking the bytes pushed onto S and U. Calls are recorded
+// with the stack depth at the call site. The total depth of a routine
+// is then computed along the call graph.
+
+#define STK_NEWSTACK   0x01 // S loaded with a new value
+#define STK_DYNAMIC    0x02 // S modified by a non constant amount
+#define STK_INDIRECT   0x04 // call or jump through register or vector
+#define STK_RECURSIVE  0x08 // part of a call cycle
+#define STK_UNBALANCED 0x10 // different depths at a join or return
+#define STK_UNBOUNDED  0x20 // stack grows inside a loop
+#define STK_DATA       0x40 // control flow runs into data
+#define STK_INHERIT    0x80 // a called routine has notes
+#define STK_EXTERN    0x100 // no code assembled at entry
+
+struct CallStruct
+{
+   int From;   // address of call instruction
+   int Target; // called address (UNDEF: unknown)
+   int Depth;  // S depth inside the callee's frame
+   int UDepth; // U depth at call
+   int Tail;   // 1: JMP (no return address)
+};
+
+THREAD_LOCAL struct RoutineStruct
+{
+   int Entry;  // address of entry point
+   int Own;    // max. S bytes used by the routine itself
+   int UOwn;   // max. U bytes used by the routine itself
+   int Total;  // max. S bytes including called routines
+   int UTotal; // max. U bytes including called routines
+   int Flags;  // STK_... notes
+   int State;  // 0: new, 1: in progress, 2: total computed
+   int Cycles; // sum of cycles of all instructions reached
+   int Bytes;  // sum of bytes of all instructions reached
+   int Ncall;  // number of call sites
+   struct CallStruct *Call;
+} *Rou;
+
+THREAD_LOCAL int Routines;     // number of routines
+THREAD_LOCAL int RouMax;       // allocated size of Rou
+THREAD_LOCAL int *RouIndex;    // address -> routine index (-1: none)
+THREAD_LOCAL int *WalkSeen;    // S depth + 1 at visited addresses (0: unvisited)
+THREAD_LOCAL char *WalkVisits; // number of visits per address
+THREAD_LOCAL int Stack;        // -s: write stack report
+
+// ************
+// ModuleOfAddr
+// ************
+
+int ModuleOfAddr(int a)
+{
+   int i;
+
+   for (i=0 ; i < Modules ; ++i)
+   {
+      if (a >= Mod[i].Start && (a < Mod[i].End ||
+         (Mod[i].End < 0 && a == Mod[i].Start))) return i;
+   }
+   return -1;
+}
+
+// **********
+// AddRoutine
+// **********
+
+int AddRoutine(int a)
+{
+   struct RoutineStruct *r;
+
+   a &= 0xffff;
+   if (RouIndex[a] >= 0) return RouIndex[a];
+   if (Routines >= RouMax)
+   {
+      RouMax += 256;
+      Rou = (struct RoutineStruct *)
+            ReallocOrDie(Rou,RouMax*sizeof(struct RoutineStruct));
+   }
+   r = Rou + Routines;
+   memset(r,0,sizeof(struct RoutineStruct));
+   r->Entry = a;
+   RouIndex[a] = Routines;
+   return Routines++;
+}
+
+// *******
+// AddCall
+// *******
+
+void AddCall(int ri, int From, int Target, int Depth, int UDepth, int Tail)
+{
+   struct RoutineStruct *r = Rou + ri;
+   struct CallStruct *c;
+
+   r->Call = (struct CallStruct *)
+             ReallocOrDie(r->Call,(r->Ncall+1)*sizeof(struct CallStruct));
+   c = r->Call + r->Ncall++;
+   c->From   = From;
+   c->Target = Target;
+   c->Depth  = Depth;
+   c->UDepth = UDepth;
+   c->Tail   = Tail;
+   if (Target == UNDEF) r->Flags |= STK_INDIRECT;
+   else AddRoutine(Target);
+}
+
+// ***********
+// WalkRoutine
+// ***********
+
+void WalkRoutine(int ri)
+{
+   struct InsStruct d;
+   int *wl;     // work list of address, S depth, U depth
+   int  wn;     // work list entries
+   int  wm;     // work list size
+   int *touch;  // visited addresses
+   int  tn,tm;
+   int a,s,u,oc,n,m,Flags,Next;
+
+   wm = 64;
+   wl = (int *)MallocOrDie(wm*3*sizeof(int));
+   tm = 256;
+   touch = (int *)MallocOrDie(tm*sizeof(int));
+   tn = 0;
+   wn = 0;
+   Flags = 0;
+   wl[wn++] = Rou[ri].Entry; wl[wn++] = 0; wl[wn++] = 0;
+   if (ADL[Rou[ri].Entry] <= 0) Flags |= STK_EXTERN;
+   m = ModuleOfAddr(Rou[ri].Entry);
+
+   while (wn)
+   {
+      u = wl[--wn]; s = wl[--wn]; a = wl[--wn];
+      for (;;)
+      {
+         if (a < 0 || a > 0xffff || ADL[a] == 0 ||
+            (ADL[a] < 0 && ROM[a] != 0x12)) // only NOP padding is allowed
+         {
+            if (!(Flags & STK_EXTERN)) Flags |= STK_DATA;
+            break;
+         }
+         if (WalkSeen[a])
+         {
+            if (WalkSeen[a] - 1 == s) break;
+            Flags |= STK_UNBALANCED;
+            if (s < WalkSeen[a] - 1) break;
+            if (++WalkVisits[a] > 2)
+            {
+               Flags |= STK_UNBOUNDED;
+               break;
+            }
+         }
+         else
+         {
+            if (tn == tm)
+            {
+               tm *= 2;
+               touch = (int *)ReallocOrDie(touch,tm*sizeof(int));
+            }
+            touch[tn++] = a;
+            n = DecodeInstruction(a,&d);
+            Rou[ri].Cycles += d.Cyc;
+            Rou[ri].Bytes  += n;
+         }
+         WalkSeen[a] = s + 1;
+         n    = DecodeInstruction(a,&d);
+         oc   = d.Opc;
+         Next = a + n;
+
+         if (oc == 0x34) s += PushBytes(d.Pb);           // PSHS
+         else if (oc == 0x36) u += PushBytes(d.Pb);      // PSHU
+         else if (oc == 0x37) u -= PushBytes(d.Pb);      // PULU
+         else if (oc == 0x1038) s += 2;                  // PSHSW
+         else if (oc == 0x1039) s -= 2;                  // PULSW
+         else if (oc == 0x103a) u += 2;                  // PSHUW
+         else if (oc == 0x103b) u -= 2;                  // PULUW
+         else if (oc == 0x35)                            // PULS
+         {
+            s -= PushBytes(d.Pb);
+            if (d.Pb & 0x80) // PULS PC = return
+            {
+               if (s != -2) Flags |= STK_UNBALANCED;
+               break;
+            }
+         }
+         else if (oc == 0x32)                            // LEAS
+         {
+            if (d.Reg == 3 && d.Off != UNDEF && !INDIRECT(d.Pb)) s -= d.Off;
+            else Flags |= STK_DYNAMIC;
+         }
+         else if (oc == 0x33)                            // LEAU
+         {
+            if (d.Reg == 2 && d.Off != UNDEF && !INDIRECT(d.Pb)) u -= d.Off;
+         }
+         else if (oc == 0x10ce || oc == 0x10de ||
+                  oc == 0x10ee || oc == 0x10fe)          // LDS
+         {
+            s = 0;
+            Flags |= STK_NEWSTACK;
+         }
+         else if (oc == 0x1e || oc == 0x1f ||            // EXG, TFR
+                 (oc >= 0x1030 && oc <= 0x1036))         // ADDR ... EORR
+         {
+            if ((d.Pb & 0x0f) == 4 || (oc == 0x1e && (d.Pb >> 4) == 4))
+               Flags |= STK_DYNAMIC;
+         }
+         else if (oc == 0x17 || oc == 0x8d ||            // LBSR, BSR
+                  oc == 0x9d || oc == 0xad || oc == 0xbd)// JSR
+         {
+            AddCall(ri,a,d.Val,s+2,u,0);
+            if (s + 2 > Rou[ri].Own) Rou[ri].Own = s + 2;
+         }
+         else if (oc == 0x3f || oc == 0x103f || oc == 0x113f || oc == 0x3c)
+         {                                               // SWI, CWAI
+            if (s + 12 > Rou[ri].Own) Rou[ri].Own = s + 12;
+            if (oc != 0x3c)
+            {
+               m = (oc == 0x3f) ? 0xfffa : (oc == 0x103f) ? 0xfff4 : 0xfff2;
+               if (LOCK[m] && LOCK[m+1])
+                  AddCall(ri,a,(ROM[m] << 8) | ROM[m+1],s+12,u,0);
+               m = ModuleOfAddr(Rou[ri].Entry);
+            }
+         }
+         else if (oc == 0x39)                            // RTS
+         {
+            if (s != 0) Flags |= STK_UNBALANCED;
+            break;
+         }
+         else if (oc == 0x3b) break;                     // RTI
+         else if (oc == 0x0e || oc == 0x6e || oc == 0x7e)// JMP
+         {
+            if (d.Val == UNDEF) Flags |= STK_INDIRECT;
+            else if (m >= 0 && ModuleOfAddr(d.Val) == m)
+            {
+               a = d.Val; // jump inside module
+               continue;
+            }
+            else AddCall(ri,a,d.Val,s,u,1);
+            break;
+         }
+         else if (oc == 0x20 || oc == 0x16)              // BRA, LBRA
+         {
+            a = d.Val;
+            continue;
+         }
+         else if (d.Amo == AM_Relative && oc != 0x21 && oc != 0x1021)
+         {                                               // Bcc, LBcc
+            if (wn + 3 > wm * 3)
+            {
+               wm *= 2;
+               wl = (int *)ReallocOrDie(wl,wm*3*sizeof(int));
+            }
+            wl[wn++] = d.Val; wl[wn++] = s; wl[wn++] = u;
+         }
+         if (s > Rou[ri].Own)  Rou[ri].Own  = s;
+         if (u > Rou[ri].UOwn) Rou[ri].UOwn = u;
+         a = Next;
+      }
+   }
+   while (tn) // reset visited addresses for the next walk
+   {
+      a = touch[--tn];
+      WalkSeen[a] = 0;
+      WalkVisits[a] = 0;
+   }
+   Rou[ri].Flags |= Flags;
+   free(touch);
+   free(wl);
+}
+
+// **********
+// StackTotal
+// **********
+
+void StackTotal(int ri)
+{
+   struct RoutineStruct *r = Rou + ri;
+   struct RoutineStruct *t;
+   int i;
+
+   if (r->State == 2) return;
+   if (r->State == 1)
+   {
+      r->Flags |= STK_RECURSIVE;
+      return;
+   }
+   r->State  = 1;
+   r->Total  = r->Own;
+   r->UTotal = r->UOwn;
+   for (i=0 ; i < r->Ncall ; ++i)
+   {
+      if (r->Call[i].Target == UNDEF) continue;
+      t = Rou + RouIndex[r->Call[i].Target];
+      StackTotal(t - Rou);
+      if (t->State == 1) // call cycle
+      {
+         r->Flags |= STK_RECURSIVE;
+         continue;
+      }
+      if (r->Call[i].Depth + t->Total > r->Total)
+         r->Total = r->Call[i].Depth + t->Total;
+      if (r->Call[i].UDepth + t->UTotal > r->UTotal)
+         r->UTotal = r->Call[i].UDepth + t->UTotal;
+      if (t->Flags & ~STK_NEWSTACK) r->Flags |= STK_INHERIT;
+   }
+   r->State = 2;
+}
+
+// ***********
+// RoutineName
+// ***********
+
+const char *RoutineName(int a)
+{
+   static THREAD_LOCAL char Buf[8];
+   int i;
+
+   for (i=0 ; i < Modules ; ++i) // an empty module shares the start of the next
+      if (Mod[i].Start == a && (Mod[i].End < 0 || Mod[i].End > a)) return Mod[i].Name;
+   i = AddressIndex(a);
+   if (i >= 0 && lab[i].Att[0] == LPOS) return lab[i].Name;
+   snprintf(Buf,sizeof(Buf),"$%4.4x",a);
+   return Buf;
+}
+
+// ************
+// StackNotes
+// ************
+
+void StackNotes(FILE *fp, int Flags)
+{
+   if (Flags & STK_NEWSTACK)   fprintf(fp," new-stack");
+   if (Flags & STK_DYNAMIC)    fprintf(fp," dynamic");
+   if (Flags & STK_INDIRECT)   fprintf(fp," indirect");
+   if (Flags & STK_RECURSIVE)  fprintf(fp," recursive");
+   if (Flags & STK_UNBALANCED) fprintf(fp," unbalanced");
+   if (Flags & STK_UNBOUNDED)  fprintf(fp," unbounded");
+   if (Flags & STK_DATA)       fprintf(fp," data");
+   if (Flags & STK_EXTERN)     fprintf(fp," external");
+   if (Flags & STK_INHERIT)    fprintf(fp," (callee)");
+}
+
+// *************
+// AnalyzeRoutines
+// *************
+
+// Builds the routine table from modules, interrupt vectors
+// and all call targets found while walking the code.
+
+// *********
+// MainEntry
+// *********
+
+// start of the main line: the RESET vector, else the execution
+// address of a STORE, else the first assembled instruction
+
+int MainEntry(void)
+{
+   int i,a;
+
+   if (LOCK[0xfffe] && LOCK[0xffff]) return (ROM[0xfffe] << 8) | ROM[0xffff];
+   for (i=0 ; i < StoreCount ; ++i) if (SFE[i] > -1) return SFE[i] & 0xffff;
+   for (a=0 ; a < 0x10000 ; ++a) if (ADL[a] > 0) return a;
+   return -1;
+}
+
+void AnalyzeRoutines(void)
+{
+   int i,v;
+
+   if (RouIndex) return; // already done
+   InitOpcodeTable();
+   RouIndex   = (int *)MallocOrDie(0x10000*sizeof(int));
+   WalkSeen   = (int *)MallocOrDie(0x10000*sizeof(int));
+   WalkVisits = (char *)MallocOrDie(0x10000);
+   memset(RouIndex,0xff,0x10000*sizeof(int));
+
+   for (i=0 ; i < Modules ; ++i)
+      if (ADL[Mod[i].Start & 0xffff] > 0) AddRoutine(Mod[i].Start);
+   for (v=0xfff2 ; v < 0x10000 ; v+=2)
+      if (LOCK[v] && LOCK[v+1]) AddRoutine((ROM[v] << 8) | ROM[v+1]);
+   if ((v = MainEntry()) >= 0) AddRoutine(v);
+   for (i=0 ; i < Routines ; ++i) WalkRoutine(i); // may add routines
+   for (i=0 ; i < Routines ; ++i) StackTotal(i);
+}
+
+// Interrupt vectors and the size of the frame pushed by the CPU
+
+struct VectorStruct
+{
+   const char *Name;
+   int Address;
+   int Frame;
+} Vector[] =
+{
+   {"SWI3" ,0xfff2,12},
+   {"SWI2" ,0xfff4,12},
+   {"FIRQ" ,0xfff6, 3},
+   {"IRQ"  ,0xfff8,12},
+   {"SWI"  ,0xfffa,12},
+   {"NMI"  ,0xfffc,12},
+   {"RESET",0xfffe, 0}
+};
+
+#define VECTORS (int)(sizeof(Vector) / sizeof(struct VectorStruct))
+
+// ***********
+// StackReport
+// ***********
+
+void StackReport(const char *Filename)
+{
+   int i,j,a,Main,Worst,Frames;
+   struct RoutineStruct *r;
+   FILE *sp;
+
+   AnalyzeRoutines();
+   sp = AssertFileOp(fopen(Filename,"w"),"Open stack file");
+   CacheFile(Filename,1);
+   fprintf(sp,"Stack depth report for %s\n\n",Src);
+   fprintf(sp,"S    : bytes used below S at entry, including called routines\n");
+   fprintf(sp,"       (the return address pushed by the caller is not included)\n");
+   fprintf(sp,"Own  : bytes pushed by the routine itself\n");
+   fprintf(sp,"U    : bytes pushed onto U used as data stack\n\n");
+   fprintf(sp,"Entry Routine                            Own     S  U-Own     U Calls Notes\n");
+   fprintf(sp,"----- ------------------------------ ------ ----- ------ ----- ----- -----\n");
+   for (i=0 ; i < Routines ; ++i)
+   {
+      r = Rou + i;
+      fprintf(sp,"%4.4x  %-30.30s %6d %5d %6d %5d %5d",r->Entry,
+         RoutineName(r->Entry),r->Own,r->Total,r->UOwn,r->UTotal,r->Ncall);
+      StackNotes(sp,r->Flags);
+      fprintf(sp,"\n");
+   }
+
+   // interrupt frames are added on top of the deepest main line
+
+   fprintf(sp,"\nInterrupt vectors (6809 frame sizes)\n\n");
+   Main = Frames = 0;
+   for (i=0 ; i < VECTORS ; ++i)
+   {
+      a = Vector[i].Address;
+      if (!LOCK[a] || !LOCK[a+1]) continue;
+      j = RouIndex[(ROM[a] << 8) | ROM[a+1]];
+      r = Rou + j;
+      fprintf(sp,"%-5s $%4.4x -> %-30.30s frame %2d  handler %5d",
+         Vector[i].Name,a,RoutineName(r->Entry),Vector[i].Frame,r->Total);
+      StackNotes(sp,r->Flags);
+      fprintf(sp,"\n");
+      if (i == 6) Main = r->Total; // RESET handler is the main line
+      else if (i == 2 || i == 3 || i == 5) // FIRQ, IRQ, NMI may nest
+         Frames += Vector[i].Frame + r->Total;
+   }
+   if ((!LOCK[0xfffe] || !LOCK[0xffff]) && (a = MainEntry()) >= 0)
+   {
+      r = Rou + RouIndex[a];
+      fprintf(sp,"%-5s $%4.4x -> %-30.30s frame %2d  main    %5d","Main",a,
+         RoutineName(a),0,r->Total); // no RESET vector
+      StackNotes(sp,r->Flags);
+      fprintf(sp,"\n");
+      Main = r->Total;
+   }
+   Worst = Main + Frames;
+   fprintf(sp,"\nMain line            : %5d bytes\n",Main);
+   fprintf(sp,"Nested FIRQ/IRQ/NMI  : %5d bytes\n",Frames);
+   fprintf(sp,"Worst case S stack   : %5d bytes\n",Worst);
+   StatFileSize(Filename,sp);
+   if (fclose(sp)) AssertFileOp(NULL, "Close stack file");
+}
+
+// **********
+// Call Graph
+// **********
+
+// Nodes of the call graph are modules. Code outside of modules is
+// assigned to the preceding global label, so local labels like
+// "Delay.loop" are folded onto their module or routine.
+// Edges are JSR, BSR, LBSR and JMP instructions with known targets.
+
+THREAD_LOCAL struct NodeStruct
+{
+   char *Name;      // module or label name
+   int   Start;     // address of first byte
+   int   End;       // address after last byte
+   int   Cycles;    // sum of static cycles of all instructions
+   int   IncBytes;  // bytes including all reachable callees
+   int   IncCycles; // cycles including all reachable callees
+   int   Callers;   // number of calling nodes
+   int   Ncall;     // number of called nodes
+   int  *Callee;    // called nodes
+   int  *Count;     // number of call sites per called node
+   int   Mark;      // visit stamp for inclusive totals
+} *Nod;
+
+THREAD_LOCAL int Nodes;          // number of nodes
+THREAD_LOCAL int NodMax;         // allocated size of Nod
+THREAD_LOCAL int Graph;          // -g: write call graph
+
+// ********
+// FindNode
+// ********
+
+int FindNode(int Start, const char *Name)
+{
+   struct NodeStruct *n;
+   int i;
+
+   for (i=0 ; i < Nodes ; ++i) if (Nod[i].Start == Start) return i;
+   if (Nodes >= NodMax)
+   {
+      NodMax += 256;
+      Nod = (struct NodeStruct *)
+            ReallocOrDie(Nod,NodMax*sizeof(struct NodeStruct));
+   }
+   n = Nod + Nodes;
+   memset(n,0,sizeof(struct NodeStruct));
+   n->Name  = StrNDup((char *)Name,strlen(Name));
+   n->Start = Start;
+   n->End   = -1;
+   return Nodes++;
+}
+
+// **********
+// NodeOfAddr
+// **********
+
+int NodeOfAddr(int a)
+{
+   int i,b;
+   char Buf[8];
+
+   if ((i = ModuleOfAddr(a)) >= 0) return FindNode(Mod[i].Start,Mod[i].Name);
+   b = -1;
+   for (i=0 ; i < Labels ; ++i)
+   {
+      if (lab[i].Address > a || strchr(lab[i].Name,'.')) continue;
+      if (lab[i].Address != a && lab[i].Att[0] != LPOS) continue;
+      if (b < 0 || lab[i].Address > lab[b].Address) b = i;
+   }
+   if (b >= 0) return FindNode(lab[b].Address,lab[b].Name);
+   snprintf(Buf,sizeof(Buf),"$%4.4x",a);
+   return FindNode(a,Buf);
+}
+
+// *******
+// AddEdge
+// *******
+
+void AddEdge(int From, int To)
+{
+   struct NodeStruct *n = Nod + From;
+   int i;
+
+   for (i=0 ; i < n->Ncall ; ++i)
+   {
+      if (n->Callee[i] == To)
+      {
+         ++n->Count[i];
+         return;
+      }
+   }
+   n->Callee = (int *)ReallocOrDie(n->Callee,(n->Ncall+1)*sizeof(int));
+   n->Count  = (int *)ReallocOrDie(n->Count ,(n->Ncall+1)*sizeof(int));
+   n->Callee[n->Ncall] = To;
+   n->Count[n->Ncall++] = 1;
+   ++Nod[To].Callers;
+}
+
+// ************
+// InclusiveSum
+// ************
+
+void InclusiveSum(int r, int i)
+{
+   struct NodeStruct *n = Nod + i;
+   int j;
+
+   if (n->Mark == r + 1) return;
+   n->Mark = r + 1;
+   Nod[r].IncBytes  += n->End - n->Start;
+   Nod[r].IncCycles += n->Cycles;
+   for (j=0 ; j < n->Ncall ; ++j) InclusiveSum(r,n->Callee[j]);
+}
+
+// **************
+// BuildCallGraph
+// **************
+
+void BuildCallGraph(void)
+{
+   struct InsStruct d;
+   int a,i,e,oc;
+
+   InitOpcodeTable();
+   for (i=0 ; i < Modules ; ++i)
+   {
+      if (Mod[i].End >= 0 && Mod[i].End <= Mod[i].Start) continue; // empty
+      e = FindNode(Mod[i].Start,Mod[i].Name);
+      Nod[e].End = Mod[i].End < 0 ? Mod[i].Start : Mod[i].End;
+   }
+
+   // find calls and jumps
+
+   for (a=0 ; a < 0x10000 ; a += ADL[a] > 0 ? ADL[a] : 1)
+   {
+      if (ADL[a] <= 0) continue;
+      DecodeInstruction(a,&d);
+      oc = d.Opc;
+      if (oc != 0x17 && oc != 0x8d && oc != 0xad && oc != 0xbd &&
+          oc != 0x6e && oc != 0x7e) continue;
+      if (d.Val == UNDEF) continue;
+      if (AddressIndex(d.Val) < 0 && ModuleOfAddr(d.Val) < 0) continue;
+      i = NodeOfAddr(a);
+      e = NodeOfAddr(d.Val);
+      if (i != e) AddEdge(i,e);
+   }
+
+   // nodes outside modules end at the next node or data
+
+   for (i=0 ; i < Nodes ; ++i)
+   {
+      if (Nod[i].End >= 0) continue;
+      for (a=Nod[i].Start ; a < 0x10000 && ADL[a] ; ++a)
+      {
+         for (e=0 ; e < Nodes ; ++e) if (Nod[e].Start == a) break;
+         if (a > Nod[i].Start && e < Nodes) break;
+      }
+      Nod[i].End = a;
+   }
+
+   // static cycles: every instruction counted once
+
+   for (i=0 ; i < Nodes ; ++i)
+   for (a=Nod[i].Start ; a < Nod[i].End ; a += ADL[a] > 0 ? ADL[a] : 1)
+   {
+      if (ADL[a] > 0 || (ADL[a] < 0 && ROM[a] == 0x12))
+      {
+         DecodeInstruction(a,&d);
+         Nod[i].Cycles += d.Cyc;
+      }
+   }
+   for (i=0 ; i < Nodes ; ++i) InclusiveSum(i,i);
+}
+
+// **************
+// CallGraphReport
+// **************
+
+void CallGraphReport(const char *DotName, const char *TabName)
+{
+   struct NodeStruct *n;
+   int i,j;
+   FILE *gp;
+
+   BuildCallGraph();
+
+   gp = AssertFileOp(fopen(DotName,"w"),"Open dot file");
+   CacheFile(DotName,1);
+   fprintf(gp,"digraph \"%s\" {\n",Src);
+   fprintf(gp,"   node [shape=box fontname=\"Courier\"];\n");
+   for (i=0 ; i < Nodes ; ++i)
+   {
+      n = Nod + i;
+      fprintf(gp,"   n%d [label=\"%s\\n$%4.4x %d bytes %d cyc\\n"
+                 "incl %d bytes %d cyc\"];\n",i,n->Name,n->Start,
+                 n->End-n->Start,n->Cycles,n->IncBytes,n->IncCycles);
+   }
+   for (i=0 ; i < Nodes ; ++i)
+   for (j=0 ; j < Nod[i].Ncall ; ++j)
+   {
+      fprintf(gp,"   n%d -> n%d",i,Nod[i].Callee[j]);
+      if (Nod[i].Count[j] > 1) fprintf(gp," [label=\"%d\"]",Nod[i].Count[j]);
+      fprintf(gp,";\n");
+   }
+   fprintf(gp,"}\n");
+   StatFileSize(DotName,gp);
+   if (fclose(gp)) AssertFileOp(NULL, "Close dot file");
+
+   gp = AssertFileOp(fopen(TabName,"w"),"Open call graph file");
+   CacheFile(TabName,1);
+   fprintf(gp,"Call graph for %s\n\n",Src);
+   fprintf(gp,"Bytes and cycles: static size and sum of instruction cycles\n");
+   fprintf(gp,"Incl            : including all routines reachable by calls\n\n");
+   fprintf(gp,"Start Routine                         Bytes Cycles  Incl Cycles Callers Calls\n");
+   fprintf(gp,"----- ------------------------------ ------ ------ ----- ------ ------- -----\n");
+   for (i=0 ; i < Nodes ; ++i)
+   {
+      n = Nod + i;
+      fprintf(gp,"%4.4x  %-30.30s %6d %6d %5d %6d %7d",n->Start,n->Name,
+         n->End-n->Start,n->Cycles,n->IncBytes,n->IncCycles,n->Callers);
+      for (j=0 ; j < n->Ncall ; ++j)
+      {
+         fprintf(gp,"%s%s",j ? "," : " ",Nod[n->Callee[j]].Name);
+         if (n->Count[j] > 1) fprintf(gp,"(%d)",n->Count[j]);
+      }
+      fprintf(gp,"\n");
+   }
+   StatFileSize(TabName,gp);
+   if (fclose(gp)) AssertFileOp(NULL, "Close call graph file");
+}
+
+// ************
+// Tail Merging
+// ************
+
+#define MRGINS 64 // max. instructions of a merged tail
+#define MINBLK  8 // min. size of repeated blocks in hints
+
+THREAD_LOCAL int  *MrgPrev;    // address -> start of previous instruction (-1: none)
+THREAD_LOCAL unsigned char *MrgRefs; // address -> # of references (255: label)
+
+THREAD_LOCAL struct TailStruct
+{
+   int Start;     // first address of omitted copy
+   int End;       // address after omitted copy
+   int Shared;    // first address of shared copy
+   int Save;      // bytes saved
+} *Tail;
+
+THREAD_LOCAL int Tails;
+
+// ********
+// FlowEnd
+// ********
+
+int FlowEnd(struct InsStruct *d)
+{
+   int oc = d->Opc;
+
+   if (oc == 0x39 || oc == 0x3b) return 1;                 // RTS RTI
+   if ((oc == 0x35 || oc == 0x37) && (d->Pb & 0x80)) return 1; // PULS PULU PC
+   if (oc == 0x0e || oc == 0x6e || oc == 0x7e) return d->Reg != 4; // JMP
+   return 0;
+}
+
+// *********
+// MrgTarget
+// *********
+
+// returns the target of a relative branch, -1 if the instruction
+// has no relative operand and -2 if it depends on its position
+
+int MrgTarget(int a)
+{
+   struct InsStruct d;
+
+   DecodeInstruction(a,&d);
+   if (d.Amo == AM_Relative) return d.Val;
+   if (d.Amo == AM_Indexed && d.Reg == 4) return -2;
+   return -1;
+}
+
+// *********
+// ValidTail
+// *********
+
+// Checks, if the copy with instructions ins[0] (end) ... ins[k] (start)
+// can be omitted: relative branches must stay inside and no address
+// inside may be referenced from outside.
+
+int ValidTail(int *ins, int k, int End)
+{
+   int i,j,t,n;
+
+   for (i=0 ; i <= k ; ++i)
+   {
+      t = MrgTarget(ins[i]);
+      if (t == -2 || (t >= 0 && (t < ins[k] || t >= End))) return 0;
+      if (!MrgLine[ins[i]]) return 0;
+   }
+   for (i=0 ; i < k ; ++i)
+   {
+      if (MrgRefs[ins[i]] == 255) return 0; // label
+      n = 0;
+      for (j=0 ; j <= k ; ++j) if (MrgTarget(ins[j]) == ins[i]) ++n;
+      if (MrgRefs[ins[i]] > n) return 0;
+   }
+   return 1;
+}
+
+// *********
+// MatchTail
+// *********
+
+// Compares the tails ending with the instructions at x and y
+// and adds the better one of both directions to Tail[].
+
+void MatchTail(int x, int y)
+{
+   int ix[MRGINS],iy[MRGINS];
+   int n,k,px,py,ex,ey,d,l,s;
+   int BestSave,BestStart,BestShared,BestEnd;
+
+   ex = x + ADL[x];
+   ey = y + ADL[y];
+   px = x;
+   py = y;
+   for (n=0 ; n < MRGINS ; ++n)
+   {
+      if (px < 0 || py < 0 || ADL[px] != ADL[py]) break;
+      if (memcmp(ROM+px,ROM+py,ADL[px])) break;
+      if (px < ey && py < ex) break; // overlapping copies
+      if (MrgTarget(px) == -2 || !MrgLine[px] || !MrgLine[py]) break;
+      if (MrgTarget(px) < 0 && (!MrgOpd[px] || !MrgOpd[py] ||
+          strcmp(MrgOpd[px],MrgOpd[py]))) break; // values may differ
+      ix[n] = px;
+      iy[n] = py;
+      px = MrgPrev[px];
+      py = MrgPrev[py];
+   }
+   BestSave = 0;
+   BestStart = BestShared = BestEnd = 0;
+   for (k=n-1 ; k >= 0 ; --k) // omit copy y
+   {
+      l = ey - iy[k];
+      if (l <= 3 + BestSave) break;
+      if (!ValidTail(iy,k,ey)) continue;
+      d = ix[k] - (iy[k] + 2);
+      s = l - ((d >= -120 && d <= 120) ? 2 : 3);
+      if (s > BestSave)
+      {
+         BestSave = s; BestStart = iy[k]; BestEnd = ey; BestShared = ix[k];
+      }
+      break;
+   }
+   for (k=n-1 ; k >= 0 ; --k) // omit copy x
+   {
+      l = ex - ix[k];
+      if (l <= 3 + BestSave) break;
+      if (!ValidTail(ix,k,ex)) continue;
+      d = iy[k] - (ix[k] + 2);
+      s = l - ((d >= -120 && d <= 120) ? 2 : 3);
+      if (s > BestSave)
+      {
+         BestSave = s; BestStart = ix[k]; BestEnd = ex; BestShared = iy[k];
+      }
+      break;
+   }
+   if (BestSave < 2) return;
+   Tail = (struct TailStruct *)ReallocOrDie(Tail,(Tails+1)*sizeof(struct TailStruct));
+   Tail[Tails].Start  = BestStart;
+   Tail[Tails].End    = BestEnd;
+   Tail[Tails].Shared = BestShared;
+   Tail[Tails].Save   = BestSave;
+   ++Tails;
+}
+
+int CmpTail(const void *arg1, const void *arg2)
+{
+   const struct TailStruct *t1 = (const struct TailStruct *)arg1;
+   const struct TailStruct *t2 = (const struct TailStruct *)arg2;
+
+   if (t1->Save != t2->Save) return t2->Save - t1->Save;
+   return t1->Start - t2->Start;
+}
+
+// **********
+// MergeTails
+// **********
+
+// Searches identical tails in the image of phase 2 and prepares
+// the actions for the rerun. Returns the number of merged tails.
+
+int MergeTails(void)
+{
+   struct InsStruct d;
+   int a,b,i,j,l,n,Ends;
+   int *End;
+   char *Used;  // 1: omitted  2: shared
+
+   InitOpcodeTable();
+   MrgPrev = (int *)MallocOrDie(0x10000*sizeof(int));
+   MrgRefs = (unsigned char *)MallocOrDie(0x10000);
+   Used    = (char *)MallocOrDie(0x10000);
+   End     = (int *)MallocOrDie(0x10000*sizeof(int));
+   memset(MrgPrev,0xff,0x10000*sizeof(int));
+   memset(MrgRefs,0,0x10000);
+   memset(Used,0,0x10000);
+
+   // references: labels, vectors and operands of all instructions
+
+   for (i=0 ; i < Labels ; ++i)
+   {
+      a = lab[i].Address;
+      if (a >= 0 && a < 0x10000) MrgRefs[a] = 255;
+   }
+   for (a=0xfff0 ; a < 0x10000 ; a+=2)
+      if (LOCK[a]) MrgRefs[(ROM[a] << 8) | ROM[a+1]] = 255;
+   Ends = 0;
+   for (a=0 ; a < 0x10000 ; a += ADL[a] > 0 ? ADL[a] : 1)
+   {
+      if (ADL[a] <= 0) continue;
+      DecodeInstruction(a,&d);
+      if (d.Val != UNDEF && d.Amo != AM_Immediate && MrgRefs[d.Val] < 254)
+         ++MrgRefs[d.Val];
+      b = a + ADL[a];
+      if (b < 0x10000 && ADL[b] > 0) MrgPrev[b] = a;
+      if (FlowEnd(&d)) End[Ends++] = a;
+   }
+
+   // compare all pairs of tails with identical last instruction
+
+   Tails = 0;
+   for (i=0 ; i < Ends ; ++i)
+   for (j=i+1 ; j < Ends ; ++j)
+   {
+      a = End[i];
+      b = End[j];
+      if (ADL[a] == ADL[b] && !memcmp(ROM+a,ROM+b,ADL[a])) MatchTail(a,b);
+   }
+   qsort(Tail,Tails,sizeof(struct TailStruct),CmpTail);
+
+   // accept tails, that do not overlap with accepted ones
+
+   Merges = 0;
+   MrgLines = TotalLiNo + 1;
+   MrgAct = (int *)MallocOrDie(MrgLines*sizeof(int));
+   memset(MrgAct,0,MrgLines*sizeof(int));
+   for (i=0 ; i < Tails ; ++i)
+   {
+      l = Tail[i].End - Tail[i].Start;
+      for (a=0 ; a < l ; ++a)
+         if (Used[Tail[i].Start+a] || Used[Tail[i].Shared+a] == 1) break;
+      if (a < l) continue;
+      for (a=0 ; a < l ; ++a)
+      {
+         Used[Tail[i].Start+a]  = 1;
+         Used[Tail[i].Shared+a] = 2;
+      }
+      Mrg = (struct MergeStruct *)
+            ReallocOrDie(Mrg,(Merges+1)*sizeof(struct MergeStruct));
+      Mrg[Merges].Start  = Tail[i].Start;
+      Mrg[Merges].End    = Tail[i].End;
+      Mrg[Merges].Shared = Tail[i].Shared;
+      Mrg[Merges].Bra    = l - Tail[i].Save == 2;
+      Mrg[Merges].Label  = Merges;
+      for (j=0 ; j < Merges ; ++j) // reuse label of shared tail
+         if (Mrg[j].Shared == Tail[i].Shared) Mrg[Merges].Label = Mrg[j].Label;
+      n = MrgLine[Tail[i].Shared];
+      MrgAct[n] = (Mrg[Merges].Label << 2) | MRG_LABEL;
+      MrgAct[MrgLine[Tail[i].Start]] = (Merges << 2) | MRG_JUMP;
+      for (a=Tail[i].Start+ADL[Tail[i].Start] ; a < Tail[i].End ; a += ADL[a])
+         MrgAct[MrgLine[a]] = MRG_SKIP;
+      Merged += Tail[i].Save;
+      ++Merges;
+   }
+   free(End);
+   free(Used);
+   free(Tail);
+   free(MrgRefs);
+   free(MrgPrev);
+   Tail = NULL;
+   return Merges;
+}
+
+// ***********
+// MergeReport
+// ***********
+
+void MergeReport(void)
+{
+   int i;
+   struct MergeStruct *m;
+
+   for (i=0 ; i < Merges ; ++i)
+   {
+      m = Mrg + i;
+      fprintf(of,"TAIL %4.4x-%4.4x %3d bytes:%5d  -->  %s _TAIL_%d %4.4x:%5d\n",
+         m->Start,m->End-1,m->End-m->Start,MrgLiNo[m->Start],
+         m->Bra ? "BRA" : "JMP",m->Label,m->Shared,MrgLiNo[m->Shared]);
+      ++optc;
+   }
+}
+
+// *********
+// BlockSafe
+// *********
+
+// instructions, that may be moved into a subroutine
+
+int BlockSafe(int a)
+{
+   struct InsStruct d;
+   int oc;
+
+   if (ADL[a] <= 0) return 0;
+   DecodeInstruction(a,&d);
+   oc = d.Opc;
+   if (d.Mne < 0 || d.Amo == AM_Relative || d.Reg == 3 || d.Reg == 4) return 0;
+   if (FlowEnd(&d)) return 0;
+   if (oc == 0x32 || oc == 0x34 || oc == 0x35 ||       // LEAS PSHS PULS
+       oc == 0x3c || oc == 0x3f || oc == 0x13 ||       // CWAI SWI SYNC
+       oc == 0x103f || oc == 0x113f ||                 // SWI2 SWI3
+       oc == 0x1038 || oc == 0x1039) return 0;         // PSHSW PULSW
+   if ((oc == 0x1e || oc == 0x1f) &&                   // EXG TFR S,PC
+      ((d.Pb & 0x0e) == 4 || (d.Pb & 0xe0) == 0x40)) return 0;
+   if ((oc & 0xff) == 0xce || (oc & 0xff) == 0xde ||   // LDS
+       (oc & 0xff) == 0xee || (oc & 0xff) == 0xfe) return oc < 0x1000;
+   return 1;
+}
+
+// ***********
+// BlockLength
+// ***********
+
+// length of identical instructions at a and b in bytes
+
+int BlockLength(int a, int b)
+{
+   int l = 0;
+
+   while (a != b && a + l < 0x10000 && b + l < 0x10000 &&
+          ADL[a+l] > 0 && ADL[a+l] == ADL[b+l] && BlockSafe(a+l) &&
+          !memcmp(ROM+a+l,ROM+b+l,ADL[a+l]))
+   {
+      if ((a < b && a + l + ADL[a+l] > b) || (b < a && b + l + ADL[b+l] > a))
+         break; // overlapping
+      l += ADL[a+l];
+   }
+   return l;
+}
+
+// ************
+// ReportBlocks
+// ************
+
+// Writes hints for repeated instruction blocks, that may be replaced
+// by a subroutine call. Saving = (n-1) * length - 3 * n - 1.
+
+void ReportBlocks(void)
+{
+   int a,b,i,k,l,n,Min,Save;
+   int Pos[16];
+   char *Done;
+   int *Next; // next instruction with the same first two bytes
+   int *Head;
+
+   InitOpcodeTable();
+   Done = (char *)MallocOrDie(0x10000);
+   Next = (int *)MallocOrDie(0x10000*sizeof(int));
+   Head = (int *)MallocOrDie(0x10000*sizeof(int));
+   memset(Done,0,0x10000);
+   memset(Head,0xff,0x10000*sizeof(int));
+   for (a=0xffff ; a >= 0 ; --a)
+   {
+      if (ADL[a] <= 0) continue;
+      k = (ROM[a] << 8) | ROM[a+1];
+      Next[a] = Head[k];
+      Head[k] = a;
+   }
+
+   for (a=0 ; a < 0x10000 ; ++a)
+   {
+      if (Done[a] || !BlockSafe(a)) continue;
+      n = 1;
+      Pos[0] = a;
+      Min = 0x10000;
+      for (b=Next[a], k=0 ; b >= 0 && n < 16 && k < 256 ; b=Next[b], ++k)
+      {
+         if (Done[b] || ADL[b] != ADL[a]) continue;
+         l = BlockLength(a,b);
+         if (l < MINBLK) continue;
+         if (b < Pos[n-1] + (l < Min ? l : Min)) continue; // overlapping
+         if (l < Min) Min = l;
+         Pos[n++] = b;
+      }
+      if (n < 2) continue;
+      Save = (n-1) * Min - 3 * n - 1;
+      if (Save < 1) continue;
+      fprintf(of,"BLOCK %3d bytes x%d  saves %3d as subroutine:",Min,n,Save);
+      for (i=0 ; i < n ; ++i)
+      {
+         fprintf(of," %4.4x:%d",Pos[i],MrgLiNo[Pos[i]]);
+         memset(Done+Pos[i],1,Min);
+      }
+      fprintf(of,"\n");
+      ++optc;
+   }
+   free(Head);
+   free(Next);
+   free(Done);
+}
+
+// ********
+// CmpPool
+// ********
+
+int CmpPool(const void *arg1, const void *arg2)
+{
+   const struct PoolStruct *a = Pol + *(const int *)arg1;
+   const struct PoolStruct *b = Pol + *(const int *)arg2;
+
+   if (a->Len   != b->Len  ) return b->Len   - a->Len  ;
+   return a->Start - b->Start;
+}
+
+// ********
+// PoolSafe
+// ********
+
+// A pooled line may be omitted, if its label is the only one
+// inside the string and no unlabelled data follows the string.
+
+int PoolSafe(struct PoolStruct *s)
+{
+   int i,e;
+
+   if (s->Len < 1) return 0;
+   e = s->Start + s->Len;
+   for (i=0 ; i < Labels ; ++i)
+   {
+      if (lab[i].Address < s->Start || lab[i].Address >= e) continue;
+      if (strcmp(lab[i].Name,s->Name)) return 0;
+   }
+   if (e > 0xffff || !LOCK[e] || ADL[e] > 0) return 1;
+   return AddressIndex(e) >= 0;
+}
+
+// ***********
+// PoolStrings
+// ***********
+
+// Byte data, that is equal to or a suffix of another recorded line,
+// is aliased to the end of that line. Returns the # of pooled lines.
+
+int PoolStrings(void)
+{
+   int i,j,n,o;
+   int *Ord;
+   struct PoolStruct *s,*t;
+
+   Ord = (int *)MallocOrDie(Pools*sizeof(int));
+   for (i=0 ; i < Pools ; ++i) Ord[i] = i;
+   qsort(Ord,Pools,sizeof(int),CmpPool);
+
+   n = 0;
+   for (i=0 ; i < Pools ; ++i)
+   {
+      s = Pol + Ord[i];
+      if (!PoolSafe(s)) continue;
+      for (j=0 ; j < i ; ++j)
+      {
+         t = Pol + Ord[j];
+         o = t->Len - s->Len;
+         if (t->Target >= 0 || t->Start == s->Start) continue;
+         if (!memcmp(ROM+t->Start+o,ROM+s->Start,s->Len)) break;
+      }
+      if (j == i) continue;
+      s->Target = Ord[j];
+      s->Offset = o;
+      s->Next   = t->Alias;
+      t->Alias  = Ord[i];
+      Pooled   += s->Len;
+      ++n;
+   }
+   free(Ord);
+   if (n == 0) return 0;
+
+   PoolLines = TotalLiNo + 1;
+   PoolAct = (int *)MallocOrDie(PoolLines*sizeof(int));
+   memset(PoolAct,0,PoolLines*sizeof(int));
+   for (i=0 ; i < Pools ; ++i)
+      if (Pol[i].Target >= 0 || Pol[i].Alias >= 0) PoolAct[Pol[i].Line] = i + 1;
+   return n;
+}
+
+// **********
+// PoolReport
+// **********
+
+void PoolReport(void)
+{
+   int i;
+   struct PoolStruct *s,*t;
+
+   // POOL ON works without -u, -o or -z, which open the hint file
+   if (!of)
+   {
+      of = AssertFileOp(fopen(Opt,"w"), "Open hint file");
+      CacheFile(Opt,1);
+   }
+   for (i=0 ; i < Pools ; ++i)
+   {
+      s = Pol + i;
+      if (s->Target < 0) continue;
+      t = Pol + s->Target;
+      fprintf(of,"POOL %4.4x %3d bytes:%5d  -->  %s = %s+%d\n",
+         s->Start,s->Len,s->LiNo,s->Name,t->Name,s->Offset);
+      ++optc;
+   }
+}
+
+// *********
+// Simulator
+// *********
+
+// The assembled image is copied into Sim.Mem and executed by an
+// interpreter for the 6809 and 6309 instruction set. Cycles are
+// counted with the 6809 timing of Cycles[]. Memory mapped I/O is
+// configured with a file (--io), see RunConfig.
+
+#define CC_E 0x80 // entire state on stack
+#define CC_F 0x40 // FIRQ mask
+#define CC_H 0x20 // half carry
+#define CC_I 0x10 // IRQ mask
+#define CC_N 0x08 // negative
+#define CC_Z 0x04 // zero
+#define CC_V 0x02 // overflow
+#define CC_C 0x01 // carry
+
+enum SimOperation
+{
+   SO_ILL, SO_NEG, SO_COM, SO_LSR, SO_ROR, SO_ASR, SO_ASL, SO_ROL,
+   SO_DEC, SO_INC, SO_TST, SO_CLR, SO_SUB, SO_CMP, SO_SBC, SO_AND,
+   SO_BIT, SO_LD , SO_ST , SO_EOR, SO_ADC, SO_OR , SO_ADD, SO_LEA,
+   SO_PSH, SO_PUL, SO_JMP, SO_JSR, SO_BRA, SO_BSR, SO_RTS, SO_RTI,
+   SO_SWI, SO_NOP, SO_WAIT,SO_DAA, SO_SEX, SO_EXG, SO_TFR, SO_TFM,
+   SO_ABX, SO_MUL, SO_MULD,SO_DIVD,SO_DIVQ,SO_XIM, SO_BOP
+};
+
+// register codes: TFR/EXG codes 0-15 and
+
+#define SR_MEM -1   // memory operand
+#define SR_Q   16   // Q = D:W
+#define SR_MD  17   // mode register
+#define SR_R   18   // register to register (ADDR, CMPR, ...)
+#define SR_W   0x20 // PSHSW, PULSW, PSHUW, PULUW
+
+struct SimNameStruct
+{
+   char Name[6];
+   int  Code;
+};
+
+struct SimNameStruct SimBase[] =
+{
+   {"NEG",SO_NEG},{"COM",SO_COM},{"LSR",SO_LSR},{"ROR",SO_ROR},
+   {"ASR",SO_ASR},{"ASL",SO_ASL},{"LSL",SO_ASL},{"ROL",SO_ROL},
+   {"DEC",SO_DEC},{"INC",SO_INC},{"TST",SO_TST},{"CLR",SO_CLR},
+   {"SUB",SO_SUB},{"CMP",SO_CMP},{"SBC",SO_SBC},{"AND",SO_AND},
+   {"BIT",SO_BIT},{"LD" ,SO_LD },{"ST" ,SO_ST },{"EOR",SO_EOR},
+   {"ADC",SO_ADC},{"OR" ,SO_OR },{"ADD",SO_ADD},{"LEA",SO_LEA},
+   {"PSH",SO_PSH},{"PUL",SO_PUL}
+};
+
+struct SimNameStruct SimSuffix[] =
+{
+   {""  ,SR_MEM},{"A" , 8},{"B" , 9},{"D" , 0},{"E" ,14},{"F" ,15},
+   {"W" , 6},{"X" , 1},{"Y" , 2},{"U" , 3},{"S" , 4},{"Q" ,SR_Q},
+   {"MD",SR_MD},{"CC",10},{"R" ,SR_R},{"SW",4|SR_W},{"UW",3|SR_W}
+};
+
+struct SimNameStruct SimSpecial[] =
+{
+   {"JMP" ,SO_JMP },{"JSR"  ,SO_JSR },{"BSR" ,SO_BSR },{"LBSR" ,SO_BSR },
+   {"RTS" ,SO_RTS },{"RTI"  ,SO_RTI },{"SWI" ,SO_SWI },{"SWI2" ,SO_SWI },
+   {"SWI3",SO_SWI },{"NOP"  ,SO_NOP },{"SYNC",SO_WAIT},{"CWAI" ,SO_WAIT},
+   {"DAA" ,SO_DAA },{"SEX"  ,SO_SEX },{"SEXW",SO_SEX },{"EXG"  ,SO_EXG },
+   {"TFR" ,SO_TFR },{"TFM"  ,SO_TFM },{"ABX" ,SO_ABX },{"MUL"  ,SO_MUL },
+   {"MULD",SO_MULD},{"DIVD" ,SO_DIVD},{"DIVQ",SO_DIVQ},{"OIM"  ,SO_XIM },
+   {"AIM" ,SO_XIM },{"EIM"  ,SO_XIM },{"TIM" ,SO_XIM },{"BAND" ,SO_BOP },
+   {"BIAND",SO_BOP},{"BOR"  ,SO_BOP },{"BIOR",SO_BOP },{"BEOR" ,SO_BOP },
+   {"BIEOR",SO_BOP},{"LDBT" ,SO_BOP },{"STBT",SO_BOP }
+};
+
+#define SIMOPS (sizeof(Mat) / sizeof(struct MatStruct))
+
+THREAD_LOCAL unsigned char SimOp[SIMOPS]; // Mat[] index -> operation
+THREAD_LOCAL signed char  SimReg[SIMOPS]; // Mat[] index -> register code or variant
+
+// reasons for the end of a simulation
+
+enum SimStop
+{
+   SIM_RUN, SIM_RETURN, SIM_LIMIT, SIM_BREAK, SIM_ILLEGAL,
+   SIM_IO, SIM_WAIT, SIM_DIV0
+};
+
+const char *SimStopText[] =
+{
+   "running", "return from entry", "cycle limit", "breakpoint",
+   "illegal opcode", "I/O stop", "SYNC or CWAI", "division by zero"
+};
+
+const char *SimRegName[16] =
+{
+   "D","X","Y","U","S","PC","W","V","A","B","CC","DP","","","E","F"
+};
+
+THREAD_LOCAL struct SimStruct
+{
+   int A,B,E,F;        // accumulators
+   int X,Y,U,S,V;      // 16 bit registers
+   int PC,DP,CC,MD;    // program counter, direct page, flags, mode
+   int Depth;          // subroutine level (0: entry routine)
+   int Call;           // called address + 1 of current instruction
+   int Ret;            // current instruction returned
+   int Stop;           // reason for stop (SIM_RUN: running)
+   long long Cycles;   // executed cycles
+   long long Steps;    // executed instructions
+   unsigned char *Mem; // 64K address space
+} Sim;
+
+// I/O configuration
+
+enum IOType { IO_IN, IO_OUT, IO_STOP };
+
+THREAD_LOCAL struct IOStruct
+{
+   int   Lo,Hi;  // address range
+   int   Type;   // IO_IN, IO_OUT or IO_STOP
+   int   Value;  // value read (IN without file or at end of file)
+   FILE *fp;     // file for IN and OUT (NULL: constant or stdout)
+} *SimIO;
+
+THREAD_LOCAL int SimIOs;             // number of I/O ranges
+THREAD_LOCAL short *SimIOMap;        // address -> I/O range + 1 (0: memory)
+
+// Profile
+
+#define SIMDEPTH 256
+
+THREAD_LOCAL struct SimCallStruct
+{
+   int       Adr;  // called address
+   long long Cyc;  // cycles at call
+} SimStk[SIMDEPTH];
+
+THREAD_LOCAL long long *SimCyc;      // cycles per instruction address
+THREAD_LOCAL long long *SimCnt;      // executions per instruction address
+THREAD_LOCAL long long *SimCalls;    // calls per address
+THREAD_LOCAL long long *SimIncl;     // inclusive cycles per called address
+THREAD_LOCAL char *SimBrk;           // breakpoint flags
+
+THREAD_LOCAL char *RunLabel;         // --run: entry label
+THREAD_LOCAL char *RunIO;            // --io : I/O configuration file
+THREAD_LOCAL char *RunBreak[16];     // --break: labels
+THREAD_LOCAL int   RunBreaks;        // number of breakpoint labels
+THREAD_LOCAL long long RunLimit = 100000000; // --cycles: cycle limit
+
+// *******
+// SimInit
+// *******
+
+// Classifies the mnemonics of Mat[] for the interpreter
+
+void SimInit(void)
+{
+   int i,j,k,l;
+   const char *m;
+
+   InitOpcodeTable();
+   for (i=0 ; i < (int)SIMOPS ; ++i)
+   {
+      m = Mat[i].Mne;
+      SimOp[i]  = SO_ILL;
+      SimReg[i] = SR_MEM;
+      for (j=0 ; j < (int)(sizeof(SimSpecial)/sizeof(SimSpecial[0])) ; ++j)
+      if (!strcmp(m,SimSpecial[j].Name))
+      {
+         SimOp[i] = SimSpecial[j].Code;
+         if (SimOp[i] == SO_BOP) SimReg[i] = j - 27; // BAND=27 ... STBT -> 0-7
+         if (SimOp[i] == SO_XIM) SimReg[i] = m[0];
+         if (!strcmp(m,"SEXW")) SimReg[i] = 6;
+         break;
+      }
+      if (SimOp[i] != SO_ILL) continue;
+      if (Mat[i].Opc[AM_Relative] >= 0)
+      {
+         SimOp[i] = SO_BRA;
+         continue;
+      }
+      for (j=0 ; j < (int)(sizeof(SimBase)/sizeof(SimBase[0])) ; ++j)
+      {
+         l = strlen(SimBase[j].Name);
+         if (strncmp(m,SimBase[j].Name,l)) continue;
+         for (k=0 ; k < (int)(sizeof(SimSuffix)/sizeof(SimSuffix[0])) ; ++k)
+         if (!strcmp(m+l,SimSuffix[k].Name)) break;
+         if (k == (int)(sizeof(SimSuffix)/sizeof(SimSuffix[0]))) continue;
+         SimOp[i]  = SimBase[j].Code;
+         SimReg[i] = SimSuffix[k].Code;
+         break;
+      }
+   }
+}
+
+// ***************
+// SimRead SimWrite
+// ***************
+
+int SimRead(int a)
+{
+   int c;
+   struct IOStruct *io;
+
+   a &= 0xffff;
+   if (!SimIOMap || !SimIOMap[a]) return Sim.Mem[a];
+   io = SimIO + SimIOMap[a] - 1;
+   if (io->Type != IO_IN) return Sim.Mem[a];
+   if (!io->fp) return io->Value;
+   c = fgetc(io->fp);
+   return c == EOF ? io->Value : c;
+}
+
+void SimWrite(int a, int v)
+{
+   struct IOStruct *io;
+
+   a &= 0xffff;
+   if (SimIOMap && SimIOMap[a])
+   {
+      io = SimIO + SimIOMap[a] - 1;
+      if (io->Type == IO_OUT)
+      {
+         fputc(v & 0xff,io->fp ? io->fp : stdout);
+         return;
+      }
+      if (io->Type == IO_STOP) Sim.Stop = SIM_IO;
+      return;
+   }
+   Sim.Mem[a] = v;
+}
+
+int SimRead16(int a)
+{
+   return (SimRead(a) << 8) | SimRead(a+1);
+}
+
+int SimFetch(void)
+{
+   int v = SimRead(Sim.PC);
+   Sim.PC = (Sim.PC + 1) & 0xffff;
+   return v;
+}
+
+int SimFetch16(void)
+{
+   int v = SimFetch() << 8;
+   return v | SimFetch();
+}
+
+// *********
+// Registers
+// *********
+
+int SimBits(int r)
+{
+   if (r == SR_Q) return 32;
+   if (r >= 0 && r < 8) return 16;
+   return 8;
+}
+
+int SimGetReg(int r)
+{
+   switch (r)
+   {
+      case  0: return (Sim.A << 8) | Sim.B;
+      case  1: return Sim.X;
+      case  2: return Sim.Y;
+      case  3: return Sim.U;
+      case  4: return Sim.S;
+      case  5: return Sim.PC;
+      case  6: return (Sim.E << 8) | Sim.F;
+      case  7: return Sim.V;
+      case  8: return Sim.A;
+      case  9: return Sim.B;
+      case 10: return Sim.CC;
+      case 11: return Sim.DP;
+      case 14: return Sim.E;
+      case 15: return Sim.F;
+      case SR_MD: return Sim.MD;
+   }
+   return 0;
+}
+
+void SimSetReg(int r, int v)
+{
+   v &= (r >= 0 && r < 8) ? 0xffff : 0xff;
+   switch (r)
+   {
+      case  0: Sim.A = v >> 8; Sim.B = v & 0xff; break;
+      case  1: Sim.X  = v; break;
+      case  2: Sim.Y  = v; break;
+      case  3: Sim.U  = v; break;
+      case  4: Sim.S  = v; break;
+      case  5: Sim.PC = v; break;
+      case  6: Sim.E = v >> 8; Sim.F = v & 0xff; break;
+      case  7: Sim.V  = v; break;
+      case  8: Sim.A  = v; break;
+      case  9: Sim.B  = v; break;
+      case 10: Sim.CC = v; break;
+      case 11: Sim.DP = v; break;
+      case 14: Sim.E  = v; break;
+      case 15: Sim.F  = v; break;
+      case SR_MD: Sim.MD = v; break;
+   }
+}
+
+unsigned int SimGetQ(void)
+{
+   return ((unsigned int)SimGetReg(0) << 16) | (unsigned int)SimGetReg(6);
+}
+
+void SimSetQ(unsigned int q)
+{
+   SimSetReg(0,q >> 16);
+   SimSetReg(6,q & 0xffff);
+}
+
+int *SimIndexReg(int n)
+{
+   switch (n & 3)
+   {
+      case 0: return &Sim.X;
+      case 1: return &Sim.Y;
+      case 2: return &Sim.U;
+   }
+   return &Sim.S;
+}
+
+// *************
+// Stack access
+// *************
+
+void SimPush(int *sp, int v)
+{
+   *sp = (*sp - 1) & 0xffff;
+   SimWrite(*sp,v);
+}
+
+void SimPush16(int *sp, int v)
+{
+   SimPush(sp,v & 0xff);
+   SimPush(sp,v >> 8);
+}
+
+int SimPull(int *sp)
+{
+   int v = SimRead(*sp);
+   *sp = (*sp + 1) & 0xffff;
+   return v;
+}
+
+int SimPull16(int *sp)
+{
+   int v = SimPull(sp) << 8;
+   return v | SimPull(sp);
+}
+
+// PSHS, PSHU, PULS and PULU with postbyte pb
+
+void SimPushRegs(int *sp, int pb)
+{
+   if (pb & 0x80) SimPush16(sp,Sim.PC);
+   if (pb & 0x40) SimPush16(sp,sp == &Sim.S ? Sim.U : Sim.S);
+   if (pb & 0x20) SimPush16(sp,Sim.Y);
+   if (pb & 0x10) SimPush16(sp,Sim.X);
+   if (pb & 0x08) SimPush(sp,Sim.DP);
+   if (pb & 0x04) SimPush(sp,Sim.B);
+   if (pb & 0x02) SimPush(sp,Sim.A);
+   if (pb & 0x01) SimPush(sp,Sim.CC);
+}
+
+void SimPullRegs(int *sp, int pb)
+{
+   if (pb & 0x01) Sim.CC = SimPull(sp);
+   if (pb & 0x02) Sim.A  = SimPull(sp);
+   if (pb & 0x04) Sim.B  = SimPull(sp);
+   if (pb & 0x08) Sim.DP = SimPull(sp);
+   if (pb & 0x10) Sim.X  = SimPull16(sp);
+   if (pb & 0x20) Sim.Y  = SimPull16(sp);
+   if (pb & 0x40)
+   {
+      if (sp == &Sim.S) Sim.U = SimPull16(sp);
+      else              Sim.S = SimPull16(sp);
+   }
+   if (pb & 0x80) Sim.PC = SimPull16(sp);
+}
+
+// entire state for SWI and RTI, E and F in 6309 native mode
+
+void SimPushAll(void)
+{
+   SimPush16(&Sim.S,Sim.PC);
+   SimPush16(&Sim.S,Sim.U);
+   SimPush16(&Sim.S,Sim.Y);
+   SimPush16(&Sim.S,Sim.X);
+   SimPush(&Sim.S,Sim.DP);
+   if (Sim.MD & 1)
+   {
+      SimPush(&Sim.S,Sim.F);
+      SimPush(&Sim.S,Sim.E);
+   }
+   SimPush(&Sim.S,Sim.B);
+   SimPush(&Sim.S,Sim.A);
+   SimPush(&Sim.S,Sim.CC);
+}
+
+// *****
+// Flags
+// *****
+
+void SimNZ(unsigned int r, int bits)
+{
+   unsigned int m = bits == 32 ? 0xffffffff : (1u << bits) - 1;
+
+   Sim.CC &= ~(CC_N | CC_Z);
+   if ((r >> (bits-1)) & 1) Sim.CC |= CC_N;
+   if (!(r & m))            Sim.CC |= CC_Z;
+}
+
+int SimAdd(int a, int b, int c, int bits)
+{
+   int m = (1 << bits) - 1;
+   int r = a + b + c;
+
+   Sim.CC &= ~(CC_H | CC_V | CC_C);
+   if (bits == 8 && ((a ^ b ^ r) & 0x10)) Sim.CC |= CC_H;
+   if (r > m) Sim.CC |= CC_C;
+   if (((~(a ^ b) & (a ^ r)) >> (bits-1)) & 1) Sim.CC |= CC_V;
+   r &= m;
+   SimNZ(r,bits);
+   return r;
+}
+
+int SimSub(int a, int b, int c, int bits)
+{
+   int m = (1 << bits) - 1;
+   int r = a - b - c;
+
+   Sim.CC &= ~(CC_V | CC_C);
+   if (r < 0) Sim.CC |= CC_C;
+   if ((((a ^ b) & (a ^ r)) >> (bits-1)) & 1) Sim.CC |= CC_V;
+   r &= m;
+   SimNZ(r,bits);
+   return r;
+}
+
+// NEG, COM, LSR, ROR, ASR, ASL, ROL, DEC, INC, TST, CLR
+
+int SimUnary(int op, int v, int bits)
+{
+   int r,s,m,c;
+
+   m = (1 << bits) - 1;
+   s = 1 << (bits-1);
+   c = Sim.CC & CC_C;
+   switch (op)
+   {
+      case SO_NEG:
+         r = (-v) & m;
+         Sim.CC &= ~(CC_V | CC_C);
+         if (r)      Sim.CC |= CC_C;
+         if (v == s) Sim.CC |= CC_V;
+         break;
+      case SO_COM:
+         r = ~v & m;
+         Sim.CC = (Sim.CC & ~CC_V) | CC_C;
+         break;
+      case SO_LSR:
+      case SO_ROR:
+      case SO_ASR:
+         r = v >> 1;
+         if (op == SO_ROR && c) r |= s;
+         if (op == SO_ASR)      r |= v & s;
+         Sim.CC = (Sim.CC & ~CC_C) | (v & 1);
+         break;
+      case SO_ASL:
+      case SO_ROL:
+         r = ((v << 1) | (op == SO_ROL ? c : 0)) & m;
+         Sim.CC &= ~(CC_V | CC_C);
+         if (v & s)            Sim.CC |= CC_C;
+         if ((v ^ (v << 1)) & s) Sim.CC |= CC_V;
+         break;
+      case SO_DEC:
+         r = (v - 1) & m;
+         Sim.CC &= ~CC_V;
+         if (v == s) Sim.CC |= CC_V;
+         break;
+      case SO_INC:
+         r = (v + 1) & m;
+         Sim.CC &= ~CC_V;
+         if (v == s - 1) Sim.CC |= CC_V;
+         break;
+      case SO_CLR:
+         r = 0;
+         Sim.CC &= ~(CC_V | CC_C);
+         break;
+      default: // TST
+         r = v;
+         Sim.CC &= ~CC_V;
+   }
+   SimNZ(r,bits);
+   return r;
+}
+
+// SUB, CMP, SBC, AND, BIT, LD, ST, EOR, ADC, OR, ADD
+
+int SimBinary(int op, int a, int b, int bits)
+{
+   int r,c;
+
+   c = Sim.CC & CC_C;
+   switch (op)
+   {
+      case SO_ADD: return SimAdd(a,b,0,bits);
+      case SO_ADC: return SimAdd(a,b,c,bits);
+      case SO_SUB:
+      case SO_CMP: return SimSub(a,b,0,bits);
+      case SO_SBC: return SimSub(a,b,c,bits);
+      case SO_AND:
+      case SO_BIT: r = a & b; break;
+      case SO_OR : r = a | b; break;
+      case SO_EOR: r = a ^ b; break;
+      case SO_LD : r = b;     break;
+      default    : r = a;     break; // ST
+   }
+   SimNZ(r,bits);
+   Sim.CC &= ~CC_V;
+   return r;
+}
+
+int SimCondition(int cc)
+{
+   int n,z,v,c,t;
+
+   n = (Sim.CC >> 3) & 1;
+   z = (Sim.CC >> 2) & 1;
+   v = (Sim.CC >> 1) & 1;
+   c =  Sim.CC       & 1;
+   switch (cc >> 1)
+   {
+      case 0 : t = 1;               break; // BRA BRN
+      case 1 : t = !(c | z);        break; // BHI BLS
+      case 2 : t = !c;              break; // BCC BCS
+      case 3 : t = !z;              break; // BNE BEQ
+      case 4 : t = !v;              break; // BVC BVS
+      case 5 : t = !n;              break; // BPL BMI
+      case 6 : t = !(n ^ v);        break; // BGE BLT
+      default: t = !((n ^ v) | z);  break; // BGT BLE
+   }
+   return (cc & 1) ? !t : t;
+}
+
+// **********
+// SimIndexed
+// **********
+
+// returns the effective address of an indexed operand
+// and adds the cycles of the indexed mode to *c
+
+int SimIndexed(int *c)
+{
+   int pb,ea,*r;
+   struct InsStruct d;
+
+   pb = SimFetch();
+   d.Cyc = 0;
+   IndexedInfo(pb,&d);
+   *c += d.Cyc;
+   r = SimIndexReg(pb >> 5);
+   if (!(pb & 0x80)) // 5 bit offset
+      return (*r + ((pb & 0x10) ? (pb & 0x1f) - 32 : (pb & 0x1f))) & 0xffff;
+   switch (pb) // 6309 W register modes
+   {
+      case 0x8f: case 0x90: ea = SimGetReg(6); break;
+      case 0xaf: case 0xb0: ea = SimGetReg(6) + SimFetch16(); break;
+      case 0xcf: case 0xd0:
+         ea = SimGetReg(6);
+         SimSetReg(6,ea+2);
+         break;
+      case 0xef: case 0xf0:
+         SimSetReg(6,SimGetReg(6)-2);
+         ea = SimGetReg(6);
+         break;
+      default:
+         switch (pb & 0x0f)
+         {
+            case 0x0: ea = *r; *r = (*r + 1) & 0xffff; break;
+            case 0x1: ea = *r; *r = (*r + 2) & 0xffff; break;
+            case 0x2: *r = (*r - 1) & 0xffff; ea = *r; break;
+            case 0x3: *r = (*r - 2) & 0xffff; ea = *r; break;
+            case 0x4: ea = *r; break;
+            case 0x5: ea = *r + (signed char)Sim.B; break;
+            case 0x6: ea = *r + (signed char)Sim.A; break;
+            case 0x7: ea = *r + (signed char)Sim.E; break;
+            case 0x8: ea = *r + (signed char)SimFetch(); break;
+            case 0x9: ea = *r + (short)SimFetch16(); break;
+            case 0xa: ea = *r + (signed char)Sim.F; break;
+            case 0xb: ea = *r + (short)SimGetReg(0); break;
+            case 0xc: ea = (signed char)SimFetch(); ea += Sim.PC; break;
+            case 0xd: ea = (short)SimFetch16(); ea += Sim.PC; break;
+            case 0xe: ea = *r + (short)SimGetReg(6); break;
+            default : ea = SimFetch16(); break; // [n16]
+         }
+   }
+   ea &= 0xffff;
+   if (INDIRECT(pb)) ea = SimRead16(ea);
+   return ea;
+}
+
+// *******
+// SimLoad
+// *******
+
+unsigned int SimLoad(int ea, int bits)
+{
+   unsigned int v = 0;
+
+   while (bits > 0)
+   {
+      v = (v << 8) | SimRead(ea++);
+      bits -= 8;
+   }
+   return v;
+}
+
+void SimStore(int ea, unsigned int v, int bits)
+{
+   while (bits > 0)
+   {
+      bits -= 8;
+      SimWrite(ea++,(v >> bits) & 0xff);
+   }
+}
+
+// *******
+// SimStep
+// *******
+
+// executes one instruction and returns its cycles
+
+int SimStep(void)
+{
+   int a,i,m,n,c,oc,op,r,ea,pb,im,v,w,bits,page,*sp;
+   unsigned int q;
+   long long s,t;
+
+   a = Sim.PC;
+   oc = SimFetch();
+   page = 0;
+   if (oc == 0x10 || oc == 0x11)
+   {
+      page = oc - 0x0f;
+      oc = (oc << 8) | SimFetch();
+   }
+   i = OpcMne[page][oc & 0xff];
+   if (i < 0 || i >= DimOp || SimOp[i] == SO_ILL)
+   {
+      Sim.PC = a;
+      Sim.Stop = SIM_ILLEGAL;
+      return 0;
+   }
+   op = SimOp[i];
+   r  = SimReg[i];
+   m  = OpcAmo[page][oc & 0xff];
+   c  = Cycles[page][oc & 0xff];
+   pb = im = ea = 0;
+   if (op == SO_XIM) im = SimFetch();
+
+   switch (m)
+   {
+      case AM_Register:
+         pb = SimFetch();
+         break;
+      case AM_Relative:
+         if (Mat[i].Mne[0] == 'L') v = (short)SimFetch16();
+         else                      v = (signed char)SimFetch();
+         ea = (Sim.PC + v) & 0xffff;
+         break;
+      case AM_Immediate:
+         ea = Sim.PC;
+         if (oc == 0x118d || op == SO_WAIT)      n = 1; // DIVD, CWAI
+         else if (op == SO_MULD || op == SO_DIVQ) n = 2;
+         else n = SimBits(r) >> 3;
+         Sim.PC = (Sim.PC + n) & 0xffff;
+         break;
+      case AM_Direct:
+         if (op == SO_BOP) pb = SimFetch();
+         ea = (Sim.DP << 8) | SimFetch();
+         break;
+      case AM_Indexed:
+         ea = SimIndexed(&c);
+         break;
+      case AM_Extended:
+         ea = SimFetch16();
+         break;
+   }
+
+   if (op >= SO_NEG && op <= SO_CLR)
+   {
+      bits = r == SR_MEM ? 8 : SimBits(r);
+      v = r == SR_MEM ? SimRead(ea) : SimGetReg(r);
+      v = SimUnary(op,v,bits);
+      if (op != SO_TST)
+      {
+         if (r == SR_MEM) SimWrite(ea,v);
+         else             SimSetReg(r,v);
+      }
+      return c;
+   }
+
+   if (op >= SO_SUB && op <= SO_ADD)
+   {
+      if (r == 10) // ANDCC, ORCC
+      {
+         v = SimRead(ea);
+         if (op == SO_AND) Sim.CC &= v;
+         else              Sim.CC |= v;
+      }
+      else if (r == SR_MD) // LDMD, BITMD
+      {
+         v = SimRead(ea);
+         if (op == SO_LD) Sim.MD = (Sim.MD & 0xc0) | (v & 3);
+         else
+         {
+            Sim.CC &= ~CC_Z;
+            if (!(Sim.MD & v & 0xc0)) Sim.CC |= CC_Z;
+            Sim.MD &= ~(v & 0xc0);
+         }
+      }
+      else if (r == SR_Q) // LDQ, STQ
+      {
+         if (op == SO_LD) SimSetQ(q = SimLoad(ea,32));
+         else SimStore(ea,q = SimGetQ(),32);
+         SimNZ(q,32);
+         Sim.CC &= ~CC_V;
+      }
+      else if (r == SR_R) // ADDR, CMPR, ...
+      {
+         w = pb & 15;
+         bits = SimBits(w);
+         v = SimGetReg(pb >> 4) & ((1 << bits) - 1);
+         v = SimBinary(op,SimGetReg(w),v,bits);
+         if (op != SO_CMP) SimSetReg(w,v);
+      }
+      else
+      {
+         bits = SimBits(r);
+         w = SimGetReg(r);
+         if (op == SO_ST)
+         {
+            SimStore(ea,w,bits);
+            SimBinary(op,w,w,bits);
+         }
+         else
+         {
+            v = SimBinary(op,w,SimLoad(ea,bits),bits);
+            if (op != SO_CMP && op != SO_BIT) SimSetReg(r,v);
+         }
+      }
+      return c;
+   }
+
+   switch (op)
+   {
+      case SO_LEA:
+         SimSetReg(r,ea);
+         if (r == 1 || r == 2)
+         {
+            Sim.CC &= ~CC_Z;
+            if (!ea) Sim.CC |= CC_Z;
+         }
+         break;
+      case SO_PSH:
+      case SO_PUL:
+         sp = (r & 0x1f) == 4 ? &Sim.S : &Sim.U;
+         if (r & SR_W)
+         {
+            if (op == SO_PSH) SimPush16(sp,SimGetReg(6));
+            else              SimSetReg(6,SimPull16(sp));
+            break;
+         }
+         c += PushBytes(pb);
+         if (op == SO_PSH) SimPushRegs(sp,pb);
+         else
+         {
+            SimPullRegs(sp,pb);
+            if ((pb & 0x80) && sp == &Sim.S) Sim.Ret = 1;
+         }
+         break;
+      case SO_JMP:
+         Sim.PC = ea;
+         break;
+      case SO_JSR:
+      case SO_BSR:
+         SimPush16(&Sim.S,Sim.PC);
+         Sim.PC = ea;
+         Sim.Call = ea + 1;
+         break;
+      case SO_BRA:
+         v = oc & 0xff;
+         v = (v >= 0x20 && v <= 0x2f) ? v & 15 : 0; // LBRA: 0x16
+         if (SimCondition(v))
+         {
+            Sim.PC = ea;
+            if (page && (oc & 0xff) != 0x21) ++c;
+         }
+         break;
+      case SO_RTS:
+         Sim.PC = SimPull16(&Sim.S);
+         Sim.Ret = 1;
+         break;
+      case SO_RTI:
+         Sim.CC = SimPull(&Sim.S);
+         if (Sim.CC & CC_E)
+         {
+            Sim.A = SimPull(&Sim.S);
+            Sim.B = SimPull(&Sim.S);
+            if (Sim.MD & 1)
+            {
+               Sim.E = SimPull(&Sim.S);
+               Sim.F = SimPull(&Sim.S);
+               c += 2;
+            }
+            Sim.DP = SimPull(&Sim.S);
+            Sim.X  = SimPull16(&Sim.S);
+            Sim.Y  = SimPull16(&Sim.S);
+            Sim.U  = SimPull16(&Sim.S);
+            c += 9;
+         }
+         Sim.PC = SimPull16(&Sim.S);
+         Sim.Ret = 1;
+         break;
+      case SO_SWI:
+         Sim.CC |= CC_E;
+         SimPushAll();
+         if (page == 0) Sim.CC |= CC_I | CC_F;
+         Sim.PC = SimRead16(page == 0 ? 0xfffa : page == 1 ? 0xfff4 : 0xfff2);
+         Sim.Call = Sim.PC + 1;
+         break;
+      case SO_WAIT:
+         if (m == AM_Immediate) Sim.CC &= SimRead(ea);
+         Sim.PC = a;
+         Sim.Stop = SIM_WAIT;
+         break;
+      case SO_DAA:
+         v = 0;
+         if ((Sim.CC & CC_H) || (Sim.A & 15) > 9) v |= 0x06;
+         if ((Sim.CC & CC_C) || Sim.A > 0x99) v |= 0x60;
+         w = Sim.A + v;
+         Sim.CC &= ~CC_V;
+         if (w > 0xff) Sim.CC |= CC_C;
+         Sim.A = w & 0xff;
+         SimNZ(Sim.A,8);
+         break;
+      case SO_SEX:
+         if (r == 6) // SEXW
+         {
+            SimSetReg(0,(Sim.E & 0x80) ? 0xffff : 0);
+            SimNZ(SimGetQ(),32);
+         }
+         else
+         {
+            Sim.A = (Sim.B & 0x80) ? 0xff : 0;
+            SimNZ(SimGetReg(0),16);
+         }
+         break;
+      case SO_EXG:
+      case SO_TFR:
+         v = SimGetReg(pb >> 4);
+         w = SimGetReg(pb & 15);
+         if (SimBits(pb >> 4) > SimBits(pb & 15)) v &= 0xff;
+         else if (SimBits(pb >> 4) < SimBits(pb & 15)) v |= 0xff00;
+         if (op == SO_EXG)
+         {
+            if (SimBits(pb & 15) > SimBits(pb >> 4)) w &= 0xff;
+            else if (SimBits(pb & 15) < SimBits(pb >> 4)) w |= 0xff00;
+            SimSetReg(pb >> 4,w);
+         }
+         SimSetReg(pb & 15,v);
+         break;
+      case SO_TFM:
+         w = SimGetReg(6);
+         while (w)
+         {
+            v = SimGetReg(pb >> 4);
+            n = SimGetReg(pb & 15);
+            SimWrite(n,SimRead(v));
+            switch (oc)
+            {
+               case 0x1138: SimSetReg(pb >> 4,v+1); SimSetReg(pb & 15,n+1); break;
+               case 0x1139: SimSetReg(pb >> 4,v-1); SimSetReg(pb & 15,n-1); break;
+               case 0x113a: SimSetReg(pb >> 4,v+1); break;
+               default    : SimSetReg(pb & 15,n+1); break;
+            }
+            SimSetReg(6,--w);
+            c += 3;
+         }
+         break;
+      case SO_ABX:
+         Sim.X = (Sim.X + Sim.B) & 0xffff;
+         break;
+      case SO_MUL:
+         v = Sim.A * Sim.B;
+         SimSetReg(0,v);
+         Sim.CC &= ~(CC_Z | CC_C);
+         if (!v)       Sim.CC |= CC_Z;
+         if (v & 0x80) Sim.CC |= CC_C;
+         break;
+      case SO_MULD:
+         q = (unsigned int)((short)SimGetReg(0) * (short)SimLoad(ea,16));
+         SimSetQ(q);
+         SimNZ(q,32);
+         break;
+      case SO_DIVD:
+      case SO_DIVQ:
+         if (op == SO_DIVD)
+         {
+            v = (signed char)SimRead(ea);
+            s = (short)SimGetReg(0);
+         }
+         else
+         {
+            v = (short)SimLoad(ea,16);
+            s = (int)SimGetQ();
+         }
+         if (!v)
+         {
+            Sim.PC = a;
+            Sim.Stop = SIM_DIV0;
+            break;
+         }
+         t = s / v;
+         Sim.CC &= ~(CC_V | CC_C);
+         if (t & 1) Sim.CC |= CC_C;
+         if (op == SO_DIVD)
+         {
+            if (t < -128 || t > 127) Sim.CC |= CC_V;
+            Sim.A = (s % v) & 0xff;
+            Sim.B = t & 0xff;
+            SimNZ(Sim.B,8);
+         }
+         else
+         {
+            if (t < -32768 || t > 32767) Sim.CC |= CC_V;
+            SimSetReg(0,(int)(s % v));
+            SimSetReg(6,(int)t);
+            SimNZ(SimGetReg(6),16);
+         }
+         break;
+      case SO_XIM:
+         v = SimRead(ea);
+         if (r == 'A' || r == 'T') v &= im;
+         if (r == 'O')             v |= im;
+         if (r == 'E')             v ^= im;
+         SimNZ(v,8);
+         Sim.CC &= ~CC_V;
+         if (r != 'T') SimWrite(ea,v);
+         break;
+      case SO_BOP:
+         w = (pb >> 6) == 0 ? 10 : (pb >> 6) == 1 ? 8 : 9;
+         v = SimRead(ea);
+         n = (v >> ((pb >> 3) & 7)) & 1; // memory bit
+         q = SimGetReg(w);
+         im = (q >> (pb & 7)) & 1;       // register bit
+         switch (r)
+         {
+            case 0: im &=  n; break; // BAND
+            case 1: im &= !n; break; // BIAND
+            case 2: im |=  n; break; // BOR
+            case 3: im |= !n; break; // BIOR
+            case 4: im ^=  n; break; // BEOR
+            case 5: im ^= !n; break; // BIEOR
+            case 6: im  =  n; break; // LDBT
+         }
+         if (r == 7) // STBT
+         {
+            v = (v & ~(1 << ((pb >> 3) & 7))) | (im << ((pb >> 3) & 7));
+            SimWrite(ea,v);
+         }
+         else SimSetReg(w,(q & ~(1 << (pb & 7))) | (im << (pb & 7)));
+         break;
+   }
+   return c;
+}
+
+// ******
+// SimRun
+// ******
+
+// Runs until the entry routine returns or another stop condition
+
+void SimRun(long long Limit)
+{
+   int a,c;
+   struct SimCallStruct *f;
+
+   while (!Sim.Stop)
+   {
+      a = Sim.PC;
+      if (SimBrk && Sim.Steps && SimBrk[a])
+      {
+         Sim.Stop = SIM_BREAK;
+         break;
+      }
+      if (Limit && Sim.Cycles >= Limit)
+      {
+         Sim.Stop = SIM_LIMIT;
+         break;
+      }
+      Sim.Call = Sim.Ret = 0;
+      c = SimStep();
+      if (Sim.Stop == SIM_ILLEGAL) break;
+      Sim.Cycles += c;
+      ++Sim.Steps;
+      if (SimCyc)
+      {
+         SimCyc[a] += c;
+         ++SimCnt[a];
+      }
+      if (Sim.Call)
+      {
+         if (++Sim.Depth < SIMDEPTH)
+         {
+            SimStk[Sim.Depth].Adr = Sim.Call - 1;
+            SimStk[Sim.Depth].Cyc = Sim.Cycles;
+         }
+         if (SimCalls) ++SimCalls[Sim.Call - 1];
+      }
+      if (Sim.Ret)
+      {
+         if (Sim.Depth == 0)
+         {
+            Sim.PC   = a;
+            Sim.Stop = SIM_RETURN;
+            break;
+         }
+         f = SimStk + Sim.Depth;
+         if (SimIncl && Sim.Depth < SIMDEPTH) SimIncl[f->Adr] += Sim.Cycles - f->Cyc;
+         --Sim.Depth;
+      }
+   }
+}
+
+// ********
+// SimReset
+// ********
+
+// Copies the image into the simulator memory and sets the registers
+
+void SimReset(int Entry)
+{
+   int a;
+   unsigned char *Mem = Sim.Mem;
+
+   if (!Mem) Mem = (unsigned char *)MallocOrDie(0x10000);
+   memcpy(Mem,ROM,0x10000);
+   memset(&Sim,0,sizeof(Sim));
+   Sim.Mem = Mem;
+   Sim.CC = CC_I | CC_F;
+   for (a=0 ; a < 0x10000 && !LOCK[a] ; ++a) ; // lowest assembled address
+   Sim.S  = a & 0xffff; // stack below the code
+   Sim.PC = Entry;
+}
+
+// *********
+// SimNumber
+// *********
+
+// Value of a label or a number ($hex, %binary or C syntax)
+
+int SimNumber(char *p, const char *File)
+{
+   int j;
+   char *e;
+   long v;
+
+   if (*p == '$')      v = strtol(p+1,&e,16);
+   else if (*p == '%') v = strtol(p+1,&e, 2);
+   else if (isdigit((unsigned char)*p)) v = strtol(p,&e,0);
+   else
+   {
+      if ((j = LabelIndex(p)) < 0)
+      {
+         fprintf(stderr,"Unknown symbol '%s' in %s\n",p,File);
+         Terminate(1);
+      }
+      return lab[j].Address;
+   }
+   if (*e)
+   {
+      fprintf(stderr,"Illegal value '%s' in %s\n",p,File);
+      Terminate(1);
+   }
+   return (int)v;
+}
+
+// *********
+// RunConfig
+// *********
+
+// Reads the I/O configuration for the simulation. Each line is one of:
+//
+// IN   address[-address] value     reads return value
+// IN   address[-address] file      reads return bytes of file
+// OUT  address[-address] [file]    writes go to stdout or file
+// STOP address[-address]           writes stop the simulation
+// REG  register value              initial register value
+//
+// Text after ';' is a comment.
+
+void RunConfig(const char *File)
+{
+   int i,n,lo,hi;
+   char Buf[ML],Cmd[ML],Adr[ML],Arg[ML],*p;
+   FILE *fp;
+   struct IOStruct *io;
+
+   fp = fopen(File,"r");
+   if (!fp)
+   {
+      fprintf(stderr,"Could not open <%s>\n",File);
+      Terminate(1);
+   }
+   CacheFile(File,0);
+   SimIOMap = (short *)MallocOrDie(0x10000*sizeof(short));
+   memset(SimIOMap,0,0x10000*sizeof(short));
+   while (fgets(Buf,sizeof(Buf),fp))
+   {
+      if ((p = strchr(Buf,';'))) *p = 0;
+      Arg[0] = 0;
+      n = sscanf(Buf,"%s %s %s",Cmd,Adr,Arg);
+      if (n < 1) continue;
+      if (n < 2) // every command has an address or register
+      {
+         fprintf(stderr,"Illegal line in %s: %s",File,Buf);
+         Terminate(1);
+      }
+      if (!StrCaseCmp(Cmd,"REG"))
+      {
+         for (i=0 ; i < 16 ; ++i)
+            if (SimRegName[i][0] && !StrCaseCmp(Adr,SimRegName[i])) break;
+         if (i == 16 || n < 3)
+         {
+            fprintf(stderr,"Illegal line in %s: %s",File,Buf);
+            Terminate(1);
+         }
+         SimSetReg(i,SimNumber(Arg,File));
+         continue;
+      }
+      if ((p = strchr(Adr,'-')))
+      {
+         *p++ = 0;
+         hi = SimNumber(p,File);
+      }
+      lo = SimNumber(Adr,File);
+      if (!p) hi = lo;
+      SimIO = (struct IOStruct *)ReallocOrDie(SimIO,(SimIOs+1)*sizeof(struct IOStruct));
+      io = SimIO + SimIOs++;
+      io->Lo    = lo & 0xffff;
+      io->Hi    = hi & 0xffff;
+      io->Value = 0;
+      io->fp    = NULL;
+      if (!StrCaseCmp(Cmd,"IN"))
+      {
+         io->Type = IO_IN;
+         if (n < 3)
+         {
+            fprintf(stderr,"Missing value in %s: %s",File,Buf);
+            Terminate(1);
+         }
+         if (Arg[0] == '$' || Arg[0] == '%' || isdigit((unsigned char)Arg[0]))
+            io->Value = SimNumber(Arg,File);
+         else
+         {
+            io->fp = AssertFileOp(fopen(Arg,"rb"),"Open I/O input");
+            CacheFile(Arg,0);
+         }
+      }
+      else if (!StrCaseCmp(Cmd,"OUT"))
+      {
+         io->Type = IO_OUT;
+         if (n > 2)
+         {
+            io->fp = AssertFileOp(fopen(Arg,"wb"),"Open I/O output");
+            CacheFile(Arg,1);
+         }
+      }
+      else if (!StrCaseCmp(Cmd,"STOP")) io->Type = IO_STOP;
+      else
+      {
+         fprintf(stderr,"Unknown command in %s: %s",File,Buf);
+         Terminate(1);
+      }
+      for (i=io->Lo ; i <= io->Hi ; ++i) SimIOMap[i] = SimIOs;
+   }
+   fclose(fp);
+}
+
+// ***********
+// CmpSimLabel
+// ***********
+
+int CmpSimLabel(const void *arg1, const void *arg2)
+{
+   int a = lab[*(const int *)arg1].Address;
+   int b = lab[*(const int *)arg2].Address;
+
+   return a - b;
+}
+
+// *********
+// RunReport
+// *********
+
+// Writes the result of the simulation with the cycles per label,
+// the inclusive cycles of called routines and the cycles per module.
+
+void RunReport(const char *Filename)
+{
+   int i,j,k,n,a,*Idx;
+   long long *Flat,*Hits,Total,Mc;
+   FILE *rf;
+   const char *msg = "Write run report";
+
+   rf = AssertFileOp(fopen(Filename,"w"),msg);
+   CacheFile(Filename,1);
+   Total = Sim.Cycles ? Sim.Cycles : 1;
+   fprintf(rf,"; Simulation of %s at $%4.4x\n",RunLabel,lab[LabelIndex(RunLabel)].Address);
+   fprintf(rf,"; Stop        : %s at $%4.4x\n",SimStopText[Sim.Stop],Sim.PC);
+   fprintf(rf,"; Instructions: %lld\n",Sim.Steps);
+   fprintf(rf,"; Cycles      : %lld (6809 timing)\n",Sim.Cycles);
+   fprintf(rf,"; A=%2.2x B=%2.2x E=%2.2x F=%2.2x X=%4.4x Y=%4.4x U=%4.4x S=%4.4x"
+              " DP=%2.2x CC=%2.2x\n\n",Sim.A,Sim.B,Sim.E,Sim.F,Sim.X,Sim.Y,
+              Sim.U,Sim.S,Sim.DP,Sim.CC);
+
+   // labels at instruction starts sorted by address
+
+   Idx = (int *)MallocOrDie((Labels+1)*sizeof(int));
+   for (i=n=0 ; i < Labels ; ++i)
+   {
+      a = lab[i].Address;
+      if (a >= 0 && a <= 0xffff && (ADL[a] > 0 || SimCnt[a])) Idx[n++] = i;
+   }
+   qsort(Idx,n,sizeof(int),CmpSimLabel);
+   Flat = (long long *)MallocOrDie((n+1)*sizeof(long long));
+   Hits = (long long *)MallocOrDie((n+1)*sizeof(long long));
+   memset(Flat,0,(n+1)*sizeof(long long));
+   memset(Hits,0,(n+1)*sizeof(long long));
+   for (a=0,k=-1 ; a < 0x10000 ; ++a)
+   {
+      while (k+1 < n && lab[Idx[k+1]].Address <= a) ++k;
+      if (!SimCnt[a]) continue;
+      j = k < 0 ? n : k; // n: code before first label
+      Flat[j] += SimCyc[a];
+      if (k >= 0 && lab[Idx[k]].Address == a) Hits[j] += SimCnt[a];
+   }
+
+   fprintf(rf,"Label                          Address      Count       Cycles     %%"
+              "      Calls    Inclusive\n");
+   fprintf(rf,"----------------------------------------------------------------"
+              "------------------------------\n");
+   for (;;) // descending flat cycles
+   {
+      for (i=0,k=-1 ; i < n ; ++i) if (Flat[i] && (k < 0 || Flat[i] > Flat[k])) k = i;
+      if (k < 0) break;
+      a = lab[Idx[k]].Address;
+      fprintf(rf,"%-30.30s  $%4.4x %10lld %12lld %5.1f",lab[Idx[k]].Name,a,
+              Hits[k],Flat[k],100.0*Flat[k]/Total);
+      if (SimCalls[a]) fprintf(rf," %10lld %12lld",SimCalls[a],SimIncl[a]);
+      fprintf(rf,"\n");
+      Flat[k] = 0;
+   }
+   if (Flat[n]) fprintf(rf,"%-30.30s        %10s %12lld %5.1f\n","(no label)","",
+                        Flat[n],100.0*Flat[n]/Total);
+
+   if (Modules)
+   {
+      fprintf(rf,"\nModule                          Start    End       Cycles     %%"
+                 "      Calls    Inclusive\n");
+      fprintf(rf,"----------------------------------------------------------------"
+                 "------------------------------\n");
+   }
+   for (i=0 ; i < Modules ; ++i)
+   {
+      if (Mod[i].End < Mod[i].Start) continue;
+      for (a=Mod[i].Start,Mc=0 ; a < Mod[i].End ; ++a) Mc += SimCyc[a];
+      a = Mod[i].Start;
+      if (!Mc && !SimCalls[a]) continue;
+      fprintf(rf,"%-30.30s  $%4.4x  $%4.4x %12lld %5.1f",Mod[i].Name,a,
+              Mod[i].End-1,Mc,100.0*Mc/Total);
+      if (SimCalls[a]) fprintf(rf," %10lld %12lld",SimCalls[a],SimIncl[a]);
+      fprintf(rf,"\n");
+   }
+   free(Idx);
+   free(Flat);
+   free(Hits);
+   StatFileSize(Filename,rf);
+   if (fclose(rf)) AssertFileOp(NULL,msg);
+}
+
+// *************
+// RunSimulation
+// *************
+
+void RunSimulation(const char *Filename)
+{
+   int i,j;
+
+   if ((j = LabelIndex(RunLabel)) < 0)
+   {
+      fprintf(stderr,"Unknown label '%s' for --run\n",RunLabel);
+      Terminate(1);
+   }
+   SimInit();
+   SimReset(lab[j].Address);
+   if (RunIO) RunConfig(RunIO);
+   SimBrk = (char *)MallocOrDie(0x10000);
+   memset(SimBrk,0,0x10000);
+   for (i=0 ; i < RunBreaks ; ++i)
+   {
+      if ((j = LabelIndex(RunBreak[i])) < 0)
+      {
+         fprintf(stderr,"Unknown label '%s' for --break\n",RunBreak[i]);
+         Terminate(1);
+      }
+      SimBrk[lab[j].Address & 0xffff] = 1;
+   }
+   SimCyc   = (long long *)MallocOrDie(0x10000*sizeof(long long));
+   SimCnt   = (long long *)MallocOrDie(0x10000*sizeof(long long));
+   SimCalls = (long long *)MallocOrDie(0x10000*sizeof(long long));
+   SimIncl  = (long long *)MallocOrDie(0x10000*sizeof(long long));
+   memset(SimCyc  ,0,0x10000*sizeof(long long));
+   memset(SimCnt  ,0,0x10000*sizeof(long long));
+   memset(SimCalls,0,0x10000*sizeof(long long));
+   memset(SimIncl ,0,0x10000*sizeof(long long));
+   SimRun(RunLimit);
+   fflush(stdout);
+   for (i=0 ; i < SimIOs ; ++i) if (SimIO[i].fp) fclose(SimIO[i].fp);
+   RunReport(Filename);
+}
+
+// *******
+// EXECUTE
+// *******
+
+// EXECUTE Routine,Size[,Value] reserves Size bytes at pc. After phase 2
+// Routine is called by the simulator with X = pc, Y = Size and
+// D = Value. The bytes it writes to the reserved range are copied
+// into the image.
+
+#define EXESTACK 256 // bytes below S, that must not be in the range
+
+THREAD_LOCAL struct ExeStruct
+{
+   int   Start;  // address of reserved bytes
+   int   Len;    // number of reserved bytes
+   int   Entry;  // address of routine
+   int   Arg;    // value for D
+   int   LiNo;   // line number
+   char *Text;   // source line
+} *Exe;
+
+THREAD_LOCAL int Executes;    // number of EXECUTE lines
+
+char *ParseExecute(char *p)
+{
+   int i,e,m,v;
+   char *q;
+   struct ExeStruct *x;
+
+   p = EvalOperand(p,&e,0);
+   p = NeedChar(p,',');
+   if (!p)
+   {
+      ErrorMsg("Missing ',' after EXECUTE routine\n");
+      Terminate(1);
+   }
+   p = EvalOperand(p+1,&m,0);
+   if (m < 1 || pc + m > 0x10000)
+   {
+      ErrorMsg("Illegal EXECUTE size %d\n",m);
+      Terminate(1);
+   }
+   v = 0;
+   if ((q = NeedChar(p,','))) p = EvalOperand(q+1,&v,0);
+   if (Phase == 2)
+   {
+      for (i=0 ; i < m ; ++i) Put(pc+i,Preset,p);
+      Exe = (struct ExeStruct *)ReallocOrDie(Exe,(Executes+1)*sizeof(struct ExeStruct));
+      x = Exe + Executes++;
+      x->Start = pc;
+      x->Len   = m;
+      x->Entry = e & 0xffff;
+      x->Arg   = v & 0xffff;
+      x->LiNo  = LiNo;
+      x->Text  = StrNDup(Line,strlen(Line));
+      if (ListOn)
+      {
+         PrintPC();
+         fprintf(lf,"              %s ; %d bytes\n",Line,m);
+      }
+   }
+   pc += m;
+   p += strlen(p);
+   return p;
+}
+
+// ***********
+// RunExecutes
+// ***********
+
+// Runs the routines of the EXECUTE lines in source order,
+// so a routine may use the results of previous ones.
+
+void RunExecutes(void)
+{
+   int i;
+   struct ExeStruct *x;
+
+   if (!Executes) return;
+   SimInit();
+   for (i=0 ; i < Executes ; ++i)
+   {
+      x = Exe + i;
+      SimReset(x->Entry);
+      if (((Sim.S - x->Start - x->Len) & 0xffff) < EXESTACK) // stack wraps into range
+      {
+         LiNo = x->LiNo;
+         strcpy(Line,x->Text);
+         ErrorMsg("EXECUTE range $%4.4x-$%4.4x overlaps the stack below $%4.4x\n",
+                  x->Start,x->Start+x->Len-1,Sim.S);
+         Terminate(1);
+      }
+      Sim.X = x->Start;
+      Sim.Y = x->Len;
+      SimSetReg(0,x->Arg);
+      SimRun(RunLimit);
+      if (Sim.Stop != SIM_RETURN)
+      {
+         LiNo = x->LiNo;
+         strcpy(Line,x->Text);
+         ErrorMsg("EXECUTE stopped by %s at $%4.4x\n",SimStopText[Sim.Stop],Sim.PC);
+         Terminate(1);
+      }
+      memcpy(ROM+x->Start,Sim.Mem+x->Start,x->Len);
+      if (ListOn)
+      fprintf(lf,"EXECUTE %4.4x-%4.4x %5d bytes %10lld cycles  line %d\n",
+              x->Start,x->Start+x->Len-1,x->Len,Sim.Cycles,x->LiNo);
+      free(x->Text);
+   }
+   Executes = 0;
+}
+
+// ********
+// Profiler
+// ********
+
+// --profile reads a trace of an emulator. Lines are either PC traces
+// (first hex number of the line is the executed address, e.g. MAME
+// "E000: LDX #$E006" or "$e000") or hit counts ("E000 1234", second
+// field decimal). Phase 2 writes every source line with its count and
+// estimated cycles to <source>.prf. The PC trace is followed again
+// for call stacks in the folded format of flame graph tools.
+
+THREAD_LOCAL char *ProfTrace;         // --profile: trace file
+THREAD_LOCAL long long *ProfHits;     // executions per address
+
+THREAD_LOCAL struct FoldStruct
+{
+   char     *Key;        // frames separated by ';'
+   long long Cyc;        // cycles
+   int       Next;       // next entry with same hash
+} *Fold;
+
+THREAD_LOCAL int Folds;               // number of folded stacks
+THREAD_LOCAL int FoldHead[1024];      // hash -> first entry + 1
+
+// *********
+// TraceLine
+// *********
+
+// Returns the address and count of a trace line and 1 for a PC trace,
+// 2 for a hit count or 0 if the line does not start with an address.
+
+int TraceLine(char *p, int *a, long long *n)
+{
+   char *e;
+   long v;
+
+   while (isspace((unsigned char)*p)) ++p;
+   if (*p == '$') ++p;
+   if (!isxdigit((unsigned char)*p)) return 0;
+   v = strtol(p,&e,16);
+   if (isalnum((unsigned char)*e) || v < 0 || v > 0xffff) return 0;
+   *a = (int)v;
+   *n = 1;
+   if (*e == ':') return 1;
+   while (*e == ' ' || *e == '\t') ++e;
+   if (isdigit((unsigned char)*e))
+   {
+      p = e;
+      while (isdigit((unsigned char)*e)) ++e;
+      while (isspace((unsigned char)*e)) ++e;
+      if (*e == 0)
+      {
+         *n = strtoll(p,NULL,10);
+         return 2;
+      }
+   }
+   return 1;
+}
+
+// *********
+// ReadTrace
+// *********
+
+void ReadTrace(const char *Filename)
+{
+   int a;
+   long long n;
+   char Buf[ML];
+   FILE *tf;
+
+   tf = fopen(Filename,"r");
+   if (!tf)
+   {
+      fprintf(stderr,"Could not open <%s>\n",Filename);
+      Terminate(1);
+   }
+   CacheFile(Filename,0);
+   ProfHits = (long long *)MallocOrDie(0x10000*sizeof(long long));
+   memset(ProfHits,0,0x10000*sizeof(long long));
+   while (fgets(Buf,sizeof(Buf),tf))
+      if (TraceLine(Buf,&a,&n)) ProfHits[a] += n;
+   fclose(tf);
+   InitOpcodeTable();
+}
+
+// ***********
+// ProfileLine
+// ***********
+
+// Called after every line of phase 2
+
+void ProfileLine(void)
+{
+   struct InsStruct d;
+
+   if (ProfAdr < 0)
+   {
+      fprintf(prf,"%10s %12s       %s\n","","",Line);
+      return;
+   }
+   DecodeInstruction(ProfAdr,&d);
+   if (ProfHits[ProfAdr])
+      fprintf(prf,"%10lld %12lld  %4.4x %s\n",ProfHits[ProfAdr],
+              ProfHits[ProfAdr]*d.Cyc,ProfAdr,Line);
+   else fprintf(prf,"%10s %12s  %4.4x %s\n","","",ProfAdr,Line);
+   ProfAdr = -1;
+}
+
+// *********
+// FrameName
+// *********
+
+const char *FrameName(int a)
+{
+   static THREAD_LOCAL char Buf[8];
+   int i;
+
+   if ((i = AddressIndex(a)) >= 0) return lab[i].Name;
+   if ((i = ModuleOfAddr(a)) >= 0) return Mod[i].Name;
+   snprintf(Buf,sizeof(Buf),"$%4.4x",a);
+   return Buf;
+}
+
+// *******
+// FoldAdd
+// *******
+
+void FoldAdd(const char *Key, long long c)
+{
+   int h,i;
+   const char *p;
+
+   for (h=0,p=Key ; *p ; ++p) h = (h * 31 + (unsigned char)*p) & 1023;
+   for (i=FoldHead[h]-1 ; i >= 0 ; i=Fold[i].Next-1)
+   if (!strcmp(Fold[i].Key,Key))
+   {
+      Fold[i].Cyc += c;
+      return;
+   }
+   Fold = (struct FoldStruct *)ReallocOrDie(Fold,(Folds+1)*sizeof(struct FoldStruct));
+   Fold[Folds].Key  = StrNDup((char *)Key,strlen(Key));
+   Fold[Folds].Cyc  = c;
+   Fold[Folds].Next = FoldHead[h];
+   FoldHead[h] = ++Folds;
+}
+
+// *************
+// ProfileReport
+// *************
+
+// Appends the cycles per module to <source>.prf and writes the
+// folded call stacks to <source>.fold.
+
+void ProfileReport(const char *TraceName, const char *FoldName)
+{
+   int i,a,l,p,t,Depth,Len[SIMDEPTH];
+   long long n,Total,Mc;
+   char Key[4096],Buf[ML];
+   const char *f,*m;
+   struct InsStruct d;
+   FILE *tf,*ff;
+
+   for (a=0,Total=0 ; a < 0x10000 ; ++a) if (ProfHits[a])
+   {
+      DecodeInstruction(a,&d);
+      Total += ProfHits[a] * d.Cyc;
+   }
+   fprintf(prf,"\n\nModule                          Start    End        Count       Cycles     %%\n");
+   fprintf(prf,"-------------------------------------------------------------------------------\n");
+   for (i=0 ; i < Modules ; ++i)
+   {
+      for (a=Mod[i].Start,n=Mc=0 ; a < Mod[i].End ; ++a) if (ProfHits[a])
+      {
+         DecodeInstruction(a,&d);
+         n  += ProfHits[a];
+         Mc += ProfHits[a] * d.Cyc;
+      }
+      if (!n) continue;
+      fprintf(prf,"%-30.30s  $%4.4x  $%4.4x %12lld %12lld %5.1f\n",Mod[i].Name,
+              Mod[i].Start,Mod[i].End-1,n,Mc,Total ? 100.0*Mc/Total : 0.0);
+   }
+   fprintf(prf,"%-46s %12s %12lld\n","Total","",Total);
+
+   // follow the trace for call stacks
+
+   tf = AssertFileOp(fopen(TraceName,"r"),"Open trace");
+   Depth = 0;
+   Key[0] = 0;
+   Len[0] = 0;
+   p = -1;
+   while (fgets(Buf,sizeof(Buf),tf))
+   {
+      if (!(t = TraceLine(Buf,&a,&n))) continue;
+      if (p >= 0 && t == 1)
       {
-         ++ErrNum;
-         ErrorLine(p);
-         ErrorMsg("Illegal address %d\n",v);
-         exit(1);
+         DecodeInstruction(p,&d);
+         m = d.Mne >= 0 ? Mat[d.Mne].Mne : "";
+         if ((!strcmp(m,"JSR") || !strcmp(m,"BSR") || !strcmp(m,"LBSR") ||
+             !strncmp(m,"SWI",3)) && a != p + d.Len && Depth < SIMDEPTH-1)
+         {
+            f = FrameName(a);
+            l = strlen(Key);
+            if (l + strlen(f) + 2 < sizeof(Key)) snprintf(Key+l,sizeof(Key)-l,";%s",f);
+            Len[++Depth] = l;
+         }
+         else if ((!strcmp(m,"RTS") || !strcmp(m,"RTI") ||
+                  (!strcmp(m,"PULS") && (d.Pb & 0x80))) && Depth > 0)
+            Key[Len[Depth--]] = 0;
       }
-      i = q[1] - '0';
-      if (i < 0 || i > 7)
+      if (!Key[0] || t == 2) // first address or hit counts
       {
-         ++ErrNum;
-         ErrorLine(p);
-         ErrorMsg("Illegal bit# %d\n",i);
-         exit(1);
+         f = ModuleOfAddr(a) >= 0 ? Mod[ModuleOfAddr(a)].Name : FrameName(a);
+         snprintf(Key,sizeof(Key),";%s",f);
+         Depth = 0;
       }
-      pb |= (i<<3); // add source bit
-      ol = 2;
-      ql = 1;
-      il = 4;
+      DecodeInstruction(a,&d);
+      FoldAdd(Key+1,n * d.Cyc);
+      p = a;
+   }
+   fclose(tf);
+
+   ff = AssertFileOp(fopen(FoldName,"w"),"Write folded stacks");
+   CacheFile(FoldName,1);
+   for (i=0 ; i < Folds ; ++i)
+      if (Fold[i].Cyc) fprintf(ff,"%s %lld\n",Fold[i].Key,Fold[i].Cyc);
+   StatFileSize(FoldName,ff);
+   if (fclose(ff)) AssertFileOp(NULL,"Write folded stacks");
+}
+
+// *********
+// PlaceSafe
+// *********
+
+// returns 0, if the code would break when module m is moved:
+// code falls into or out of the module or a short branch or
+// 8 bit PC relative offset crosses the module boundary
+
+int PlaceSafe(int m, char *Bad)
+{
+   int a,l;
+   struct InsStruct d;
+
+   if (Bad[m] || Mod[m].End <= Mod[m].Start) return 0;
+   for (a=Mod[m].Start-5 ; a < Mod[m].Start ; ++a)
+   if (a >= 0 && ADL[a] > 0 && a + ADL[a] == Mod[m].Start)
+   {
+      DecodeInstruction(a,&d);
+      if (!FlowEnd(&d) && d.Opc != 0x20 && d.Opc != 0x16) return 0;
+   }
+   for (a=Mod[m].Start,l=-1 ; a < Mod[m].End ; ++a)
+   if (ADL[a] > 0)
+   {
+      l = a;
+      a += ADL[a] - 1;
+   }
+   if (l >= 0 && l + ADL[l] == Mod[m].End)
+   {
+      DecodeInstruction(l,&d);
+      if (!FlowEnd(&d) && d.Opc != 0x20 && d.Opc != 0x16) return 0;
+   }
+   return 1;
+}
+
+// ************
+// PlaceModules
+// ************
+
+// Reads the counts for --place and selects the region of every module:
+// the most executed modules with 90% of all counts go to the HOT
+// region, all others to the COLD region. Returns the # of moved modules.
+
+int PlaceModules(const char *Filename)
+{
+   int i,j,k,a,t,*Ord;
+   long long n,*Cnt,*Acc,Total,Sum;
+   char Buf[ML],Name[ML],*Bad;
+   struct InsStruct d;
+   FILE *cf;
+
+   cf = fopen(Filename,"r");
+   if (!cf)
+   {
+      fprintf(stderr,"Could not open <%s>\n",Filename);
+      Terminate(1);
+   }
+   CacheFile(Filename,0);
+   InitOpcodeTable();
+   PlcHits = (long long *)MallocOrDie(0x10000*sizeof(long long));
+   memset(PlcHits,0,0x10000*sizeof(long long));
+   while (fgets(Buf,sizeof(Buf),cf))
+   {
+      // labels first, a label like Add or A1 is no address
+
+      if (sscanf(Buf,"%255s %lld",Name,&n) == 2 && (j = LabelIndex(Name)) >= 0)
+         PlcHits[lab[j].Address & 0xffff] += n;
+      else if ((t = TraceLine(Buf,&a,&n))) PlcHits[a] += n;
+   }
+   fclose(cf);
+
+   // modules with short branches or offsets crossing their boundary
+
+   Bad = (char *)MallocOrDie(Modules+1);
+   memset(Bad,0,Modules+1);
+   for (a=0 ; a < 0x10000 ; ++a)
+   {
+      if (ADL[a] <= 0) continue;
+      DecodeInstruction(a,&d);
+      if ((d.Amo == AM_Relative && Mat[d.Mne].Mne[0] != 'L') ||
+          (d.Amo == AM_Indexed && d.Reg == 4 && (d.Pb & 0x8f) == 0x8c))
+      {
+         i = ModuleOfAddr(a);
+         j = ModuleOfAddr(d.Val);
+         if (i != j && i >= 0) Bad[i] = 1;
+         if (i != j && j >= 0) Bad[j] = 1;
+      }
+   }
+
+   // select HOT and COLD modules
+
+   Cnt = (long long *)MallocOrDie((Modules+1)*sizeof(long long));
+   Ord = (int *)MallocOrDie((Modules+1)*sizeof(int));
+   PlcMods = Modules;
+   PlcAct = (char *)MallocOrDie(Modules+1);
+   memset(PlcAct,0,Modules+1);
+   for (i=k=0,Total=0 ; i < Modules ; ++i)
+   {
+      for (a=Mod[i].Start,Cnt[i]=0 ; a < Mod[i].End ; ++a) Cnt[i] += PlcHits[a];
+      if (!PlaceSafe(i,Bad)) continue;
+      Total += Cnt[i];
+      Ord[k++] = i;
+   }
+   for (i=0 ; i < k ; ++i) // sort by count, descending
+   for (j=i+1 ; j < k ; ++j)
+   if (Cnt[Ord[j]] > Cnt[Ord[i]])
+   {
+      t = Ord[i];
+      Ord[i] = Ord[j];
+      Ord[j] = t;
+   }
+   for (i=0,Sum=0 ; i < k ; ++i)
+   {
+      t = (Cnt[Ord[i]] && Sum < Total - Total / 10) ? PLC_HOT : PLC_COLD;
+      if (t == PLC_HOT) Sum += Cnt[Ord[i]];
+      if (!PlcUsed[t]) continue;
+      PlcAct[Ord[i]] = t;
+      ++Placed;
+   }
+
+   // variables accessed with extended addressing, candidates for DP
+
+   Acc = (long long *)MallocOrDie(0x10000*sizeof(long long));
+   memset(Acc,0,0x10000*sizeof(long long));
+   for (a=0 ; a < 0x10000 ; ++a)
+   {
+      if (ADL[a] <= 0 || !PlcHits[a]) continue;
+      DecodeInstruction(a,&d);
+      if (d.Amo == AM_Extended && d.Opc != 0x7e && d.Opc != 0xbd &&
+          (d.Val < 0x10000 && ADL[d.Val] <= 0)) Acc[d.Val] += PlcHits[a];
+   }
+   for (PlcDPs=0 ; PlcDPs < 16 ; ++PlcDPs)
+   {
+      for (a=0,j=-1 ; a < 0x10000 ; ++a) if (Acc[a] && (j < 0 || Acc[a] > Acc[j])) j = a;
+      if (j < 0) break;
+      PlcDP[PlcDPs]  = j;
+      PlcAcc[PlcDPs] = Acc[j];
+      Acc[j] = 0;
+   }
+
+   // report lines for the hint file, written after the rerun
+
+   PlcRep = (char **)MallocOrDie((Modules+PlcDPs+1)*sizeof(char *));
+   for (i=PlcReps=0 ; i < Modules ; ++i)
+   {
+      if (PlcAct[i] == 0 && (PlaceSafe(i,Bad) || Mod[i].End <= Mod[i].Start)) continue;
+      snprintf(Buf,sizeof(Buf),"PLACE %-5s %-30.30s $%4.4x %10lld%s",
+         PlcAct[i] == PLC_HOT ? "HOT" : PlcAct[i] == PLC_COLD ? "COLD" : "-",
+         Mod[i].Name,Mod[i].Start,Cnt[i],PlcAct[i] ? "" : "  not movable");
+      PlcRep[PlcReps++] = StrNDup(Buf,strlen(Buf));
+   }
+   for (i=0 ; i < PlcDPs ; ++i)
+   {
+      j = AddressIndex(PlcDP[i]);
+      snprintf(Buf,sizeof(Buf),"DP    %-36.36s $%4.4x %10lld accesses",
+         j >= 0 ? lab[j].Name : "",PlcDP[i],PlcAcc[i]);
+      PlcRep[PlcReps++] = StrNDup(Buf,strlen(Buf));
+   }
+   free(Bad);
+   free(Cnt);
+   free(Ord);
+   free(Acc);
+   return Placed;
+}
+
+// ***********
+// PlaceReport
+// ***********
+
+void PlaceReport(void)
+{
+   int i;
+
+   for (i=0 ; i < PlcReps ; ++i)
+   {
+      fprintf(of,"%s\n",PlcRep[i]);
+      ++optc;
+   }
+}
+
+void WriteBinaryFormat(int i)
+{
+    unsigned char lo,hi;
+    char *Tmp;
+    FILE *bf;
+    const char *msg = "Write binary";
+
+    if (df) fprintf(df,"Storing $%4.4x - $%4.4x <%s>\n",
+                    SFA[i],SFA[i]+SFL[i],SFF[i]);
+    Tmp = OutputTmp(SFF[i]);
+    bf = AssertFileOp(fopen(Tmp,"wb"), msg);
+    CacheFile(SFF[i],1);
+    if (SFE[i] > -1)
+    {
+       lo = SFA[i] & 0xff;
+       hi = SFA[i]  >>  8;
+       if (fwrite(&hi,1,1,bf) < 1) AssertFileOp(NULL, msg);
+       if (fwrite(&lo,1,1,bf) < 1) AssertFileOp(NULL, msg);
+    }
+    if (fwrite(ROM+SFA[i],1,SFL[i],bf) < (size_t)SFL[i]) AssertFileOp(NULL, msg);
+    StatFileSize(SFF[i],bf);
+    if (OutputClose(bf,SFF[i],Tmp)) AssertFileOp(NULL, msg);
+}
+
+int Checksum(int start, int n)
+{
+   int sum = 0;
+   int i;
+   for (i=start ; i < start+n-1 ; i+=2)
+      sum += (ROM[i] << 8) | ROM[i+1];
+   return sum & 0xffff;
+}
+
+void WriteSparrowFormat(int i)
+{
+    int Start,Length,Check;
+    unsigned char Head[8];
+    char *Tmp;
+    FILE *bf;
+    const char *msg = "Write Sparrow binary";
+
+    Start  = SFA[i];
+    Length = SFL[i];
+    Check  = Checksum(Start,Length);
+
+    if (df) fprintf(df,"Storing $%4.4x - $%4.4x <%s>\n",
+                    Start,Start+Length-1,SFF[i]);
+    Head[0] = 'S';
+    Head[1] =  Start  >> 16;
+    Head[2] = (Start  >>  8) & 0xff;
+    Head[3] = (Start       ) & 0xff;
+    Head[4] = Length  >>  8;
+    Head[5] = Length  & 0xff;
+    Head[6] = Check   >>  8;
+    Head[7] = Check   & 0xff;
+
+    Tmp = OutputTmp(SFF[i]);
+    bf = AssertFileOp(fopen(Tmp,"wb"), msg);
+    CacheFile(SFF[i],1);
+    if (fwrite(Head,1,8,bf) < 8) AssertFileOp(NULL, msg);
+    if (fwrite(ROM+Start,1,Length,bf) < (size_t)Length) AssertFileOp(NULL, msg);
+    StatFileSize(SFF[i],bf);
+    if (OutputClose(bf,SFF[i],Tmp)) AssertFileOp(NULL, msg);
+}
+
+void WriteS19Line(FILE *bf, const char *RecordType, int PayloadSize, int Address, unsigned char *Data)
+{
+   int i,Checksum;
+   const char *msg = "Write S19 record";
+
+   fprintf(bf, "%s", RecordType);
+   // 3 extra bytes for address and checksum
+   Checksum = PayloadSize + 3 + (Address & 0xff) + (Address >> 8);
+   fprintf(bf, "%02X%04X", PayloadSize + 3, Address);
+   if (ferror(bf)) AssertFileOp(NULL, msg);
+   for (i=0; i < PayloadSize; ++i)
+   {
+      fprintf(bf, "%02X", Data[i]);
+      if (ferror(bf)) AssertFileOp(NULL, msg);
+      Checksum += Data[i];
+   }
+   // Force CR LF line endings for ancient EPROM programmers
+   fprintf(bf, "%02X\r\n", ~Checksum & 0xff);
+   if (ferror(bf)) AssertFileOp(NULL, msg);
+}
+
+void WriteS19Format(int i)
+{
+    unsigned char buf[80];
+    FILE *bf;
+    char *filename, *ExtPtr, *Tmp;
+    int UnwrittenBytes,Addr,BytesInThisLine;
+    const char *msg = "Write S19 file";
+
+    filename = (char *)StrNDup(SFF[i],strlen(SFF[i]) + 4);
+    ExtPtr = strrchr(filename, '.');
+    if (!ExtPtr)
+    {
+       ExtPtr = filename + strlen(filename);
+       memmove(ExtPtr, ".S19",5);
+    }
+    if (df)
+    {
+       fprintf(df,"Storing $%4.4x - $%4.4x <%s>\n",
+                    SFA[i],SFA[i]+SFL[i],filename);
+       if (ferror(df)) AssertFileOp(NULL, msg);
+    }
+    Tmp = OutputTmp(filename);
+    bf = AssertFileOp(fopen(Tmp, "wb"), msg);
+    CacheFile(filename,1);
+
+    // Write a S0 header which the TTL pseudo op should define
+    memmove((char *)buf,"Bit Shift Assembler",20);
+    WriteS19Line(bf, "S0", strlen((char *)buf), 0, buf);
+
+    SFR[i] = 0;
+    UnwrittenBytes = SFL[i];
+    Addr = SFA[i];
+    BytesInThisLine = 32;
+    if (UnwrittenBytes < 32) BytesInThisLine = UnwrittenBytes;
+    while (UnwrittenBytes > 0)
+    {
+       WriteS19Line(bf, "S1", BytesInThisLine, Addr, &ROM[Addr]);
+       ++SFR[i];
+       Addr += BytesInThisLine;
+       UnwrittenBytes -= BytesInThisLine;
+    }
+
+    WriteS19Line(bf, "S5", 0, SFR[i], NULL);
+
+    if (SFE[i] > -1) WriteS19Line(bf, "S9", 0, SFE[i], NULL);
+    StatFileSize(filename,bf);
+    if (OutputClose(bf,filename,Tmp)) AssertFileOp(NULL, msg);
+    free(filename);
+}
+
+void WriteBinaries(void)
+{
+   int i;
+
+   for (i=0 ; i < StoreCount ; ++i)
+   {
+           if (SFT[i] == SRECORD) WriteS19Format(i);
+      else if (SFT[i] == SPARROW) WriteSparrowFormat(i);
+      else                        WriteBinaryFormat(i);
    }
+}
+
+// *******
+// RelName
+// *******
+
+// relocation in the object file: A absolute, S<n> section, X<n> external
+
+char *RelName(int r, char *Buf)
+{
+   if (r > 0) sprintf(Buf,"S%d",r);
+   else if (r < 0) sprintf(Buf,"X%d",-r);
+   else strcpy(Buf,"A");
+   return Buf;
+}
 
-   // indexed address mode
+// ***********
+// WriteObject
+// ***********
 
-   else if (strchr(p,','))
+// Writes the relocatable object of --obj, a text file with the lines
+//   SECT name loc base size          loc: fixed address or REL
+//   D address bytes                  data of the preceding SECT
+//   EXTERN name                      n-th line declares X<n>
+//   INTERN name rel value            exported symbol
+//   FIX S<n> address kind rel value  operand to relocate
+// Numbers are hexadecimal, addresses are those of the assembly.
+
+void WriteObject(char *Name)
+{
+   int a,e,i,j;
+   char B1[16],B2[16];
+   char *Tmp;
+   struct SectStruct *s,*t;
+   FILE *fp;
+
+   CloseSection();
+   for (i=0 ; i < Sects ; ++i)
+   for (j=i+1 ; j < Sects ; ++j)
    {
-      if (XIM) oc = XIM & 0xefff; // extended -> indexed
-      else oc = Mat[MneIndex].Opc[AM_Indexed];
-      if (df) fprintf(df,"indexed am oc = %4.4x\n",oc);
-      if (oc < 0)
+      s = Sect + i;
+      t = Sect + j;
+      if (s->Base < t->End && t->Base < s->End)
       {
          ++ErrNum;
-         ErrorLine(p);
-         ErrorMsg("Illegal indexed instruction %s %s\n",Mat[MneIndex].Mne,OpText);
-         exit(1);
+         DiagPrintf("\n*** Sections %s and %s overlap at $%4.4x ***\n",
+                    s->Name,t->Name,s->Base > t->Base ? s->Base : t->Base);
       }
-      pb = SetPostByte(p,&v);
-
-      if (XIM) ol = 2;
-      else     ol = 1 + (oc > 255); // opcode length
-      il = ol + 1 + ql;    // opcode + postbyte + address
    }
-
-   // all other
-
-   else
+   for (i=0 ; i < Labels ; ++i)
    {
-      p = EvalOperand(p,&v,0);
-
-      if (XIM)
+      if (!lab[i].Intern) continue;
+      if (lab[i].Address == UNDEF || lab[i].Rel < 0)
       {
-         ol = 2;
-         if (v > 255)
-         {
-            oc = XIM;
-            ql = 2;
-         }
-         else
-         {
-            oc = XIM & 0xfff; // extended -> direct
-            ql = 1;
-         }
-         il = ol + ql;
-         if (df) fprintf(df,"XIM oc = %4.4x  v = %4.4x il = %d\n",oc,v,il);
+         ++ErrNum;
+         DiagPrintf("\n*** INTERN symbol [%s] is not defined ***\n",lab[i].Name);
       }
+   }
+   if (ErrNum)
+   {
+      remove(Name);
+      return;
+   }
 
-      if (Phase == 2) // opcode and instruction length is set in phase 1
+   Tmp = OutputTmp(Name); // make sees no change if equal
+   fp = AssertFileOp(fopen(Tmp,"w"), "Open object file");
+   CacheFile(Name,1);
+   fprintf(fp,"BS9 object 1\n");
+   for (i=0 ; i < Sects ; ++i)
+   {
+      s = Sect + i;
+      if (s->Loc < 0) fprintf(fp,"SECT %s REL %4.4x %4.4x\n",s->Name,s->Base,s->End-s->Base);
+      else fprintf(fp,"SECT %s %4.4x %4.4x %4.4x\n",s->Name,s->Loc,s->Base,s->End-s->Base);
+      for (a=s->Base ; a < s->End ; a += 32)
       {
-         if (XIM)
-         {
-            oc = (ROM[pc] << 8) + ROM[pc+1];
-            il = ADL[pc];
-            ql = il - ol;
-            if (df) fprintf(df,"ROM oc = %4.4x  v = %4.4x\n",oc,v);
-         }
-         else
-         {
-            oc = ROM[pc];
-            if (df) fprintf(df,"ROM oc = %4.4x  v = %4.4x\n",oc,v);
-            ol = 1 + (oc == 0x10 || oc == 0x11);
-            if (ol == 2) oc = (oc << 8) | ROM[pc+1];
-            il = ADL[pc];
-            ql = il - ol;
-            if (ForcedMode < 0 || ql == 1) v &= 0xff;
-         }
+         fprintf(fp,"D %4.4x ",a);
+         for (j=a ; j < a+32 && j < s->End ; ++j) fprintf(fp,"%2.2x",ROM[j]);
+         fprintf(fp,"\n");
       }
-      else
-      {
-         // extended address mode
+   }
+   for (e=1 ; e <= Externs ; ++e)
+   for (i=0 ; i < Labels ; ++i)
+   if (lab[i].Rel == -e) fprintf(fp,"EXTERN %s\n",lab[i].Name);
+   for (i=0 ; i < Labels ; ++i)
+   if (lab[i].Intern)
+      fprintf(fp,"INTERN %s %s %4.4x\n",lab[i].Name,RelName(lab[i].Rel,B1),
+              lab[i].Address & 0xffff);
+   for (i=0 ; i < Fixes ; ++i)
+      fprintf(fp,"FIX %s %4.4x %c %s %4.4x\n",RelName(Fix[i].Sect+1,B1),
+              Fix[i].Addr,Fix[i].Kind,RelName(Fix[i].Target,B2),Fix[i].Value & 0xffff);
+   StatFileSize(Name,fp);
+   if (ferror(fp) || OutputClose(fp,Name,Tmp)) AssertFileOp(NULL, "Close object file");
+}
 
-         if (!XIM) oc = Mat[MneIndex].Opc[AM_Extended];
-         if (oc >= 0)
-         {
-            // assume extended mode
+// **************
+// StatPeakMemory
+// **************
 
-            ol = 1 + (oc > 255); // opcode  length
-            ql = 2;              // operand length
-            il = ol + 2;         // instruction length
+// peak resident set size in kB, -1 if the system does not report it
 
-            // direct address mode
+long StatPeakMemory(void)
+{
+   long kB = -1;
+#ifdef __linux__
+   char Buf[128];
+   FILE *fp;
 
-            if (ForcedMode <= 0) // not forced extended
-            {
-               if (XIM) qc = oc & 0xfff;
-               else     qc = Mat[MneIndex].Opc[AM_Direct];
+   fp = fopen("/proc/self/status","r");
+   if (!fp) return -1;
+   while (fgets(Buf,sizeof(Buf),fp))
+      if (!strncmp(Buf,"VmHWM:",6)) kB = strtol(Buf+6,NULL,10);
+   fclose(fp);
+#endif
+   return kB;
+}
 
-               if (qc >= 0 && (ForcedMode < 0 ||
-                  (v != UNDEF && (v >> 8) == DP)))
-               {
-                  oc = qc;
-                  v &= 0xff;
-                  ql = 1;
-                  il = ol + 1;
-      if (XIM && df) fprintf(df,"XIM3 oc = %4.4x  v = %4.4x il = %d\n",oc,v,il);
-               }
-            }
-         }
-         else
-         {
-            ++ErrNum;
-            ErrorLine(p);
-            ErrorMsg("Illegal instruction %s %s\n",Mat[MneIndex].Mne,OpText);
-            exit(1);
-         }
-      }
+// **************
+// StatJsonString
+// **************
 
-      if (XIM && df) fprintf(df,"XIM2 oc = %4.4x  v = %4.4x il = %d\n",oc,v,il);
-      if (Optimize)
-      {
-          // optimise JSR to BSR
+void StatJsonString(const char *s)
+{
+   putchar('"');
+   for ( ; *s ; ++s)
+   {
+      if (*s == '"' || *s == '\\') putchar('\\');
+      putchar(*s);
+   }
+   putchar('"');
+}
 
-          rd = v - pc - 3;
-          if (Phase == 2 && oc == 0xbd && rd >= -128 && rd < 128)
-          {
-             optc++;
-             fprintf(of," JSR %4.4x   ***   BSR %2.2x:%5d %s\n",
-                     v,rd&0xff,LiNo,Line);
-          }
+// ***********
+// StatsReport
+// ***********
 
-         // optimize JMP to BRA
+// Print phase timing and internal counters (-t, --stats[=json]).
+// Times are processor seconds summed over all runs of a phase,
+// phase 1 and 2 run more than once with inlining, merging,
+// pooling or placement.
 
-         rd = v - pc - 3;
-         if (rd >= -128 && rd < 0)
-         {
-            if (Phase == 1 && oc == 0x7e)
-            {
-               oc = 0x20; // BRA
-               ol =  1;
-               ql =  1;
-               il =  2;
-               v  = rd;
-            }
-            if (Phase == 2 && oc == 0x20)
-            {
-               optc++;
-               fprintf(of," JMP %4.4x   -->   BRA %2.2x:%5d %s\n",
-                       v,rd&0xff,LiNo,Line);
-               strcpy(Hint," ; BRA");
-               ol =  1;
-               ql =  1;
-               il =  2;
-               v  = rd;
-            }
-         }
+void StatsReport(void)
+{
+   int i;
+   long Peak;
+   double Pass,Rate,Probe;
+   const char *Phs[4] = {"phase1","phase2","binaries","symbols"};
+
+   Pass  = StatTime[0] + StatTime[1];
+   Rate  = Pass > 0 ? StatLines / Pass : 0;
+   Probe = StatLookups ? (double)StatProbes / StatLookups : 0;
+   Peak  = StatPeakMemory();
+
+   if (Stats == 2)
+   {
+      printf("{\n  \"source\": ");
+      StatJsonString(Src);
+      printf(",\n  \"time\": {");
+      for (i=0 ; i < 4 ; ++i)
+         printf("%s\"%s\": %.6f",i ? ", " : "",Phs[i],StatTime[i]);
+      printf("},\n");
+      printf("  \"runs\": {\"phase1\": %d, \"phase2\": %d},\n",
+             StatRuns[0],StatRuns[1]);
+      printf("  \"phase2_processes\": %d,\n",StatChunks);
+      printf("  \"lines\": %ld,\n",StatLines);
+      printf("  \"lines_per_sec\": %.0f,\n",Rate);
+      printf("  \"lookups\": %ld,\n",StatLookups);
+      printf("  \"probes\": %ld,\n",StatProbes);
+      printf("  \"avg_probe\": %.2f,\n",Probe);
+      printf("  \"macros\": %ld,\n",StatMacros);
+      printf("  \"includes\": %ld,\n",StatIncludes);
+      printf("  \"puts\": %ld,\n",StatPuts);
+      printf("  \"allocs\": %ld,\n",StatAllocs);
+      printf("  \"alloc_bytes\": %lu,\n",(unsigned long)StatHeap);
+      printf("  \"peak_rss_kb\": %ld,\n",Peak);
+      printf("  \"files\": [");
+      for (i=0 ; i < StatFiles ; ++i)
+      {
+         printf("%s\n    {\"name\": ",i ? "," : "");
+         StatJsonString(StatFile[i].Name);
+         printf(", \"bytes\": %ld}",StatFile[i].Bytes);
       }
+      printf("%s]\n}\n",StatFiles ? "\n  " : "");
+      return;
    }
+   printf("Phase 1     : %9.3f s  %d run%s\n",StatTime[0],StatRuns[0],
+          StatRuns[0] == 1 ? "" : "s");
+   printf("Phase 2     : %9.3f s  %d run%s",StatTime[1],StatRuns[1],
+          StatRuns[1] == 1 ? "" : "s");
+   if (StatChunks) printf(", %d processes",StatChunks);
+   printf("\n");
+   printf("Binaries    : %9.3f s\n",StatTime[2]);
+   printf("Symbols     : %9.3f s\n",StatTime[3]);
+   printf("Lines       : %9ld    %.0f lines/s\n",StatLines,Rate);
+   printf("Lookups     : %9ld    %.2f probes/lookup\n",StatLookups,Probe);
+   printf("Macros      : %9ld    expansions\n",StatMacros);
+   printf("Includes    : %9ld    files opened\n",StatIncludes);
+   printf("Put         : %9ld    calls\n",StatPuts);
+   printf("Allocated   : %9lu    bytes requested in %ld allocations\n",
+          (unsigned long)StatHeap,StatAllocs);
+   if (Peak >= 0)
+   printf("Peak memory : %9ld    kB resident\n",Peak);
+   for (i=0 ; i < StatFiles ; ++i)
+   printf("File        : %9ld    bytes  %s\n",StatFile[i].Bytes,StatFile[i].Name);
+}
 
-   if (Phase == 1) SetInstructionLength(p);
+const char *StatOn  = " * ";
+const char *StatOff = "   ";
 
-   if (Phase == 2)
+const char *Stat(int o)
+{
+   if (o) return StatOn ;
+   else   return StatOff;
+}
+
+// ***********
+// OptionValue
+// ***********
+
+char *OptionValue(int argc, char *argv[], int *ic)
+{
+   if (++*ic == argc)
    {
-      Synchronize();
-      if (v == UNDEF && ql > 0)
-      {
-         ErrorLine(p);
-         ErrorMsg("Use of an undefined label\n");
-         exit(1);
-      }
+      fprintf(stderr, "Missing value for %s\n",argv[*ic-1]);
+      Terminate(1);
+   }
+   return argv[*ic];
+}
 
-      // insert binary code
+void usage(void)
+{
+   printf("Usage: bs9 [options] <source> [<source> ...]\n");
+   printf("Options:\n");
+   printf("   -d print details in file <Debug.lst>\n");
+   printf("   -D Define symbols\n");
+   printf("   -g write call graph <source>.dot and <source>.cg\n");
+   printf("   -i ignore case in symbols\n");
+   printf("   -j number of threads for batch mode (default: one per CPU)\n");
+   printf("   -h display this usage\n");
+   printf("   -l preset value for memory\n");
+   printf("   -m Motorola codestyle: blank = field separator\n");
+   printf("   -M write make dependencies <source>.d (-MF file: to file)\n");
+   printf("   -n include line numbers in listing\n");
+   printf("   -o optimize long branches and jumps\n");
+   printf("   -p print preprocessed source\n");
+   printf("   -q quiet mode\n");
+   printf("   -s write stack depth report <source>.stk\n");
+   printf("   -t print phase timing and internal counters\n");
+   printf("   -u pool identical strings (suffix sharing)\n");
+   printf("   -x assemble listing file - skip hex in front\n");
+   printf("   -z merge identical code tails, hints for repeated blocks\n");
+   printf("   --run label     simulate from label, write <source>.run\n");
+   printf("   --cycles n      stop simulation after n cycles (0: no limit)\n");
+   printf("   --break label   stop simulation at label\n");
+   printf("   --io file       I/O and register setup for simulation\n");
+   printf("   --profile trace annotate <source>.prf and <source>.fold from trace\n");
+   printf("   --place counts  move hot and cold modules to PLACE regions\n");
+   printf("   --stats[=json]  same as -t, optionally as JSON (implies -q)\n");
+   printf("   --batch list    assemble the sources listed in file list\n");
+   printf("   --variants file assemble each source for each line 'name options' of file\n");
+   printf("   --cpu n         start with CPU 6809 or 6309 (default)\n");
+   printf("   --parallel n    run phase 2 in n processes\n");
+   printf("   --obj           write relocatable object <source>.o9, no binaries\n");
+   printf("   --link file     link the objects given as sources to file\n");
+   printf("   --base address  lowest address for relocatable sections (--link)\n");
+   printf("   --pch dir       cache symbols and macros of include files in dir\n");
+   printf("   --sym           write the symbols to <source>.sym for IMPORTSYM\n");
+   printf("   --cache dir     restore the outputs of unchanged inputs from dir\n");
+   printf("   --watch         assemble again whenever an input file changes\n");
+   exit(1);
+}
 
-      if (df) fprintf(df,"PUT OC = %4.4x\n",oc);
-      if (oc > 255) // two byte opcode
+#ifdef BS9_THREADS
+
+// **************
+// Phase2Parallel
+// **************
+
+// Phase 2 in up to Parallel child processes, each starting at a
+// checkpoint of phase 1. A child writes its listing and hints to
+// temporary files and reports the changed bytes, references, modules,
+// STORE commands and messages. The parent appends the pieces in order.
+// Returns 0 if phase 2 must run sequentially: for options that need
+// phase 2 in order, if a label changed its value in phase 1, if a child
+// stopped with a fatal error, reached ERRMAX or wrote overlapping bytes.
+
+struct ChunkStruct
+{
+   int   First;    // checkpoint to start with (-1: start of source)
+   int   End;      // total line number of the last line (0: to the end)
+   pid_t Pid;
+   FILE *Lst;      // listing
+   FILE *Hnt;      // hints
+   FILE *Res;      // results
+   int   Fatal;    // 1: fatal error or unexpected change
+   int   Errors;   // new errors
+   int   Optc;     // new hints
+   int   GenEnd;
+   int   TotalLiNo;
+   int   LiNo;
+   int   Changes;  // changed addresses
+   int   Mods;     // new modules
+   int   Stores;   // new STORE commands
+   long  Lines;    // statistics
+   long  Puts;
+   long  Lookups;
+   long  Probes;
+   long  Macros;
+   long  Includes;
+   size_t DiagLen; // length of messages
+};
+
+// runs in the child process, never returns
+
+void RunChunk(struct ChunkStruct *k)
+{
+   int a,i,n;
+   int Labs = Labels,Execs = Executes,Pols = Pools,Mods = Modules,Stores = StoreCount;
+   int Errs = ErrNum,Hints = optc;
+   long Lines = StatLines,Puts = StatPuts,Lookups = StatLookups;
+   long Probes = StatProbes,Macros = StatMacros,Includes = StatIncludes;
+   unsigned char *R,*L;
+   signed char *A;
+   jmp_buf Jmp;
+   FILE *fp = k->Res;
+
+   R = (unsigned char *)MallocOrDie(0x10000);
+   L = (unsigned char *)MallocOrDie(0x10000);
+   A = (signed char *)MallocOrDie(0x10000);
+   memcpy(R,ROM,0x10000);
+   memcpy(L,LOCK,0x10000);
+   memcpy(A,ADL,0x10000);
+   if (k->First >= 0) Restart(Chk + k->First);
+   else OnceReset(0);
+   lf = k->Lst;
+   if (of) of = k->Hnt;
+   free(Diag);
+   Diag    = NULL;
+   DiagLen = 0;
+   DiagOn  = 1;
+   ExitJmp = &Jmp;
+   if (setjmp(Jmp)) k->Fatal = 1;
+   else
+   {
+      if (mf) // the child has its own copy of the source text
       {
-         Put(pc,oc >> 8,p);
-         Put(pc+1,oc,p);
-         ibi = 2;
+         mf->Pos = k->First >= 0 ? (size_t)Chk[k->First].Pos : 0;
+         mf->Eof = 0;
       }
+      else sf = fopen(Src,"r"); // the parent's file position is shared
+      if (!mf && (!sf || fseek(sf,k->First >= 0 ? Chk[k->First].Pos : 0,SEEK_SET)))
+         k->Fatal = 1;
       else
       {
-         Put(pc,oc,p);
-         ibi = 1;
+         IncludeStack[0].fp = sf;
+         Phase2Lines(k->End);
+         if (GenEnd < pc) GenEnd = pc;
       }
-
-      if (pb >= 0) // post byte
+   }
+   if (Labels != Labs || Executes != Execs || Pools != Pols) k->Fatal = 1;
+   k->Errors    = ErrNum - Errs;
+   k->Optc      = optc - Hints;
+   k->GenEnd    = GenEnd;
+   k->TotalLiNo = TotalLiNo;
+   k->LiNo      = LiNo;
+   k->Mods      = Modules - Mods;
+   k->Stores    = StoreCount - Stores;
+   k->Lines     = StatLines - Lines;
+   k->Puts      = StatPuts - Puts;
+   k->Lookups   = StatLookups - Lookups;
+   k->Probes    = StatProbes - Probes;
+   k->Macros    = StatMacros - Macros;
+   k->Includes  = StatIncludes - Includes;
+   k->DiagLen   = DiagLen;
+   for (k->Changes=0, a=0 ; a < 0x10000 ; ++a)
+      if (ROM[a] != R[a] || LOCK[a] != L[a] || ADL[a] != A[a]) ++k->Changes;
+   fwrite(k,sizeof(struct ChunkStruct),1,fp);
+   if (!k->Fatal)
+   {
+      fwrite(Diag,1,DiagLen,fp);
+      for (a=0 ; a < 0x10000 ; ++a)
       {
-         Put(pc+ibi++,pb,p);
+         if (ROM[a] != R[a] || LOCK[a] != L[a] || ADL[a] != A[a])
+         {
+            fwrite(&a,sizeof(int),1,fp);
+            fputc(ROM[a],fp);
+            fputc(LOCK[a],fp);
+            fputc(ADL[a],fp);
+         }
       }
-
-      if (ql == 4) // 32 bit value
+      for (i=Mods ; i < Modules ; ++i)
       {
-         Put(pc+ibi++,v >> 24,p);
-         Put(pc+ibi++,v >> 16,p);
-         Put(pc+ibi++,v >>  8,p);
-         Put(pc+ibi++,v      ,p);;
+         PutString(fp,Mod[i].Name);
+         fwrite(&Mod[i].Start,sizeof(int),1,fp);
+         fwrite(&Mod[i].End,sizeof(int),1,fp);
       }
-
-      if (ql == 2) // 16 bit value
+      for (i=Stores ; i < StoreCount ; ++i)
       {
-         if (v > 0xffff || v < -32768)
-         {
-            ErrorLine(p);
-            ErrorMsg("16 bit address/value out of range\n");
-            exit(1);
-         }
-         Put(pc+ibi++,v >> 8,p);
-         Put(pc+ibi++,v     ,p);
+         PutString(fp,SFF[i]);
+         fwrite(SFA+i,sizeof(int),1,fp);
+         fwrite(SFL+i,sizeof(int),1,fp);
+         fwrite(SFE+i,sizeof(int),1,fp);
+         fwrite(SFT+i,sizeof(int),1,fp);
+      }
+      for (i=0 ; i < Labels ; ++i)
+      {
+         if ((n = lab[i].NumRef) == 0) continue;
+         fwrite(&i,sizeof(int),1,fp);
+         fwrite(&n,sizeof(int),1,fp);
+         fwrite(lab[i].Ref+1,sizeof(int),n,fp);
+         fwrite(lab[i].Att+1,sizeof(int),n,fp);
       }
+      i = -1;
+      fwrite(&i,sizeof(int),1,fp);
+   }
+   fflush(NULL);
+   _exit(0);
+}
 
-      if (ql == 1) //  8 bit value
+// appends the contents of the temporary file src to dst
+
+void AppendFile(FILE *dst, FILE *src)
+{
+   char Buf[4096];
+   size_t n;
+
+   rewind(src);
+   while ((n = fread(Buf,1,sizeof(Buf),src)) > 0) fwrite(Buf,1,n,dst);
+}
+
+int Phase2Parallel(void)
+{
+   int a,i,j,n,c,Errors,Chunks,Status,Start;
+   unsigned char *SaveROM,*SaveLOCK;
+   signed char *SaveADL;
+   char *Text,*Name;
+   struct ChunkStruct *Chunk,*k,Keep;
+
+   if (Parallel < 2 || Checks == 0 || Reassigned || IncShare || (!mf && !sf)) return 0;
+   if (df || pf || prf || MrgLine || MrgAct || PoolAct || PoolAll || Pools) return 0;
+   if (PlaceFile || Inlines || Modules || StoreCount || ObjMode) return 0;
+
+   // split at the first checkpoints after equal shares of the lines
+
+   Chunk = (struct ChunkStruct *)MallocOrDie(Parallel * sizeof(struct ChunkStruct));
+   memset(Chunk,0,Parallel * sizeof(struct ChunkStruct));
+   Chunk[0].First = -1;
+   for (i=1, j=0, Chunks=1 ; i < Parallel ; ++i)
+   {
+      n = (int)((long long)i * ChkLines / Parallel);
+      while (j < Checks && Chk[j].TotalLiNo < n) ++j;
+      if (j == Checks) break;
+      Chunk[Chunks-1].End = Chk[j].TotalLiNo;
+      Chunk[Chunks++].First = j++;
+   }
+
+   fflush(NULL); // the children inherit the stdio buffers
+   for (i=0 ; i < Chunks ; ++i)
+   {
+      k = Chunk + i;
+      k->Lst = AssertFileOp(tmpfile(),"Open chunk listing");
+      k->Hnt = AssertFileOp(tmpfile(),"Open chunk hints");
+      k->Res = AssertFileOp(tmpfile(),"Open chunk results");
+      k->Pid = fork();
+      if (k->Pid == 0) RunChunk(k);
+      if (k->Pid < 0) k->Fatal = 1;
+   }
+
+   // collect the results
+
+   for (i=0, c=0, Errors=ErrNum ; i < Chunks ; ++i)
+   {
+      k = Chunk + i;
+      if (k->Pid > 0 && (waitpid(k->Pid,&Status,0) != k->Pid || Status))
+         k->Fatal = 1;
+      if (!k->Fatal)
       {
-         if (v >= 0xff00 && v <= 0xffff) v &= 0xff;
-         if ((v-(DP<<8)) < 256 && (v-(DP<<8)) >= -128) v -= DP<<8;
-         if (v > 255 || v < -128)
-         {
-            printf("v = %x  DP = %x\n",v,DP);
-            ErrorLine(p);
-            ErrorMsg("8 bit address/value out of range\n");
-            exit(1);
-         }
-         Put(pc+ibi++,v,p);
+         Keep = *k;
+         rewind(k->Res);
+         if (fread(k,sizeof(struct ChunkStruct),1,k->Res) != 1) k->Fatal = 1;
+         k->Lst = Keep.Lst;
+         k->Hnt = Keep.Hnt;
+         k->Res = Keep.Res;
+         Errors += k->Errors;
       }
+      c |= k->Fatal;
+   }
+   if (Errors >= ERRMAX) c = 1;
+   StatChunks = c ? 0 : Chunks;
 
-      for (i=0 ; i < nops ; ++i) Put(pc+ibi++,0x12,p); // NOP
+   // apply the changed bytes, stop at overlapping code
 
-      if (ListOn)
+   SaveROM  = (unsigned char *)MallocOrDie(0x10000);
+   SaveLOCK = (unsigned char *)MallocOrDie(0x10000);
+   SaveADL  = (signed char *)MallocOrDie(0x10000);
+   memcpy(SaveROM,ROM,0x10000);
+   memcpy(SaveLOCK,LOCK,0x10000);
+   memcpy(SaveADL,ADL,0x10000);
+   for (i=0 ; i < Chunks && !c ; ++i)
+   {
+      k = Chunk + i;
+      fseek(k->Res,sizeof(struct ChunkStruct) + k->DiagLen,SEEK_SET);
+      for (j=0 ; j < k->Changes && !c ; ++j)
       {
-         PrintPC();
-         PrintOC(v);
-         fprintf(lf," %s",Line);
-         if (Hint[0])
+         a = GetInt(k->Res);
+         if (a < 0 || a > 0xffff) c = 1;
+         else
          {
-            fprintf(lf,"%s",Hint);
-            Hint[0] = 0;
+            n = fgetc(k->Res);
+            if (LOCK[a] != SaveLOCK[a] && ROM[a] != n) c = 1; // overwrite
+            ROM[a]  = n;
+            LOCK[a] = fgetc(k->Res);
+            ADL[a]  = (signed char)fgetc(k->Res);
          }
-
-         if (nops && df) fprintf(df,"Added %d NOP's\n",nops);
-         if (nops >  1 && lf) fprintf(lf," ; added %d NOP's",nops);
-         if (nops == 1 && lf) fprintf(lf," ; added a NOP");
       }
    }
-
-   if (il < 1 || il > 5)
+   if (c) // phase 2 in order
    {
-      ++ErrNum;
-      ErrorMsg("Wrong instruction length = %d\n",il);
-      il = 1;
+      memcpy(ROM,SaveROM,0x10000);
+      memcpy(LOCK,SaveLOCK,0x10000);
+      memcpy(ADL,SaveADL,0x10000);
    }
+   free(SaveROM);
+   free(SaveLOCK);
+   free(SaveADL);
 
-   if (pc+il > 0xffff)
+   // listing, hints, messages, modules, stores and references
+
+   for (i=0 ; i < Chunks && !c ; ++i)
    {
-      if (Phase > 1)
+      k = Chunk + i;
+      AppendFile(lf,k->Lst);
+      if (of) AppendFile(of,k->Hnt);
+      fseek(k->Res,sizeof(struct ChunkStruct),SEEK_SET);
+      if (k->DiagLen)
       {
-         ++ErrNum;
-         ErrorMsg("Program counter exceeds 64 KB\n");
+         Text = (char *)MallocOrDie(k->DiagLen+1);
+         n = fread(Text,1,k->DiagLen,k->Res);
+         Text[n] = 0;
+         if (!DiagOn) fputs(Text,stdout);
+         else
+         {
+            Diag = (char *)ReallocOrDie(Diag,DiagLen+n+1);
+            memcpy(Diag+DiagLen,Text,n+1);
+            DiagLen += n;
+         }
+         free(Text);
       }
-   }
-   else pc += il;
-   return p;
+      fseek(k->Res,k->Changes * (sizeof(int) + 3),SEEK_CUR);
+      for (j=0 ; j < k->Mods ; ++j)
+      {
+         Name  = GetString(k->Res);
+         Start = GetInt(k->Res);
+         AddModule(Name,Start,GetInt(k->Res));
+      }
+      for (j=0 ; j < k->Stores && StoreCount < SFMAX ; ++j, ++StoreCount)
+      {
+         SFF[StoreCount] = GetString(k->Res);
+         SFA[StoreCount] = GetInt(k->Res);
+         SFL[StoreCount] = GetInt(k->Res);
+         SFE[StoreCount] = GetInt(k->Res);
+         SFT[StoreCount] = GetInt(k->Res);
+      }
+      while ((j = GetInt(k->Res)) >= 0 && j < Labels)
+      {
+         n = GetInt(k->Res);
+         if (n <= 0) break;
+         lab[j].Ref = (int *)ReallocOrDie(lab[j].Ref,(lab[j].NumRef+n+1)*sizeof(int));
+         lab[j].Att = (int *)ReallocOrDie(lab[j].Att,(lab[j].NumRef+n+1)*sizeof(int));
+         if (fread(lab[j].Ref+lab[j].NumRef+1,sizeof(int),n,k->Res) != (size_t)n) break;
+         if (fread(lab[j].Att+lab[j].NumRef+1,sizeof(int),n,k->Res) != (size_t)n) break;
+         lab[j].NumRef += n;
+      }
+      ErrNum       += k->Errors;
+      optc         += k->Optc;
+      if (GenEnd < k->GenEnd) GenEnd = k->GenEnd;
+      TotalLiNo     = k->TotalLiNo;
+      LiNo          = k->LiNo;
+      StatLines    += k->Lines;
+      StatPuts     += k->Puts;
+      StatLookups  += k->Lookups;
+      StatProbes   += k->Probes;
+      StatMacros   += k->Macros;
+      StatIncludes += k->Includes;
+   }
+   for (i=0 ; i < Chunks ; ++i)
+   {
+      fclose(Chunk[i].Lst);
+      fclose(Chunk[i].Hnt);
+      fclose(Chunk[i].Res);
+   }
+   free(Chunk);
+   return !c;
 }
 
-#define MAXARGS 10
+#endif // BS9_THREADS
 
-// *************
-// ScanArguments
-// *************
+// **************
+// AssembleSource
+// **************
 
-// for nargs == MAXARGS this is a recording call
-// otherwise it's an expansion call
+// Runs the passes for the opened source and the reports selected
+// by the options. Binaries are written if Write is set.
+// Used by main and by BS9_Assemble.
 
-int ScanArguments(char *p, char *args, int ptr[], int nargs)
+void AssembleSource(int Write)
 {
-   int l,n;
-   char sym[ML];
+   int n;
 
-   if (df) fprintf(df,"Scan Args %d <%s>\n",nargs,p);
-   n = 0;
-   ptr[0] = 0;
-   while (*p && n < nargs)
+   Phase1();
+   if (Inlines) // repeat phase 1 with inlined calls
    {
-      if (df) fprintf(df,"Arg #%d <%s>\n",n,p);
-      p = SkipSpace(p);
-      if (*p == ')') break; // end of list
-      if (nargs == MAXARGS) p = GetSymbol(p,sym);
-      else                  p = GetMacroArg(p,sym);
-      l = strlen(sym);
-      if (l) memmove(args+ptr[n],sym,l+1);
-      else   args[ptr[n]] = 0;
-      ++n;
-      ptr[n] = ptr[n-1] + l + 1;
-      p = SkipSpace(p);
-      if (*p == ')') break; // end of list
-      if (*p != ',' && n < nargs-1 && nargs < MAXARGS)
-      {
-         ++ErrNum;
-         ErrorMsg("Syntax error in macro definition '%c'\n",*p);
-         exit(1);
-      }
-      if (*p == ',') ++p;
+      SelectInlines();
+      ResetPass();
+      InlPass = 1;
+      Phase1();
    }
-   return n;
+   Phase2();
+   while (InlLongNew) // repeat with promoted short branches
+   {
+      InlLongNew = 0;
+      ResetPass();
+      ResetOutput();
+      Phase1();
+      Phase2();
+   }
+   n = 0;
+   if (Merge) n += MergeTails();
+   if (Pools) n += PoolStrings();
+   if (PlaceFile) n += PlaceModules(PlaceFile);
+   if (n) // repeat phase 1 and 2 with merged tails and pooled strings
+   {
+      ResetPass();
+      ResetOutput();
+      if (Merge) MergeReport();
+      if (PoolAct) PoolReport();
+      Phase1();
+      Phase2();
+   }
+   if (PchDir && !ErrNum) PchSave();
+   if (PlaceFile) PlaceReport();
+   if (Merge) ReportBlocks();
+   if (Write)
+   {
+      StatTime[2] = StatClock();
+      if (ObjMode) WriteObject(Obj);
+      else WriteBinaries();
+      if (SymExport && !ErrNum) ExportSymbols(Exp);
+      StatTime[2] = StatClock() - StatTime[2];
+   }
+   if (Stack) StackReport(Stk);
+   if (Graph) CallGraphReport(Dot,Cgr);
+   if (RunLabel) RunSimulation(Run);
+   if (prf) ProfileReport(ProfTrace,Fld);
+   StatTime[3] = StatClock();
+   ListUndefinedSymbols();
+   qsort(lab,Labels,sizeof(struct LabelStruct),CmpAddress);
+   fprintf(lf,"\n\n%5d Symbols\n",Labels);
+   fprintf(lf,"-------------\n");
+   ListSymbols(lf,Labels,0,0xffff);
+   qsort(lab,Labels,sizeof(struct LabelStruct),CmpRefs);
+   ListSymbols(lf,Labels,0,0xff);
+   ListSymbols(lf,Labels,0,0x4000);
+   StatTime[3] = StatClock() - StatTime[3];
 }
 
+// Define BS9_NO_MAIN to include this file into a test driver (micro9.c)
 
-// Called after name MCRO returns # of args
+#if !defined(BS9_NO_MAIN) && !defined(BS9_LIBRARY)
 
-int ScanArgs(char *p, char *args, int ptr[])
+// sources of the command line and of --batch files
+
+char **JobSrc;         // source file names
+int    Jobs;           // number of sources
+int    JobMax;         // allocated size of JobSrc
+int    Workers;        // -j: number of threads (0: one per CPU)
+int    BatchList;      // sources were given by --batch
+char  *LinkName;       // --link: linked output, the sources are objects
+int    LinkBase;       // --base: lowest address of relocatable sections
+
+// define sets of --variants, every source is assembled for each set
+
+struct VariantStruct
 {
-   int l,n;
-   char sym[ML];
+   char  *Name;  // appended to the output file names
+   int    Argc;  // options in the form of a command line
+   char **Argv;
+} *Var;
 
-   n = 0;
-   ptr[0] = 0;
-   // if (df) fprintf(df,"Inside ScanArgs: <%s>\n",p);
-   while (*p && n < 10)
+int Variants;          // number of variants
+
+void AddJob(char *Name)
+{
+   if (Jobs == JobMax)
    {
-      p = SkipSpace(p);
-      if (*p == ';') break; // comment
-      p = NextSymbol(p,sym);
-      l = strlen(sym);
-      // if (df) fprintf(df,"ScanSym:<%s>[%d]\n",sym,l);
-      if (l) memmove(args+ptr[n],sym,l+1);
-      else   args[ptr[n]] = 0;
-      ++n;
-      ptr[n] = ptr[n-1] + l + 1;
-      p = SkipSpace(p);
-      if (*p != ',') break; // end of list
-      ++p; // skip comma
+      JobMax = JobMax ? 2 * JobMax : 64;
+      JobSrc = (char **)ReallocOrDie(JobSrc,JobMax * sizeof(char *));
    }
-   return n;
+   JobSrc[Jobs++] = Name;
 }
 
-void MacroInfo(int n)
-{
-   fprintf(df,"-----------------\n");
-   fprintf(df,"Name: %s\n",Mac[n].Name);
-   fprintf(df,"Args: %d\n",Mac[n].Narg);
-   fprintf(df,"Cola: %d\n",Mac[n].Cola);
-   fprintf(df,"Type: %d\n",Mac[n].Type);
-   fprintf(df,"Body: <<<%s>>>\n",Mac[n].Body);
-   fprintf(df,"-----------------\n");
-}
+// *********
+// ReadBatch
+// *********
 
-// ***********
-// RecordMacro
-// ***********
+// adds the sources listed in a batch file, one per line,
+// empty lines and lines starting with '#' or ';' are skipped
 
-void RecordMacro(char *p)
+void ReadBatch(char *Name)
 {
-   char Macro[ML];
-   int i,j,l,al,an,bl,mf;
-   int ap[10];
-   char args[ML];
-   char Buf[ML];
-   char *b;
-   char *at;
+   char Buf[FNSIZE];
+   char *p;
+   int l;
+   FILE *fp;
 
-   if (Macros > MAXMAC -2)
+   fp = fopen(Name,"r");
+   if (!fp)
    {
-      ++ErrNum;
-      ErrorMsg("Too many macros (> %d)\n",MAXMAC);
-      exit(1);
+      fprintf(stderr,"Could not open batch file <%s>\n",Name);
+      Terminate(1);
+   }
+   while (fgets(Buf,sizeof(Buf),fp))
+   {
+      p = SkipSpace(Buf);
+      for (l=strlen(p) ; l > 0 && isspace((unsigned char)p[l-1]) ; --l) ;
+      if (l == 0 || *p == '#' || *p == ';') continue;
+      AddJob(StrNDup(p,l));
    }
+   fclose(fp);
+   BatchList = 1;
+}
 
-   bl = 1;
-   mf = strcmpword(p,"MACRO") != 0; // 1 : name MACRO
-   if (!mf) p += 5;                 // 0 : MACRO name
-   if (df) fprintf(df,"macro type = %d\n",mf);
+// ************
+// ReadVariants
+// ************
 
-   p = NextSymbol(p,Macro);
-   l = strlen(Macro);
-   if (mf) p = StrMatch(p,"MACRO") + 5;
-   p = SkipSpace(p);
+// Reads the variants, one per line: a name followed by options,
+// e.g. "dragon --cpu 6809 -DDRAGON=1". Empty lines and lines
+// starting with '#' or ';' are skipped.
 
-   if (df)
+void ParseOptions(int argc, char *argv[], int Job);
+
+void ReadVariants(char *Name)
+{
+   char Buf[MAX_STR];
+   char *p,*q;
+   FILE *fp;
+   struct VariantStruct *v;
+
+   fp = fopen(Name,"r");
+   if (!fp)
    {
-      fprintf(df,"Macro name: <%s>\n",Macro);
-      fprintf(df,"Arglist: <%s>\n",p);
+      fprintf(stderr,"Could not open variant file <%s>\n",Name);
+      Terminate(1);
    }
-
-   if (*p == '(') ++p;
-   if (mf) an = ScanArgs(p,args,ap);
-   else    an = ScanArguments(p,args,ap,MAXARGS);
-   if (df)
+   while (fgets(Buf,sizeof(Buf),fp))
    {
-      fprintf(df,"RecordMacro: %s(",Macro);
-      for (i=0 ; i < an ; ++i)
+      p = SkipSpace(Buf);
+      if (*p == 0 || *p == '\n' || *p == '\r' || *p == '#' || *p == ';') continue;
+      Var = (struct VariantStruct *)ReallocOrDie(Var,(Variants+1) * sizeof(struct VariantStruct));
+      v = Var + Variants++;
+      v->Argc = 0;
+      v->Argv = (char **)MallocOrDie((strlen(p)/2 + 2) * sizeof(char *));
+      v->Argv[v->Argc++] = Name; // argv[0] is not an option
+      for (v->Name = NULL ; *p ; p = SkipSpace(q))
       {
-         at = args + ap[i];
-         al = strlen(at);
-         fprintf(df,"%s[%d]",at,al);
-         if (i < an-1) fprintf(df,",");
+         for (q=p ; *q && !isspace((unsigned char)*q) ; ++q) ;
+         if (v->Name) v->Argv[v->Argc++] = StrNDup(p,q-p);
+         else         v->Name = StrNDup(p,q-p);
       }
-      fprintf(df,")\n");
+      ParseOptions(v->Argc,v->Argv,1); // check the options
    }
-   j = MacroIndex(Macro);
-   if (j < 0)  // create new entry in macro table
-   {
-      j = Macros;
-      Mac[j].Name = (char *)StrNDup(Macro,l);
-      Mac[j].Narg = an;
-      Mac[j].Type = mf;
-      fgets(Line,sizeof(Line),sf);
-      while (!feof(sf) && !StrCaseStr(Line,"ENDM"))
-      {
-         ++LiNo;
-         l = strlen(Line);
-         if (l && Line[l-1] == 10) Line[--l] = 0; // Remove linefeed
-         if (l && Line[l-1] == 13) Line[--l] = 0; // Remove return
+   fclose(fp);
+}
+
+// ************
+// ParseOptions
+// ************
 
-         // parse line and substitute arguments
+// Sets the option variables of the calling thread. Jobs of the batch
+// mode parse the command line again, then sources are ignored.
 
-         p = Line;
-         b = Buf;
-         while (*p)
+void ParseOptions(int argc, char *argv[], int Job)
+{
+   int ic,i0,v;
+   char *EndPtr;
+
+   for (ic=1 ; ic < argc ; ++ic)
+   {
+      i0 = ic;
+           if (!strcmp(argv[ic],"-x")) SkipHex    = 1;
+      else if (!strcmp(argv[ic],"-d")) Debug      = 1;
+      else if (!strcmp(argv[ic],"-i")) IgnoreCase = 1;
+      else if (!strcmp(argv[ic],"-m")) CodeStyle  = 1;
+      else if (!strcmp(argv[ic],"-n")) WithLiNo   = 1;
+      else if (!strcmp(argv[ic],"-o")) Optimize   = 1;
+      else if (!strcmp(argv[ic],"-p")) Preprocess = 1;
+      else if (!strcmp(argv[ic],"-q")) Quiet      = 1;
+      else if (!strcmp(argv[ic],"-s")) Stack      = 1;
+      else if (!strcmp(argv[ic],"-g")) Graph      = 1;
+      else if (!strcmp(argv[ic],"-u")) PoolAll    = 1;
+      else if (!strcmp(argv[ic],"-z")) Merge      = 1;
+      else if (!strcmp(argv[ic],"-t")) Stats      = 1;
+      else if (!strcmp(argv[ic],"--stats"))      Stats = 1;
+      else if (!strcmp(argv[ic],"--stats=json"))
+      {
+         Stats = 2; // JSON on stdout, no banner
+         Quiet = 1;
+      }
+      else if (!strcmp(argv[ic],"--run"))   RunLabel = OptionValue(argc,argv,&ic);
+      else if (!strcmp(argv[ic],"--io"))    RunIO    = OptionValue(argc,argv,&ic);
+      else if (!strcmp(argv[ic],"--profile")) ProfTrace = OptionValue(argc,argv,&ic);
+      else if (!strcmp(argv[ic],"--place"))   PlaceFile = OptionValue(argc,argv,&ic);
+      else if (!strcmp(argv[ic],"--batch"))
+      {
+         EndPtr = OptionValue(argc,argv,&ic);
+         if (!Job) ReadBatch(EndPtr);
+      }
+      else if (!strcmp(argv[ic],"--variants"))
+      {
+         EndPtr = OptionValue(argc,argv,&ic);
+         if (!Job) ReadVariants(EndPtr);
+      }
+      else if (!strcmp(argv[ic],"--obj"))   ObjMode  = 1;
+      else if (!strcmp(argv[ic],"--pch"))   PchDir   = OptionValue(argc,argv,&ic);
+      else if (!strcmp(argv[ic],"--sym"))   SymExport = 1;
+      else if (!strcmp(argv[ic],"--cache")) CacheDir = OptionValue(argc,argv,&ic);
+      else if (!strcmp(argv[ic],"--watch")) Watch = 1;
+      else if (!strcmp(argv[ic],"-M"))      DepOut = 1;
+      else if (!strcmp(argv[ic],"-MF"))     DepFile = OptionValue(argc,argv,&ic);
+      else if (!strcmp(argv[ic],"--link"))  LinkName = OptionValue(argc,argv,&ic);
+      else if (!strcmp(argv[ic],"--base"))
+      {
+         EndPtr = OptionValue(argc,argv,&ic);
+         if (*EndPtr == '$') LinkBase = strtol(EndPtr+1,&EndPtr,16);
+         else                LinkBase = strtol(EndPtr,&EndPtr,0);
+         if (*EndPtr != '\0' || LinkBase < 0 || LinkBase > 0xffff)
          {
-            for (i=0 ; i < an ; ++i)
-            {
-               at = args + ap[i];
-               al = strlen(at);
-               if (al && !StrnCmp(p,at,al))
-               {
-                  *b++ = CHAMAC;
-                  *b++ = '0' + i;
-                  p += al;
-                  break;
-               }
-            }
-            if (i == an) *b++ = *p++;
+            fprintf(stderr, "Illegal value '%s' for --base\n",argv[ic]);
+            Terminate(1);
          }
-         *b++ = '\n';
-         *b = 0;
-
-         if (df)
+      }
+      else if (!strcmp(argv[ic],"--cpu"))
+      {
+         InitCPU = strtol(OptionValue(argc,argv,&ic),&EndPtr,10);
+         if (*EndPtr != '\0' || !SetCPU(InitCPU))
          {
-            fprintf(df,"MAC line  :%s\n",Line);
-            fprintf(df,"MAC parsed:%s\n",Buf);
+            fprintf(stderr, "Illegal value '%s' for --cpu\n",argv[ic]);
+            Terminate(1);
          }
-         l = strlen(Buf);
-         if (bl == 1)
+      }
+      else if (!strcmp(argv[ic],"--parallel"))
+      {
+         Parallel = strtol(OptionValue(argc,argv,&ic),&EndPtr,0);
+         if (*EndPtr != '\0' || Parallel < 0)
          {
-            bl = l+1;
-            Mac[j].Body = (char *)StrNDup(Buf,l);
+            fprintf(stderr, "Illegal value '%s' for --parallel\n",argv[ic]);
+            Terminate(1);
          }
-         else
+      }
+      else if (!strcmp(argv[ic],"-j"))
+      {
+         errno = 0;
+         Workers = strtol(OptionValue(argc,argv,&ic),&EndPtr,0);
+         if (errno != 0 || *EndPtr != '\0' || Workers < 0)
          {
-            bl += l;
-            Mac[j].Body = (char *)ReallocOrDie(Mac[j].Body,bl);
-            strcat(Mac[j].Body,Buf);
+            fprintf(stderr, "Illegal value '%s' for -j\n",argv[ic]);
+            Terminate(1);
          }
-         fgets(Line,sizeof(Line),sf);
       }
-      Macros++;
-      if (df) fprintf(df,"finished macro %d\n",Macros);
-   }
-   else if (Phase == 2) // List macro
-   {
-      PrintLiNo();
-      ++LiNo;
-      if (ListOn) fprintf(lf,"            %s\n",Line);
-      do
+      else if (!strcmp(argv[ic],"--break"))
+      {
+         if (RunBreaks == 16)
+         {
+            fprintf(stderr, "Too many breakpoints\n");
+            Terminate(1);
+         }
+         RunBreak[RunBreaks++] = OptionValue(argc,argv,&ic);
+      }
+      else if (!strcmp(argv[ic],"--cycles"))
+      {
+         errno = 0;
+         RunLimit = strtoll(OptionValue(argc,argv,&ic),&EndPtr,0);
+         if (errno != 0 || *EndPtr != '\0' || RunLimit < 0)
+         {
+            fprintf(stderr, "Illegal value '%s' for --cycles\n",argv[ic]);
+            Terminate(1);
+         }
+      }
+      else if (!strncmp(argv[ic],"-D",2)) DefineLabel(argv[ic]+2,&v,1);
+      else if (!strncmp(argv[ic],"-l",2))
+      {
+         if (++ic == argc)
+         {
+            fprintf(stderr, "Missing value for -l\n");
+            Terminate(1);
+         }
+         errno = 0;
+         Preset = strtol(argv[ic], &EndPtr,0);
+         if (errno != 0 || *EndPtr != '\0' || Preset < 0 || Preset > 0xff)
+         {
+            fprintf(stderr, "Illegal value '%s' for -l\n",argv[ic]);
+            Terminate(1);
+         }
+         memset(ROM,Preset,sizeof(ROM));
+      }
+      else if (argv[ic][0] >= '0' || argv[ic][0] == '.')
       {
-         fgets(Line,sizeof(Line),sf);
-         PrintLiNo();
-         ++LiNo;
-         if (ListOn) fprintf(lf,"            %s",Line);
-         if (pf) fprintf(pf,"%s",Line);
-      } while (!feof(sf) && !StrCaseStr(Line,"ENDM"));
-      LiNo-=2;
-   }
-   else if (Phase == 1)
-   {
-      ++ErrNum;
-      ErrorMsg("Duplicate macro [%s]\n",Macro);
-      exit(1);
+         if (!Job) AddJob(argv[ic]);
+      }
+      else
+      {
+         usage();
+      }
+      // options and their values are part of the build cache key
+      if (argv[i0][0] == '-' && CacheKeyOption(argv[i0]))
+         for ( ; i0 <= ic ; ++i0) OptKey = HashBytes(argv[i0],strlen(argv[i0])+1,OptKey);
    }
-   if (df) MacroInfo(j);
-   ++LiNo;
 }
 
+// ************
+// AssembleFile
+// ************
 
-int ExpandMacro(char *m)
+// Assembles one source with the options of the calling thread,
+// writes listing, binaries and reports and returns the error count.
+
+int AssembleFile(char *argsrc)
 {
-   int j,an;
-   char *p;
-   char Macro[ML];
+   int l;
+   char *Base;
 
-   j = MacroIndex(m);
-   if (j < 0) return j;
-   if (df) fprintf(df,"\nExpanding [%s] phase %d\n",Mac[j].Name,Phase);
+   // default file names if only source file specified:
+   // prog.as9   prog.pp   prog.lst   prog.opt
 
-   p = NextSymbol(m,Macro);
-   p = SkipSpace(p);
-   if (*p == '(') ++p;  // parenthesis are optional
+   l = strlen(argsrc);
+   if (l > FNSIZE - 4)
+   {
+      DiagPrintf("\n*** filename too long ***\n");
+      Terminate(1);
+   }
 
-   ExtractOpText(p);    // separate arguments from comment
-   p  = OpText;
-   an = ScanArguments(p,MacArgs,ArgPtr,Mac[j].Narg);
+   // check extension of form ".xxx"
 
-   if (an != Mac[j].Narg)
+   if (l > 4 && argsrc[l-4] == '.')
    {
-      ++ErrNum;
-      ErrorMsg("Wrong # of arguments in [%s] called (%d) defined (%d)\n",
-            Macro,an,Mac[j].Narg);
-      exit(1);
+      Src = (char *)StrNDup(argsrc,l);
+      l -= 4; // length of basename
    }
-   ++MacLev;
-   MacPtr[MacLev] = Mac[j].Body;
-   if (df) fprintf(df,"Macro Level:%d\n",MacLev);
-   if (df) fprintf(df,"Macro Body :<<<%s>>>\n",Mac[j].Body);
-
-   if (Phase == 2)
+   else
    {
-      Mac[j].Cola = m - Line;
-      PrintLine();
+      Src = StrNDup(argsrc,l+4);
+      memmove(Src+l,".as9",4); // add default extension
    }
-   return j;
-}
 
+   // variants write <basename>-<variant>.ls9 etc.
 
-void NextMacLine(char *w)
-{
-   int i;
-   char *r;
-
-   if (df) fprintf(df,"Next Macro Line:%s\n",w);
-
-   // do not count macro expansion lines
-
-   --LiNo;
-
-   // check for end of macro body
-
-   while (MacLev > 0 && *MacPtr[MacLev] == 0) --MacLev;
-
-   if (df) fprintf(df,"MacPtr[%d] = {{%s}}\n",MacLev,MacPtr[MacLev]);
-
-   if (MacPtr[MacLev] && *MacPtr[MacLev])
+   Base = Src;
+   if (Variant)
    {
-      while (*MacPtr[MacLev] &&
-             *MacPtr[MacLev] != '\n')
+      Base = (char *)MallocOrDie(l + strlen(Variant) + 2);
+      l = sprintf(Base,"%.*s-%s",l,Src,Variant);
+      if (l > FNSIZE - 6)
       {
-         if (*MacPtr[MacLev] == CHAMAC)
-         {
-            i = *(++MacPtr[MacLev]) - '0';
-            r = MacArgs + ArgPtr[i];
-            while (*r) *w++ = *r++;
-            ++MacPtr[MacLev];
-         }
-         else *w++ = *MacPtr[MacLev]++;
+         DiagPrintf("\n*** filename too long ***\n");
+         Terminate(1);
       }
-      if (*MacPtr[MacLev] == '\n') ++MacPtr[MacLev];
    }
-   *w = 0;
-}
 
+   // set static filenames
 
-void ParseLine(char *cp)
-{
-   int i,l,v,m;
-   char *start;
+   memmove(Pre,Base,l);
+   memmove(Lst,Base,l);
+   memmove(Opt,Base,l);
+   memmove(Stk,Base,l);
+   memmove(Dot,Base,l);
+   memmove(Cgr,Base,l);
+   memmove(Run,Base,l);
+   memmove(Prf,Base,l);
+   memmove(Fld,Base,l);
+   memmove(Obj,Base,l);
+   memmove(Exp,Base,l);
+   memmove(Dep,Base,l);
 
-   am = -1;
-   oc = -1;
-   Label[0] = 0;
-   OpText[0] = 0;
-   Comment[0] = 0;
-   cp = SkipHexCode(cp);        // Skip disassembly
-   cp = SkipSpace(cp);          // Skip leading blanks
-   start = cp;                  // Remember start of line
-   if (df) fprintf(df,"%5d %4.4x Parse[%d]:%s\n",LiNo,pc&0xffff,Phase,cp);
-   if (CheckCondition(cp)) return;
-   if (Skipping)
-   {
-      PrintLiNo();
-      if (ListOn && Phase == 2) fprintf(lf,"SKIP          %s\n",Line);
-      if (df)         fprintf(df,"%5d SKIP          %s\n",LiNo,Line);
-      return;
-   }
-   if (pf && Phase == 2 && !MacLev)
+   // add extensions
+
+   memmove(Pre+l,".pp" ,3);
+   memmove(Lst+l,".ls9",4);
+   memmove(Opt+l,".opt",4);
+   memmove(Stk+l,".stk",4);
+   memmove(Dot+l,".dot",4);
+   memmove(Cgr+l,".cg" ,3);
+   memmove(Run+l,".run",4);
+   memmove(Prf+l,".prf",4);
+   memmove(Fld+l,".fold",5);
+   memmove(Obj+l,".o9" ,3);
+   memmove(Exp+l,".sym",4);
+   memmove(Dep+l,".d"  ,2);
+   if (DepFile)
+   {
+      snprintf(Dep,sizeof(Dep),"%s",DepFile);
+      DepOut = 1;
+   }
+   if (Base != Src) free(Base);
+
+   if (!Quiet)
    {
-       fprintf(pf,"%s\n",Line); // write to preprocessed file
+      printf("\n");
+      printf("*******************************************\n");
+      printf("* Bit Shift Assembler 06-Jan-2025         *\n");
+      printf("* Today is            %s         *\n",datebuffer);
+      printf("* --------------------------------------- *\n");
+      printf("* Source: %-31.31s *\n",Src);
+      printf("* List  : %-31.31s *\n",Lst);
+      if (ObjMode)
+      printf("* Object: %-31.31s *\n",Obj);
    }
-   if (strncmp(cp,"/*",2) == 0 || strncmp(cp,"\\*",2) == 0) // SDDRIVE comment style
+   if (ObjMode && (Merge || PlaceFile))
    {
-      CodeStyle = 1;
-      if (Phase == 2) PrintLine();
-      return;
+      DiagPrintf("\n*** --obj cannot be combined with -z or --place ***\n");
+      Terminate(1);
    }
-   if (*cp == 0)  // Empty
+   if (CacheDir && CacheRestore())
    {
-      if (Phase == 2)
+      if (!Quiet)
       {
-          PrintLiNo();
-          fputc('\n',lf);
+         printf("* Cache : %-31.31s *\n","outputs restored");
+         printf("*******************************************\n\n");
       }
-      return;
+      return 0;
    }
-   if (*cp == ';')  // comment only
+   CacheFile(Src,0);
+
+   if (!SourceOpen(Src))
    {
-      PrintLine();
-      return;
+      DiagPrintf("Could not open <%s>\n",Src);
+      Terminate(1);
    }
-
-   if (*cp == '*')  // comment or setting of PC ?
+   IncludeStack[0].fp = sf;
+   IncludeStack[0].mf = mf;
+   IncludeStack[0].Src = Src;
+   LstTmp = OutputTmp(Lst);
+   lf = AssertFileOp(fopen(LstTmp,"w"), "Open list file");
+   CacheFile(Lst,1);
+   if (Debug) df = AssertFileOp(fopen("Debug.lst","w"), "Open Debug file");
+   if (Preprocess)
    {
-      if (!NeedChar(cp+1,'='))
-      {
-         PrintLine();  // no "* =" syntax
-         return;
-      }
+      pf = AssertFileOp(fopen(Pre,"w"), "Open preprocessor file");
+      CacheFile(Pre,1);
    }
-
-   // set local backward label
-
-   if (*cp == '-')
+   if (ProfTrace)
    {
-      l = strlen(cp);
-      i = 0;
-      while (*cp++ == '-' && i < 10 && i < l) ++i;
-      minlab[i] = pc;
+      ReadTrace(ProfTrace);
+      prf = AssertFileOp(fopen(Prf,"w"), "Open profile file");
+      CacheFile(Prf,1);
+   }
+   if (Optimize || Merge || PoolAll || PlaceFile)
+   {
+      of = AssertFileOp(fopen(Opt,"w"), "Open hint file");
+      CacheFile(Opt,1); // removed again without hints
+   }
+   if (Merge)
+   {
+      MrgLine = (int *)MallocOrDie(0x10000*sizeof(int));
+      MrgLiNo = (int *)MallocOrDie(0x10000*sizeof(int));
+      MrgOpd  = (char **)MallocOrDie(0x10000*sizeof(char *));
+      memset(MrgLine,0,0x10000*sizeof(int));
+      memset(MrgLiNo,0,0x10000*sizeof(int));
+      memset(MrgOpd ,0,0x10000*sizeof(char *));
    }
 
-   // set local forward label
+   InitLabels     = Labels;
+   InitIgnoreCase = IgnoreCase;
+   InitCodeStyle  = CodeStyle;
 
-   if (*cp == '+')
+   AssembleSource(1);
+   StatFileSize(Lst,lf);
+   if (pf) StatFileSize(Pre,pf);
+   if (SourceClose()) AssertFileOp(NULL, "Close source file");
+   if (ListingClose()) AssertFileOp(NULL, "Close list file");
+   sf = NULL;
+
+   if (df) if (fclose(df)) AssertFileOp(NULL, "Close debug file");
+   df = NULL;
+   if (pf) if (fclose(pf)) AssertFileOp(NULL, "Close preprocessor file");
+   pf = NULL;
+   if (prf)
    {
-      l = strlen(cp);
-      i = 0;
-      while (*cp++ == '+' && i < 10 && i < l) ++i;
-      if (Phase == 1)
-      {
-         plulab[i][plucnt[i]] = pc;
-         if (++plucnt[i] > PLUMAX-2)
-         {
-            ++ErrNum;
-            ErrorMsg("too many local labels\n");
-            exit(1);
-         }
-      }
+      StatFileSize(Prf,prf);
+      if (fclose(prf)) AssertFileOp(NULL, "Close profile file");
+      prf = NULL;
+      if (!Quiet) printf("* Prof  : %-31.31s *\n",Prf);
    }
-
-   cp = CheckPseudo(cp);
-   if (!cp) return;      // Pseudo Op successfull processed
-   if (*cp == '.' || *cp == '_' || isalpha(*cp)) // Macro, Label or mnemonic
+   if (of)
    {
-      if (StrMatch(cp,"MACRO"))
-      {
-         RecordMacro(cp);
-         return;
-      }
-      if ((MneIndex = IsInstruction(cp)) < 0)
-      {
-         m = ExpandMacro(cp);
-         if (m < 0) // not a macro
-         {
-            if (df) fprintf(df,"LABEL:%s:\n",cp);
-            if (df) fprintf(df,"start:%s:\n",start);
-            if (cp == start) cp = DefineLabel(cp,&v,0);
-            else
-            {
-               if (StrKey(cp,"SET") || StrKey(cp,"ENUM") ||
-                   StrKey(cp,"EQU") || strchr(cp,'='))
-                  cp = DefineLabel(cp,&v,0);
-            }
-            cp = SkipSpace(cp);         // Skip leading blanks
-            if (*cp) m = ExpandMacro(cp);   // Macro after label
-            if (m >= 0) cp += strlen(cp);         // advance to EOL
-         }
-         else cp += strlen(cp);         // advance to EOL
-         if (m < 0 && (*cp == 0 || *cp == ';')) // no code or data
-         {
-            PrintLiNo();
-            if (ListOn && Phase == 2)
-               fprintf(lf,"%4.4x              %s\n",v&0xffff,Line);
-            return;
-         }
-      }
+      if (optc) StatFileSize(Opt,of);
+      if (fclose(of)) AssertFileOp(NULL, "Close hint file");
+      of = NULL;
+      if (optc == 0) remove(Opt);
+      if (optc && !Quiet) printf("* Opt   : %-31.31s *\n",Opt);
    }
-   if (ForcedEnd)  return;
-   if (*cp ==  0 ) return;             // No code
-   if (*cp == ';') return;             // No code
-   if (*cp == '&') { cp = SetBSS(cp+1); return; }    // Set BSS counter
-   if (*cp == '*') { cp = SetPC(cp+1) ; return; }    // Set PC
-   cp = CheckPseudo(cp);
-   if (!cp) return;      // Pseudo Op successfull processed
-   if (MneIndex < 0) MneIndex = IsInstruction(cp); // Check for mnemonic after label
-   if (MneIndex >= 0)
+   if (Stack && !Quiet) printf("* Stack : %-31.31s *\n",Stk);
+   if (Graph && !Quiet) printf("* Graph : %-31.31s *\n",Dot);
+   if (RunLabel && !Quiet) printf("* Run   : %-31.31s *\n",Run);
+   if (!Quiet)
    {
-      ExtractOpText(cp+strlen(Mat[MneIndex].Mne));
-      cp += strlen(cp);
-      GenerateCode(OpText);
+      printf("* -d:%s  -i:%s  -n:%s  -o:%s  -x:%s  *\n",
+            Stat(Debug),Stat(IgnoreCase),Stat(WithLiNo),
+            Stat(Optimize),Stat(SkipHex));
+      printf("*******************************************\n");
+      printf("* Source Lines: %6d                    *\n",TotalLiNo);
+      printf("* Symbols     : %6d                    *\n",Labels);
+      printf("* Macros      : %6d                    *\n",Macros);
+      if (Preset)
+      printf("* Preset      : %6d                    *\n",Preset);
+      if (optc)
+      printf("* Hints       : %6d for optimization   *\n",optc);
+      if (Inlined)
+      printf("* Inlined     : %6d calls              *\n",Inlined);
+      if (Merged)
+      printf("* Merged      : %6d bytes saved        *\n",Merged);
+      if (Pooled)
+      printf("* Pooled      : %6d bytes saved        *\n",Pooled);
+      if (Placed)
+      printf("* Placed      : %6d modules            *\n",Placed);
+      if (RunLabel)
+      printf("* Cycles      : %10lld                *\n",Sim.Cycles);
+      printf("*******************************************\n");
    }
-   if (ListOn && Phase == 2) fprintf(lf,"\n");
-   if (*cp == 0 || *cp == ';' || *cp == '*') return; // end of code
-
-   printf("<%s>\n",cp);
-   ++ErrNum;
-   ErrorLine(cp);
-   ErrorMsg("Syntax error\n");
-   exit(1);
+   if (ErrNum)
+      DiagPrintf("* %3d ERROR%s occured%s                      *\n",
+             ErrNum, ErrNum == 1 ? "" : "S", ErrNum == 1 ? " " : "");
+   else if (!Quiet) printf("* OK, no errors                           *\n");
+   if (!Quiet) printf("*******************************************\n\n");
+   if (Stats) StatsReport();
+   if (DepOut && !ErrNum) WriteDependencies(Dep);
+   if (CacheDir && !ErrNum) CacheStore();
+   // MneStat();
+   return ErrNum;
 }
 
-void Phase1Listing(void)
-{
-   fprintf(df,"%5d %4.4x",LiNo,pc);
-   if (Label[0]) fprintf(df,"  Label:[%s]{%4.4x}",Label,lab[LabelIndex(Label)].Address);
-   if (OpText[0]) fprintf(df,"  %s",OpText);
-   if (Comment[0]) fprintf(df,"  %s",Comment);
-   fprintf(df,"\n");
-}
+#ifdef BS9_THREADS
 
+// ********
+// RunBatch
+// ********
 
-int CloseInclude(void)
-{
-   const char *msg = "Close INCLUDE file";
+// Batch mode assembles every source in its own thread. A job starts
+// with the initial values of the thread local variables and parses
+// the options again, so jobs share nothing but the include files.
+// The jobs are split among the workers, a worker without jobs steals
+// the oldest job of another worker.
 
-   PrintLiNo();
-   if (Phase == 2)
-   {
-      if (ListOn) fprintf(lf,";                       closed INCLUDE file %s\n",
-            IncludeStack[IncludeLevel].Src);
-      if (ferror(lf)) AssertFileOp(NULL, msg);
-   }
-   if (fclose(sf)) AssertFileOp(NULL, msg);
-   free(IncludeStack[IncludeLevel].Src);
-   sf = IncludeStack[--IncludeLevel].fp;
-   LiNo = IncludeStack[IncludeLevel].LiNo;
-   fgets(Line,sizeof(Line),sf);
-   ForcedEnd = 0;
-   return feof(sf);
-}
+#define JOB_STACK (16 << 20) // stack of a job thread incl. thread locals
 
-void Phase1(void)
+struct JobStruct
 {
-    int i,l,Eof;
+   char *Src;    // source file
+   int   Var;    // variant or -1
+   int   Errors; // error count
+   int   Lines;  // source lines
+} *Job;
 
-   Phase = 1;
-   ForcedEnd = 0;
-   for (i=0 ; i < 11 ; ++i) minlab[i] = UNDEF;
+struct QueueStruct
+{
+   int  *Job;    // job numbers
+   int   Head;   // oldest job, taken by thieves
+   int   Tail;   // end of queue, taken by the owner
+   pthread_mutex_t Lock;
+} *Queue;
 
-   fgets(Line,sizeof(Line),sf);
-   Eof = feof(sf);
-   while (!Eof || IncludeLevel > 0)
-   {
-      ++LiNo; ++TotalLiNo;
-      l = strlen(Line);
-      if (l && Line[l-1] == 10) Line[--l] = 0; // Remove linefeed
-      if (l && Line[l-1] == 13) Line[--l] = 0; // Remove return
-      ParseLine(Line);
-      if (MacLev)
-      {
-         NextMacLine(Line);
-         if (df) fprintf(df,"Macro: %s\n",Line);
-      }
-      else
-      {
-         fgets(Line,sizeof(Line),sf);
-      }
-      Eof = feof(sf) || ForcedEnd;;
-      if (Eof && IncludeLevel > 0) Eof = CloseInclude();
-   }
-}
+int    OptArgc;       // command line for the jobs
+char **OptArgv;
+char   BatchDate[80]; // date for the listings
 
+// runs in a fresh thread for each job
 
-void Phase2(void)
+void *BatchJob(void *arg)
 {
-   int i,l,Eof;
-
-   Phase     =    2;
-   pc        =   -1;
-   EnumValue =   -1;
-   ForcedEnd =    0;
-   ListOn    =    1;
-   CPU       = 6309;
-   Scope[0]  =    0;
-   ModuleStart =  0;
-
-   for (i=0 ; i < 11 ; ++i) minlab[i] = UNDEF;
+   int l;
+   char Err[2*FNSIZE];
+   jmp_buf Jmp;
+   FILE *fp;
+   struct JobStruct *j = (struct JobStruct *)arg;
 
-   if (IfLevel)
+   strcpy(datebuffer,BatchDate);
+   LineFit(0); // -D parses its symbol into Label
+   ParseOptions(OptArgc,OptArgv,1);
+   if (j->Var >= 0)
    {
-      printf("\n*** Error in conditional assembly ***\n");
-      if (IfLevel == 1)
-         printf("*** an #endif statement is missing\n");
-      else
-         printf("*** %d #endif statements are missing\n",IfLevel);
-      exit(1);
+      Variant = Var[j->Var].Name;
+      ParseOptions(Var[j->Var].Argc,Var[j->Var].Argv,1);
    }
-   rewind(sf);
-   LiNo = 0; TotalLiNo = 0;
-   fgets(Line,sizeof(Line),sf);
-   Eof = feof(sf);
-   while (!Eof || IncludeLevel > 0)
+   Quiet  = 1;
+   Stats  = 0;
+   DiagOn = 1; // messages go to <source>.err
+   ExitJmp = &Jmp;
+   if (setjmp(Jmp))
    {
-      ++LiNo; ++TotalLiNo;
-      l = strlen(Line);
-      if (l && Line[l-1] == 10) Line[--l] = 0; // Remove linefeed
-      if (l && Line[l-1] == 13) Line[--l] = 0; // Remove return
-      ParseLine(Line);
-      if (MacLev)
-      {
-         NextMacLine(Line);
-         ListOn = MacList;
-      }
-      else
+      if (!ErrNum) ErrNum = 1; // fatal error
+      while (IncludeLevel > 0)
       {
-         fgets(Line,sizeof(Line),sf);
-         ListOn = ListGlobal;
+         SourceClose();
+         sf = IncludeStack[--IncludeLevel].fp;
+         mf = IncludeStack[IncludeLevel].mf;
       }
-      Eof = feof(sf) || ForcedEnd;
-      if (Eof && IncludeLevel > 0) Eof = CloseInclude();
-      if (GenEnd < pc) GenEnd = pc; // Remember highest assenble address
-      if (ErrNum >= ERRMAX)
+      if (sf || mf) SourceClose();
+      ListingClose();
+      if (df)  fclose(df);
+      if (pf)  fclose(pf);
+      if (of)  fclose(of);
+      if (prf) fclose(prf);
+   }
+   else AssembleFile(j->Src);
+   ExitJmp = NULL;
+   j->Errors = ErrNum;
+   j->Lines  = TotalLiNo;
+
+   l = strlen(j->Src);
+   if (l > 4 && j->Src[l-4] == '.') l -= 4;
+   snprintf(Err,sizeof(Err),"%.*s%s%s.err",l,j->Src,
+            Variant ? "-" : "",Variant ? Variant : "");
+   if (Diag)
+   {
+      fp = fopen(Err,"w");
+      if (fp)
       {
-         printf("\n*** Error count reached maximum of %d ***\n",ErrNum);
-         printf("Assembly stopped\n");
-         return;
+         fputs(Diag,fp);
+         fclose(fp);
       }
    }
+   else remove(Err);
+   return NULL;
 }
 
+// next job for worker w: own queue first, then steal
 
-void ListSymbols(FILE *lf, int n, int lb, int ub)
+int NextJob(int w)
 {
-   int i,j,l;
-   char A;
+   int i,j = -1;
+   struct QueueStruct *q;
 
-   if (!ListOn) return;
-   for (i=0 ; i < n && i < Labels; ++i)
-   if (lab[i].Address >= lb && lab[i].Address <= ub)
+   for (i=0 ; i < Workers && j < 0 ; ++i)
    {
-      fprintf(lf,"%-30.30s $%4.4x",lab[i].Name,lab[i].Address);
-      for (j=0 ; j <= lab[i].NumRef ; ++j)
-      {
-         if (j > 0 && (j % 5) == 0)
-         fprintf(lf,"\n                                    ");
-         fprintf(lf,"%6d",lab[i].Ref[j]);
-         l = lab[i].Att[j];
-         if (l == LDEF || l == LBSS || l == LPOS) A = 'D';
-         else  A = ' ';
-         if ((A != ' ' || (j % 5) != 4) && j != lab[i].NumRef)
-            fprintf(lf,"%c",A);
-      }
-      fprintf(lf,"\n");
+      q = Queue + (w + i) % Workers;
+      pthread_mutex_lock(&q->Lock);
+      if (q->Head < q->Tail) j = i ? q->Job[q->Head++] : q->Job[--q->Tail];
+      pthread_mutex_unlock(&q->Lock);
    }
+   return j;
 }
 
-
-void ListUndefinedSymbols(void)
+void *Worker(void *arg)
 {
-   int i;
+   int j,w;
+   pthread_t t;
+   pthread_attr_t Attr;
 
-   for (i=0 ; i < Labels ; ++i)
+   w = (int)((struct QueueStruct *)arg - Queue);
+   pthread_attr_init(&Attr);
+   pthread_attr_setstacksize(&Attr,JOB_STACK);
+   while ((j = NextJob(w)) >= 0)
    {
-      if (lab[i].Address == UNDEF)
+      if (pthread_create(&t,&Attr,BatchJob,Job+j))
       {
-         printf("* Undefined   : %-25.25s *\n",lab[i].Name);
-         ++ErrNum;
+         fprintf(stderr,"Could not create thread for <%s>\n",Job[j].Src);
+         Terminate(1);
       }
+      pthread_join(t,NULL);
    }
+   pthread_attr_destroy(&Attr);
+   return NULL;
 }
 
-int CmpAddress( const void *arg1, const void *arg2 )
+int RunBatch(int argc, char *argv[])
 {
-   struct LabelStruct *Label1;
-   struct LabelStruct *Label2;
+   int i,w,n,Failed = 0,Lines = 0;
+   char Name[2*FNSIZE];
+   pthread_t *t;
 
-   Label1 = (struct LabelStruct *) arg1;
-   Label2 = (struct LabelStruct *) arg2;
+   OptArgc = argc;
+   OptArgv = argv;
+   strcpy(BatchDate,datebuffer);
+   IncShare = 1;
+   if (Workers == 0)
+   {
+#ifdef _SC_NPROCESSORS_ONLN
+      Workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+      if (Workers < 1) Workers = 1;
+   }
 
-   if (Label1->Address == Label2->Address) return 0;
-   if (Label1->Address  > Label2->Address) return 1;
-   return -1;
-}
+   // every source with every variant
 
+   n = Variants ? Variants : 1;
+   Job = (struct JobStruct *)MallocOrDie(Jobs * n * sizeof(struct JobStruct));
+   for (i=0 ; i < Jobs * n ; ++i)
+   {
+      Job[i].Src    = JobSrc[i / n];
+      Job[i].Var    = Variants ? i % n : -1;
+      Job[i].Errors = 0;
+      Job[i].Lines  = 0;
+   }
+   Jobs *= n;
+   if (Workers > Jobs) Workers = Jobs;
 
-int CmpRefs( const void *arg1, const void *arg2 )
-{
-   struct LabelStruct *Label1;
-   struct LabelStruct *Label2;
+   Queue = (struct QueueStruct *)MallocOrDie(Workers * sizeof(struct QueueStruct));
+   t     = (pthread_t *)MallocOrDie(Workers * sizeof(pthread_t));
 
-   Label1 = (struct LabelStruct *) arg1;
-   Label2 = (struct LabelStruct *) arg2;
+   // worker w owns the jobs w*Jobs/Workers to (w+1)*Jobs/Workers-1
+   // and takes them in ascending order from the end of its queue
 
-   if (Label1->NumRef == Label2->NumRef)
+   for (w=0 ; w < Workers ; ++w)
    {
-      if (Label1->Address < Label2->Address) return  1;
-      if (Label1->Address > Label2->Address) return -1;
-      return 0;
+      n = (w+1) * Jobs / Workers - w * Jobs / Workers;
+      Queue[w].Job  = (int *)MallocOrDie(n * sizeof(int));
+      Queue[w].Head = 0;
+      Queue[w].Tail = n;
+      for (i=0 ; i < n ; ++i) Queue[w].Job[i] = (w+1) * Jobs / Workers - 1 - i;
+      pthread_mutex_init(&Queue[w].Lock,NULL);
    }
-   if (Label1->NumRef  < Label2->NumRef) return 1;
-   return -1;
+   for (w=0 ; w < Workers ; ++w)
+   {
+      if (pthread_create(t+w,NULL,Worker,Queue+w))
+      {
+         fprintf(stderr,"Could not create worker thread\n");
+         Terminate(1);
+      }
+   }
+   for (w=0 ; w < Workers ; ++w) pthread_join(t[w],NULL);
+
+   for (i=0 ; i < Jobs ; ++i)
+   {
+      Lines += Job[i].Lines;
+      if (Job[i].Errors) ++Failed;
+      if (Job[i].Var < 0) snprintf(Name,sizeof(Name),"%s",Job[i].Src);
+      else snprintf(Name,sizeof(Name),"%s [%s]",Job[i].Src,Var[Job[i].Var].Name);
+      if (Job[i].Errors || !Quiet)
+         printf("%-40s %7d lines %4d error%s\n",Name,Job[i].Lines,
+                Job[i].Errors,Job[i].Errors == 1 ? "" : "s");
+   }
+   if (!Quiet || Failed)
+      printf("%d jobs, %d lines, %d failed, %d threads, %d shared files\n",
+             Jobs,Lines,Failed,Workers,IncShareds);
+   return Failed;
 }
 
-void WriteBinaryFormat(int i)
-{
-    unsigned char lo,hi;
-    FILE *bf;
-    const char *msg = "Write binary";
+// *****
+// Watch
+// *****
 
-    if (df) fprintf(df,"Storing $%4.4x - $%4.4x <%s>\n",
-                    SFA[i],SFA[i]+SFL[i],SFF[i]);
-    bf = AssertFileOp(fopen(SFF[i],"wb"), msg);
-    if (SFE[i] > -1)
-    {
-       lo = SFA[i] & 0xff;
-       hi = SFA[i]  >>  8;
-       if (fwrite(&hi,1,1,bf) < 1) AssertFileOp(NULL, msg);
-       if (fwrite(&lo,1,1,bf) < 1) AssertFileOp(NULL, msg);
-    }
-    if (fwrite(ROM+SFA[i],1,SFL[i],bf) < (size_t)SFL[i]) AssertFileOp(NULL, msg);
-    if (fclose(bf)) AssertFileOp(NULL, msg);
-}
+// Watch mode (--watch) stays resident and assembles the source again
+// whenever one of its input files changes. The text of the source and
+// include files stays in memory (as in batch mode) and only changed
+// files are read again. Every assembly runs in a forked child, which
+// starts with the clean state of the parent, so no table needs a reset.
 
-int Checksum(int start, int n)
+char **WatchName;  // input files of the last assembly
+int    WatchNames; // number of files
+int    WatchMax;   // allocated size of WatchName
+
+void WatchAdd(const char *Name, int l)
 {
-   int sum = 0;
    int i;
-   for (i=start ; i < start+n-1 ; i+=2)
-      sum += (ROM[i] << 8) | ROM[i+1];
-   return sum & 0xffff;
+
+   for (i=0 ; i < WatchNames ; ++i)
+      if (!strncmp(Name,WatchName[i],l) && !WatchName[i][l]) return;
+   if (WatchNames == WatchMax)
+   {
+      WatchMax = WatchMax ? 2 * WatchMax : 32;
+      WatchName = (char **)ReallocOrDie(WatchName,WatchMax * sizeof(char *));
+   }
+   WatchName[WatchNames++] = StrNDup((char *)Name,l);
 }
 
-void WriteSparrowFormat(int i)
+// assembles Src in a child, which sends its input files through a
+// pipe, returns 0 if the assembly had no errors
+
+int WatchBuild(char *Src)
 {
-    int Start,Length,Check;
-    unsigned char Head[8];
-    FILE *bf;
-    const char *msg = "Write Sparrow binary";
+   int i,Status,fd[2];
+   long l,n,Max;
+   char *Text,*p,*q;
+   pid_t Pid;
+   jmp_buf Jmp;
 
-    Start  = SFA[i];
-    Length = SFL[i];
-    Check  = Checksum(Start,Length);
+   if (pipe(fd))
+   {
+      fprintf(stderr,"Could not create pipe for --watch\n");
+      Terminate(1);
+   }
+   fflush(NULL); // the child inherits the stdio buffers
+   Pid = fork();
+   if (Pid == 0)
+   {
+      close(fd[0]);
+      ExitJmp = &Jmp;
+      if (setjmp(Jmp))
+      {
+         if (!ErrNum) ErrNum = 1;
+         ListingClose();
+      }
+      else AssembleFile(Src);
+      for (i=0 ; i < CacheNum ; ++i)
+      {
+         if (CacheFiles[i].Out) continue;
+         if (write(fd[1],CacheFiles[i].Name,strlen(CacheFiles[i].Name)) < 0 ||
+             write(fd[1],"\n",1) < 0) break;
+      }
+      close(fd[1]);
+      fflush(NULL);
+      _exit(ErrNum != 0);
+   }
+   close(fd[1]);
+   if (Pid < 0)
+   {
+      close(fd[0]);
+      fprintf(stderr,"Could not fork for --watch\n");
+      Terminate(1);
+   }
 
-    if (df) fprintf(df,"Storing $%4.4x - $%4.4x <%s>\n",
-                    Start,Start+Length-1,SFF[i]);
-    Head[0] = 'S';
-    Head[1] =  Start  >> 16;
-    Head[2] = (Start  >>  8) & 0xff;
-    Head[3] = (Start       ) & 0xff;
-    Head[4] = Length  >>  8;
-    Head[5] = Length  & 0xff;
-    Head[6] = Check   >>  8;
-    Head[7] = Check   & 0xff;
+   // the input files of the last assembly replace the previous ones
 
-    bf = AssertFileOp(fopen(SFF[i],"wb"), msg);
-    if (fwrite(Head,1,8,bf) < 8) AssertFileOp(NULL, msg);
-    if (fwrite(ROM+Start,1,Length,bf) < (size_t)Length) AssertFileOp(NULL, msg);
-    if (fclose(bf)) AssertFileOp(NULL, msg);
+   Text = NULL;
+   l = Max = 0;
+   do
+   {
+      if (l == Max)
+      {
+         Max = Max ? 2 * Max : 1024;
+         Text = (char *)ReallocOrDie(Text,Max);
+      }
+      n = read(fd[0],Text+l,Max-l);
+      if (n > 0) l += n;
+   } while (n > 0 || (n < 0 && errno == EINTR));
+   close(fd[0]);
+   for (i=0 ; i < WatchNames ; ++i) free(WatchName[i]);
+   WatchNames = 0;
+   for (p=Text ; p < Text + l && (q = (char *)memchr(p,'\n',Text+l-p)) ; p = q+1)
+      WatchAdd(p,q-p);
+   free(Text);
+   if (waitpid(Pid,&Status,0) != Pid) return 1;
+   return !WIFEXITED(Status) || WEXITSTATUS(Status);
 }
 
-void WriteS19Line(FILE *bf, const char *RecordType, int PayloadSize, int Address, unsigned char *Data)
+// marks changed files by polling their size and time stamp
+
+void WatchPoll(char *Changed)
 {
-   int i,Checksum;
-   const char *msg = "Write S19 record";
+   int i,n = 0;
+   struct stat *St,s;
 
-   fprintf(bf, "%s", RecordType);
-   // 3 extra bytes for address and checksum
-   Checksum = PayloadSize + 3 + (Address & 0xff) + (Address >> 8);
-   fprintf(bf, "%02X%04X", PayloadSize + 3, Address);
-   if (ferror(bf)) AssertFileOp(NULL, msg);
-   for (i=0; i < PayloadSize; ++i)
+   St = (struct stat *)MallocOrDie((WatchNames + 1) * sizeof(struct stat));
+   for (i=0 ; i < WatchNames ; ++i)
+      if (stat(WatchName[i],St+i)) memset(St+i,0,sizeof(struct stat));
+   while (!n)
    {
-      fprintf(bf, "%02X", Data[i]);
-      if (ferror(bf)) AssertFileOp(NULL, msg);
-      Checksum += Data[i];
+      poll(NULL,0,200);
+      for (i=0 ; i < WatchNames ; ++i)
+      {
+         if (stat(WatchName[i],&s)) memset(&s,0,sizeof(struct stat));
+         if (s.st_mtime != St[i].st_mtime || s.st_size != St[i].st_size)
+            n += Changed[i] = 1;
+      }
    }
-   // Force CR LF line endings for ancient EPROM programmers
-   fprintf(bf, "%02X\r\n", ~Checksum & 0xff);
-   if (ferror(bf)) AssertFileOp(NULL, msg);
+   free(St);
 }
 
-void WriteS19Format(int i)
+#ifdef __linux__
+
+// marks changed files with inotify on the directories of the files,
+// which catches editors, that save to a new file and rename it
+
+int WatchNotify(char *Changed)
 {
-    unsigned char buf[80];
-    FILE *bf;
-    char *filename, *ExtPtr;
-    int UnwrittenBytes,Addr,BytesInThisLine;
-    const char *msg = "Write S19 file";
+   int i,n,fd,l,Found = 0;
+   int *Wd;
+   char Dir[FNSIZE],Buf[4096];
+   const char *Base;
+   struct inotify_event *e;
+   struct pollfd Pfd;
 
-    filename = (char *)StrNDup(SFF[i],strlen(SFF[i]) + 4);
-    ExtPtr = strrchr(filename, '.');
-    if (!ExtPtr)
-    {
-       ExtPtr = filename + strlen(filename);
-       memmove(ExtPtr, ".S19",5);
-    }
-    if (df)
-    {
-       fprintf(df,"Storing $%4.4x - $%4.4x <%s>\n",
-                    SFA[i],SFA[i]+SFL[i],filename);
-       if (ferror(df)) AssertFileOp(NULL, msg);
-    }
-    bf = AssertFileOp(fopen(filename, "wb"), msg);
-    free(filename);
+   fd = inotify_init();
+   if (fd < 0) return 0;
+   Wd = (int *)MallocOrDie((WatchNames + 1) * sizeof(int));
+   for (i=0 ; i < WatchNames ; ++i)
+   {
+      Base = strrchr(WatchName[i],'/');
+      if (Base) snprintf(Dir,sizeof(Dir),"%.*s",
+                         Base == WatchName[i] ? 1 : (int)(Base - WatchName[i]),WatchName[i]);
+      else strcpy(Dir,".");
+      Wd[i] = inotify_add_watch(fd,Dir,IN_CLOSE_WRITE | IN_MOVED_TO |
+                                IN_CREATE | IN_DELETE);
+   }
 
-    // Write a S0 header which the TTL pseudo op should define
-    memmove((char *)buf,"Bit Shift Assembler",20);
-    WriteS19Line(bf, "S0", strlen((char *)buf), 0, buf);
+   // after the first change wait 50 ms for more, e.g. "save all"
+
+   Pfd.fd     = fd;
+   Pfd.events = POLLIN;
+   while (poll(&Pfd,1,Found ? 50 : -1) > 0 || (!Found && errno == EINTR))
+   {
+      if (!(Pfd.revents & POLLIN)) continue;
+      l = read(fd,Buf,sizeof(Buf));
+      for (n=0 ; n < l ; n += sizeof(struct inotify_event) + e->len)
+      {
+         e = (struct inotify_event *)(Buf + n);
+         if (!e->len) continue;
+         for (i=0 ; i < WatchNames ; ++i)
+         {
+            Base = strrchr(WatchName[i],'/');
+            Base = Base ? Base + 1 : WatchName[i];
+            if (Wd[i] == e->wd && !strcmp(Base,e->name)) Found = Changed[i] = 1;
+         }
+      }
+   }
+   free(Wd);
+   close(fd);
+   return 1;
+}
+
+#endif
 
-    SFR[i] = 0;
-    UnwrittenBytes = SFL[i];
-    Addr = SFA[i];
-    BytesInThisLine = 32;
-    if (UnwrittenBytes < 32) BytesInThisLine = UnwrittenBytes;
-    while (UnwrittenBytes > 0)
-    {
-       WriteS19Line(bf, "S1", BytesInThisLine, Addr, &ROM[Addr]);
-       ++SFR[i];
-       Addr += BytesInThisLine;
-       UnwrittenBytes -= BytesInThisLine;
-    }
+// waits for changes and reads the changed files again
 
-    WriteS19Line(bf, "S5", 0, SFR[i], NULL);
+int WatchWait(void)
+{
+   int i,n = 0;
+   char *Changed;
 
-    if (SFE[i] > -1) WriteS19Line(bf, "S9", 0, SFE[i], NULL);
-    if (fclose(bf)) AssertFileOp(NULL, msg);
+   Changed = (char *)MallocOrDie(WatchNames + 1);
+   memset(Changed,0,WatchNames + 1);
+#ifdef __linux__
+   if (!WatchNotify(Changed))
+#endif
+   WatchPoll(Changed);
+   pthread_mutex_lock(&IncLock);
+   for (i=0 ; i < WatchNames ; ++i)
+   {
+      if (!Changed[i]) continue;
+      SharedLoad(WatchName[i]);
+      printf("changed %s\n",WatchName[i]);
+      ++n;
+   }
+   pthread_mutex_unlock(&IncLock);
+   free(Changed);
+   return n;
 }
 
-void WriteBinaries(void)
+int WatchSource(char *Src)
 {
-   int i;
+   int i,j,Failed;
+   double t;
+   struct timeval t0,t1;
 
-   for (i=0 ; i < StoreCount ; ++i)
+   IncShare = 1;
+   for (;;)
    {
-           if (SFT[i] == SRECORD) WriteS19Format(i);
-      else if (SFT[i] == SPARROW) WriteSparrowFormat(i);
-      else                        WriteBinaryFormat(i);
+      gettimeofday(&t0,NULL);
+      Failed = WatchBuild(Src);
+      gettimeofday(&t1,NULL);
+      t = 1e3 * (t1.tv_sec - t0.tv_sec) + 1e-3 * (t1.tv_usec - t0.tv_usec);
+      printf("%s %s in %.0f ms, watching %d files\n",Src,
+             Failed ? "failed" : "assembled",t,WatchNames);
+      fflush(stdout);
+
+      // keep the files, that the child has read, in memory
+
+      pthread_mutex_lock(&IncLock);
+      for (i=0 ; i < WatchNames ; ++i)
+      {
+         for (j=0 ; j < IncShareds ; ++j)
+            if (!strcmp(WatchName[i],IncShared[j].Name)) break;
+         if (j == IncShareds) SharedLoad(WatchName[i]);
+      }
+      pthread_mutex_unlock(&IncLock);
+      while (!WatchWait()) ;
    }
+   return 0;
 }
 
-const char *StatOn  = " * ";
-const char *StatOff = "   ";
+#endif // BS9_THREADS
 
-const char *Stat(int o)
-{
-   if (o) return StatOn ;
-   else   return StatOff;
+// ******
+// Linker
+// ******
+
+// bs9 --link file [--base address] object ...
+// reads the objects written with --obj and places their sections:
+// sections with a fixed address (ORG, SECT LOC=) there, relocatable
+// sections in the first free gap from --base on (default 0), sections
+// of the same name one after the other in the order of the first
+// appearance of the name. The EXTERN symbols are resolved with the
+// INTERN symbols of all objects, the fixups are applied and the memory
+// from the lowest to the highest placed address is written to file,
+// as S-records for the extension .s19 or .srec, else binary.
+// Sections and symbols are listed in <file>.map.
+
+struct LinkSectStruct
+{
+   char *Name;
+   int   Obj;      // object index in JobSrc
+   int   Loc;      // fixed address or -1: relocatable
+   int   Base;     // address in the assembly
+   int   Size;
+   int   Addr;     // placed address or -1
+   unsigned char *Data;
+} *LSect;
+
+struct LinkSymStruct
+{
+   char *Name;
+   int   Obj;
+   int   Rel;      // 0: absolute, > 0: LSect[Rel-1], < 0: LExt[-Rel-1]
+   int   Value;    // value in the assembly
+} *LSym, *LExt;    // INTERN and EXTERN symbols
+
+struct LinkFixStruct
+{
+   int   Sect;     // index in LSect
+   int   Addr;     // address in the assembly
+   int   Kind;     // 'W', 'R' or 'B' (see AddFix)
+   int   Rel;      // like LinkSymStruct
+   int   Value;
+} *LFix;
+
+int LSects,LSyms,LExts,LFixes;
+
+// makes room for element n of array p with elements of size s
+
+void *GrowArray(void *p, int n, size_t s)
+{
+   if (n && (n < 16 || (n & (n-1)))) return p;
+   return ReallocOrDie(p,(n ? 2*n : 16) * s);
 }
 
-void usage(void)
+void LinkError(int o, const char *msg, const char *s)
 {
-   printf("Usage: bs9 [options] <source>\n");
-   printf("Options:\n");
-   printf("   -d print details in file <Debug.lst>\n");
-   printf("   -D Define symbols\n");
-   printf("   -i ignore case in symbols\n");
-   printf("   -h display this usage\n");
-   printf("   -l preset value for memory\n");
-   printf("   -m Motorola codestyle: blank = field separator\n");
-   printf("   -n include line numbers in listing\n");
-   printf("   -o optimize long branches and jumps\n");
-   printf("   -p print preprocessed source\n");
-   printf("   -q quiet mode\n");
-   printf("   -x assemble listing file - skip hex in front\n");
-   exit(1);
+   fprintf(stderr,"*** %s: %s%s ***\n",JobSrc[o],msg,s);
+   Terminate(1);
 }
 
-int main(int argc, char *argv[])
+// converts A, S<n> or X<n> of object o with sections from FirstSect
+// and externals from FirstExt
+
+int LinkRel(int o, char *t, int FirstSect, int FirstExt)
 {
-   int ic,l,v;
-   char *EndPtr;
-   char *argsrc = NULL; // argument filename;
-   time_t rawtime;
-   struct tm * timeinfo;
+   int n = atoi(t+1);
 
-   time (&rawtime);
-   timeinfo = localtime (&rawtime);
-   strftime (datebuffer,80,"%e-%b-%Y",timeinfo);
+   if (!strcmp(t,"A")) return 0;
+   if (*t == 'S' && n > 0 && FirstSect + n <= LSects) return FirstSect + n;
+   if (*t == 'X' && n > 0 && FirstExt  + n <= LExts)  return -(FirstExt + n);
+   LinkError(o,"illegal relocation ",t);
+   return 0;
+}
 
-   for (ic=1 ; ic < argc ; ++ic)
-   {
-           if (!strcmp(argv[ic],"-x")) SkipHex    = 1;
-      else if (!strcmp(argv[ic],"-d")) Debug      = 1;
-      else if (!strcmp(argv[ic],"-i")) IgnoreCase = 1;
-      else if (!strcmp(argv[ic],"-m")) CodeStyle  = 1;
-      else if (!strcmp(argv[ic],"-n")) WithLiNo   = 1;
-      else if (!strcmp(argv[ic],"-o")) Optimize   = 1;
-      else if (!strcmp(argv[ic],"-p")) Preprocess = 1;
-      else if (!strcmp(argv[ic],"-q")) Quiet      = 1;
-      else if (!strncmp(argv[ic],"-D",2)) DefineLabel(argv[ic]+2,&v,1);
-      else if (!strncmp(argv[ic],"-l",2))
+void ReadObject(int o)
+{
+   int i,k,FirstSect,FirstExt;
+   unsigned int a,b,n,v;
+   char Buf[MAX_STR],Key[ML],Nam[ML],Loc[ML],Tar[ML],Knd[ML];
+   char *p;
+   FILE *fp;
+   struct LinkSectStruct *s;
+
+   fp = fopen(JobSrc[o],"r");
+   if (!fp) LinkError(o,"could not open object","");
+   if (!fgets(Buf,sizeof(Buf),fp) || strncmp(Buf,"BS9 object 1",12))
+      LinkError(o,"not an object of bs9 --obj","");
+   FirstSect = LSects;
+   FirstExt  = LExts;
+   while (fgets(Buf,sizeof(Buf),fp))
+   {
+      if (sscanf(Buf,"%s",Key) != 1) continue;
+      if (!strcmp(Key,"SECT") && sscanf(Buf,"%*s %s %s %x %x",Nam,Loc,&b,&n) == 4)
       {
-         if (++ic == argc)
-         {
-            fprintf(stderr, "Missing value for -l\n");
-            exit(1);
-         }
-         errno = 0;
-         Preset = strtol(argv[ic], &EndPtr,0);
-         if (errno != 0 || *EndPtr != '\0' || Preset < 0 || Preset > 0xff)
+         LSect = (struct LinkSectStruct *)GrowArray(LSect,LSects,sizeof(struct LinkSectStruct));
+         s = LSect + LSects++;
+         s->Name = StrNDup(Nam,strlen(Nam));
+         s->Obj  = o;
+         s->Loc  = strcmp(Loc,"REL") ? (int)strtol(Loc,NULL,16) : -1;
+         s->Base = b;
+         s->Size = n;
+         s->Addr = s->Loc;
+         s->Data = (unsigned char *)MallocOrDie(n+1);
+         memset(s->Data,Preset,n+1);
+      }
+      else if (!strcmp(Key,"D") && LSects > FirstSect && sscanf(Buf,"%*s %x %n",&a,&k) == 1)
+      {
+         s = LSect + LSects - 1;
+         for (p=Buf+k ; isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]) ; p += 2, ++a)
          {
-            fprintf(stderr, "Illegal value '%s' for -l\n",argv[ic]);
-            exit(1);
+            if ((int)a < s->Base || (int)a >= s->Base + s->Size) LinkError(o,"data outside of section ",s->Name);
+            s->Data[a - s->Base] = Hex2Byte(p);
          }
-         memset(ROM,Preset,sizeof(ROM));
       }
-      else if (argsrc == NULL && (argv[ic][0] >= '0' || argv[ic][0] == '.'))
+      else if (!strcmp(Key,"EXTERN") && sscanf(Buf,"%*s %s",Nam) == 1)
       {
-         argsrc = argv[ic];
+         LExt = (struct LinkSymStruct *)GrowArray(LExt,LExts,sizeof(struct LinkSymStruct));
+         LExt[LExts].Name = StrNDup(Nam,strlen(Nam));
+         LExt[LExts].Obj  = o;
+         LExt[LExts].Rel  = -1; // index of INTERN symbol, resolved later
+         ++LExts;
       }
-      else
+      else if (!strcmp(Key,"INTERN") && sscanf(Buf,"%*s %s %s %x",Nam,Tar,&v) == 3)
       {
-         usage();
+         for (i=0 ; i < LSyms ; ++i)
+         if (!StrCmp(Nam,LSym[i].Name))
+         {
+            fprintf(stderr,"*** %s: symbol %s is also defined in %s ***\n",
+                    JobSrc[o],Nam,JobSrc[LSym[i].Obj]);
+            Terminate(1);
+         }
+         LSym = (struct LinkSymStruct *)GrowArray(LSym,LSyms,sizeof(struct LinkSymStruct));
+         LSym[LSyms].Name  = StrNDup(Nam,strlen(Nam));
+         LSym[LSyms].Obj   = o;
+         LSym[LSyms].Rel   = LinkRel(o,Tar,FirstSect,FirstExt);
+         LSym[LSyms].Value = v;
+         ++LSyms;
+      }
+      else if (!strcmp(Key,"FIX") && sscanf(Buf,"%*s %s %x %s %s %x",Loc,&a,Knd,Tar,&v) == 5 &&
+               strchr("WRB",Knd[0]))
+      {
+         LFix = (struct LinkFixStruct *)GrowArray(LFix,LFixes,sizeof(struct LinkFixStruct));
+         LFix[LFixes].Sect  = LinkRel(o,Loc,FirstSect,FirstExt) - 1;
+         LFix[LFixes].Addr  = a;
+         LFix[LFixes].Kind  = Knd[0];
+         LFix[LFixes].Rel   = LinkRel(o,Tar,FirstSect,FirstExt);
+         LFix[LFixes].Value = v;
+         if (LFix[LFixes].Sect < 0) LinkError(o,"fixup outside of sections","");
+         s = LSect + LFix[LFixes].Sect;
+         if ((int)a < s->Base || (int)a + (Knd[0] == 'B' ? 1 : 2) > s->Base + s->Size)
+            LinkError(o,"fixup outside of section ",s->Name);
+         ++LFixes;
       }
+      else LinkError(o,"syntax error in line ",Buf);
    }
-   if (!argsrc)
+   fclose(fp);
+}
+
+// address of relocation r after placing
+
+int LinkDelta(int r)
+{
+   struct LinkSymStruct *y;
+
+   if (r > 0) return LSect[r-1].Addr - LSect[r-1].Base;
+   if (r < 0)
    {
-      printf("*** missing filename for assembler source file ***\n");
-      usage();
+      y = LSym + LExt[-r-1].Rel;
+      return y->Value + LinkDelta(y->Rel);
    }
+   return 0;
+}
 
-   // default file names if only source file specified:
-   // prog.as9   prog.pp   prog.lst   prog.opt
+// places section s at the first free gap from address a on,
+// returns the address after the section
 
-   l = strlen(argsrc);
-   if (l > FNSIZE - 4)
+int PlaceSection(struct LinkSectStruct *s, int a, int *Owner)
+{
+   int i;
+
+   for (i=0 ; i < s->Size ; ++i)
    {
-      fprintf(stderr,"\n*** filename too long ***\n");
-      exit(1);
+      if (a + i > 0xffff) LinkError(s->Obj,"no room for section ",s->Name);
+      if (Owner[a+i])
+      {
+         a += i + 1; // restart behind the used byte
+         i = -1;
+      }
    }
+   s->Addr = a;
+   for (i=0 ; i < s->Size ; ++i) Owner[a+i] = s - LSect + 1;
+   return a + s->Size;
+}
 
-   // check extension of form ".xxx"
+int Link(void)
+{
+   int a,i,j,l,o,v,Lo,Hi,Errors = 0;
+   int *Owner;
+   char *Map,*Tmp;
+   struct LinkSectStruct *s;
+   struct LinkFixStruct *f;
+   FILE *fp;
 
-   if (l > 4 && argsrc[l-4] == '.')
+   for (o=0 ; o < Jobs ; ++o) ReadObject(o);
+
+   // fixed sections
+
+   Owner = (int *)MallocOrDie(0x10000 * sizeof(int));
+   memset(Owner,0,0x10000 * sizeof(int));
+   for (i=0 ; i < LSects ; ++i)
    {
-      Src = (char *)StrNDup(argsrc,l);
-      l -= 4; // length of basename
+      s = LSect + i;
+      if (s->Loc < 0) continue;
+      if (s->Loc + s->Size > 0x10000) LinkError(s->Obj,"section exceeds 64 KB: ",s->Name);
+      for (a=s->Loc ; a < s->Loc + s->Size ; ++a)
+      {
+         if (Owner[a])
+         {
+            fprintf(stderr,"*** %s: section %s overlaps section %s of %s at $%4.4x ***\n",
+                    JobSrc[s->Obj],s->Name,LSect[Owner[a]-1].Name,
+                    JobSrc[LSect[Owner[a]-1].Obj],a);
+            Terminate(1);
+         }
+         Owner[a] = i + 1;
+      }
    }
-   else
+
+   // relocatable sections grouped by name
+
+   for (i=0 ; i < LSects ; ++i)
    {
-      Src = StrNDup(argsrc,l+4);
-      memmove(Src+l,".as9",4); // add default extension
+      if (LSect[i].Addr >= 0) continue;
+      a = LinkBase;
+      for (j=i ; j < LSects ; ++j)
+      {
+         s = LSect + j;
+         if (s->Addr < 0 && !strcmp(s->Name,LSect[i].Name))
+            a = PlaceSection(s,a,Owner);
+      }
    }
+   free(Owner);
 
-   // set static filenames
-
-   memmove(Pre,Src,l);
-   memmove(Lst,Src,l);
-   memmove(Opt,Src,l);
+   // resolve EXTERN symbols
 
-   // add extensions
+   for (i=0 ; i < LExts ; ++i)
+   {
+      for (j=0 ; j < LSyms ; ++j)
+      if (!StrCmp(LExt[i].Name,LSym[j].Name)) break;
+      if (j == LSyms)
+      {
+         ++Errors;
+         fprintf(stderr,"*** %s: unresolved external symbol %s ***\n",
+                 JobSrc[LExt[i].Obj],LExt[i].Name);
+      }
+      LExt[i].Rel = j;
+   }
+   if (Errors) return Errors;
 
-   memmove(Pre+l,".pp" ,3);
-   memmove(Lst+l,".ls9",4);
-   memmove(Opt+l,".opt",4);
+   // copy sections and apply fixups
 
-   if (!Quiet)
+   Lo = 0x10000;
+   Hi = 0;
+   for (i=0 ; i < LSects ; ++i)
    {
-      printf("\n");
-      printf("*******************************************\n");
-      printf("* Bit Shift Assembler 06-Jan-2025         *\n");
-      printf("* Today is            %s         *\n",datebuffer);
-      printf("* --------------------------------------- *\n");
-      printf("* Source: %-31.31s *\n",Src);
-      printf("* List  : %-31.31s *\n",Lst);
+      s = LSect + i;
+      if (s->Size == 0) continue;
+      memcpy(ROM + s->Addr,s->Data,s->Size);
+      if (s->Addr < Lo) Lo = s->Addr;
+      if (s->Addr + s->Size > Hi) Hi = s->Addr + s->Size;
    }
-
-   sf = fopen(Src,"r");
-   if (!sf)
+   for (i=0 ; i < LFixes ; ++i)
+   {
+      f = LFix + i;
+      s = LSect + f->Sect;
+      a = f->Addr - s->Base + s->Addr;
+      v = f->Value + LinkDelta(f->Rel);
+      if (f->Kind != 'W') v -= LinkDelta(f->Sect+1); // distance from pc
+      v &= 0xffff;
+      if (f->Kind == 'B')
+      {
+         if (v >= 0x8000) v -= 0x10000;
+         if (v < -128 || v > 127)
+         {
+            ++Errors;
+            fprintf(stderr,"*** %s: short branch at $%4.4x out of range (%d) ***\n",
+                    JobSrc[s->Obj],a,v);
+         }
+         ROM[a] = v;
+      }
+      else
+      {
+         ROM[a]   = v >> 8;
+         ROM[a+1] = v;
+      }
+   }
+   if (Errors) return Errors;
+   if (Hi == 0)
    {
-      printf("Could not open <%s>\n",Src);
-      exit(1);
+      fprintf(stderr,"*** no code to link ***\n");
+      return 1;
    }
-   IncludeStack[0].fp = sf;
-   IncludeStack[0].Src = Src;
-   lf = AssertFileOp(fopen(Lst,"w"), "Open list file");
-   if (Debug) df = AssertFileOp(fopen("Debug.lst","w"), "Open Debug file");
-   if (Preprocess) pf = AssertFileOp(fopen(Pre,"w"), "Open preprocessor file");
-   if (Optimize) of = AssertFileOp(fopen(Opt,"w"), "Open hint file");
 
-   Phase1();
-   Phase2();
+   // output file
+
+   SFA[0] = Lo;
+   SFL[0] = Hi - Lo;
+   SFE[0] = -1;
+   SFF[0] = StrNDup(LinkName,strlen(LinkName));
+   l = strlen(LinkName);
+   SFT[0] = BINARY;
+   if (l > 4 && !StrCaseCmp(LinkName+l-4,".s19"))  SFT[0] = SRECORD;
+   if (l > 5 && !StrCaseCmp(LinkName+l-5,".srec")) SFT[0] = SRECORD;
+   StoreCount = 1;
    WriteBinaries();
-   ListUndefinedSymbols();
-   qsort(lab,Labels,sizeof(struct LabelStruct),CmpAddress);
-   fprintf(lf,"\n\n%5d Symbols\n",Labels);
-   fprintf(lf,"-------------\n");
-   ListSymbols(lf,Labels,0,0xffff);
-   qsort(lab,Labels,sizeof(struct LabelStruct),CmpRefs);
-   ListSymbols(lf,Labels,0,0xff);
-   ListSymbols(lf,Labels,0,0x4000);
-   if (fclose(sf)) AssertFileOp(NULL, "Close source file");
-   if (fclose(lf)) AssertFileOp(NULL, "Close list file");
 
-   if (df) if (fclose(df)) AssertFileOp(NULL, "Close debug file");
-   if (Optimize)
+   // map file
+
+   for (l=strlen(LinkName) ; l > 0 && LinkName[l-1] != '.' && LinkName[l-1] != '/' ; --l) ;
+   if (l == 0 || LinkName[l-1] != '.') l = strlen(LinkName) + 1;
+   Map = (char *)MallocOrDie(l + 4);
+   sprintf(Map,"%.*s.map",l-1,LinkName);
+   Tmp = OutputTmp(Map);
+   fp = AssertFileOp(fopen(Tmp,"w"), "Open map file");
+   fprintf(fp,"Sections\n--------\n");
+   for (i=0 ; i < LSects ; ++i)
+   {
+      s = LSect + i;
+      fprintf(fp,"$%4.4x %5d %-5s %-20s %s\n",s->Addr,s->Size,
+              s->Loc < 0 ? "" : "fixed",s->Name,JobSrc[s->Obj]);
+   }
+   fprintf(fp,"\nSymbols\n-------\n");
+   for (i=0 ; i < LSyms ; ++i)
+      fprintf(fp,"$%4.4x %-30s %s\n",(LSym[i].Value + LinkDelta(LSym[i].Rel)) & 0xffff,
+              LSym[i].Name,JobSrc[LSym[i].Obj]);
+   if (ferror(fp) || OutputClose(fp,Map,Tmp)) AssertFileOp(NULL, "Close map file");
+   if (!Quiet)
+      printf("Linked %d objects, %d sections, $%4.4x - $%4.4x to %s\n",
+             Jobs,LSects,Lo,Hi-1,LinkName);
+   free(Map);
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   time_t rawtime;
+   struct tm * timeinfo;
+
+   time (&rawtime);
+   timeinfo = localtime (&rawtime);
+   strftime (datebuffer,80,"%e-%b-%Y",timeinfo);
+
+   LineFit(0); // -D parses its symbol into Label
+   ParseOptions(argc,argv,0);
+   if (!Jobs)
    {
-      if (fclose(of)) AssertFileOp(NULL, "Close hint file");
-      if (optc == 0) remove(Opt);
-      if (optc) printf("* Opt   : %-31.31s *\n",Opt);
+      printf("*** missing filename for assembler source file ***\n");
+      usage();
    }
-   if (!Quiet)
+   if (LinkName) return Link();
+   if (Watch && (Jobs > 1 || BatchList || Variants))
    {
-      printf("* -d:%s  -i:%s  -n:%s  -o:%s  -x:%s  *\n",
-            Stat(Debug),Stat(IgnoreCase),Stat(WithLiNo),
-            Stat(Optimize),Stat(SkipHex));
-      printf("*******************************************\n");
-      printf("* Source Lines: %6d                    *\n",TotalLiNo);
-      printf("* Symbols     : %6d                    *\n",Labels);
-      printf("* Macros      : %6d                    *\n",Macros);
-      if (Preset)
-      printf("* Preset      : %6d                    *\n",Preset);
-      if (optc)
-      printf("* Hints       : %6d for optimization   *\n",optc);
-      printf("*******************************************\n");
+      printf("*** --watch needs a single source file ***\n");
+      return 1;
    }
-   if (ErrNum)
-      printf("* %3d ERROR%s occured%s                      *\n",
-             ErrNum, ErrNum == 1 ? "" : "S", ErrNum == 1 ? " " : "");
-   else if (!Quiet) printf("* OK, no errors                           *\n");
-   if (!Quiet) printf("*******************************************\n\n");
-   // MneStat();
+   if (Stats && (Jobs > 1 || BatchList || Variants))
+   {
+      printf("*** -t and --stats need a single source file ***\n");
+      return 1;
+   }
+#ifdef BS9_THREADS
+   if (Watch) return WatchSource(JobSrc[0]);
+#endif
+   if (Jobs == 1 && !BatchList && !Variants) return AssembleFile(JobSrc[0]);
+#ifdef BS9_THREADS
+   return RunBatch(argc,argv);
+#else
+   fprintf(stderr,"*** batch mode needs threads ***\n");
+   return 1;
+#endif
+}
+
+#endif // BS9_NO_MAIN
+
+// *******
+// Library
+// *******
+
+// Compiled with BS9_LIBRARY (make lib) the file provides the interface
+// of bs9.h instead of main(). The state of the assembler stays in the
+// globals of this file and is reset for every call of BS9_Assemble.
+
+#ifdef BS9_LIBRARY
+
+#include "bs9.h"
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+// **************
+// ResetAssembler
+// **************
+
+// Clears the results of a previous BS9_Assemble.
+
+void ResetAssembler(void)
+{
+   int i;
+
+   InitLabels     = 0;
+   InitIgnoreCase = 0;
+   InitCodeStyle  = 0;
+   ResetPass();
+   for (i=0 ; i < Modules ; ++i) free(Mod[i].Name);
+   Modules = 0;
+   for (i=0 ; i < StoreCount ; ++i) free(SFF[i]);
+   StoreCount = 0;
+   for (i=0 ; i < Inlines ; ++i)
+   {
+      free(Inl[i].Name);
+      free(Inl[i].Body);
+   }
+   Inlines = 0;
+   InlPass = 0;
+   InlCur  = -1;
+   InlSkip = 0;
+   Inlined = 0;
+   free(InlLong);
+   InlLong  = NULL;
+   InlLongs = 0;
+   for (i=0 ; i < Pools ; ++i) free(Pol[i].Name);
+   Pools  = 0;
+   Pooled = 0;
+   free(PoolAct);
+   PoolAct   = NULL;
+   PoolLines = 0;
+   for (i=0 ; i < Executes ; ++i) free(Exe[i].Text);
+   Executes = 0;
+   ErrNum   = 0;
+   optc     = 0;
+   ListOn   = 1;
+   Phase    = 0;
+   ProfAdr  = -1;
+   free(Diag);
+   Diag    = NULL;
+   DiagLen = 0;
+}
+
+// ************
+// BS9_Assemble
+// ************
+
+int BS9_Assemble(const char *Name, const char *Text,
+                 const struct BS9File *Files, int NumFiles,
+                 struct BS9Result *Res)
+{
+   int i;
+   jmp_buf Jmp;
+   struct MemFileStruct Root;
+
+   memset(Res,0,sizeof(struct BS9Result));
+   MemFiles = (struct MemFileStruct *)MallocOrDie((NumFiles+1)*sizeof(struct MemFileStruct));
+   for (i=0 ; i < NumFiles ; ++i)
+   {
+      memset(MemFiles+i,0,sizeof(struct MemFileStruct));
+      MemFiles[i].Name = Files[i].Name;
+      MemFiles[i].Text = Files[i].Text;
+      MemFiles[i].Len  = strlen(Files[i].Text);
+   }
+   MemFileCount = NumFiles;
+   memset(&Root,0,sizeof(Root));
+   Root.Name = Name;
+   Root.Text = Text;
+   Root.Len  = strlen(Text);
+   mf  = &Root;
+   sf  = NULL;
+   Src = (char *)Name;
+   IncludeLevel = 0;
+   IncludeStack[0].fp  = NULL;
+   IncludeStack[0].mf  = mf;
+   IncludeStack[0].Src = Src;
+   LineFit(0);
+   ResetAssembler();
+   DiagOn = 1;
+   lf = AssertFileOp(fopen(NULL_DEVICE,"w"), "Open list file");
+   of = AssertFileOp(fopen(NULL_DEVICE,"w"), "Open hint file");
+
+   ExitJmp = &Jmp;
+   if (setjmp(Jmp))
+   {
+      if (!ErrNum) ErrNum = 1; // fatal error
+      while (IncludeLevel > 0)
+      {
+         SourceClose();
+         free(IncludeStack[IncludeLevel].Src);
+         sf = IncludeStack[--IncludeLevel].fp;
+         mf = IncludeStack[IncludeLevel].mf;
+      }
+      MacLev = 0;
+   }
+   else AssembleSource(0);
+   ExitJmp = NULL;
+
+   fclose(lf);
+   fclose(of);
+   lf = of = NULL;
+   mf = NULL;
+   free(MemFiles);
+   MemFiles = NULL;
+   MemFileCount = 0;
+   DiagOn = 0;
+
+   Res->Image = (unsigned char *)MallocOrDie(0x10000);
+   memcpy(Res->Image,ROM,0x10000);
+   for (i=0 ; i < 0x10000 && !LOCK[i] ; ++i) ;
+   Res->Start = i;
+   for (i=0xffff ; i >= Res->Start && !LOCK[i] ; --i) ;
+   Res->End   = i + 1;
+   Res->Errors = ErrNum;
+   Res->Diag   = Diag;
+   Diag        = NULL;
+   DiagLen     = 0;
    return ErrNum;
 }
+
+// **********
+// BS9_Symbol
+// **********
+
+int BS9_Symbol(const char *Name, int *Value)
+{
+   int i;
+
+   i = LabelIndex((char *)Name);
+   if (i < 0 || lab[i].Address == UNDEF) return 0;
+   *Value = lab[i].Address;
+   return 1;
+}
+
+// ********
+// BS9_Free
+// ********
+
+void BS9_Free(struct BS9Result *Res)
+{
+   free(Res->Image);
+   free(Res->Diag);
+   memset(Res,0,sizeof(struct BS9Result));
+}
+
+#endif // BS9_LIBRARY
@@ -0,0 +1,49 @@
+// library interface of the Bit Shift Assembler
+// build libbs9.a or libbs9.so with "make lib" (bs9.c with BS9_LIBRARY)
+
+#ifndef BS9_H
+#define BS9_H
+
+#if defined(__GNUC__)
+#define BS9_API __attribute__((visibility("default")))
+#else
+#define BS9_API
+#endif
+
+// virtual file for INCLUDE "Name"
+
+struct BS9File
+{
+   const char *Name; // name as written in the INCLUDE line
+   const char *Text; // contents, lines separated by '\n'
+};
+
+// result of BS9_Assemble, release with BS9_Free
+
+struct BS9Result
+{
+   unsigned char *Image; // 64K memory image, Preset where nothing was stored
+   int   Start;          // lowest assembled address
+   int   End;            // highest assembled address + 1
+   int   Errors;         // number of errors
+   char *Diag;           // error messages or NULL
+};
+
+// Assembles the source Text under the file name Name. INCLUDE looks
+// for Files[0..NumFiles-1] first, then for files on disk. Nothing is
+// written to disk: STORE is ignored and the listing is discarded.
+// Returns the number of errors. The assembler state is thread local,
+// so different threads may call BS9_Assemble at the same time.
+
+BS9_API int  BS9_Assemble(const char *Name, const char *Text,
+                          const struct BS9File *Files, int NumFiles,
+                          struct BS9Result *Res);
+
+// Value of a symbol of the last BS9_Assemble of the calling thread,
+// returns 0 if undefined
+
+BS9_API int  BS9_Symbol(const char *Name, int *Value);
+
+BS9_API void BS9_Free(struct BS9Result *Res);
+
+#endif
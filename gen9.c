@@ -0,0 +1,304 @@
+// benchmark source generator for bs9
+// version 1.0  16-OCT-2026
+
+// gen9 [-s scale] [directory]
+// writes synthetic workloads <directory>/<name>.as9 (default "bench"):
+// sym   many symbols and references to them
+// mac   nested macro expansions
+// inc   a deep tree of INCLUDE files in <directory>/inc
+// fcb   large FCB, FDB and FCC data tables
+// fwd   forward references to routines and branch targets
+// cond  nested conditional blocks
+// The sources depend only on the scale, so runs are reproducible.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define MakeDir(d) _mkdir(d)
+#else
+#include <sys/stat.h>
+#define MakeDir(d) mkdir(d,0755)
+#endif
+
+#define INC_DEPTH  4 // levels of the include tree
+#define INC_FANOUT 3 // files included by each inner file
+#define MAC_DEPTH  5 // nesting of macro calls
+
+int Scale = 1;
+char *Dir = "bench";
+unsigned int Seed = 6809;
+
+// deterministic pseudo random numbers, independent of the C library
+
+int Random(int n)
+{
+   Seed = Seed * 1103515245 + 12345;
+   return (Seed >> 16) % n;
+}
+
+int Clamp(int v, int Max)
+{
+   return v > Max ? Max : v;
+}
+
+FILE *Create(const char *Name)
+{
+   char Path[256];
+   FILE *fp;
+
+   snprintf(Path,sizeof(Path),"%s/%s",Dir,Name);
+   fp = fopen(Path,"w");
+   if (!fp)
+   {
+      perror(Path);
+      exit(1);
+   }
+   return fp;
+}
+
+void Close(FILE *fp, const char *Name)
+{
+   if (fclose(fp))
+   {
+      perror(Name);
+      exit(1);
+   }
+   printf("%s/%s\n",Dir,Name);
+}
+
+void Header(FILE *fp, const char *Name)
+{
+   fprintf(fp,"; %s.as9 generated by gen9 -s %d\n\n",Name,Scale);
+   fprintf(fp,"        ORG  $1000\n");
+   fprintf(fp,"Start\n");
+}
+
+void Footer(FILE *fp, const char *Name)
+{
+   fprintf(fp,"Last\n");
+   fprintf(fp,"        STORE Start,Last-Start,\"%s/%s.bin\"\n",Dir,Name);
+   fprintf(fp,"        END\n");
+}
+
+// symbol table: equates, data labels and references in random order
+
+void GenSym(void)
+{
+   int i,n;
+   FILE *fp;
+
+   n = Clamp(1000 * Scale, 3500);
+   fp = Create("sym.as9");
+   for (i=0 ; i < n ; ++i)
+      fprintf(fp,"Sym%04d = $%4.4x\n",i,0x8000 + Random(0x4000));
+   Header(fp,"sym");
+   for (i=0 ; i < 3 * n ; ++i)
+   {
+      switch (Random(4))
+      {
+         case 0: fprintf(fp,"        LDA  Sym%04d\n",Random(n)); break;
+         case 1: fprintf(fp,"        LDX  #Sym%04d+%d\n",Random(n),Random(16)); break;
+         case 2: fprintf(fp,"        STD  Sym%04d\n",Random(n)); break;
+         case 3: fprintf(fp,"        LEAY Sym%04d-Sym%04d,X\n",Random(n),Random(n));
+      }
+   }
+   for (i=0 ; i < n ; ++i)
+      fprintf(fp,"Dat%04d FCB  %d\n",i,i & 0xff);
+   Footer(fp,"sym");
+   Close(fp,"sym.as9");
+}
+
+// macros: M<d> expands M<d-1> twice, M0 is one instruction
+
+void GenMac(void)
+{
+   int i,n;
+   FILE *fp;
+
+   n = Clamp(300 * Scale, 700);
+   fp = Create("mac.as9");
+   fprintf(fp,"MACRO M0(Val)\n        LDA  #Val\nENDM\n\n");
+   for (i=1 ; i <= MAC_DEPTH ; ++i)
+   {
+      fprintf(fp,"MACRO M%d(Val)\n",i);
+      fprintf(fp,"        M%d(Val)\n",i-1);
+      fprintf(fp,"        M%d(Val+1)\n",i-1);
+      fprintf(fp,"ENDM\n\n");
+   }
+   Header(fp,"mac");
+   for (i=0 ; i < n ; ++i)
+      fprintf(fp,"        M%d(%d)\n",MAC_DEPTH,Random(64));
+   Footer(fp,"mac");
+   Close(fp,"mac.as9");
+}
+
+// include tree: inc/i<path>.as9 includes its INC_FANOUT children
+
+void GenIncFile(const char *Path, int Level, int Lines)
+{
+   char Name[64],Child[64];
+   int i;
+   FILE *fp;
+
+   snprintf(Name,sizeof(Name),"inc/i%s.as9",Path);
+   fp = Create(Name);
+   fprintf(fp,"I%s\n",Path);
+   for (i=0 ; i < Lines ; ++i)
+   {
+      if (i & 1) fprintf(fp,"        LDB  I%s+%d\n",Path,i);
+      else       fprintf(fp,"        ADDA #%d\n",Random(256));
+   }
+   if (Level < INC_DEPTH)
+   {
+      for (i=0 ; i < INC_FANOUT ; ++i)
+      {
+         snprintf(Child,sizeof(Child),"%s_%d",Path,i);
+         fprintf(fp,"        INCLUDE \"%s/inc/i%s.as9\"\n",Dir,Child);
+         GenIncFile(Child,Level+1,Lines);
+      }
+   }
+   Close(fp,Name);
+}
+
+void GenInc(void)
+{
+   char Path[256];
+   FILE *fp;
+
+   snprintf(Path,sizeof(Path),"%s/inc",Dir);
+   if (MakeDir(Path) && errno != EEXIST)
+   {
+      perror(Path);
+      exit(1);
+   }
+   fp = Create("inc.as9");
+   Header(fp,"inc");
+   fprintf(fp,"        INCLUDE \"%s/inc/i0.as9\"\n",Dir);
+   Footer(fp,"inc");
+   Close(fp,"inc.as9");
+   GenIncFile("0",0,Clamp(20 * Scale,80));
+}
+
+// data tables: byte rows, word tables with expressions and strings
+
+void GenFcb(void)
+{
+   int i,j,n;
+   FILE *fp;
+
+   n = Clamp(1000 * Scale, 2500);
+   fp = Create("fcb.as9");
+   Header(fp,"fcb");
+   for (i=0 ; i < n ; ++i)
+   {
+      fprintf(fp,"Tab%04d FCB  ",i);
+      for (j=0 ; j < 16 ; ++j)
+         fprintf(fp,"%s$%2.2x",j ? "," : "",Random(256));
+      fprintf(fp,"\n");
+   }
+   for (i=0 ; i < n / 4 ; ++i)
+      fprintf(fp,"        FDB  Tab%04d,Tab%04d+%d,(Tab%04d-Tab0000)/2\n",
+              Random(n),Random(n),Random(16),Random(n));
+   for (i=0 ; i < n / 8 ; ++i)
+      fprintf(fp,"Str%04d FCC  \"String number %d\\r\",0\n",i,i);
+   Footer(fp,"fcb");
+   Close(fp,"fcb.as9");
+}
+
+// forward references: a jump table and routines calling later routines
+
+void GenFwd(void)
+{
+   int i,n;
+   FILE *fp;
+
+   n = Clamp(1000 * Scale, 2500);
+   fp = Create("fwd.as9");
+   Header(fp,"fwd");
+   for (i=0 ; i < n ; ++i)
+      fprintf(fp,"        FDB  F%04d\n",i);
+   for (i=0 ; i < n ; ++i)
+   {
+      fprintf(fp,"F%04d   LDX  #F%04d\n",i,Clamp(i+1+Random(50),n));
+      fprintf(fp,"        JSR  F%04d\n",Clamp(i+2,n));
+      fprintf(fp,"        BEQ  F%04d\n",Clamp(i+1,n));
+      fprintf(fp,"        RTS\n");
+   }
+   fprintf(fp,"F%04d   RTS\n",n);
+   Footer(fp,"fwd");
+   Close(fp,"fwd.as9");
+}
+
+// conditional assembly: nested if/else/endif on generated flags
+
+void GenCond(void)
+{
+   int i,n;
+   FILE *fp;
+
+   n = Clamp(2000 * Scale, 8000);
+   fp = Create("cond.as9");
+   for (i=0 ; i < 16 ; ++i)
+      fprintf(fp,"Opt%d = %d\n",i,Random(2));
+   Header(fp,"cond");
+   for (i=0 ; i < n ; ++i)
+   {
+      fprintf(fp,"if Opt%d\n",Random(16));
+      fprintf(fp,"if Opt%d & Opt%d\n",Random(16),Random(16));
+      fprintf(fp,"        LDA  #%d\n",Random(256));
+      fprintf(fp,"else\n");
+      fprintf(fp,"        LDB  #%d\n",Random(256));
+      fprintf(fp,"endif\n");
+      fprintf(fp,"else\n");
+      fprintf(fp,"ifndef Opt%d\n",Random(16));
+      fprintf(fp,"        LDX  #%d\n",i);
+      fprintf(fp,"endif\n");
+      fprintf(fp,"        NOP\n");
+      fprintf(fp,"endif\n");
+   }
+   Footer(fp,"cond");
+   Close(fp,"cond.as9");
+}
+
+void Usage(void)
+{
+   fprintf(stderr,"usage: gen9 [-s scale] [directory]\n");
+   exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+   int ic;
+
+   for (ic=1 ; ic < argc ; ++ic)
+   {
+      if (!strcmp(argv[ic],"-s"))
+      {
+         if (++ic == argc) Usage();
+         Scale = atoi(argv[ic]);
+         if (Scale < 1)
+         {
+            fprintf(stderr,"*** wrong scale ***\n");
+            exit(1);
+         }
+      }
+      else if (argv[ic][0] == '-') Usage();
+      else Dir = argv[ic];
+   }
+   if (MakeDir(Dir) && errno != EEXIST)
+   {
+      perror(Dir);
+      exit(1);
+   }
+   GenSym();
+   GenMac();
+   GenInc();
+   GenFcb();
+   GenFwd();
+   GenCond();
+   return 0;
+}
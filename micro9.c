@@ -0,0 +1,212 @@
+// microbenchmark driver for the parsing primitives of bs9
+// version 1.0  16-OCT-2026
+
+// micro9 [-t seconds] <source>
+// Runs phase 1 of <source> to fill the symbol table, then collects
+// the labels, mnemonics and operands of the source lines as corpus
+// and calls SkipSpace, IsInstruction, ExtractOpText, EvalOperand,
+// SetPostByte, LabelIndex and ParseASCII on them in a loop, until
+// each function ran at least -t seconds (default 0.2).
+// Reported are the calls, the nanoseconds and the allocations
+// (MallocOrDie and ReallocOrDie) per call.
+
+#define BS9_NO_MAIN
+#include "bs9.c"
+
+#define CORPUS 20000 // max. texts per corpus
+
+enum Corpora
+{
+   C_SPACE, // text after label       -> SkipSpace
+   C_MNE  , // text from mnemonic     -> IsInstruction
+   C_OPS  , // text after mnemonic    -> ExtractOpText
+   C_EXPR , // expression operands    -> EvalOperand
+   C_INDEX, // indexed operands       -> SetPostByte
+   C_LABEL, // defined labels         -> LabelIndex
+   C_ASCII, // string operands        -> ParseASCII
+   CORPORA
+};
+
+struct CorpusStruct
+{
+   const char *Name;   // measured function
+   char **Text;        // corpus texts
+   int    Num;         // number of texts
+} Corpus[CORPORA] =
+{
+   {"SkipSpace"    ,NULL,0},
+   {"IsInstruction",NULL,0},
+   {"ExtractOpText",NULL,0},
+   {"EvalOperand"  ,NULL,0},
+   {"SetPostByte"  ,NULL,0},
+   {"LabelIndex"   ,NULL,0},
+   {"ParseASCII"   ,NULL,0}
+};
+
+double MinTime = 0.2; // seconds per function
+volatile long Sink;   // keeps results alive
+
+void AddText(int c, char *p, int l)
+{
+   struct CorpusStruct *cp = Corpus + c;
+
+   if (!cp->Text) cp->Text = (char **)MallocOrDie(CORPUS * sizeof(char *));
+   if (l < 1 || cp->Num == CORPUS) return;
+   cp->Text[cp->Num++] = StrNDup(p,l);
+}
+
+// phase 1 defines all symbols used by the operands
+
+void Assemble(char *Source)
+{
+   Src = Source;
+   sf = fopen(Src,"r");
+   if (!sf)
+   {
+      printf("Could not open <%s>\n",Src);
+      exit(1);
+   }
+   IncludeStack[0].fp  = sf;
+   IncludeStack[0].Src = Src;
+   lf = AssertFileOp(tmpfile(),"Open list file");
+   InitLabels = Labels;
+   Phase1();
+   if (ErrNum) exit(1);
+}
+
+// split the source lines into the corpora
+
+void Collect(char *Source)
+{
+   int m;
+   char Buf[MAX_STR];
+   char *p,*q;
+   FILE *fp;
+
+   fp = AssertFileOp(fopen(Source,"r"),"Open source");
+   while (fgets(Buf,sizeof(Buf),fp))
+   {
+      Buf[strcspn(Buf,"\r\n")] = 0;
+      if (!Buf[0] || Buf[0] == ';' || Buf[0] == '*') continue;
+      p = Buf;
+      if (!isspace(*p))
+      {
+         for (q=p ; isym(*q) ; ++q) ;
+         AddText(C_LABEL,p,q-p);
+         p = q;
+      }
+      AddText(C_SPACE,p,strlen(p));
+      p = SkipSpace(p);
+      if (*p == '=')
+      {
+         ExtractOpText(p+1);
+         AddText(C_EXPR,OpText,strlen(OpText));
+         continue;
+      }
+      if (!isalpha(*p)) continue;
+      AddText(C_MNE,p,strlen(p));
+      for (q=p ; *q && !isspace(*q) ; ++q) ;
+      if (!*SkipSpace(q)) continue;
+      AddText(C_OPS,q,strlen(q));
+      m = IsInstruction(p);
+      ExtractOpText(q);
+      if (m >= 0)
+      {
+         if (OpText[0] == '#')
+            AddText(C_EXPR,OpText+1,strlen(OpText+1));
+         else if (strchr(OpText,',') && Mat[m].Opc[AM_Indexed] >= 0)
+            AddText(C_INDEX,OpText,strlen(OpText));
+         else if (OpText[strspn(OpText,"+-")] == 0)
+            continue; // anonymous branch target
+         else if (Mat[m].Opc[AM_Relative] >= 0 || Mat[m].Opc[AM_Direct] >= 0)
+            AddText(C_EXPR,OpText,strlen(OpText));
+      }
+      else if (!StrNCaseCmp(p,"EQU",3) && isspace(p[3]))
+         AddText(C_EXPR,OpText,strlen(OpText));
+      else if (OpText[0] == '"')
+         AddText(C_ASCII,OpText,strlen(OpText));
+   }
+   fclose(fp);
+}
+
+// one pass over a corpus, returns the number of calls
+
+int Pass(int c)
+{
+   int i,v,l;
+   long r = 0;
+   char Buf[MAX_STR];
+   unsigned char b[MAX_STR];
+   struct CorpusStruct *cp = Corpus + c;
+
+   for (i=0 ; i < cp->Num ; ++i)
+   {
+      switch (c)
+      {
+         case C_SPACE: r += *SkipSpace(cp->Text[i]); break;
+         case C_MNE  : r += IsInstruction(cp->Text[i]); break;
+         case C_OPS  : r += *ExtractOpText(cp->Text[i]); break;
+         case C_EXPR : EvalOperand(cp->Text[i],&v,0); r += v; break;
+         case C_INDEX: // SetPostByte modifies indirect operands
+            strcpy(Buf,cp->Text[i]);
+            r += SetPostByte(Buf,&v);
+            break;
+         case C_LABEL: r += LabelIndex(cp->Text[i]); break;
+         case C_ASCII:
+            l = 0;
+            ParseASCII(cp->Text[i],b,&l);
+            r += l;
+      }
+   }
+   Sink += r;
+   return cp->Num;
+}
+
+void Measure(int c)
+{
+   long Calls = 0;
+   long Allocs = StatAllocs;
+   double Start,t;
+
+   if (!Corpus[c].Num)
+   {
+      printf("%-14s %7d %12s %10s %10s\n",Corpus[c].Name,0,"-","-","-");
+      return;
+   }
+   Start = StatClock();
+   do Calls += Pass(c);
+   while ((t = StatClock() - Start) < MinTime);
+   printf("%-14s %7d %12ld %10.1f %10.3f\n",Corpus[c].Name,Corpus[c].Num,
+          Calls,1e9 * t / Calls,(double)(StatAllocs - Allocs) / Calls);
+}
+
+void Usage(void)
+{
+   fprintf(stderr,"usage: micro9 [-t seconds] <source>\n");
+   exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+   int ic,c;
+   char *Source = NULL;
+
+   for (ic=1 ; ic < argc ; ++ic)
+   {
+      if (!strcmp(argv[ic],"-t"))
+      {
+         if (++ic == argc) Usage();
+         MinTime = atof(argv[ic]);
+      }
+      else if (argv[ic][0] == '-' || Source) Usage();
+      else Source = argv[ic];
+   }
+   if (!Source) Usage();
+   Assemble(Source);
+   Collect(Source);
+   printf("%s: %d symbols\n",Source,Labels);
+   printf("%-14s %7s %12s %10s %10s\n","Function","Corpus","Calls",
+          "ns/op","allocs/op");
+   for (c=0 ; c < CORPORA ; ++c) Measure(c);
+   return 0;
+}